@@ -30,6 +30,15 @@ const char *initiator = "iqn.2010-11.ronnie:iscsi-inq";
 int max_in_flight = 50;
 int blocks_per_io = 200;
 
+/* blocks covered by one ROD token */
+#define TOKEN_BYTES (256 * 1024 * 1024ULL)
+
+enum offload {
+	OFFLOAD_NONE  = 0,
+	OFFLOAD_XCOPY = 1,
+	OFFLOAD_TOKEN = 2
+};
+
 struct client {
 	int finished;
 	int in_flight;
@@ -47,6 +56,7 @@ struct client {
 	int use_16_for_rw;
 	int progress;
 	int ignore_errors;
+	enum offload offload;
 };
 
 
@@ -185,6 +195,254 @@ void fill_read_queue(struct client *client)
 	}
 }
 
+/*
+ * Look up a designator of the LU itself that can name it in an
+ * EXTENDED COPY target descriptor.
+ */
+int get_lu_designator(struct iscsi_context *iscsi, int lun,
+		      struct scsi_copy_target_descriptor *td,
+		      unsigned char *designator)
+{
+	struct scsi_task *task;
+	struct scsi_inquiry_device_identification *inq;
+	struct scsi_inquiry_device_designator *dev, *found = NULL;
+
+	task = iscsi_inquiry_sync(iscsi, lun, 1,
+				  SCSI_INQUIRY_PAGECODE_DEVICE_IDENTIFICATION,
+				  255);
+	if (task == NULL || task->status != SCSI_STATUS_GOOD) {
+		scsi_free_scsi_task(task);
+		return -1;
+	}
+	inq = scsi_datain_unmarshall(task);
+	if (inq == NULL) {
+		scsi_free_scsi_task(task);
+		return -1;
+	}
+	for (dev = inq->designators; dev; dev = dev->next) {
+		if (dev->association != SCSI_ASSOCIATION_LOGICAL_UNIT
+		||  dev->designator_length > SCSI_XCOPY_MAX_DESIGNATOR_LEN) {
+			continue;
+		}
+		if (dev->designator_type == SCSI_DESIGNATOR_TYPE_NAA) {
+			found = dev;
+			break;
+		}
+		if (dev->designator_type == SCSI_DESIGNATOR_TYPE_EUI_64
+		&&  found == NULL) {
+			found = dev;
+		}
+	}
+	if (found == NULL) {
+		scsi_free_scsi_task(task);
+		return -1;
+	}
+
+	memset(td, 0, sizeof(*td));
+	td->device_type       = inq->device_type;
+	td->code_set          = found->code_set;
+	td->association       = found->association;
+	td->designator_type   = found->designator_type;
+	td->designator_length = found->designator_length;
+	memcpy(designator, found->designator, found->designator_length);
+	td->designator        = designator;
+	scsi_free_scsi_task(task);
+
+	return 0;
+}
+
+/*
+ * Copy as much as possible with EXTENDED COPY, sent to the copy manager
+ * of the destination LUN. Returns -1 if the copy manager cannot do it,
+ * leaving client->pos at the first block that was not copied.
+ */
+int xcopy_blocks(struct client *client)
+{
+	struct scsi_copy_target_descriptor td[2];
+	struct scsi_copy_segment_descriptor *segs;
+	struct scsi_copy_results_op_params *op;
+	struct scsi_task *task;
+	unsigned char designators[2][SCSI_XCOPY_MAX_DESIGNATOR_LEN];
+	uint32_t max_segs, max_seg_blocks;
+	uint64_t n;
+	int i;
+
+	if (get_lu_designator(client->src_iscsi, client->src_lun,
+			      &td[0], designators[0]) != 0
+	||  get_lu_designator(client->dst_iscsi, client->dst_lun,
+			      &td[1], designators[1]) != 0) {
+		printf("No usable LU designator for EXTENDED COPY\n");
+		return -1;
+	}
+	td[0].block_length = client->src_blocksize;
+	td[1].block_length = client->dst_blocksize;
+
+	task = iscsi_receive_copy_results_sync(client->dst_iscsi,
+					       client->dst_lun,
+					       SCSI_COPY_RESULTS_OP_PARAMS,
+					       0, 256);
+	if (task == NULL || task->status != SCSI_STATUS_GOOD
+	||  (op = scsi_datain_unmarshall(task)) == NULL) {
+		printf("EXTENDED COPY is not supported by the target\n");
+		scsi_free_scsi_task(task);
+		return -1;
+	}
+	max_segs = op->max_segment_desc_count;
+	if (op->max_desc_list_length != 0
+	&&  (op->max_desc_list_length - 2 * SCSI_XCOPY_TARGET_DESC_LEN) /
+	    SCSI_XCOPY_SEGMENT_DESC_LEN < max_segs) {
+		max_segs = (op->max_desc_list_length -
+			    2 * SCSI_XCOPY_TARGET_DESC_LEN) /
+			SCSI_XCOPY_SEGMENT_DESC_LEN;
+	}
+	max_seg_blocks = 0xffff;
+	if (op->max_segment_length != 0
+	&&  op->max_segment_length / client->src_blocksize < max_seg_blocks) {
+		max_seg_blocks = op->max_segment_length / client->src_blocksize;
+	}
+	if (op->max_target_desc_count < 2) {
+		max_segs = 0;
+	}
+	scsi_free_scsi_task(task);
+	if (max_segs == 0 || max_seg_blocks == 0) {
+		printf("EXTENDED COPY limits are too small\n");
+		return -1;
+	}
+
+	segs = calloc(max_segs, sizeof(*segs));
+	if (segs == NULL) {
+		printf("Failed to allocate segment descriptors\n");
+		return -1;
+	}
+
+	while (client->pos < client->src_num_blocks) {
+		uint64_t lba = client->pos;
+
+		for (i = 0; i < (int)max_segs && lba < client->src_num_blocks; i++) {
+			n = client->src_num_blocks - lba;
+			if (n > max_seg_blocks) {
+				n = max_seg_blocks;
+			}
+			segs[i].src_index  = 0;
+			segs[i].dst_index  = 1;
+			segs[i].num_blocks = n;
+			segs[i].src_lba    = lba;
+			segs[i].dst_lba    = lba;
+			lba += n;
+		}
+
+		task = iscsi_extended_copy_sync(client->dst_iscsi,
+						client->dst_lun, 0,
+						SCSI_LIST_ID_NONE, td, 2,
+						segs, i);
+		if (task == NULL || task->status != SCSI_STATUS_GOOD) {
+			if (task != NULL
+			&&  task->status == SCSI_STATUS_CHECK_CONDITION) {
+				printf("EXTENDED COPY failed with sense key:%d ascq:%04x\n", task->sense.key, task->sense.ascq);
+			} else {
+				printf("EXTENDED COPY failed with %s\n", iscsi_get_error(client->dst_iscsi));
+			}
+			scsi_free_scsi_task(task);
+			free(segs);
+			return -1;
+		}
+		scsi_free_scsi_task(task);
+		client->pos = lba;
+
+		if (client->progress) {
+			printf("\r%"PRIu64" of %"PRIu64" blocks transferred.", client->pos, client->src_num_blocks);
+		}
+	}
+	free(segs);
+
+	return 0;
+}
+
+/*
+ * Copy as much as possible by populating a ROD token for a chunk of the
+ * source and writing the destination using it. Returns -1 if either
+ * side cannot do it, leaving client->pos at the first block that was
+ * not copied.
+ */
+int token_copy_blocks(struct client *client)
+{
+	struct scsi_copy_results_rod_token_info *rti;
+	struct scsi_task *task;
+	struct unmap_list range;
+	unsigned char token[SCSI_ROD_TOKEN_LEN];
+	uint32_t list_id = 0;
+	uint64_t n, done;
+
+	while (client->pos < client->src_num_blocks) {
+		n = client->src_num_blocks - client->pos;
+		if (n > TOKEN_BYTES / client->src_blocksize) {
+			n = TOKEN_BYTES / client->src_blocksize;
+		}
+		range.lba = client->pos;
+		range.num = n;
+		list_id++;
+
+		task = iscsi_populate_token_sync(client->src_iscsi,
+						 client->src_lun, list_id, 0,
+						 &range, 1);
+		if (task == NULL || task->status != SCSI_STATUS_GOOD) {
+			printf("POPULATE TOKEN failed with %s\n", iscsi_get_error(client->src_iscsi));
+			scsi_free_scsi_task(task);
+			return -1;
+		}
+		scsi_free_scsi_task(task);
+
+		task = iscsi_receive_copy_results_sync(client->src_iscsi,
+					client->src_lun,
+					SCSI_COPY_RESULTS_ROD_TOKEN_INFO,
+					list_id, 1024);
+		if (task == NULL || task->status != SCSI_STATUS_GOOD
+		||  (rti = scsi_datain_unmarshall(task)) == NULL
+		||  !rti->has_rod_token) {
+			printf("Failed to receive ROD token\n");
+			scsi_free_scsi_task(task);
+			return -1;
+		}
+		memcpy(token, rti->rod_token, SCSI_ROD_TOKEN_LEN);
+		scsi_free_scsi_task(task);
+
+		task = iscsi_write_using_token_sync(client->dst_iscsi,
+						    client->dst_lun, list_id,
+						    0, token, &range, 1);
+		if (task == NULL || task->status != SCSI_STATUS_GOOD) {
+			printf("WRITE USING TOKEN failed with %s\n", iscsi_get_error(client->dst_iscsi));
+			scsi_free_scsi_task(task);
+			return -1;
+		}
+		scsi_free_scsi_task(task);
+
+		/* the target may have written less than asked for */
+		done = n;
+		task = iscsi_receive_copy_results_sync(client->dst_iscsi,
+					client->dst_lun,
+					SCSI_COPY_RESULTS_ROD_TOKEN_INFO,
+					list_id, 1024);
+		if (task != NULL && task->status == SCSI_STATUS_GOOD
+		&&  (rti = scsi_datain_unmarshall(task)) != NULL
+		&&  rti->copy_operation_status == SCSI_COPY_STATUS_RESIDUAL
+		&&  rti->transfer_count < n) {
+			done = rti->transfer_count;
+		}
+		scsi_free_scsi_task(task);
+		if (done == 0) {
+			printf("WRITE USING TOKEN made no progress\n");
+			return -1;
+		}
+		client->pos += done;
+
+		if (client->progress) {
+			printf("\r%"PRIu64" of %"PRIu64" blocks transferred.", client->pos, client->src_num_blocks);
+		}
+	}
+
+	return 0;
+}
+
 int main(int argc, char *argv[])
 {
 	char *src_url = NULL;
@@ -206,13 +464,14 @@ int main(int argc, char *argv[])
 		{"max",            required_argument,    NULL,        'm'},
 		{"blocks",         required_argument,    NULL,        'b'},
 		{"ignore-errors",  no_argument,          NULL,        'n'},
+		{"offload",        required_argument,    NULL,        'o'},
 		{0, 0, 0, 0}
 	};
 	int option_index;
 
 	memset(&client, 0, sizeof(client));
 
-	while ((c = getopt_long(argc, argv, "d:s:i:m:b:p6n", long_options,
+	while ((c = getopt_long(argc, argv, "d:s:i:m:b:o:p6n", long_options,
 			&option_index)) != -1) {
 		switch (c) {
 		case 'd':
@@ -239,6 +498,16 @@ int main(int argc, char *argv[])
 		case 'n':
 			client.ignore_errors = 1;
 			break;
+		case 'o':
+			if (!strcmp(optarg, "xcopy")) {
+				client.offload = OFFLOAD_XCOPY;
+			} else if (!strcmp(optarg, "token")) {
+				client.offload = OFFLOAD_TOKEN;
+			} else {
+				fprintf(stderr, "--offload must be xcopy or token\n");
+				exit(1);
+			}
+			break;
 		default:
 			fprintf(stderr, "Unrecognized option '%c'\n\n", c);
 			exit(1);
@@ -370,6 +639,19 @@ int main(int argc, char *argv[])
 		exit(10);
 	}
 
+	if (client.offload == OFFLOAD_XCOPY && xcopy_blocks(&client) != 0) {
+		printf("Falling back to read/write from block %"PRIu64"\n", client.pos);
+	}
+	if (client.offload == OFFLOAD_TOKEN && token_copy_blocks(&client) != 0) {
+		printf("Falling back to read/write from block %"PRIu64"\n", client.pos);
+	}
+	if (client.pos == client.src_num_blocks) {
+		client.finished = 1;
+		if (client.progress) {
+			printf("\n");
+		}
+	}
+
 	fill_read_queue(&client);
 
 	while (client.finished == 0) {
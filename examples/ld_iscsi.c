@@ -52,9 +52,6 @@ struct iscsi_fd_list {
        uint64_t num_blocks;
        off_t offset;
        mode_t mode;
-       int get_lba_status;
-       struct scsi_lba_status_descriptor lbasd_cached;
-       int lbasd_cache_valid;
 };
 
 static struct iscsi_fd_list iscsi_fd_list[ISCSI_MAX_FD];
@@ -124,6 +121,25 @@ int open(const char *path, int flags, mode_t mode)
 
         LD_ISCSI_DPRINTF(4,"readcapacity16_sync: block_size: %d, num_blocks: %"PRIu64,rc16->block_length,rc16->returned_lba + 1);
 
+		if (iscsi_set_block_limits(iscsi, rc16->block_length, NULL) != 0) {
+			LD_ISCSI_DPRINTF(0,"failed to set block limits: %s", iscsi_get_error(iscsi));
+			scsi_free_scsi_task(task);
+			iscsi_destroy_url(iscsi_url);
+			iscsi_destroy_context(iscsi);
+			errno = EIO;
+			return -1;
+		}
+
+		if (getenv("LD_ISCSI_READ_CACHE") != NULL) {
+			/* the cache needs the size of the LUN too */
+			if (iscsi_discover_block_limits_sync(iscsi, iscsi_url->lun) != 0
+			||  iscsi_enable_read_cache(iscsi, iscsi_url->lun, rc16->block_length * 128, atoi(getenv("LD_ISCSI_READ_CACHE"))) != 0) {
+				LD_ISCSI_DPRINTF(1,"read cache disabled: %s", iscsi_get_error(iscsi));
+			} else {
+				iscsi_set_read_cache_readahead(iscsi, iscsi_url->lun, 16, 0);
+			}
+		}
+
 		fd = iscsi_get_fd(iscsi);
 		if (fd >= ISCSI_MAX_FD) {
 			LD_ISCSI_DPRINTF(0,"Too many files open");
@@ -142,11 +158,12 @@ int open(const char *path, int flags, mode_t mode)
 		iscsi_fd_list[fd].lun        = iscsi_url->lun;
 		iscsi_fd_list[fd].mode       = mode;
 
-		if (getenv("LD_ISCSI_GET_LBA_STATUS") != NULL) {
-			iscsi_fd_list[fd].get_lba_status = atoi(getenv("LD_ISCSI_GET_LBA_STATUS"));
+		if (getenv("LD_ISCSI_GET_LBA_STATUS") != NULL && atoi(getenv("LD_ISCSI_GET_LBA_STATUS")) != 0) {
 			if (rc16->lbpme == 0){
 				LD_ISCSI_DPRINTF(1,"Logical unit is fully provisioned. Will skip get_lba_status tasks");
-				iscsi_fd_list[fd].get_lba_status = 0;
+			} else if (iscsi_discover_block_limits_sync(iscsi, iscsi_url->lun) != 0
+			||  iscsi_enable_lba_map(iscsi, iscsi_url->lun) != 0) {
+				LD_ISCSI_DPRINTF(1,"provisioning map disabled: %s", iscsi_get_error(iscsi));
 			}
 		}
 
@@ -304,8 +321,6 @@ ssize_t read(int fd, void *buf, size_t count)
 	if ((iscsi_fd_list[fd].is_iscsi == 1) && (iscsi_fd_list[fd].in_flight == 0)) {
 		uint64_t offset;
 		uint64_t num_blocks, lba;
-		struct scsi_task *task;
-		struct scsi_get_lba_status *lbas;
 
 		if (iscsi_fd_list[fd].dup2fd >= 0) {
 			return read(iscsi_fd_list[fd].dup2fd, buf, count);
@@ -321,84 +336,24 @@ ssize_t read(int fd, void *buf, size_t count)
 		/* Trim num_blocks requested to last lba */
 		if ((lba + num_blocks) > iscsi_fd_list[fd].num_blocks) {
 			num_blocks = iscsi_fd_list[fd].num_blocks - lba;
-			count = num_blocks * iscsi_fd_list[fd].block_size;
+			count = num_blocks * iscsi_fd_list[fd].block_size - (iscsi_fd_list[fd].offset - offset);
 		}
 
 		iscsi_fd_list[fd].in_flight = 1;
-        if (iscsi_fd_list[fd].get_lba_status != 0) {
-			uint32_t i;
-			uint32_t _num_allocated=0;
-			uint32_t _num_blocks=0;
-
-			if (iscsi_fd_list[fd].lbasd_cache_valid==1) {
-				LD_ISCSI_DPRINTF(5,"cached get_lba_status_descriptor is lba %"PRIu64", num_blocks %d, provisioning %d",iscsi_fd_list[fd].lbasd_cached.lba,iscsi_fd_list[fd].lbasd_cached.num_blocks,iscsi_fd_list[fd].lbasd_cached.provisioning);
-			    if (iscsi_fd_list[fd].lbasd_cached.provisioning != 0x00 && lba >= iscsi_fd_list[fd].lbasd_cached.lba && lba+num_blocks < iscsi_fd_list[fd].lbasd_cached.lba+iscsi_fd_list[fd].lbasd_cached.num_blocks)
-			    {
-					LD_ISCSI_DPRINTF(4,"skipped read16_sync for non-allocated blocks: lun %d, lba %"PRIu64", num_blocks: %"PRIu64", block_size: %d, offset: %"PRIu64" count: %lu",iscsi_fd_list[fd].lun,lba,num_blocks,iscsi_fd_list[fd].block_size,offset,(unsigned long)count);
-					memset(buf, 0x00, count);
-					iscsi_fd_list[fd].offset += count;
-					iscsi_fd_list[fd].in_flight = 0;
-					return count;
-				}
-			}
-			LD_ISCSI_DPRINTF(4,"get_lba_status_sync: lun %d, lba %"PRIu64", num_blocks: %"PRIu64,iscsi_fd_list[fd].lun,lba,num_blocks);
-			task = iscsi_get_lba_status_sync(iscsi_fd_list[fd].iscsi, iscsi_fd_list[fd].lun, lba, 8+16);
-			if (task == NULL || task->status != SCSI_STATUS_GOOD) {
-				LD_ISCSI_DPRINTF(0,"failed to send get_lba_status command");
-				iscsi_fd_list[fd].in_flight = 0;
-				errno = EIO;
-				return -1;
-			}
-			lbas = scsi_datain_unmarshall(task);
-			if (lbas == NULL) {
-				LD_ISCSI_DPRINTF(0,"failed to unmarshall get_lba_status data");
-				scsi_free_scsi_task(task);
-				iscsi_fd_list[fd].in_flight = 0;
-				errno = EIO;
-				return -1;
-			}
-
-			LD_ISCSI_DPRINTF(5,"get_lba_status: num_descriptors: %d",lbas->num_descriptors);
-			for (i=0;i<lbas->num_descriptors;i++) {
-				struct scsi_lba_status_descriptor *lbasd = &lbas->descriptors[i];
-				LD_ISCSI_DPRINTF(5,"get_lba_status_descriptor %d, lba %"PRIu64", num_blocks %d, provisioning %d",i,lbasd->lba,lbasd->num_blocks,lbasd->provisioning);
-				if (lbasd->lba != _num_blocks+lba) {
-					LD_ISCSI_DPRINTF(0,"get_lba_status response is non-continuous");
-					scsi_free_scsi_task(task);
-					iscsi_fd_list[fd].in_flight = 0;
-					errno = EIO;
-					return -1;
-			    }
-				_num_allocated+=(lbasd->provisioning==0x00)?lbasd->num_blocks:0;
-				_num_blocks+=lbasd->num_blocks;
-				iscsi_fd_list[fd].lbasd_cached=lbas->descriptors[i];
-				iscsi_fd_list[fd].lbasd_cache_valid=1;
-			}
-			scsi_free_scsi_task(task);
-            if (_num_allocated == 0 && _num_blocks >= num_blocks) {
-		        LD_ISCSI_DPRINTF(4,"skipped read16_sync for non-allocated blocks: lun %d, lba %"PRIu64", num_blocks: %"PRIu64", block_size: %d, offset: %"PRIu64" count: %lu",iscsi_fd_list[fd].lun,lba,num_blocks,iscsi_fd_list[fd].block_size,offset,(unsigned long)count);
-				memset(buf, 0x00, count);
-		        iscsi_fd_list[fd].offset += count;
-		        iscsi_fd_list[fd].in_flight = 0;
-		        return count;
-			}
-		}
-
-		LD_ISCSI_DPRINTF(4,"read16_sync: lun %d, lba %"PRIu64", num_blocks: %"PRIu64", block_size: %d, offset: %"PRIu64" count: %lu",iscsi_fd_list[fd].lun,lba,num_blocks,iscsi_fd_list[fd].block_size,offset,(unsigned long)count);
-
-		task = iscsi_read16_sync(iscsi_fd_list[fd].iscsi, iscsi_fd_list[fd].lun, lba, num_blocks * iscsi_fd_list[fd].block_size, iscsi_fd_list[fd].block_size, 0, 0, 0, 0, 0);
-		iscsi_fd_list[fd].in_flight = 0;
-		if (task == NULL || task->status != SCSI_STATUS_GOOD) {
-			LD_ISCSI_DPRINTF(0,"failed to send read16 command");
+		LD_ISCSI_DPRINTF(4,"pread_sync: lun %d, lba %"PRIu64", num_blocks: %"PRIu64", block_size: %d, offset: %"PRIu64" count: %lu",iscsi_fd_list[fd].lun,lba,num_blocks,iscsi_fd_list[fd].block_size,offset,(unsigned long)count);
+
+		/* goes through the read cache when LD_ISCSI_READ_CACHE is set,
+		 * and deallocated blocks are not read at all when
+		 * LD_ISCSI_GET_LBA_STATUS is set */
+		if (iscsi_pread_sync(iscsi_fd_list[fd].iscsi, iscsi_fd_list[fd].lun, iscsi_fd_list[fd].offset, buf, count) != 0) {
+			LD_ISCSI_DPRINTF(0,"failed to read: %s", iscsi_get_error(iscsi_fd_list[fd].iscsi));
+			iscsi_fd_list[fd].in_flight = 0;
 			errno = EIO;
 			return -1;
 		}
-
-		memcpy(buf, &task->datain.data[iscsi_fd_list[fd].offset - offset], count);
+		iscsi_fd_list[fd].in_flight = 0;
 		iscsi_fd_list[fd].offset += count;
 
-		scsi_free_scsi_task(task);
-
 		return count;
 	}
 
@@ -431,50 +386,34 @@ ssize_t (*real_write)(int fd, const void *buf, size_t count);
 ssize_t write(int fd, const void *buf, size_t count)
 {
 	if ((iscsi_fd_list[fd].is_iscsi == 1) && (iscsi_fd_list[fd].in_flight == 0)) {
-		uint64_t offset;
-		uint64_t num_blocks, lba;
-		struct scsi_task *task;
+		uint64_t offset, size;
 
 		if (iscsi_fd_list[fd].dup2fd >= 0) {
 			return write(iscsi_fd_list[fd].dup2fd, buf, count);
 		}
-		if (iscsi_fd_list[fd].offset%iscsi_fd_list[fd].block_size) {
-			errno = EINVAL;
-			return -1;
-		}
-		if (count%iscsi_fd_list[fd].block_size) {
-			errno = EINVAL;
-			return -1;
-		}
-
-                iscsi_fd_list[fd].lbasd_cache_valid = 0;
 
 		offset = iscsi_fd_list[fd].offset;
-		num_blocks = count/iscsi_fd_list[fd].block_size;
-		lba = offset / iscsi_fd_list[fd].block_size;
+		size = iscsi_fd_list[fd].num_blocks * iscsi_fd_list[fd].block_size;
 
-		/* Don't try to read beyond the last LBA */
-		if (lba >= iscsi_fd_list[fd].num_blocks) {
+		/* Don't try to write beyond the end of the device */
+		if (offset >= size) {
 			return 0;
 		}
-		/* Trim num_blocks requested to last lba */
-		if ((lba + num_blocks) > iscsi_fd_list[fd].num_blocks) {
-			num_blocks = iscsi_fd_list[fd].num_blocks - lba;
-			count = num_blocks * iscsi_fd_list[fd].block_size;
+		if (offset + count > size) {
+			count = size - offset;
 		}
 
 		iscsi_fd_list[fd].in_flight = 1;
-		LD_ISCSI_DPRINTF(4,"write16_sync: lun %d, lba %"PRIu64", num_blocks: %"PRIu64", block_size: %d, offset: %"PRIu64" count: %lu",iscsi_fd_list[fd].lun,lba,num_blocks,iscsi_fd_list[fd].block_size,offset,(unsigned long)count);
-		task = iscsi_write16_sync(iscsi_fd_list[fd].iscsi, iscsi_fd_list[fd].lun, lba, (unsigned char *) buf, count, iscsi_fd_list[fd].block_size, 0, 0, 0, 0, 0);
-		iscsi_fd_list[fd].in_flight = 0;
-		if (task == NULL || task->status != SCSI_STATUS_GOOD) {
-			LD_ISCSI_DPRINTF(0,"failed to send write16 command");
+		LD_ISCSI_DPRINTF(4,"pwrite_sync: lun %d, offset: %"PRIu64" count: %lu",iscsi_fd_list[fd].lun,offset,(unsigned long)count);
+		if (iscsi_pwrite_sync(iscsi_fd_list[fd].iscsi, iscsi_fd_list[fd].lun, offset, (unsigned char *) buf, count) != 0) {
+			iscsi_fd_list[fd].in_flight = 0;
+			LD_ISCSI_DPRINTF(0,"failed to write: %s", iscsi_get_error(iscsi_fd_list[fd].iscsi));
 			errno = EIO;
 			return -1;
 		}
+		iscsi_fd_list[fd].in_flight = 0;
 
 		iscsi_fd_list[fd].offset += count;
-		scsi_free_scsi_task(task);
 
 		return count;
 	}
@@ -54,6 +54,9 @@ struct iscsi_in_pdu {
 	long long hdr_pos;
 	unsigned char hdr[ISCSI_RAW_HEADER_SIZE + ISCSI_DIGEST_SIZE];
 
+	long long ahs_pos;
+	unsigned char *ahs;
+
 	long long data_pos;
 	unsigned char *data;
 };
@@ -115,6 +118,22 @@ struct iscsi_context {
 	int bind_interfaces_cnt;
 	int nops_in_flight;
 
+	int nop_keepalive_interval;
+	int nop_keepalive_max_missed;
+	int nop_keepalive_missed;
+	int nop_keepalive_pending;
+	uint64_t nop_keepalive_sent_ns;
+	time_t next_nop_keepalive;
+	time_t last_rx_time;
+
+#define ISCSI_NOP_RTT_WINDOW 128
+	uint32_t nop_rtt_samples;
+	uint32_t nop_rtt_min_us;
+	uint32_t nop_rtt_max_us;
+	uint32_t nop_rtt_last_us;
+	uint64_t nop_rtt_sum_us;
+	uint32_t nop_rtt_window[ISCSI_NOP_RTT_WINDOW];
+
 	int chap_a;
 	int chap_i;
 
@@ -136,6 +155,58 @@ struct iscsi_context {
 	enum iscsi_initial_r2t use_initial_r2t;
 	enum iscsi_immediate_data want_immediate_data;
 	enum iscsi_immediate_data use_immediate_data;
+	enum iscsi_post_login_tur post_login_tur;
+
+	/* deficit round robin between the command PDUs and the DATA-OUT
+	 * trains of the individual tasks in the outqueue.
+	 * The command PDUs are the flow that follows the last DATA-OUT
+	 * flow, drr_current is NULL when it is their turn.
+	 */
+	uint32_t dataout_quantum;
+	struct iscsi_pdu *drr_cmd;	/* first command PDU in the outqueue */
+	int64_t drr_cmd_deficit;
+	struct iscsi_drr_flow *drr_flows;
+	int drr_nflows;
+	struct iscsi_drr_flow *drr_current;
+	int drr_in_turn;		/* drr_current had its quantum */
+
+	struct iscsi_completion_queue *cq;
+	struct iscsi_io_thread *io_thread;
+
+	/* used to carve up iscsi_read_blocks_async() and friends */
+	struct iscsi_block_limits {
+		uint32_t block_size;
+		uint32_t max_xfer_len;
+		uint32_t opt_xfer_len;
+		uint32_t opt_gran;
+		/* 0 if we do not know the size of the LUN */
+		uint64_t num_blocks;
+		int lbpme;
+		int lbprz;
+		uint32_t max_unmap;
+		uint32_t max_unmap_bdc;
+		uint32_t opt_unmap_gran;
+		uint32_t unmap_gran_align;
+		uint64_t max_ws_len;
+		int lbpws;
+		/* T10 PI type 1-3, 0 if protection is not enabled */
+		int prot_type;
+		int p_i_exp;
+	} limits;
+	int split_depth;
+	/* byte granular writes in flight and those waiting to get in */
+	struct iscsi_byte_io *byte_io_locked;
+	struct iscsi_byte_io *byte_io_waiting;
+
+	/* commands held back from the CmdSN window so they can be merged */
+	uint32_t merge_max_bytes;
+	struct iscsi_held_cmd *held_cmds;
+
+	struct iscsi_read_cache *read_caches;
+	struct iscsi_write_back *write_backs;
+	struct iscsi_lba_map *lba_maps;
+	struct iscsi_discard *discards;
+	struct iscsi_zero_detect *zero_detects;
 
 	int lun;
 	int no_auto_reconnect;
@@ -145,6 +216,12 @@ struct iscsi_context {
 
 	int log_level;
 	iscsi_log_fn log_fn;
+	struct iscsi_log_ring *log_ring;
+	struct iscsi_capture *capture;
+
+	struct iscsi_stats stats;
+	/* sending is stopped at the edge of the CmdSN window */
+	int cmdsn_stalled;
 
 	int mallocs;
 	int reallocs;
@@ -219,6 +296,15 @@ struct iscsi_scsi_cbdata {
 	struct scsi_task         *task;
 };
 
+/* The queued DATA-OUT PDUs of one task */
+struct iscsi_drr_flow {
+	struct iscsi_drr_flow *next;
+	uint32_t itt;
+	int64_t deficit;
+	struct iscsi_pdu *head;
+	struct iscsi_pdu *tail;
+};
+
 struct iscsi_pdu {
 	struct iscsi_pdu *next;
 
@@ -232,6 +318,10 @@ struct iscsi_pdu {
 #define ISCSI_PDU_DROP_ON_RECONNECT	0x00000004
 /* stop sending after this PDU has been sent */
 #define ISCSI_PDU_CORK_WHEN_SENT	0x00000008
+/* HEAD OF QUEUE or high priority task, queue ahead of DATA-OUT trains */
+#define ISCSI_PDU_URGENT		0x00000010
+/* tasks with a command priority of this or higher (lower value) are urgent */
+#define ISCSI_URGENT_TASK_PRIORITY	3
 
 	uint32_t flags;
 
@@ -259,6 +349,10 @@ struct iscsi_pdu {
 	struct iscsi_scsi_cbdata scsi_cbdata;
 	time_t scsi_timeout;
 	uint32_t expxferlen;
+
+	/* the DATA-OUT flow this PDU is queued on and the next PDU on it */
+	struct iscsi_drr_flow *drr_flow;
+	struct iscsi_pdu *drr_next;
 };
 
 struct iscsi_pdu *iscsi_allocate_pdu(struct iscsi_context *iscsi,
@@ -282,12 +376,108 @@ void iscsi_pdu_set_bufferoffset(struct iscsi_pdu *pdu, uint32_t bufferoffset);
 int iscsi_pdu_add_data(struct iscsi_context *iscsi, struct iscsi_pdu *pdu,
 		       unsigned char *dptr, int dsize);
 int iscsi_queue_pdu(struct iscsi_context *iscsi, struct iscsi_pdu *pdu);
+int iscsi_queue_pdus(struct iscsi_context *iscsi, struct iscsi_pdu **pdus,
+		     int n);
+int iscsi_flush_outqueue(struct iscsi_context *iscsi);
+
+void iscsi_completion_queue_cb(struct iscsi_context *iscsi, int status,
+			       void *command_data, void *private_data);
+void iscsi_free_completion_queue(struct iscsi_context *iscsi);
+int iscsi_scsi_command_send(struct iscsi_context *iscsi, int lun,
+			    struct scsi_task *task, iscsi_command_cb cb,
+			    struct iscsi_data *d, void *private_data);
+int iscsi_must_hold_commands(struct iscsi_context *iscsi);
+int iscsi_hold_command(struct iscsi_context *iscsi, int lun,
+		       struct scsi_task *task, iscsi_command_cb cb,
+		       struct iscsi_data *d, void *private_data);
+int iscsi_hold_batch(struct iscsi_context *iscsi, int lun,
+		     struct scsi_task **tasks, int n, iscsi_command_cb cb,
+		     void **private_data);
+void iscsi_flush_held_commands(struct iscsi_context *iscsi);
+int iscsi_cancel_held_command(struct iscsi_context *iscsi,
+			      struct scsi_task *task);
+void iscsi_cancel_held_commands(struct iscsi_context *iscsi);
+void iscsi_move_held_commands(struct iscsi_context *to,
+			      struct iscsi_context *from);
+uint32_t iscsi_held_command_count(struct iscsi_context *iscsi);
+int iscsi_read_blocks_direct(struct iscsi_context *iscsi, int lun,
+			     uint64_t lba, uint32_t num_blocks,
+			     unsigned char *buf, iscsi_command_cb cb,
+			     void *private_data);
+struct iscsi_read_cache *iscsi_get_read_cache(struct iscsi_context *iscsi,
+					      int lun);
+int iscsi_read_cache_read(struct iscsi_context *iscsi,
+			  struct iscsi_read_cache *cache, uint64_t lba,
+			  uint32_t num_blocks, unsigned char *buf,
+			  iscsi_command_cb cb, void *private_data);
+void iscsi_read_cache_task(struct iscsi_context *iscsi, int lun,
+			   struct scsi_task *task);
+void iscsi_free_read_caches(struct iscsi_context *iscsi);
+int iscsi_read_blocks_clean(struct iscsi_context *iscsi, int lun,
+			    uint64_t lba, uint32_t num_blocks,
+			    unsigned char *buf, iscsi_command_cb cb,
+			    void *private_data);
+int iscsi_read_blocks_cached(struct iscsi_context *iscsi, int lun,
+			     uint64_t lba, uint32_t num_blocks,
+			     unsigned char *buf, iscsi_command_cb cb,
+			     void *private_data);
+struct iscsi_lba_map *iscsi_get_lba_map(struct iscsi_context *iscsi,
+					int lun);
+int iscsi_lba_map_read(struct iscsi_context *iscsi,
+		       struct iscsi_lba_map *map, uint64_t lba,
+		       uint32_t num_blocks, unsigned char *buf,
+		       iscsi_command_cb cb, void *private_data);
+void iscsi_lba_map_task(struct iscsi_context *iscsi, int lun,
+			struct scsi_task *task);
+void iscsi_free_lba_maps(struct iscsi_context *iscsi);
+void iscsi_discard_scan(struct iscsi_context *iscsi);
+int iscsi_write_blocks_split(struct iscsi_context *iscsi, int lun,
+			     uint64_t lba, uint32_t num_blocks,
+			     unsigned char *buf, iscsi_command_cb cb,
+			     void *private_data);
+struct iscsi_zero_detect *iscsi_get_zero_detect(struct iscsi_context *iscsi,
+						int lun);
+int iscsi_zero_detect_write(struct iscsi_context *iscsi,
+			    struct iscsi_zero_detect *zd, uint64_t lba,
+			    uint32_t num_blocks, unsigned char *buf,
+			    iscsi_command_cb cb, void *private_data);
+void iscsi_free_zero_detects(struct iscsi_context *iscsi);
+void iscsi_free_discards(struct iscsi_context *iscsi);
+int iscsi_write_blocks_direct(struct iscsi_context *iscsi, int lun,
+			      uint64_t lba, uint32_t num_blocks,
+			      unsigned char *buf, iscsi_command_cb cb,
+			      void *private_data);
+struct iscsi_write_back *iscsi_get_write_back(struct iscsi_context *iscsi,
+					      int lun);
+int iscsi_write_back_write(struct iscsi_context *iscsi,
+			   struct iscsi_write_back *wb, uint64_t lba,
+			   uint32_t num_blocks, unsigned char *buf,
+			   iscsi_command_cb cb, void *private_data);
+int iscsi_write_back_read(struct iscsi_context *iscsi,
+			  struct iscsi_write_back *wb, uint64_t lba,
+			  uint32_t num_blocks, unsigned char *buf,
+			  iscsi_command_cb cb, void *private_data);
+void iscsi_write_back_scan(struct iscsi_context *iscsi);
+void iscsi_free_write_backs(struct iscsi_context *iscsi);
+
+struct iscsi_io_thread *iscsi_thread_start(struct iscsi_context *iscsi);
+int iscsi_thread_submit(struct iscsi_io_thread *io,
+			struct iscsi_thread_queue *queue, int lun,
+			struct scsi_task *task, void *private_data,
+			int *outstanding);
 
 int iscsi_add_data(struct iscsi_context *iscsi, struct iscsi_data *data,
 		   unsigned char *dptr, int dsize, int pdualignment);
 
 struct scsi_task;
-void iscsi_pdu_set_cdb(struct iscsi_pdu *pdu, struct scsi_task *task);
+int iscsi_pdu_set_cdb(struct iscsi_context *iscsi, struct iscsi_pdu *pdu,
+		      struct scsi_task *task);
+
+#define ISCSI_AHS_EXTENDED_CDB		0x01
+#define ISCSI_AHS_BIDI_READ_LENGTH	0x02
+
+int iscsi_pdu_add_ahs(struct iscsi_context *iscsi, struct iscsi_pdu *pdu,
+		      int type, unsigned char *dptr, int dsize);
 
 int iscsi_get_pdu_data_size(const unsigned char *hdr);
 int iscsi_get_pdu_padding_size(const unsigned char *hdr);
@@ -350,7 +540,8 @@ void iscsi_decrement_iface_rr(void);
 
 #define ISCSI_LOG(iscsi, level, format, ...) \
 	do { \
-		if (level <= iscsi->log_level && iscsi->log_fn) { \
+		if (level <= iscsi->log_level \
+		&&  (iscsi->log_fn || iscsi->log_ring)) { \
 			iscsi_log_message(iscsi, level, format, ## __VA_ARGS__); \
 		} \
 	} while (0)
@@ -360,6 +551,11 @@ iscsi_log_message(struct iscsi_context *iscsi, int level, const char *format, ..
 
 void
 iscsi_add_to_outqueue(struct iscsi_context *iscsi, struct iscsi_pdu *pdu);
+void
+iscsi_outqueue_remove(struct iscsi_context *iscsi, struct iscsi_pdu *pdu);
+
+int iscsi_drr_queued(struct iscsi_context *iscsi, struct iscsi_pdu *pdu);
+void iscsi_drr_clear(struct iscsi_context *iscsi);
 
 int iscsi_serial32_compare(uint32_t s1, uint32_t s2);
 
@@ -367,6 +563,18 @@ uint32_t iscsi_itt_post_increment(struct iscsi_context *iscsi);
 
 void iscsi_timeout_scan(struct iscsi_context *iscsi);
 
+int iscsi_nop_keepalive_scan(struct iscsi_context *iscsi);
+
+uint64_t iscsi_clock_ns(void);
+
+void iscsi_capture_out(struct iscsi_context *iscsi, struct iscsi_pdu *pdu);
+void iscsi_capture_in(struct iscsi_context *iscsi, struct iscsi_in_pdu *in);
+
+void iscsi_stats_latency(struct iscsi_context *iscsi, struct scsi_task *task,
+			 uint64_t submit_ns);
+
+void iscsi_task_times_start(struct scsi_task *task);
+
 void iscsi_reconnect_cb(struct iscsi_context *iscsi _U_, int status,
                         void *command_data, void *private_data);
 
@@ -0,0 +1,76 @@
+/*
+   Copyright (C) 2026 by agent <agent@local>
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU Lesser General Public License as published by
+   the Free Software Foundation; either version 2.1 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public License
+   along with this program; if not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef __iscsi_trace_h__
+#define __iscsi_trace_h__
+
+/*
+ * USDT tracepoints.
+ *
+ * Built in when sys/sdt.h is available, unless configured with
+ * --disable-usdt. An unattached probe is a single nop, so they stay in
+ * production builds. The provider is libiscsi and every probe has the
+ * same five arguments:
+ *
+ *   arg0 ITT, arg1 CmdSN, arg2 LUN, arg3 opcode, arg4 bytes
+ *
+ * For the command probes the opcode is the first byte of the CDB, for
+ * the PDU probes it is the iSCSI opcode.
+ *
+ * command__submit    a SCSI command has been numbered, bytes is the
+ *                    expected transfer length
+ * pdu__enqueue       a PDU went on the outqueue, bytes is its payload
+ * pdu__header__sent  the header and any immediate data are on the wire
+ * pdu__payload__sent the payload of a PDU from the task iovectors is on
+ *                    the wire
+ * r2t__received      bytes is the length the target asked for
+ * datain__received   bytes is the data segment length
+ * response__received a SCSI response, or a Data-In with status, bytes is
+ *                    the data segment length
+ * command__callback  the callback of a SCSI command is about to be
+ *                    called, bytes is the size of the Data-In buffer
+ * pdu__timeout       a PDU timed out
+ * reconnect          the session has been logged in again, ITT and CmdSN
+ *                    are where the new session starts
+ *
+ * For example the time between submit and response per opcode:
+ *
+ *   bpftrace -e 'usdt:libiscsi.so:libiscsi:command__submit
+ *                { @s[arg0] = nsecs; }
+ *                usdt:libiscsi.so:libiscsi:response__received /@s[arg0]/
+ *                { @us[arg3] = hist((nsecs - @s[arg0]) / 1000);
+ *                  delete(@s[arg0]); }'
+ */
+
+#ifdef HAVE_SYS_SDT_H
+#include <sys/sdt.h>
+#define ISCSI_TRACE(name, itt, cmdsn, lun, opcode, bytes) \
+	DTRACE_PROBE5(libiscsi, name, itt, cmdsn, lun, opcode, bytes)
+#else
+#define ISCSI_TRACE(name, itt, cmdsn, lun, opcode, bytes) \
+	do { } while (0)
+#endif
+
+#define ISCSI_TRACE_PDU(name, pdu, bytes) \
+	ISCSI_TRACE(name, (pdu)->itt, (pdu)->cmdsn, (pdu)->lun, \
+		    (pdu)->outdata.data[0] & 0x3f, bytes)
+
+#define ISCSI_TRACE_TASK(name, pdu, task, bytes) \
+	ISCSI_TRACE(name, (pdu)->itt, (pdu)->cmdsn, (pdu)->lun, \
+		    (task)->cdb[0], bytes)
+
+#endif /* __iscsi_trace_h__ */
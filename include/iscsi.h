@@ -39,6 +39,26 @@ struct sockaddr;
 /* FEATURES */
 #define LIBISCSI_FEATURE_IOVECTOR (1)
 #define LIBISCSI_FEATURE_NOP_COUNTER (1)
+#define LIBISCSI_FEATURE_POST_LOGIN_TUR (1)
+#define LIBISCSI_FEATURE_NOP_KEEPALIVE (1)
+#define LIBISCSI_FEATURE_TASK_ATTRIBUTES (1)
+#define LIBISCSI_FEATURE_SUBMIT_BATCH (1)
+#define LIBISCSI_FEATURE_COMPLETION_QUEUE (1)
+#define LIBISCSI_FEATURE_IO_THREAD (1)
+#define LIBISCSI_FEATURE_SESSION_POOL (1)
+#define LIBISCSI_FEATURE_SPLIT_IO (1)
+#define LIBISCSI_FEATURE_BYTE_IO (1)
+#define LIBISCSI_FEATURE_COMMAND_MERGE (1)
+#define LIBISCSI_FEATURE_READ_CACHE (1)
+#define LIBISCSI_FEATURE_WRITE_BACK (1)
+#define LIBISCSI_FEATURE_LBA_MAP (1)
+#define LIBISCSI_FEATURE_DISCARD (1)
+#define LIBISCSI_FEATURE_ZERO_DETECT (1)
+#define LIBISCSI_FEATURE_T10_PI (1)
+#define LIBISCSI_FEATURE_STATS (1)
+#define LIBISCSI_FEATURE_LOG_RING (1)
+#define LIBISCSI_FEATURE_CAPTURE (1)
+#define LIBISCSI_FEATURE_TASK_TIMES (1)
 
 #define MAX_STRING_SIZE (255)
 
@@ -169,6 +189,64 @@ enum iscsi_initial_r2t {
 int
 iscsi_set_initial_r2t(struct iscsi_context *iscsi, enum iscsi_initial_r2t initial_r2t);
 
+/*
+ * This function controls what iscsi_full_connect_async/sync does with the
+ * TEST UNIT READY it sends once the login has completed.
+ *
+ * ISCSI_POST_LOGIN_TUR_WAIT     : Send TUR, retry it until all the unit
+ *                                 attentions have been cleared and only
+ *                                 then invoke the connect callback.
+ * ISCSI_POST_LOGIN_TUR_PIPELINE : Send a single TUR and invoke the connect
+ *                                 callback straight away without waiting for
+ *                                 it to complete. Commands queued from the
+ *                                 callback are sent right behind it.
+ * ISCSI_POST_LOGIN_TUR_SKIP     : Do not send a TUR at all. The application
+ *                                 will see any pending unit attention on its
+ *                                 first command.
+ *
+ * Default is ISCSI_POST_LOGIN_TUR_WAIT
+ */
+enum iscsi_post_login_tur {
+	ISCSI_POST_LOGIN_TUR_WAIT     = 0,
+	ISCSI_POST_LOGIN_TUR_PIPELINE = 1,
+	ISCSI_POST_LOGIN_TUR_SKIP     = 2
+};
+EXTERN int
+iscsi_set_post_login_tur(struct iscsi_context *iscsi, enum iscsi_post_login_tur mode);
+
+/*
+ * Interleave DATA-OUT trains with other PDUs when sending.
+ *
+ * Normally all the DATA-OUT PDUs for a large write are sent before the
+ * command PDUs of any later tasks. With a non-zero quantum the command PDUs
+ * and the DATA-OUT trains of each task are instead served deficit round
+ * robin, with each getting to send about quantum bytes per turn. Command
+ * PDUs are still sent in CmdSN order. Bytes a flow did not get to use are
+ * carried over to its next turn for as long as it has something to send,
+ * so PDUs larger than the quantum go out once enough turns have passed.
+ *
+ * quantum : bytes per turn, 0 disables interleaving (default).
+ *
+ * Returns 0 on success, -1 if it ran out of memory.
+ */
+EXTERN int
+iscsi_set_dataout_quantum(struct iscsi_context *iscsi, uint32_t quantum);
+
+/*
+ * Merge adjacent READ16/WRITE16 commands while the CmdSN window is closed.
+ *
+ * Once the target stops accepting new commands, further commands are
+ * held back in submission order. When the window opens again, held
+ * READ16 or WRITE16 commands to consecutive LBAs on the same LUN with the
+ * same flags are sent as a single command of up to max_bytes, using the
+ * tasks' own iovectors. Each original task still gets its own callback
+ * with the status, sense and residual of its part of the transfer.
+ *
+ * max_bytes : largest merged transfer, 0 disables merging (default).
+ */
+EXTERN int
+iscsi_set_command_merging(struct iscsi_context *iscsi, uint32_t max_bytes);
+
 
 /*
  * This function is used to parse an iSCSI URL into a iscsi_url structure.
@@ -581,6 +659,44 @@ EXTERN int iscsi_nop_out_async(struct iscsi_context *iscsi, iscsi_command_cb cb,
 /* read out the number of consecutive nop outs that did not receive an answer */
 EXTERN int iscsi_get_nops_in_flight(struct iscsi_context *iscsi);
 
+/*
+ * Let libiscsi send NOP-Out keepalives on its own.
+ *
+ * interval   : seconds without any PDU received from the target before a
+ *              NOP-Out is sent. 0 disables the keepalives (default).
+ * max_missed : number of consecutive intervals a keepalive may stay
+ *              unanswered before the path is declared dead and the session
+ *              is reconnected (or failed, if auto reconnect is disabled).
+ *
+ * No NOP-Out is sent while the target keeps sending us PDUs, so busy sessions
+ * carry no extra traffic. The keepalives are driven from iscsi_service(), so
+ * the application must call it at least once per interval, for example by
+ * polling with a timeout and calling iscsi_service(iscsi, 0) on expiry.
+ *
+ * Returns:
+ *  0 success
+ * <0 error
+ */
+EXTERN int iscsi_set_nop_keepalive(struct iscsi_context *iscsi, int interval,
+				   int max_missed);
+
+/*
+ * Round trip times measured from the keepalive NOP-Outs on the current
+ * connection. p99_us is computed over the most recent samples only.
+ * All values are 0 until the first keepalive has been answered.
+ */
+struct iscsi_nop_rtt {
+	uint32_t samples;
+	uint32_t last_us;
+	uint32_t min_us;
+	uint32_t avg_us;
+	uint32_t p99_us;
+	uint32_t max_us;
+	int missed;
+};
+EXTERN int iscsi_get_nop_rtt(struct iscsi_context *iscsi,
+			     struct iscsi_nop_rtt *rtt);
+
 struct scsi_task;
 struct scsi_sense;
 
@@ -736,6 +852,557 @@ EXTERN int iscsi_scsi_command_async(struct iscsi_context *iscsi, int lun,
 			     struct scsi_task *task, iscsi_command_cb cb,
 			     struct iscsi_data *data, void *private_data);
 
+/*
+ * Submit n tasks built with the scsi_cdb_*() functions in one go.
+ * The tasks get consecutive CmdSNs, are appended to the outqueue as a
+ * block and the library starts writing them to the socket before
+ * returning. Data-out must already be attached to the tasks as iovectors.
+ *
+ * private_data is an array of n pointers, one per task, or NULL.
+ *
+ * Either all tasks are queued or none are.
+ *
+ * Returns:
+ *  0 success, cb will be invoked once for each task
+ * <0 error, the tasks are still owned by the caller
+ */
+EXTERN int iscsi_submit_batch(struct iscsi_context *iscsi, int lun,
+			      struct scsi_task **tasks, int n,
+			      iscsi_command_cb cb, void **private_data);
+
+/*
+ * Completion queue.
+ *
+ * As an alternative to a callback per task, tasks submitted with a NULL
+ * callback, through the iscsi_*_task() functions, iscsi_scsi_command_async()
+ * or iscsi_submit_batch(), are put on a per context completion queue when
+ * they finish. The application
+ * reaps them with iscsi_get_completions() after iscsi_service() returns,
+ * so it can batch its own processing and never gets called back from
+ * inside the library.
+ *
+ * Tasks submitted with a callback keep working as before, including the
+ * ones the sync API uses internally.
+ */
+struct iscsi_completion {
+	struct scsi_task *task;
+	int status;
+	void *private_data;
+};
+
+/*
+ * Enable the completion queue with room for size completions to start
+ * with. The queue grows as needed.
+ * A size of 0 disables the queue again, which is only possible once it
+ * is empty.
+ *
+ * Completions still queued when the context is destroyed are released
+ * together with their tasks.
+ *
+ * Returns:
+ *  0 success
+ * <0 error
+ */
+EXTERN int iscsi_set_completion_queue(struct iscsi_context *iscsi, int size);
+
+/*
+ * Reap up to max completions from the completion queue into completions.
+ * The application owns the tasks returned and must free them with
+ * scsi_free_scsi_task().
+ *
+ * Returns:
+ * >=0 number of completions returned
+ *  <0 error, the completion queue is not enabled
+ */
+EXTERN int iscsi_get_completions(struct iscsi_context *iscsi,
+				 struct iscsi_completion *completions,
+				 int max);
+
+/*
+ * Threaded mode.
+ *
+ * Once the context is logged in, iscsi_start_io_thread() hands it over to
+ * a library owned I/O thread that runs the socket loop. From then on the
+ * application must not call iscsi_service() or any of the other functions
+ * on the context itself until iscsi_stop_io_thread() returns. Instead
+ * each application thread creates its own iscsi_thread_queue and submits
+ * tasks built with the scsi_cdb_*() functions through it.
+ *
+ * Submission only pushes onto a lock-free queue and wakes the I/O thread,
+ * it never blocks on the socket. Completed tasks come back on the queue
+ * of the thread that submitted them and are reaped with
+ * iscsi_thread_queue_get_completions(). iscsi_thread_queue_get_fd() returns
+ * a descriptor that polls readable when there are completions to reap.
+ *
+ * If the connection is lost and can not be brought back, every task in
+ * flight and every task submitted after that completes with
+ * SCSI_STATUS_ERROR. Stop the I/O thread and destroy the context then.
+ *
+ * Only available if libiscsi was built with pthread support, otherwise
+ * these functions fail.
+ */
+struct iscsi_thread_queue;
+
+EXTERN int iscsi_start_io_thread(struct iscsi_context *iscsi);
+/* Stops the I/O thread once it has passed on all submitted tasks. Tasks
+ * still in flight complete into their queues from the next iscsi_service().
+ */
+EXTERN int iscsi_stop_io_thread(struct iscsi_context *iscsi);
+
+/* A queue submits to the I/O thread that was running on the context when
+ * the queue was created, so create it after iscsi_start_io_thread(). Once
+ * that I/O thread has been stopped submitting through the queue fails.
+ *
+ * Each queue must only be used by one thread at a time. Destroying it frees
+ * any unreaped completions along with their tasks, so only destroy a queue
+ * once all tasks submitted through it have completed.
+ */
+EXTERN struct iscsi_thread_queue *
+iscsi_thread_queue_create(struct iscsi_context *iscsi);
+EXTERN void iscsi_thread_queue_destroy(struct iscsi_thread_queue *queue);
+EXTERN int iscsi_thread_queue_get_fd(struct iscsi_thread_queue *queue);
+
+/*
+ * Returns:
+ *  0 the task was queued for the I/O thread
+ * <0 error, the I/O thread is not running or we are out of memory
+ */
+EXTERN int iscsi_submit_threaded(struct iscsi_thread_queue *queue, int lun,
+				 struct scsi_task *task, void *private_data);
+/*
+ * Returns the number of completions stored in completions, at most max.
+ */
+EXTERN int
+iscsi_thread_queue_get_completions(struct iscsi_thread_queue *queue,
+				   struct iscsi_completion *completions,
+				   int max);
+
+/*
+ * Session pools.
+ *
+ * A session pool logs in several sessions to the same LUN, each with its
+ * own ISID and its own I/O thread, and presents them as a single device.
+ * Tasks submitted to the pool are spread over the sessions and all of them
+ * complete into one queue that is reaped with
+ * iscsi_session_pool_get_completions(). Like an iscsi_thread_queue the pool
+ * must only be used by one thread at a time.
+ *
+ * The contexts are created by iscsi_session_pool_create() and can be
+ * configured through iscsi_session_pool_get_context(), e.g. to set up CHAP
+ * or digests, before iscsi_session_pool_connect() logs them all in.
+ *
+ * Only available if libiscsi was built with pthread support.
+ */
+struct iscsi_session_pool;
+
+enum iscsi_pool_dispatch {
+	/* the session with the fewest tasks in flight */
+	ISCSI_POOL_DISPATCH_LEAST_OUTSTANDING = 0,
+	/* hash the starting LBA so that each stripe always uses the same
+	 * session. Tasks without an LBA fall back to least outstanding */
+	ISCSI_POOL_DISPATCH_LBA_HASH          = 1
+};
+
+EXTERN struct iscsi_session_pool *
+iscsi_session_pool_create(const char *initiator_name, int nsessions);
+/* Logs out all sessions and destroys the pool. Only call this once all
+ * submitted tasks have been reaped.
+ */
+EXTERN void iscsi_session_pool_destroy(struct iscsi_session_pool *pool);
+EXTERN const char *iscsi_session_pool_get_error(struct iscsi_session_pool *pool);
+EXTERN struct iscsi_context *
+iscsi_session_pool_get_context(struct iscsi_session_pool *pool, int session);
+/* stripe is in logical blocks and only used for ISCSI_POOL_DISPATCH_LBA_HASH */
+EXTERN int iscsi_session_pool_set_dispatch(struct iscsi_session_pool *pool,
+					   enum iscsi_pool_dispatch dispatch,
+					   uint64_t stripe);
+/*
+ * Returns:
+ *  0 all sessions are logged in and their I/O threads are running
+ * <0 error, see iscsi_session_pool_get_error()
+ */
+EXTERN int iscsi_session_pool_connect(struct iscsi_session_pool *pool,
+				      const char *url);
+EXTERN int iscsi_session_pool_get_lun(struct iscsi_session_pool *pool);
+EXTERN int iscsi_session_pool_get_fd(struct iscsi_session_pool *pool);
+EXTERN int iscsi_session_pool_submit(struct iscsi_session_pool *pool,
+				     struct scsi_task *task,
+				     void *private_data);
+EXTERN int
+iscsi_session_pool_get_completions(struct iscsi_session_pool *pool,
+				   struct iscsi_completion *completions,
+				   int max);
+
+/*
+ * Large I/O.
+ *
+ * iscsi_read_blocks_async() and iscsi_write_blocks_async() take a transfer
+ * of any size and carve it into READ/WRITE 10 or 16 commands that the
+ * target will accept, keeping up to the split depth of them in flight at a
+ * time. The data goes straight to or from buf. cb is called once, when
+ * all the commands have completed or after the first failure, with
+ * command_data set to NULL.
+ *
+ * The size of each command is the OPTIMAL TRANSFER LENGTH of the LUN,
+ * or MaxBurstLength if the target does not report one, capped to the
+ * MAXIMUM TRANSFER LENGTH. iscsi_set_block_limits() sets these from the
+ * READ CAPACITY block size and the Block Limits VPD page, bl may be NULL
+ * if the target does not have that page. iscsi_discover_block_limits_sync()
+ * fetches both from the target and then calls iscsi_set_block_limits().
+ */
+struct scsi_inquiry_block_limits;
+
+EXTERN int
+iscsi_set_block_limits(struct iscsi_context *iscsi, uint32_t block_size,
+		       struct scsi_inquiry_block_limits *bl);
+EXTERN int
+iscsi_discover_block_limits_sync(struct iscsi_context *iscsi, int lun);
+/* Number of commands to keep in flight per transfer, default 8 */
+EXTERN int iscsi_set_split_depth(struct iscsi_context *iscsi, int depth);
+
+EXTERN int
+iscsi_read_blocks_async(struct iscsi_context *iscsi, int lun, uint64_t lba,
+			uint32_t num_blocks, unsigned char *buf,
+			iscsi_command_cb cb, void *private_data);
+EXTERN int
+iscsi_write_blocks_async(struct iscsi_context *iscsi, int lun, uint64_t lba,
+			 uint32_t num_blocks, unsigned char *buf,
+			 iscsi_command_cb cb, void *private_data);
+/* Returns 0 on success and -1 on failure */
+EXTERN int
+iscsi_read_blocks_sync(struct iscsi_context *iscsi, int lun, uint64_t lba,
+		       uint32_t num_blocks, unsigned char *buf);
+EXTERN int
+iscsi_write_blocks_sync(struct iscsi_context *iscsi, int lun, uint64_t lba,
+			uint32_t num_blocks, unsigned char *buf);
+
+/*
+ * Byte granular I/O.
+ *
+ * Read or write count bytes at any byte offset of the LUN. The block
+ * aligned middle of the transfer goes straight to or from buf through the
+ * large I/O splitter above, partial blocks at either end go through a
+ * bounce buffer, with a read-modify-write for writes. Read-modify-writes
+ * are widened to the OPTIMAL TRANSFER LENGTH GRANULARITY, and writes that
+ * overlap one are held back until it has finished.
+ *
+ * Needs iscsi_set_block_limits() or iscsi_discover_block_limits_sync()
+ * first. cb is called once with command_data set to NULL.
+ */
+EXTERN int
+iscsi_pread_async(struct iscsi_context *iscsi, int lun, uint64_t offset,
+		  unsigned char *buf, size_t count,
+		  iscsi_command_cb cb, void *private_data);
+EXTERN int
+iscsi_pwrite_async(struct iscsi_context *iscsi, int lun, uint64_t offset,
+		   unsigned char *buf, size_t count,
+		   iscsi_command_cb cb, void *private_data);
+/* Returns 0 on success and -1 on failure */
+EXTERN int
+iscsi_pread_sync(struct iscsi_context *iscsi, int lun, uint64_t offset,
+		 unsigned char *buf, size_t count);
+EXTERN int
+iscsi_pwrite_sync(struct iscsi_context *iscsi, int lun, uint64_t offset,
+		  unsigned char *buf, size_t count);
+
+/*
+ * Read cache.
+ *
+ * Caches pages of page_size bytes of a LUN, at most max_pages of them,
+ * for iscsi_read_blocks_async() and iscsi_pread_async() and their sync
+ * versions. Concurrent reads of the same page share a single command and
+ * every SCSI command that writes to the LUN through this context drops
+ * the pages it covers. A read that is completely served from the cache
+ * calls its callback before iscsi_read_blocks_async() returns.
+ *
+ * Needs iscsi_discover_block_limits_sync() first, since the size of the
+ * LUN must be known.
+ *
+ * iscsi_set_read_cache_readahead() makes the cache read up to pages
+ * pages ahead of a sequential reader. With prefetch set, it sends a
+ * PRE-FETCH16 for them to the target instead of reading them into the
+ * cache.
+ *
+ * iscsi_invalidate_read_cache() drops everything, for when the LUN has
+ * been written to by someone else.
+ */
+struct iscsi_read_cache_stats {
+	uint64_t hits;
+	uint64_t misses;
+	/* reads that waited for a page someone else was reading */
+	uint64_t coalesced;
+	/* pages read or prefetched ahead */
+	uint64_t readahead;
+	uint64_t evictions;
+	uint64_t invalidations;
+};
+
+EXTERN int
+iscsi_enable_read_cache(struct iscsi_context *iscsi, int lun,
+			uint32_t page_size, uint32_t max_pages);
+EXTERN void
+iscsi_disable_read_cache(struct iscsi_context *iscsi, int lun);
+EXTERN int
+iscsi_set_read_cache_readahead(struct iscsi_context *iscsi, int lun,
+			       uint32_t pages, int prefetch);
+EXTERN void
+iscsi_invalidate_read_cache(struct iscsi_context *iscsi, int lun);
+EXTERN int
+iscsi_get_read_cache_stats(struct iscsi_context *iscsi, int lun,
+			   struct iscsi_read_cache_stats *stats);
+
+/*
+ * Write-back.
+ *
+ * Makes iscsi_write_blocks_async() and iscsi_pwrite_async() copy the data
+ * into memory and complete right away, usually before the call returns,
+ * and write it to the target later. Overlapping and adjacent writes are
+ * merged. Dirty data is written out once there is flush_bytes of it, or
+ * once it is max_age seconds old, 0 for no age limit. No more than
+ * max_bytes is held in memory, writes that would go over it wait until
+ * enough has been written out. Reads through iscsi_read_blocks_async()
+ * and iscsi_pread_async() see the data that has not been written yet.
+ *
+ * Other SCSI commands, and writes sent as plain tasks, are not ordered
+ * against the dirty data, so use a barrier first.
+ *
+ * A barrier completes once every write before it has reached the target
+ * and a SYNCHRONIZE CACHE16 covering them has completed. Barriers that
+ * become ready at the same time share the SYNCHRONIZE CACHE16. Like
+ * fsync() it fails if any write-back failed since the last barrier.
+ *
+ * iscsi_disable_write_back() fails unless everything has been written
+ * out, and data that is still dirty when the context is destroyed is
+ * lost.
+ */
+EXTERN int
+iscsi_enable_write_back(struct iscsi_context *iscsi, int lun,
+			size_t max_bytes, size_t flush_bytes, int max_age);
+EXTERN int
+iscsi_disable_write_back(struct iscsi_context *iscsi, int lun);
+EXTERN int
+iscsi_write_back_barrier_async(struct iscsi_context *iscsi, int lun,
+			       iscsi_command_cb cb, void *private_data);
+/* Returns 0 on success and -1 on failure */
+EXTERN int
+iscsi_write_back_barrier_sync(struct iscsi_context *iscsi, int lun);
+
+/*
+ * Provisioning map.
+ *
+ * Keeps track of which blocks of a thin provisioned LUN are mapped and
+ * which are deallocated, so that iscsi_read_blocks_async(),
+ * iscsi_pread_async() and their sync versions can fill the deallocated
+ * ones with zeros without reading them from the target. The map is filled
+ * in the background with GET LBA STATUS, starting with the ranges that
+ * are read, and writes sent through this context keep it up to date.
+ *
+ * Needs iscsi_discover_block_limits_sync() first, and a LUN that reports
+ * both LBPME and LBPRZ in READ CAPACITY16.
+ *
+ * iscsi_lba_map_lookup() returns the SCSI_PROVISIONING_TYPE_* of lba, and
+ * in num_blocks how many blocks from lba on are in the same state. It
+ * returns -1 if that is not known yet, and then starts finding out, with
+ * num_blocks set to how far the unknown range goes.
+ *
+ * iscsi_invalidate_lba_map() forgets everything, for when the LUN has
+ * been written to or unmapped by someone else.
+ */
+EXTERN int
+iscsi_enable_lba_map(struct iscsi_context *iscsi, int lun);
+EXTERN void
+iscsi_disable_lba_map(struct iscsi_context *iscsi, int lun);
+EXTERN int
+iscsi_lba_map_lookup(struct iscsi_context *iscsi, int lun, uint64_t lba,
+		     uint64_t *num_blocks);
+EXTERN void
+iscsi_invalidate_lba_map(struct iscsi_context *iscsi, int lun);
+
+/*
+ * Discard batching.
+ *
+ * iscsi_discard_async() queues a range to be unmapped instead of sending
+ * an UNMAP for it straight away. Queued ranges are sorted and merged and
+ * sent as UNMAPs with as many block descriptors as the target allows,
+ * once flush_blocks blocks are queued or the oldest range is max_age
+ * seconds old, 0 for no age limit, or when iscsi_flush_discards() is
+ * called. The callback for a range is called once all the UNMAPs that
+ * cover it have completed.
+ *
+ * Uses the unmap limits and granularity from the Block Limits page, so
+ * call iscsi_set_block_limits() or iscsi_discover_block_limits_sync()
+ * first. Ranges are trimmed to the whole granules they cover, which the
+ * target is free to do anyway.
+ *
+ * Discards are not ordered against other commands to the LUN, so don't
+ * write to a range until its discard has completed.
+ *
+ * iscsi_disable_discard() sends whatever is still queued first.
+ */
+EXTERN int
+iscsi_enable_discard(struct iscsi_context *iscsi, int lun,
+		     uint64_t flush_blocks, int max_age);
+EXTERN int
+iscsi_disable_discard(struct iscsi_context *iscsi, int lun);
+EXTERN int
+iscsi_discard_async(struct iscsi_context *iscsi, int lun, uint64_t lba,
+		    uint64_t num_blocks, iscsi_command_cb cb,
+		    void *private_data);
+EXTERN int
+iscsi_flush_discards(struct iscsi_context *iscsi, int lun);
+
+/*
+ * Zero block detection.
+ *
+ * Makes iscsi_write_blocks_async(), iscsi_pwrite_async() and their sync
+ * versions look for runs of at least min_blocks blocks that are all
+ * zero, and send those as a WRITE SAME16 of a single zero block instead.
+ * If the Logical Block Provisioning page found by
+ * iscsi_discover_block_limits_sync() has LBPWS set, the WRITE SAME16
+ * also has UNMAP set. The callback is called once all the commands for
+ * the write have completed.
+ *
+ * Falls back to normal writes for good if the target rejects the WRITE
+ * SAME16.
+ */
+struct iscsi_zero_detect_stats {
+	/* blocks sent as WRITE SAME16, and how many of those there were */
+	uint64_t zero_blocks;
+	uint64_t write_sames;
+	/* blocks sent as normal writes */
+	uint64_t data_blocks;
+};
+
+EXTERN int
+iscsi_enable_zero_detect(struct iscsi_context *iscsi, int lun,
+			 uint32_t min_blocks);
+EXTERN void
+iscsi_disable_zero_detect(struct iscsi_context *iscsi, int lun);
+EXTERN int
+iscsi_get_zero_detect_stats(struct iscsi_context *iscsi, int lun,
+			    struct iscsi_zero_detect_stats *stats);
+
+/*
+ * T10 protection information.
+ *
+ * For LUNs formatted with protection, which iscsi_discover_block_limits_sync()
+ * finds out from PROT_EN and P_TYPE in READ CAPACITY16. Only one
+ * protection interval per block is supported.
+ *
+ * iscsi_write_pi_task() writes num_blocks blocks from buf with a
+ * protection tuple after each: the T10-DIF CRC16 of the block as the
+ * guard, app_tag, and the low 32 bits of the LBA of the block as the
+ * reference tag. WRPROTECT is 1 so the target checks them all.
+ *
+ * iscsi_read_pi_task() reads num_blocks blocks with their tuples, checks
+ * the guard and, for type 1 and 2, the reference tag of each, and copies
+ * the data without the tuples into buf. A mismatch completes the task
+ * with SCSI_STATUS_CHECK_CONDITION, sense key COMMAND_ABORTED and the
+ * LOGICAL_BLOCK_GUARD/REFTAG_CHECK_FAILED ascq, as if the target had
+ * found it. Blocks with the escape application tag are not checked.
+ *
+ * Type 2 uses READ32/WRITE32, the other types READ16/WRITE16.
+ */
+EXTERN uint16_t
+iscsi_crc16_t10dif(uint16_t crc, const unsigned char *buf, size_t len);
+EXTERN struct scsi_task *
+iscsi_read_pi_task(struct iscsi_context *iscsi, int lun, uint64_t lba,
+		   unsigned char *buf, uint32_t num_blocks,
+		   iscsi_command_cb cb, void *private_data);
+EXTERN struct scsi_task *
+iscsi_write_pi_task(struct iscsi_context *iscsi, int lun, uint64_t lba,
+		    const unsigned char *buf, uint32_t num_blocks,
+		    uint16_t app_tag, iscsi_command_cb cb, void *private_data);
+EXTERN struct scsi_task *
+iscsi_read_pi_sync(struct iscsi_context *iscsi, int lun, uint64_t lba,
+		   unsigned char *buf, uint32_t num_blocks);
+EXTERN struct scsi_task *
+iscsi_write_pi_sync(struct iscsi_context *iscsi, int lun, uint64_t lba,
+		    const unsigned char *buf, uint32_t num_blocks,
+		    uint16_t app_tag);
+
+/*
+ * Statistics.
+ *
+ * Every context counts what it sends and receives, always. The counters
+ * are plain integers updated by whoever drives the context, so
+ * iscsi_get_stats() must be called from that same thread. They carry
+ * over across reconnects.
+ *
+ * tx and rx are indexed by iSCSI opcode and count whole PDUs, bytes
+ * including headers, digests and padding. A CmdSN stall is counted each
+ * time sending has to stop because the next command is outside the
+ * window the target has opened, not for every attempt while it stays
+ * closed.
+ *
+ * latency is indexed by the first byte of the CDB and covers the time
+ * from submitting the command to calling the callback, for every
+ * command that completes other than by being cancelled. Bucket i counts
+ * latencies of 2^i up to 2^(i+1) microseconds, bucket 0 also has those
+ * under a microsecond and the last bucket everything longer.
+ *
+ * The queue depths are the state at the time of the call.
+ */
+#define ISCSI_STATS_OPCODES 64
+#define ISCSI_STATS_CDB_OPCODES 256
+#define ISCSI_STATS_LATENCY_BUCKETS 32
+
+struct iscsi_pdu_counters {
+	uint64_t pdus;
+	uint64_t bytes;
+};
+
+struct iscsi_latency_histogram {
+	uint64_t count;
+	uint64_t total_us;
+	uint64_t buckets[ISCSI_STATS_LATENCY_BUCKETS];
+};
+
+struct iscsi_stats {
+	struct iscsi_pdu_counters tx[ISCSI_STATS_OPCODES];
+	struct iscsi_pdu_counters rx[ISCSI_STATS_OPCODES];
+
+	uint64_t r2ts;
+	uint64_t data_in;
+	uint64_t cmdsn_stalls;
+	uint64_t reconnects;
+	uint64_t timeouts;
+	uint64_t busy;
+	uint64_t task_set_full;
+
+	/* PDUs waiting to be sent, sent and waiting for a reply, and
+	 * commands held back for merging */
+	uint32_t outqueue_depth;
+	uint32_t waitpdu_depth;
+	uint32_t held_depth;
+
+	struct iscsi_latency_histogram latency[ISCSI_STATS_CDB_OPCODES];
+};
+
+EXTERN void
+iscsi_get_stats(struct iscsi_context *iscsi, struct iscsi_stats *stats);
+
+/*
+ * PDU capture.
+ *
+ * iscsi_start_capture() writes every PDU the context sends and receives
+ * from then on to filename as a pcapng file that Wireshark can decode as
+ * iSCSI. Each PDU gets a made up IPv4/TCP header with the addresses of
+ * the connection. Headers are always captured whole, of the data
+ * segment only the first snaplen bytes are kept. The file is written
+ * from a separate thread; if that cannot keep up, packets are dropped
+ * rather than slowing down the context.
+ *
+ * iscsi_stop_capture() writes out what is still buffered and closes the
+ * file. Capture carries on across reconnects and stops when the context
+ * is destroyed.
+ */
+EXTERN int
+iscsi_start_capture(struct iscsi_context *iscsi, const char *filename,
+		    uint32_t snaplen);
+EXTERN void
+iscsi_stop_capture(struct iscsi_context *iscsi);
+
 /*
  * Async commands for SCSI
  *
@@ -872,6 +1539,33 @@ iscsi_writeverify16_task(struct iscsi_context *iscsi, int lun, uint64_t lba,
 		   unsigned char *data, uint32_t datalen, int blocksize,
 		   int wrprotect, int dpo, int bytchk, int group_number,
 		   iscsi_command_cb cb, void *private_data);
+/*
+ * XDWRITEREAD and XPWRITE are bidirectional/XOR commands. XDWRITEREAD sends
+ * datalen bytes and reads the same amount of XOR data back into task->datain,
+ * the 32 byte variants use an extended CDB AHS.
+ */
+EXTERN struct scsi_task *
+iscsi_xdwriteread10_task(struct iscsi_context *iscsi, int lun, uint32_t lba,
+		   unsigned char *data, uint32_t datalen, int blocksize,
+		   int wrprotect, int dpo, int fua, int disable_write, int fua_nv,
+		   int group_number,
+		   iscsi_command_cb cb, void *private_data);
+EXTERN struct scsi_task *
+iscsi_xdwriteread32_task(struct iscsi_context *iscsi, int lun, uint64_t lba,
+		   unsigned char *data, uint32_t datalen, int blocksize,
+		   int wrprotect, int dpo, int fua, int disable_write, int fua_nv,
+		   int group_number,
+		   iscsi_command_cb cb, void *private_data);
+EXTERN struct scsi_task *
+iscsi_xpwrite10_task(struct iscsi_context *iscsi, int lun, uint32_t lba,
+		   unsigned char *data, uint32_t datalen, int blocksize,
+		   int dpo, int fua, int fua_nv, int xorpinfo, int group_number,
+		   iscsi_command_cb cb, void *private_data);
+EXTERN struct scsi_task *
+iscsi_xpwrite32_task(struct iscsi_context *iscsi, int lun, uint64_t lba,
+		   unsigned char *data, uint32_t datalen, int blocksize,
+		   int dpo, int fua, int fua_nv, int xorpinfo, int group_number,
+		   iscsi_command_cb cb, void *private_data);
 EXTERN struct scsi_task *
 iscsi_verify10_task(struct iscsi_context *iscsi, int lun,
 		    unsigned char *data, uint32_t datalen, uint32_t lba,
@@ -941,6 +1635,53 @@ iscsi_unmap_task(struct iscsi_context *iscsi, int lun, int anchor, int group,
 		 struct unmap_list *list, int list_len,
 		 iscsi_command_cb cb, void *private_data);
 
+/*
+ * Copy offload.
+ *
+ * EXTENDED COPY (LID1) copies between the LUs named by the target
+ * descriptors, as described by the block to block segment descriptors.
+ * The LUs can be anywhere the copy manager of this LUN can reach, often
+ * the same array. RECEIVE COPY RESULTS returns the status and the
+ * operating parameters of the copy manager; the datain unmarshalls to
+ * struct scsi_copy_results_copy_status, _op_params or _rod_token_info
+ * depending on the service action.
+ *
+ * POPULATE TOKEN creates a ROD token for the ranges in list, which is
+ * fetched with RECEIVE COPY RESULTS/ROD TOKEN INFORMATION using the same
+ * list_id. WRITE USING TOKEN then writes the data the token represents,
+ * starting offset blocks into it, to the ranges in list on any LUN the
+ * token is valid for.
+ */
+struct scsi_copy_target_descriptor;
+struct scsi_copy_segment_descriptor;
+
+EXTERN struct scsi_task *
+iscsi_extended_copy_task(struct iscsi_context *iscsi, int lun,
+			 int list_id, int list_id_usage,
+			 struct scsi_copy_target_descriptor *targets,
+			 int num_targets,
+			 struct scsi_copy_segment_descriptor *segments,
+			 int num_segments,
+			 iscsi_command_cb cb, void *private_data);
+
+EXTERN struct scsi_task *
+iscsi_receive_copy_results_task(struct iscsi_context *iscsi, int lun,
+				int sa, uint32_t list_id, uint32_t alloc_len,
+				iscsi_command_cb cb, void *private_data);
+
+EXTERN struct scsi_task *
+iscsi_populate_token_task(struct iscsi_context *iscsi, int lun,
+			  uint32_t list_id, uint32_t inactivity_timeout,
+			  struct unmap_list *list, int list_len,
+			  iscsi_command_cb cb, void *private_data);
+
+EXTERN struct scsi_task *
+iscsi_write_using_token_task(struct iscsi_context *iscsi, int lun,
+			     uint32_t list_id, uint64_t offset,
+			     const unsigned char *token,
+			     struct unmap_list *list, int list_len,
+			     iscsi_command_cb cb, void *private_data);
+
 EXTERN struct scsi_task *
 iscsi_readtoc_task(struct iscsi_context *iscsi, int lun, int msf, int format,
 		   int track_session, int maxsize,
@@ -1065,6 +1806,28 @@ iscsi_writeverify16_sync(struct iscsi_context *iscsi, int lun, uint64_t lba,
 		   unsigned char *data, uint32_t datalen, int blocksize,
 		   int wrprotect, int dpo, int bytchk, int group_number);
 
+EXTERN struct scsi_task *
+iscsi_xdwriteread10_sync(struct iscsi_context *iscsi, int lun, uint32_t lba,
+		   unsigned char *data, uint32_t datalen, int blocksize,
+		   int wrprotect, int dpo, int fua, int disable_write, int fua_nv,
+		   int group_number);
+
+EXTERN struct scsi_task *
+iscsi_xdwriteread32_sync(struct iscsi_context *iscsi, int lun, uint64_t lba,
+		   unsigned char *data, uint32_t datalen, int blocksize,
+		   int wrprotect, int dpo, int fua, int disable_write, int fua_nv,
+		   int group_number);
+
+EXTERN struct scsi_task *
+iscsi_xpwrite10_sync(struct iscsi_context *iscsi, int lun, uint32_t lba,
+		   unsigned char *data, uint32_t datalen, int blocksize,
+		   int dpo, int fua, int fua_nv, int xorpinfo, int group_number);
+
+EXTERN struct scsi_task *
+iscsi_xpwrite32_sync(struct iscsi_context *iscsi, int lun, uint64_t lba,
+		   unsigned char *data, uint32_t datalen, int blocksize,
+		   int dpo, int fua, int fua_nv, int xorpinfo, int group_number);
+
 EXTERN struct scsi_task *
 iscsi_readcapacity10_sync(struct iscsi_context *iscsi, int lun, int lba,
 			  int pmi);
@@ -1146,6 +1909,29 @@ EXTERN struct scsi_task *
 iscsi_unmap_sync(struct iscsi_context *iscsi, int lun, int anchor, int group,
 		 struct unmap_list *list, int list_len);
 
+EXTERN struct scsi_task *
+iscsi_extended_copy_sync(struct iscsi_context *iscsi, int lun,
+			 int list_id, int list_id_usage,
+			 struct scsi_copy_target_descriptor *targets,
+			 int num_targets,
+			 struct scsi_copy_segment_descriptor *segments,
+			 int num_segments);
+
+EXTERN struct scsi_task *
+iscsi_receive_copy_results_sync(struct iscsi_context *iscsi, int lun,
+				int sa, uint32_t list_id, uint32_t alloc_len);
+
+EXTERN struct scsi_task *
+iscsi_populate_token_sync(struct iscsi_context *iscsi, int lun,
+			  uint32_t list_id, uint32_t inactivity_timeout,
+			  struct unmap_list *list, int list_len);
+
+EXTERN struct scsi_task *
+iscsi_write_using_token_sync(struct iscsi_context *iscsi, int lun,
+			     uint32_t list_id, uint64_t offset,
+			     const unsigned char *token,
+			     struct unmap_list *list, int list_len);
+
 EXTERN struct scsi_task *
 iscsi_readtoc_sync(struct iscsi_context *iscsi, int lun, int msf,
 		   int format, int track_session, int maxsize);
@@ -1190,9 +1976,14 @@ iscsi_report_supported_opcodes_sync(struct iscsi_context *iscsi, int lun,
  *     iov[1].iov_base = second_buffer;
  *     iov[1].iov_len  = 512;
  *     scsi_task_set_iov_out(task, &iov[0], 2);
+ *
+ * When adding many buffers, reserve room for all of them first so the
+ * vector is only allocated once.
  */
 EXTERN int scsi_task_add_data_in_buffer(struct scsi_task *task, int len, unsigned char *buf);
 EXTERN int scsi_task_add_data_out_buffer(struct scsi_task *task, int len, unsigned char *buf);
+EXTERN int scsi_task_reserve_data_in_buffers(struct scsi_task *task, int niov);
+EXTERN int scsi_task_reserve_data_out_buffers(struct scsi_task *task, int niov);
 
 struct scsi_iovec;
 EXTERN void scsi_task_set_iov_out(struct scsi_task *task, struct scsi_iovec *iov, int niov);
@@ -1243,6 +2034,44 @@ EXTERN void iscsi_set_log_fn(struct iscsi_context *iscsi, iscsi_log_fn fn);
 /* predefined log function that just writes to stderr */
 EXTERN void iscsi_log_to_stderr(int level, const char *message);
 
+/*
+ * Binary logging.
+ *
+ * iscsi_set_log_ring() keeps the last records messages, rounded up to a
+ * power of two, in a ring instead of formatting them and handing them to
+ * the log function. Recording a message only stores its arguments, so
+ * a high log level costs little. Strings are truncated to what fits in
+ * the record. 0 records goes back to normal logging. Must not be called
+ * while someone is reading the ring.
+ *
+ * iscsi_log_ring_read() formats the message after *cursor, which starts
+ * at 0, and moves the cursor on. It returns 1 if there was one and 0 if
+ * the reader has caught up. It can be called from any thread, for
+ * example one that drains the ring to a file, and never holds up the
+ * thread that drives the context. Messages that were overwritten before
+ * they could be read are counted in dropped.
+ *
+ * iscsi_dump_log_ring() passes the messages that have not been dumped
+ * yet to the log function. It is called automatically whenever a
+ * message of dump_level or lower is logged, so errors come out along
+ * with what led up to them.
+ */
+struct iscsi_log_entry {
+	/* CLOCK_MONOTONIC */
+	uint64_t ns;
+	int level;
+	uint64_t dropped;
+	char message[1024];
+};
+
+EXTERN int
+iscsi_set_log_ring(struct iscsi_context *iscsi, int records, int dump_level);
+EXTERN int
+iscsi_log_ring_read(struct iscsi_context *iscsi, uint64_t *cursor,
+		    struct iscsi_log_entry *entry);
+EXTERN void
+iscsi_dump_log_ring(struct iscsi_context *iscsi);
+
 /*
  * This function is to set the TCP_USER_TIMEOUT option. It has to be called after iscsi
  * context creation. The value given in ms is then applied each time a new socket is created.
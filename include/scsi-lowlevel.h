@@ -27,7 +27,7 @@
 extern "C" {
 #endif
 
-#define SCSI_CDB_MAX_SIZE			16
+#define SCSI_CDB_MAX_SIZE			32
 
 enum scsi_opcode {
 	SCSI_OPCODE_TESTUNITREADY      = 0x00,
@@ -50,10 +50,15 @@ enum scsi_opcode {
 	SCSI_OPCODE_UNMAP              = 0x42,
 	SCSI_OPCODE_READTOC            = 0x43,
 	SCSI_OPCODE_SANITIZE           = 0x48,
+	SCSI_OPCODE_XPWRITE10          = 0x51,
+	SCSI_OPCODE_XDWRITEREAD10      = 0x53,
 	SCSI_OPCODE_MODESELECT10       = 0x55,
 	SCSI_OPCODE_MODESENSE10        = 0x5A,
 	SCSI_OPCODE_PERSISTENT_RESERVE_IN  = 0x5E,
 	SCSI_OPCODE_PERSISTENT_RESERVE_OUT = 0x5F,
+	SCSI_OPCODE_VARIABLE_LENGTH    = 0x7F,
+	SCSI_OPCODE_EXTENDED_COPY      = 0x83,
+	SCSI_OPCODE_RECEIVE_COPY_RESULTS = 0x84,
 	SCSI_OPCODE_READ16             = 0x88,
 	SCSI_OPCODE_COMPARE_AND_WRITE  = 0x89,
 	SCSI_OPCODE_WRITE16            = 0x8A,
@@ -79,6 +84,13 @@ enum scsi_persistent_in_sa {
 	SCSI_PERSISTENT_RESERVE_READ_FULL_STATUS	= 3
 };
 
+enum scsi_variable_length_sa {
+	SCSI_XPWRITE32                 = 0x0006,
+	SCSI_XDWRITEREAD32             = 0x0007,
+	SCSI_READ32                    = 0x0009,
+	SCSI_WRITE32                   = 0x000B
+};
+
 enum scsi_service_action_in {
 	SCSI_READCAPACITY16            = 0x10,
 	SCSI_GET_LBA_STATUS            = 0x12
@@ -120,6 +132,20 @@ enum scsi_maintenance_in {
 	SCSI_REPORT_SUPPORTED_OP_CODES = 0x0c
 };
 
+enum scsi_extended_copy_sa {
+	SCSI_EXTENDED_COPY_LID1        = 0x00,
+	SCSI_POPULATE_TOKEN            = 0x10,
+	SCSI_WRITE_USING_TOKEN         = 0x11
+};
+
+enum scsi_receive_copy_results_sa {
+	SCSI_COPY_RESULTS_COPY_STATUS      = 0x00,
+	SCSI_COPY_RESULTS_RECEIVE_DATA     = 0x01,
+	SCSI_COPY_RESULTS_OP_PARAMS        = 0x03,
+	SCSI_COPY_RESULTS_FAILED_SEGMENT   = 0x04,
+	SCSI_COPY_RESULTS_ROD_TOKEN_INFO   = 0x07
+};
+
 enum scsi_op_code_reporting_options {
 	SCSI_REPORT_SUPPORTING_OPS_ALL       = 0x00,
 	SCSI_REPORT_SUPPORTING_OPCODE        = 0x01,
@@ -149,6 +175,9 @@ EXTERN const char *scsi_sense_key_str(int key);
 
 /* ascq */
 #define SCSI_SENSE_ASCQ_SANITIZE_IN_PROGRESS               0x041b
+#define SCSI_SENSE_ASCQ_LOGICAL_BLOCK_GUARD_CHECK_FAILED   0x1001
+#define SCSI_SENSE_ASCQ_LOGICAL_BLOCK_APPTAG_CHECK_FAILED  0x1002
+#define SCSI_SENSE_ASCQ_LOGICAL_BLOCK_REFTAG_CHECK_FAILED  0x1003
 #define SCSI_SENSE_ASCQ_WRITE_AFTER_SANITIZE_REQUIRED      0x1115
 #define SCSI_SENSE_ASCQ_PARAMETER_LIST_LENGTH_ERROR        0x1a00
 #define SCSI_SENSE_ASCQ_MISCOMPARE_DURING_VERIFY           0x1d00
@@ -188,9 +217,24 @@ EXTERN const char *scsi_pr_type_str(enum scsi_persistent_out_type pr_type);
 enum scsi_xfer_dir {
 	SCSI_XFER_NONE  = 0,
 	SCSI_XFER_READ  = 1,
-	SCSI_XFER_WRITE = 2
+	SCSI_XFER_WRITE = 2,
+	SCSI_XFER_BIDIRECTIONAL = 3
 };
 
+/* SAM task attributes. SIMPLE is the default for a zeroed task. */
+enum scsi_task_attribute {
+	SCSI_TASK_ATTR_SIMPLE        = 0,
+	SCSI_TASK_ATTR_ORDERED       = 1,
+	SCSI_TASK_ATTR_HEAD_OF_QUEUE = 2
+};
+
+/* SAM command priority. 0 means no priority, 1 is the highest and 15 the
+ * lowest.
+ */
+#define SCSI_TASK_PRIORITY_NONE		0
+#define SCSI_TASK_PRIORITY_HIGHEST	1
+#define SCSI_TASK_PRIORITY_LOWEST	15
+
 /*
  * READTOC
  */
@@ -288,8 +332,31 @@ struct scsi_iovector {
 	struct scsi_iovec *iov;
 	int niov;
 	int nalloc;
+	/* cursor: iov[consumed] starts offset bytes into the data */
 	size_t offset;
 	int consumed;
+	/* index[i] is the offset of iov[i], built when the cursor has to
+	 * seek, index[nindex] is the size of the first nindex iovecs */
+	size_t *index;
+	int nindex;
+};
+
+/* When a task went through each stage on its way through the initiator,
+ * in CLOCK_MONOTONIC nanoseconds. A stage the task never went through,
+ * like DATA-OUT for a read, is 0.
+ */
+struct scsi_task_times {
+	/* handed to iscsi_scsi_command_async() or iscsi_submit_batch() */
+	uint64_t submitted;
+	/* the SCSI command PDU, and any immediate data, written to the
+	 * socket */
+	uint64_t header_sent;
+	/* the last DATA-OUT PDU written to the socket */
+	uint64_t dataout_sent;
+	/* the first Data-In or R2T received */
+	uint64_t first_response;
+	/* the status received */
+	uint64_t status;
 };
 
 struct scsi_task {
@@ -314,6 +381,16 @@ struct scsi_task {
 
 	struct scsi_iovector iovector_in;
 	struct scsi_iovector iovector_out;
+
+	/* For SCSI_XFER_BIDIRECTIONAL tasks expxferlen is the amount of
+	 * data-out and this is the amount of data-in we expect back.
+	 */
+	int bidi_read_xferlen;
+
+	enum scsi_task_attribute task_attr;
+	int task_priority;
+
+	struct scsi_task_times times;
 };
 
 
@@ -332,6 +409,14 @@ EXTERN void scsi_free_scsi_task(struct scsi_task *task);
 EXTERN void scsi_set_task_private_ptr(struct scsi_task *task, void *ptr);
 EXTERN void *scsi_get_task_private_ptr(struct scsi_task *task);
 
+/* Get the timestamps of the task's last trip through the initiator. A
+ * command that was merged with others reports the times of the merged
+ * command, except for when it was submitted. After a reconnect it keeps
+ * the time it was first submitted.
+ */
+EXTERN void scsi_task_get_times(struct scsi_task *task,
+				struct scsi_task_times *times);
+
 /*
  * TESTUNITREADY
  */
@@ -878,6 +963,100 @@ struct scsi_get_lba_status {
        struct scsi_lba_status_descriptor *descriptors;
 };
 
+/*
+ * EXTENDED COPY
+ */
+#define SCSI_XCOPY_TARGET_DESC_LEN	32
+#define SCSI_XCOPY_SEGMENT_DESC_LEN	28
+#define SCSI_XCOPY_MAX_DESIGNATOR_LEN	16
+#define SCSI_ROD_TOKEN_LEN		512
+
+enum scsi_list_id_usage {
+	SCSI_LIST_ID_HOLD              = 0x00,
+	SCSI_LIST_ID_NO_HOLD           = 0x02,
+	SCSI_LIST_ID_NONE              = 0x03
+};
+
+/*
+ * Identification descriptor target descriptor (0xE4), naming a LU by one
+ * of the designators from its Device Identification VPD page.
+ */
+struct scsi_copy_target_descriptor {
+	enum scsi_inquiry_peripheral_device_type device_type;
+	uint16_t relative_port;
+	enum scsi_codeset code_set;
+	enum scsi_association association;
+	enum scsi_designator_type designator_type;
+	int designator_length;
+	const unsigned char *designator;
+	uint32_t block_length;
+};
+
+/*
+ * Block device to block device segment descriptor (0x02). The indexes
+ * refer to the target descriptors of the same EXTENDED COPY.
+ */
+struct scsi_copy_segment_descriptor {
+	uint16_t src_index;
+	uint16_t dst_index;
+	uint16_t num_blocks;
+	uint64_t src_lba;
+	uint64_t dst_lba;
+};
+
+/*
+ * RECEIVE COPY RESULTS
+ */
+struct scsi_copy_results_copy_status {
+	int hdd;
+	int copy_manager_status;
+	uint16_t segments_processed;
+	int transfer_count_units;
+	uint32_t transfer_count;
+};
+
+struct scsi_copy_results_op_params {
+	int snlid;
+	uint16_t max_target_desc_count;
+	uint16_t max_segment_desc_count;
+	uint32_t max_desc_list_length;
+	uint32_t max_segment_length;
+	uint32_t max_inline_data_length;
+	uint32_t held_data_limit;
+	uint32_t max_stream_device_transfer_size;
+	uint16_t total_concurrent_copies;
+	uint8_t  max_concurrent_copies;
+	uint8_t  data_segment_granularity;
+	uint8_t  inline_data_granularity;
+	uint8_t  held_data_granularity;
+	int num_desc_type_codes;
+	unsigned char *desc_type_codes;
+};
+
+enum scsi_copy_operation_status {
+	SCSI_COPY_STATUS_GOOD          = 0x01,
+	SCSI_COPY_STATUS_ERROR         = 0x02,
+	SCSI_COPY_STATUS_RESIDUAL      = 0x03,
+	SCSI_COPY_STATUS_FOREGROUND    = 0x10,
+	SCSI_COPY_STATUS_BACKGROUND    = 0x11,
+	SCSI_COPY_STATUS_TERMINATED    = 0x60
+};
+
+struct scsi_copy_results_rod_token_info {
+	int response_to_service_action;
+	enum scsi_copy_operation_status copy_operation_status;
+	uint16_t operation_counter;
+	uint32_t estimated_status_update_delay;
+	int extended_copy_completion_status;
+	int transfer_count_units;
+	uint64_t transfer_count;
+	uint16_t segments_processed;
+	int has_sense;
+	struct scsi_sense sense;
+	int has_rod_token;
+	unsigned char rod_token[SCSI_ROD_TOKEN_LEN];
+};
+
 
 struct scsi_op_timeout_descriptor {
 	uint16_t descriptor_length;
@@ -1064,10 +1243,12 @@ EXTERN void *scsi_cdb_unmarshall(struct scsi_task *task, enum scsi_opcode opcode
 EXTERN void scsi_parse_sense_data(struct scsi_sense *sense, const uint8_t *sb);
 
 EXTERN struct scsi_task *scsi_cdb_compareandwrite(uint64_t lba, uint32_t xferlen, int blocksize, int wrprotect, int dpo, int fua, int fua_nv, int group_number);
+EXTERN struct scsi_task *scsi_cdb_extended_copy(int list_id, enum scsi_list_id_usage list_id_usage, int priority, struct scsi_copy_target_descriptor *targets, int num_targets, struct scsi_copy_segment_descriptor *segments, int num_segments);
 EXTERN struct scsi_task *scsi_cdb_get_lba_status(uint64_t starting_lba, uint32_t alloc_len);
 EXTERN struct scsi_task *scsi_cdb_orwrite(uint64_t lba, uint32_t xferlen, int blocksize, int wrprotect, int dpo, int fua, int fua_nv, int group_number);
 EXTERN struct scsi_task *scsi_cdb_persistent_reserve_in(enum scsi_persistent_in_sa sa, uint16_t xferlen);
 EXTERN struct scsi_task *scsi_cdb_persistent_reserve_out(enum scsi_persistent_out_sa sa, enum scsi_persistent_out_scope scope, enum scsi_persistent_out_type type, void *params);
+EXTERN struct scsi_task *scsi_cdb_populate_token(uint32_t list_id, uint32_t xferlen);
 EXTERN struct scsi_task *scsi_cdb_prefetch10(uint32_t lba, int num_blocks, int immed, int group);
 EXTERN struct scsi_task *scsi_cdb_prefetch16(uint64_t lba, int num_blocks, int immed, int group);
 EXTERN struct scsi_task *scsi_cdb_preventallow(int prevent);
@@ -1075,7 +1256,9 @@ EXTERN struct scsi_task *scsi_cdb_read6(uint32_t lba, uint32_t xferlen, int bloc
 EXTERN struct scsi_task *scsi_cdb_read10(uint32_t lba, uint32_t xferlen, int blocksize, int rdprotect, int dpo, int fua, int fua_nv, int group_number);
 EXTERN struct scsi_task *scsi_cdb_read12(uint32_t lba, uint32_t xferlen, int blocksize, int rdprotect, int dpo, int fua, int fua_nv, int group_number);
 EXTERN struct scsi_task *scsi_cdb_read16(uint64_t lba, uint32_t xferlen, int blocksize, int rdprotect, int dpo, int fua, int fua_nv, int group_number);
+EXTERN struct scsi_task *scsi_cdb_read32(uint64_t lba, uint32_t xferlen, int blocksize, int rdprotect, int dpo, int fua, int fua_nv, int group_number, uint32_t ref_tag, uint16_t app_tag, uint16_t app_tag_mask);
 EXTERN struct scsi_task *scsi_cdb_readcapacity16(void);
+EXTERN struct scsi_task *scsi_cdb_receive_copy_results(enum scsi_receive_copy_results_sa sa, uint32_t list_id, uint32_t alloc_len);
 EXTERN struct scsi_task *scsi_cdb_report_supported_opcodes(int rctd, int options, enum scsi_opcode opcode, int sa, uint32_t alloc_len);
 EXTERN struct scsi_task *scsi_cdb_serviceactionin16(enum scsi_service_action_in sa, uint32_t xferlen);
 EXTERN struct scsi_task *scsi_cdb_startstopunit(int immed, int pcm, int pc, int no_flush, int loej, int start);
@@ -1088,11 +1271,26 @@ EXTERN struct scsi_task *scsi_cdb_verify16(uint64_t lba, uint32_t xferlen, int v
 EXTERN struct scsi_task *scsi_cdb_write10(uint32_t lba, uint32_t xferlen, int blocksize, int wrprotect, int dpo, int fua, int fua_nv, int group_number);
 EXTERN struct scsi_task *scsi_cdb_write12(uint32_t lba, uint32_t xferlen, int blocksize, int wrprotect, int dpo, int fua, int fua_nv, int group_number);
 EXTERN struct scsi_task *scsi_cdb_write16(uint64_t lba, uint32_t xferlen, int blocksize, int wrprotect, int dpo, int fua, int fua_nv, int group_number);
+EXTERN struct scsi_task *scsi_cdb_write32(uint64_t lba, uint32_t xferlen, int blocksize, int wrprotect, int dpo, int fua, int fua_nv, int group_number, uint32_t ref_tag, uint16_t app_tag, uint16_t app_tag_mask);
+EXTERN struct scsi_task *scsi_cdb_write_using_token(uint32_t list_id, uint32_t xferlen);
 EXTERN struct scsi_task *scsi_cdb_writesame10(int wrprotect, int anchor, int unmap, uint32_t lba, int group, uint16_t num_blocks, uint32_t datalen);
 EXTERN struct scsi_task *scsi_cdb_writesame16(int wrprotect, int anchor, int unmap, uint64_t lba, int group, uint32_t num_blocks, uint32_t datalen);
 EXTERN struct scsi_task *scsi_cdb_writeverify10(uint32_t lba, uint32_t xferlen, int blocksize, int wrprotect, int dpo, int bytchk, int group_number);
 EXTERN struct scsi_task *scsi_cdb_writeverify12(uint32_t lba, uint32_t xferlen, int blocksize, int wrprotect, int dpo, int bytchk, int group_number);
 EXTERN struct scsi_task *scsi_cdb_writeverify16(uint64_t lba, uint32_t xferlen, int blocksize, int wrprotect, int dpo, int bytchk, int group_number);
+/*
+ * Set the task attribute and command priority the task is sent with.
+ * This must be called before the task is handed to
+ * iscsi_scsi_command_async(). Returns -1 if priority is out of range.
+ */
+EXTERN int scsi_task_set_attribute(struct scsi_task *task,
+				   enum scsi_task_attribute attr,
+				   int priority);
+
+EXTERN struct scsi_task *scsi_cdb_xdwriteread10(uint32_t lba, uint32_t xferlen, int blocksize, int wrprotect, int dpo, int fua, int disable_write, int fua_nv, int group_number);
+EXTERN struct scsi_task *scsi_cdb_xdwriteread32(uint64_t lba, uint32_t xferlen, int blocksize, int wrprotect, int dpo, int fua, int disable_write, int fua_nv, int group_number);
+EXTERN struct scsi_task *scsi_cdb_xpwrite10(uint32_t lba, uint32_t xferlen, int blocksize, int dpo, int fua, int fua_nv, int xorpinfo, int group_number);
+EXTERN struct scsi_task *scsi_cdb_xpwrite32(uint64_t lba, uint32_t xferlen, int blocksize, int dpo, int fua, int fua_nv, int xorpinfo, int group_number);
 
 
 void *scsi_malloc(struct scsi_task *task, size_t size);
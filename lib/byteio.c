@@ -0,0 +1,495 @@
+/*
+   Copyright (C) 2026 by agent <agent@local>
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU Lesser General Public License as published by
+   the Free Software Foundation; either version 2.1 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public License
+   along with this program; if not, see <http://www.gnu.org/licenses/>.
+*/
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "iscsi.h"
+#include "iscsi-private.h"
+#include "scsi-lowlevel.h"
+#include "slist.h"
+
+/*
+ * Byte granular I/O.
+ *
+ * A request is cut into at most three pieces: the block aligned middle,
+ * which goes straight to or from the caller's buffer through the large
+ * I/O splitter, and a head and a tail region that cover the partial
+ * blocks at either end and go through a bounce buffer.
+ *
+ * For writes the head and tail are read-modify-write. Since we are paying
+ * for a read anyway, these regions are widened to the OPTIMAL TRANSFER
+ * LENGTH GRANULARITY so that the target does not have to do a second
+ * read-modify-write of its own, but only the blocks that are not
+ * completely overwritten are read.
+ *
+ * A write that does a read-modify-write must not race with any other
+ * write to the blocks it covers, or the stale data it read would be
+ * written back over the newer data. Each write therefore locks the range
+ * it covers and waits for any overlapping write to finish first when
+ * either of them has a read-modify-write region.
+ */
+
+#define ALIGN_DOWN(x, a) ((x) / (a) * (a))
+#define ALIGN_UP(x, a)   (((x) + (a) - 1) / (a) * (a))
+
+struct iscsi_byte_io;
+
+struct iscsi_rmw_region {
+	struct iscsi_byte_io *bio;
+	/* block aligned, in bytes */
+	uint64_t start;
+	uint64_t end;
+	unsigned char *bounce;
+	int reads;
+};
+
+struct iscsi_byte_io {
+	struct iscsi_byte_io *next;
+	iscsi_command_cb cb;
+	void *private_data;
+	int lun;
+	int is_write;
+	unsigned char *buf;
+	uint64_t offset;
+	uint64_t end;
+	/* goes straight to or from buf, empty if mid_start == mid_end */
+	uint64_t mid_start;
+	uint64_t mid_end;
+	struct iscsi_rmw_region region[2];
+	int nregions;
+	/* everything a write touches, including the regions */
+	uint64_t lock_start;
+	uint64_t lock_end;
+	/* let in by iscsi_byte_io_unlock() but not started yet */
+	int starting;
+	int pending;
+	int status;
+};
+
+static void
+iscsi_byte_io_add_region(struct iscsi_byte_io *bio, uint64_t start,
+			 uint64_t end)
+{
+	struct iscsi_rmw_region *r = &bio->region[bio->nregions++];
+
+	r->bio   = bio;
+	r->start = start;
+	r->end   = end;
+}
+
+/* Work out the middle and the head and tail regions of the request */
+static void
+iscsi_byte_io_plan(struct iscsi_context *iscsi, struct iscsi_byte_io *bio)
+{
+	uint64_t bs = iscsi->limits.block_size;
+	uint64_t head_align = bs, tail_align = bs;
+	uint64_t dev_end = iscsi->limits.num_blocks * bs;
+	int head = bio->offset % bs != 0;
+	int tail = bio->end % bs != 0;
+	uint64_t m0, m1;
+
+	if (bio->is_write && iscsi->limits.opt_gran > 1) {
+		head_align = bs * iscsi->limits.opt_gran;
+		/* without the size of the LUN we can not tell whether
+		 * widening the tail would run off the end */
+		if (dev_end != 0) {
+			tail_align = head_align;
+		}
+	}
+
+	m0 = head ? ALIGN_UP(bio->offset, head_align) : bio->offset;
+	m1 = tail ? ALIGN_DOWN(bio->end, tail_align) : bio->end;
+
+	if (m0 >= m1) {
+		/* the whole request fits in one region */
+		m0 = head ? ALIGN_DOWN(bio->offset, head_align) : bio->offset;
+		m1 = tail ? ALIGN_UP(bio->end, tail_align) : bio->end;
+		if (dev_end != 0 && m1 > dev_end && bio->end <= dev_end) {
+			m1 = ALIGN_UP(bio->end, bs);
+		}
+		iscsi_byte_io_add_region(bio, m0, m1);
+		bio->mid_start = bio->mid_end = 0;
+		bio->lock_start = m0;
+		bio->lock_end   = m1;
+		return;
+	}
+
+	bio->lock_start = bio->offset;
+	bio->lock_end   = bio->end;
+	if (head) {
+		uint64_t start = ALIGN_DOWN(bio->offset, head_align);
+
+		iscsi_byte_io_add_region(bio, start, m0);
+		bio->lock_start = start;
+	}
+	bio->mid_start = m0;
+	bio->mid_end   = m1;
+	if (tail) {
+		uint64_t end = ALIGN_UP(bio->end, tail_align);
+
+		if (dev_end != 0 && end > dev_end && bio->end <= dev_end) {
+			end = ALIGN_UP(bio->end, bs);
+		}
+		iscsi_byte_io_add_region(bio, m1, end);
+		bio->lock_end = end;
+	}
+}
+
+static int
+iscsi_byte_io_conflict(struct iscsi_byte_io *a, struct iscsi_byte_io *b)
+{
+	if (a->lock_end <= b->lock_start || b->lock_end <= a->lock_start) {
+		return 0;
+	}
+	return a->nregions != 0 || b->nregions != 0;
+}
+
+static void
+iscsi_byte_io_free(struct iscsi_context *iscsi, struct iscsi_byte_io *bio)
+{
+	int i;
+
+	for (i = 0; i < bio->nregions; i++) {
+		iscsi_free(iscsi, bio->region[i].bounce);
+	}
+	iscsi_free(iscsi, bio);
+}
+
+static int
+iscsi_byte_io_start(struct iscsi_context *iscsi, struct iscsi_byte_io *bio);
+
+/* Let in every waiter that neither overlaps a locked write nor one that
+ * has been waiting for longer. They are only marked as starting, and
+ * started once the lists are settled, since a failing start unlocks
+ * again. Returns how many got in.
+ */
+static int
+iscsi_byte_io_admit(struct iscsi_context *iscsi)
+{
+	struct iscsi_byte_io *w, *next;
+	int admitted = 0;
+
+	for (w = iscsi->byte_io_waiting; w != NULL; w = next) {
+		struct iscsi_byte_io *o;
+		int blocked = 0;
+
+		next = w->next;
+		for (o = iscsi->byte_io_locked; o != NULL && !blocked;
+		     o = o->next) {
+			blocked = iscsi_byte_io_conflict(w, o);
+		}
+		for (o = iscsi->byte_io_waiting; o != w && !blocked;
+		     o = o->next) {
+			blocked = iscsi_byte_io_conflict(w, o);
+		}
+		if (blocked) {
+			continue;
+		}
+		ISCSI_LIST_REMOVE(&iscsi->byte_io_waiting, w);
+		ISCSI_LIST_ADD(&iscsi->byte_io_locked, w);
+		w->starting = 1;
+		admitted++;
+	}
+	return admitted;
+}
+
+static void
+iscsi_byte_io_unlock(struct iscsi_context *iscsi, struct iscsi_byte_io *bio)
+{
+	struct iscsi_byte_io *w;
+
+	ISCSI_LIST_REMOVE(&iscsi->byte_io_locked, bio);
+
+	/* A waiter that fails to start leaves the locked list again, which
+	 * may free up writes that only it was holding back, so go round
+	 * until a pass lets nobody in.
+	 */
+	while (iscsi_byte_io_admit(iscsi) > 0) {
+		for (;;) {
+			for (w = iscsi->byte_io_locked; w != NULL;
+			     w = w->next) {
+				if (w->starting) {
+					break;
+				}
+			}
+			if (w == NULL) {
+				break;
+			}
+			w->starting = 0;
+			if (iscsi_byte_io_start(iscsi, w) != 0
+			&&  w->pending == 0) {
+				ISCSI_LIST_REMOVE(&iscsi->byte_io_locked, w);
+				w->cb(iscsi, SCSI_STATUS_ERROR, NULL,
+				      w->private_data);
+				iscsi_byte_io_free(iscsi, w);
+			}
+		}
+	}
+}
+
+/* One of the commands of the request has completed */
+static void
+iscsi_byte_io_done(struct iscsi_context *iscsi, struct iscsi_byte_io *bio,
+		   int status)
+{
+	if (status != SCSI_STATUS_GOOD && bio->status == SCSI_STATUS_GOOD) {
+		bio->status = status;
+	}
+	if (--bio->pending > 0) {
+		return;
+	}
+
+	if (bio->is_write) {
+		iscsi_byte_io_unlock(iscsi, bio);
+	}
+	bio->cb(iscsi, bio->status, NULL, bio->private_data);
+	iscsi_byte_io_free(iscsi, bio);
+}
+
+static void
+iscsi_byte_io_mid_cb(struct iscsi_context *iscsi, int status,
+		     void *command_data _U_, void *private_data)
+{
+	iscsi_byte_io_done(iscsi, private_data, status);
+}
+
+static void
+iscsi_byte_io_region_write_cb(struct iscsi_context *iscsi, int status,
+			      void *command_data _U_, void *private_data)
+{
+	struct iscsi_rmw_region *r = private_data;
+
+	iscsi_byte_io_done(iscsi, r->bio, status);
+}
+
+static void
+iscsi_byte_io_region_read_cb(struct iscsi_context *iscsi, int status,
+			     void *command_data _U_, void *private_data)
+{
+	struct iscsi_rmw_region *r = private_data;
+	struct iscsi_byte_io *bio = r->bio;
+	uint64_t u0, u1;
+
+	if (status != SCSI_STATUS_GOOD && bio->status == SCSI_STATUS_GOOD) {
+		bio->status = status;
+	}
+	if (--r->reads > 0 || bio->status != SCSI_STATUS_GOOD) {
+		iscsi_byte_io_done(iscsi, bio, status);
+		return;
+	}
+
+	u0 = r->start > bio->offset ? r->start : bio->offset;
+	u1 = r->end < bio->end ? r->end : bio->end;
+	if (!bio->is_write) {
+		memcpy(bio->buf + (u0 - bio->offset), r->bounce + (u0 - r->start),
+		       u1 - u0);
+		iscsi_byte_io_done(iscsi, bio, status);
+		return;
+	}
+
+	memcpy(r->bounce + (u0 - r->start), bio->buf + (u0 - bio->offset),
+	       u1 - u0);
+	if (iscsi_write_blocks_async(iscsi, bio->lun,
+				     r->start / iscsi->limits.block_size,
+				     (r->end - r->start) /
+				     iscsi->limits.block_size, r->bounce,
+				     iscsi_byte_io_region_write_cb, r) != 0) {
+		iscsi_byte_io_done(iscsi, bio, SCSI_STATUS_ERROR);
+		return;
+	}
+	/* the write takes over the slot of this read */
+}
+
+static int
+iscsi_byte_io_read_region(struct iscsi_context *iscsi,
+			  struct iscsi_rmw_region *r, uint64_t start,
+			  uint64_t end)
+{
+	uint64_t bs = iscsi->limits.block_size;
+
+	if (iscsi_read_blocks_async(iscsi, r->bio->lun, start / bs,
+				    (end - start) / bs,
+				    r->bounce + (start - r->start),
+				    iscsi_byte_io_region_read_cb, r) != 0) {
+		return -1;
+	}
+	r->reads++;
+	r->bio->pending++;
+	return 0;
+}
+
+/* Queue the reads of a region. For a write only the blocks that are not
+ * completely overwritten need to be read.
+ */
+static int
+iscsi_byte_io_start_region(struct iscsi_context *iscsi,
+			   struct iscsi_rmw_region *r)
+{
+	struct iscsi_byte_io *bio = r->bio;
+	uint64_t bs = iscsi->limits.block_size;
+	uint64_t u0, u1, f1, b0;
+
+	r->bounce = iscsi_malloc(iscsi, r->end - r->start);
+	if (r->bounce == NULL) {
+		iscsi_set_error(iscsi, "Out-of-memory: Failed to allocate "
+				"bounce buffer.");
+		return -1;
+	}
+
+	u0 = r->start > bio->offset ? r->start : bio->offset;
+	u1 = r->end < bio->end ? r->end : bio->end;
+	f1 = ALIGN_UP(u0, bs);
+	b0 = ALIGN_DOWN(u1, bs);
+	if (!bio->is_write || f1 >= b0) {
+		return iscsi_byte_io_read_region(iscsi, r, r->start, r->end);
+	}
+
+	if (f1 > r->start
+	&&  iscsi_byte_io_read_region(iscsi, r, r->start, f1) != 0) {
+		return -1;
+	}
+	if (r->end > b0
+	&&  iscsi_byte_io_read_region(iscsi, r, b0, r->end) != 0) {
+		return -1;
+	}
+	return 0;
+}
+
+static int
+iscsi_byte_io_start(struct iscsi_context *iscsi, struct iscsi_byte_io *bio)
+{
+	uint64_t bs = iscsi->limits.block_size;
+	int i;
+
+	if (bio->mid_end > bio->mid_start) {
+		unsigned char *buf = bio->buf + (bio->mid_start - bio->offset);
+		uint64_t lba = bio->mid_start / bs;
+		uint32_t num_blocks = (bio->mid_end - bio->mid_start) / bs;
+		int ret;
+
+		ret = bio->is_write ?
+			iscsi_write_blocks_async(iscsi, bio->lun, lba,
+						 num_blocks, buf,
+						 iscsi_byte_io_mid_cb, bio) :
+			iscsi_read_blocks_async(iscsi, bio->lun, lba,
+						num_blocks, buf,
+						iscsi_byte_io_mid_cb, bio);
+		if (ret != 0) {
+			bio->status = SCSI_STATUS_ERROR;
+			return -1;
+		}
+		bio->pending++;
+	}
+
+	for (i = 0; i < bio->nregions; i++) {
+		if (iscsi_byte_io_start_region(iscsi, &bio->region[i]) != 0) {
+			bio->status = SCSI_STATUS_ERROR;
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+static int
+iscsi_byte_io_async(struct iscsi_context *iscsi, int lun, int is_write,
+		    uint64_t offset, unsigned char *buf, size_t count,
+		    iscsi_command_cb cb, void *private_data)
+{
+	struct iscsi_byte_io *bio, *o;
+	int blocked = 0;
+
+	if (iscsi->limits.block_size == 0) {
+		iscsi_set_error(iscsi, "Block size is not known, call "
+				"iscsi_set_block_limits() first");
+		return -1;
+	}
+	if (cb == NULL) {
+		iscsi_set_error(iscsi, "Byte I/O needs a callback");
+		return -1;
+	}
+	if (count == 0
+	||  count / iscsi->limits.block_size > 0xfffffff0) {
+		iscsi_set_error(iscsi, "Invalid byte I/O length %zu", count);
+		return -1;
+	}
+
+	bio = iscsi_zmalloc(iscsi, sizeof(struct iscsi_byte_io));
+	if (bio == NULL) {
+		iscsi_set_error(iscsi, "Out-of-memory: Failed to allocate "
+				"byte I/O.");
+		return -1;
+	}
+	bio->cb           = cb;
+	bio->private_data = private_data;
+	bio->lun          = lun;
+	bio->is_write     = is_write;
+	bio->buf          = buf;
+	bio->offset       = offset;
+	bio->end          = offset + count;
+	bio->status       = SCSI_STATUS_GOOD;
+	iscsi_byte_io_plan(iscsi, bio);
+
+	if (is_write) {
+		for (o = iscsi->byte_io_locked; o != NULL && !blocked;
+		     o = o->next) {
+			blocked = iscsi_byte_io_conflict(bio, o);
+		}
+		for (o = iscsi->byte_io_waiting; o != NULL && !blocked;
+		     o = o->next) {
+			blocked = iscsi_byte_io_conflict(bio, o);
+		}
+		if (blocked) {
+			ISCSI_LIST_ADD_END(&iscsi->byte_io_waiting, bio);
+			return 0;
+		}
+		ISCSI_LIST_ADD(&iscsi->byte_io_locked, bio);
+	}
+
+	if (iscsi_byte_io_start(iscsi, bio) != 0 && bio->pending == 0) {
+		if (is_write) {
+			iscsi_byte_io_unlock(iscsi, bio);
+		}
+		iscsi_byte_io_free(iscsi, bio);
+		return -1;
+	}
+	/* if only part of it got queued that part completes it */
+
+	return 0;
+}
+
+int
+iscsi_pread_async(struct iscsi_context *iscsi, int lun, uint64_t offset,
+		  unsigned char *buf, size_t count,
+		  iscsi_command_cb cb, void *private_data)
+{
+	return iscsi_byte_io_async(iscsi, lun, 0, offset, buf, count,
+				   cb, private_data);
+}
+
+int
+iscsi_pwrite_async(struct iscsi_context *iscsi, int lun, uint64_t offset,
+		   unsigned char *buf, size_t count,
+		   iscsi_command_cb cb, void *private_data)
+{
+	return iscsi_byte_io_async(iscsi, lun, 1, offset, buf, count,
+				   cb, private_data);
+}
@@ -0,0 +1,899 @@
+/*
+   Copyright (C) 2026 by agent <agent@local>
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU Lesser General Public License as published by
+   the Free Software Foundation; either version 2.1 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public License
+   along with this program; if not, see <http://www.gnu.org/licenses/>.
+*/
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "iscsi.h"
+#include "iscsi-private.h"
+#include "scsi-lowlevel.h"
+#include "slist.h"
+
+/*
+ * Read cache.
+ *
+ * The cache sits in front of iscsi_read_blocks_async() and everything
+ * built on top of it, and holds fixed size pages of a LUN. Pages are
+ * spread over a number of shards by a hash of their index, and each
+ * shard has its own hash table and its own CLOCK for picking the page to
+ * evict, so a sweep only ever looks at a fraction of the cache.
+ *
+ * A page that is missing is inserted as "filling" and read from the
+ * target, and any other read of that page while it is in flight waits
+ * for the same command instead of sending its own. Runs of consecutive
+ * missing pages are filled with a single READ straight into the pages.
+ *
+ * Every SCSI command that writes to the LUN invalidates the pages it
+ * covers, both when it is sent and when it completes. A page that is
+ * invalidated while it is being filled still serves the reads that are
+ * waiting for it but is not kept.
+ */
+
+#define ISCSI_CACHE_SHARD_BITS 4
+#define ISCSI_CACHE_SHARDS     (1 << ISCSI_CACHE_SHARD_BITS)
+
+/* pages per fill command */
+#define ISCSI_CACHE_MAX_FILL 64
+
+struct iscsi_cache_read {
+	iscsi_command_cb cb;
+	void *private_data;
+	int pending;
+	int status;
+};
+
+struct iscsi_cache_waiter {
+	struct iscsi_cache_waiter *next;
+	struct iscsi_cache_read *rd;
+	unsigned char *dst;
+	uint32_t offset;
+	uint32_t len;
+};
+
+struct iscsi_cache_page {
+	struct iscsi_cache_page *next;
+	uint64_t index;
+	unsigned char *data;
+	/* the last page of the LUN may be short */
+	uint32_t size;
+	/* position in the shard's clock */
+	uint32_t slot;
+	int filling;
+	int referenced;
+	int stale;
+	struct iscsi_cache_waiter *waiters;
+};
+
+struct iscsi_cache_shard {
+	struct iscsi_cache_page **hash;
+	uint32_t hash_mask;
+	struct iscsi_cache_page **clock;
+	uint32_t npages;
+	uint32_t max_pages;
+	uint32_t hand;
+};
+
+struct iscsi_read_cache {
+	struct iscsi_read_cache *next;
+	int lun;
+	uint32_t block_size;
+	uint32_t page_blocks;
+	uint64_t num_blocks;
+	struct iscsi_cache_shard shard[ISCSI_CACHE_SHARDS];
+
+	/* sequential stream detection */
+	uint64_t seq_next;
+	int seq_count;
+	/* first page that has not been read ahead yet */
+	uint64_t ra_end;
+	uint32_t ra_pages;
+	int ra_prefetch;
+
+	int fills;
+	int disabled;
+	struct iscsi_read_cache_stats stats;
+};
+
+struct iscsi_cache_fill {
+	struct iscsi_read_cache *cache;
+	int n;
+	struct iscsi_cache_page *pages[ISCSI_CACHE_MAX_FILL];
+};
+
+static inline uint64_t
+iscsi_cache_hash(uint64_t index)
+{
+	return index * 0x9e3779b97f4a7c15ULL;
+}
+
+static struct iscsi_cache_shard *
+iscsi_cache_shard(struct iscsi_read_cache *cache, uint64_t index)
+{
+	return &cache->shard[iscsi_cache_hash(index) >>
+			     (64 - ISCSI_CACHE_SHARD_BITS)];
+}
+
+static struct iscsi_cache_page **
+iscsi_cache_bucket(struct iscsi_cache_shard *shard, uint64_t index)
+{
+	return &shard->hash[(iscsi_cache_hash(index) >> 32) &
+			    shard->hash_mask];
+}
+
+static struct iscsi_cache_page *
+iscsi_cache_lookup(struct iscsi_read_cache *cache, uint64_t index)
+{
+	struct iscsi_cache_shard *shard = iscsi_cache_shard(cache, index);
+	struct iscsi_cache_page *page;
+
+	for (page = *iscsi_cache_bucket(shard, index); page != NULL;
+	     page = page->next) {
+		if (page->index == index) {
+			return page;
+		}
+	}
+	return NULL;
+}
+
+static void
+iscsi_cache_drop(struct iscsi_context *iscsi, struct iscsi_read_cache *cache,
+		 struct iscsi_cache_page *page)
+{
+	struct iscsi_cache_shard *shard = iscsi_cache_shard(cache, page->index);
+
+	ISCSI_LIST_REMOVE(iscsi_cache_bucket(shard, page->index), page);
+
+	shard->npages--;
+	shard->clock[page->slot] = shard->clock[shard->npages];
+	shard->clock[page->slot]->slot = page->slot;
+	if (shard->hand >= shard->npages) {
+		shard->hand = 0;
+	}
+
+	iscsi_free(iscsi, page->data);
+	iscsi_free(iscsi, page);
+}
+
+/* Make room in a full shard. Pages that are being filled can not go, and
+ * pages that have been read since the hand last passed them get another
+ * round.
+ */
+static int
+iscsi_cache_evict(struct iscsi_context *iscsi, struct iscsi_read_cache *cache,
+		  struct iscsi_cache_shard *shard)
+{
+	uint32_t i;
+
+	for (i = 0; i < 2 * shard->npages; i++) {
+		struct iscsi_cache_page *page = shard->clock[shard->hand];
+
+		if (!page->filling) {
+			if (!page->referenced) {
+				iscsi_cache_drop(iscsi, cache, page);
+				cache->stats.evictions++;
+				return 0;
+			}
+			page->referenced = 0;
+		}
+		shard->hand = (shard->hand + 1) % shard->npages;
+	}
+	return -1;
+}
+
+static struct iscsi_cache_page *
+iscsi_cache_insert(struct iscsi_context *iscsi, struct iscsi_read_cache *cache,
+		   uint64_t index)
+{
+	struct iscsi_cache_shard *shard = iscsi_cache_shard(cache, index);
+	struct iscsi_cache_page *page;
+	uint64_t blocks;
+
+	if (shard->npages == shard->max_pages
+	&&  iscsi_cache_evict(iscsi, cache, shard) != 0) {
+		return NULL;
+	}
+
+	page = iscsi_zmalloc(iscsi, sizeof(struct iscsi_cache_page));
+	if (page == NULL) {
+		return NULL;
+	}
+	blocks = cache->num_blocks - index * cache->page_blocks;
+	if (blocks > cache->page_blocks) {
+		blocks = cache->page_blocks;
+	}
+	page->index   = index;
+	page->size    = blocks * cache->block_size;
+	page->filling = 1;
+	page->data    = iscsi_malloc(iscsi, page->size);
+	if (page->data == NULL) {
+		iscsi_free(iscsi, page);
+		return NULL;
+	}
+
+	page->slot = shard->npages;
+	shard->clock[shard->npages++] = page;
+	ISCSI_LIST_ADD(iscsi_cache_bucket(shard, index), page);
+
+	return page;
+}
+
+static void
+iscsi_cache_read_done(struct iscsi_context *iscsi,
+		      struct iscsi_cache_read *rd, int status)
+{
+	if (status != SCSI_STATUS_GOOD && rd->status == SCSI_STATUS_GOOD) {
+		rd->status = status;
+	}
+	if (--rd->pending > 0) {
+		return;
+	}
+	rd->cb(iscsi, rd->status, NULL, rd->private_data);
+	iscsi_free(iscsi, rd);
+}
+
+static void
+iscsi_cache_free(struct iscsi_context *iscsi, struct iscsi_read_cache *cache)
+{
+	int i;
+
+	for (i = 0; i < ISCSI_CACHE_SHARDS; i++) {
+		struct iscsi_cache_shard *shard = &cache->shard[i];
+
+		while (shard->clock != NULL && shard->npages > 0) {
+			iscsi_cache_drop(iscsi, cache, shard->clock[0]);
+		}
+		iscsi_free(iscsi, shard->clock);
+		iscsi_free(iscsi, shard->hash);
+	}
+	iscsi_free(iscsi, cache);
+}
+
+/* Hand the data to everyone waiting for the pages and keep them unless
+ * the read failed or they were invalidated in the meantime. The waiters
+ * are only called once the pages are done with, since their callbacks
+ * may well come back into the cache.
+ */
+static void
+iscsi_cache_fill_done(struct iscsi_context *iscsi,
+		      struct iscsi_cache_fill *fill, int status)
+{
+	struct iscsi_read_cache *cache = fill->cache;
+	struct iscsi_cache_waiter *done = NULL, *w;
+	int i;
+
+	for (i = 0; i < fill->n; i++) {
+		struct iscsi_cache_page *page = fill->pages[i];
+
+		while ((w = page->waiters) != NULL) {
+			page->waiters = w->next;
+			if (status == SCSI_STATUS_GOOD) {
+				memcpy(w->dst, page->data + w->offset, w->len);
+			}
+			ISCSI_LIST_ADD(&done, w);
+		}
+		page->filling = 0;
+		if (status != SCSI_STATUS_GOOD || page->stale
+		||  cache->disabled) {
+			iscsi_cache_drop(iscsi, cache, page);
+		}
+	}
+	iscsi_free(iscsi, fill);
+
+	/* a callback disabling the cache must not free it under us */
+	cache->fills++;
+	while ((w = done) != NULL) {
+		done = w->next;
+		iscsi_cache_read_done(iscsi, w->rd, status);
+		iscsi_free(iscsi, w);
+	}
+	cache->fills--;
+}
+
+static void
+iscsi_cache_fill_cb(struct iscsi_context *iscsi, int status,
+		    void *command_data, void *private_data)
+{
+	struct iscsi_cache_fill *fill = private_data;
+	struct iscsi_read_cache *cache = fill->cache;
+	struct scsi_task *task = command_data;
+
+	if (status == SCSI_STATUS_GOOD
+	&&  task->residual_status == SCSI_RESIDUAL_UNDERFLOW) {
+		iscsi_set_error(iscsi, "Short read filling the cache");
+		status = SCSI_STATUS_ERROR;
+	}
+	scsi_free_scsi_task(task);
+
+	iscsi_cache_fill_done(iscsi, fill, status);
+	if (--cache->fills == 0 && cache->disabled) {
+		iscsi_cache_free(iscsi, cache);
+	}
+}
+
+static int
+iscsi_cache_fill_issue(struct iscsi_context *iscsi,
+		       struct iscsi_cache_fill *fill)
+{
+	struct iscsi_read_cache *cache = fill->cache;
+	uint64_t lba = fill->pages[0]->index * cache->page_blocks;
+	uint32_t len = 0, num_blocks;
+	struct scsi_task *task;
+	int i;
+
+	for (i = 0; i < fill->n; i++) {
+		len += fill->pages[i]->size;
+	}
+	num_blocks = len / cache->block_size;
+
+	task = num_blocks > 0xffff || lba + num_blocks - 1 > 0xffffffffULL ?
+		scsi_cdb_read16(lba, len, cache->block_size, 0, 0, 0, 0, 0) :
+		scsi_cdb_read10(lba, len, cache->block_size, 0, 0, 0, 0, 0);
+	if (task == NULL) {
+		iscsi_set_error(iscsi, "Out-of-memory: Failed to create "
+				"cache fill cdb.");
+		return -1;
+	}
+	for (i = 0; i < fill->n; i++) {
+		if (scsi_task_add_data_in_buffer(task, fill->pages[i]->size,
+						 fill->pages[i]->data) != 0) {
+			iscsi_set_error(iscsi, "Out-of-memory: Failed to add "
+					"cache page.");
+			scsi_free_scsi_task(task);
+			return -1;
+		}
+	}
+
+	if (iscsi_scsi_command_async(iscsi, cache->lun, task,
+				     iscsi_cache_fill_cb, NULL, fill) != 0) {
+		scsi_free_scsi_task(task);
+		return -1;
+	}
+	cache->fills++;
+
+	return 0;
+}
+
+/* Send off the pages collected so far, if any */
+static int
+iscsi_cache_fill_flush(struct iscsi_context *iscsi,
+		       struct iscsi_cache_fill **fillp)
+{
+	struct iscsi_cache_fill *fill = *fillp;
+
+	if (fill == NULL) {
+		return 0;
+	}
+	*fillp = NULL;
+	if (iscsi_cache_fill_issue(iscsi, fill) != 0) {
+		iscsi_cache_fill_done(iscsi, fill, SCSI_STATUS_ERROR);
+		return -1;
+	}
+	return 0;
+}
+
+/* Add a page to the fill being built, starting a new one whenever the
+ * pages stop being consecutive.
+ */
+static int
+iscsi_cache_fill_add(struct iscsi_context *iscsi,
+		     struct iscsi_read_cache *cache,
+		     struct iscsi_cache_fill **fillp,
+		     struct iscsi_cache_page *page)
+{
+	struct iscsi_cache_fill *fill = *fillp;
+
+	if (fill != NULL
+	&& (fill->n == ISCSI_CACHE_MAX_FILL
+	    || fill->pages[fill->n - 1]->index + 1 != page->index)) {
+		if (iscsi_cache_fill_flush(iscsi, fillp) != 0) {
+			iscsi_cache_drop(iscsi, cache, page);
+			return -1;
+		}
+		fill = NULL;
+	}
+	if (fill == NULL) {
+		fill = iscsi_zmalloc(iscsi, sizeof(struct iscsi_cache_fill));
+		if (fill == NULL) {
+			iscsi_set_error(iscsi, "Out-of-memory: Failed to "
+					"allocate cache fill.");
+			iscsi_cache_drop(iscsi, cache, page);
+			return -1;
+		}
+		fill->cache = cache;
+		*fillp = fill;
+	}
+	fill->pages[fill->n++] = page;
+
+	return 0;
+}
+
+static void
+iscsi_cache_bypass_cb(struct iscsi_context *iscsi, int status,
+		      void *command_data _U_, void *private_data)
+{
+	iscsi_cache_read_done(iscsi, private_data, status);
+}
+
+static void
+iscsi_cache_prefetch_cb(struct iscsi_context *iscsi _U_, int status _U_,
+			void *command_data, void *private_data _U_)
+{
+	scsi_free_scsi_task(command_data);
+}
+
+/* Once a stream of back to back reads shows up, keep ra_pages pages
+ * ahead of it, topping up when half of them have been consumed.
+ */
+static void
+iscsi_cache_readahead(struct iscsi_context *iscsi,
+		      struct iscsi_read_cache *cache, uint64_t lba,
+		      uint32_t num_blocks)
+{
+	struct iscsi_cache_fill *fill = NULL;
+	uint64_t end = lba + num_blocks, next, from, stop, index;
+	uint64_t last = (cache->num_blocks + cache->page_blocks - 1) /
+		cache->page_blocks;
+
+	if (lba == cache->seq_next) {
+		cache->seq_count++;
+	} else {
+		cache->seq_count = 0;
+		cache->ra_end    = 0;
+	}
+	cache->seq_next = end;
+	if (cache->ra_pages == 0 || cache->seq_count == 0) {
+		return;
+	}
+
+	next = (end + cache->page_blocks - 1) / cache->page_blocks;
+	if (cache->ra_end > next + cache->ra_pages / 2) {
+		return;
+	}
+	from = cache->ra_end > next ? cache->ra_end : next;
+	stop = next + cache->ra_pages;
+	if (stop > last) {
+		stop = last;
+	}
+	if (from >= stop) {
+		return;
+	}
+	cache->ra_end = stop;
+
+	if (cache->ra_prefetch) {
+		uint64_t start = from * cache->page_blocks;
+		uint64_t blocks = stop * cache->page_blocks;
+
+		if (blocks > cache->num_blocks) {
+			blocks = cache->num_blocks;
+		}
+		if (iscsi_prefetch16_task(iscsi, cache->lun, start,
+					  blocks - start, 1, 0,
+					  iscsi_cache_prefetch_cb,
+					  NULL) != NULL) {
+			cache->stats.readahead += stop - from;
+		}
+		return;
+	}
+
+	for (index = from; index < stop; index++) {
+		struct iscsi_cache_page *page;
+
+		if (iscsi_cache_lookup(cache, index) != NULL) {
+			continue;
+		}
+		page = iscsi_cache_insert(iscsi, cache, index);
+		if (page == NULL) {
+			break;
+		}
+		if (iscsi_cache_fill_add(iscsi, cache, &fill, page) != 0) {
+			break;
+		}
+		cache->stats.readahead++;
+	}
+	iscsi_cache_fill_flush(iscsi, &fill);
+}
+
+struct iscsi_read_cache *
+iscsi_get_read_cache(struct iscsi_context *iscsi, int lun)
+{
+	struct iscsi_read_cache *cache;
+
+	for (cache = iscsi->read_caches; cache != NULL; cache = cache->next) {
+		if (cache->lun == lun) {
+			return cache;
+		}
+	}
+	return NULL;
+}
+
+int
+iscsi_read_cache_read(struct iscsi_context *iscsi,
+		      struct iscsi_read_cache *cache, uint64_t lba,
+		      uint32_t num_blocks, unsigned char *buf,
+		      iscsi_command_cb cb, void *private_data)
+{
+	struct iscsi_cache_fill *fill = NULL;
+	struct iscsi_cache_read *rd;
+	uint64_t index, first, last;
+	uint32_t bs = cache->block_size;
+
+	if (cb == NULL) {
+		iscsi_set_error(iscsi, "Cached read needs a callback");
+		return -1;
+	}
+	if (num_blocks == 0 || lba + num_blocks > cache->num_blocks) {
+		iscsi_set_error(iscsi, "Cached read of %u blocks at %llu is "
+				"outside the LUN", num_blocks,
+				(unsigned long long)lba);
+		return -1;
+	}
+
+	rd = iscsi_zmalloc(iscsi, sizeof(struct iscsi_cache_read));
+	if (rd == NULL) {
+		iscsi_set_error(iscsi, "Out-of-memory: Failed to allocate "
+				"cached read.");
+		return -1;
+	}
+	rd->cb           = cb;
+	rd->private_data = private_data;
+	rd->status       = SCSI_STATUS_GOOD;
+	/* held until every page has been looked at */
+	rd->pending      = 1;
+
+	first = lba / cache->page_blocks;
+	last  = (lba + num_blocks - 1) / cache->page_blocks;
+	for (index = first; index <= last && rd->status == SCSI_STATUS_GOOD;
+	     index++) {
+		uint64_t pstart = index * cache->page_blocks;
+		uint64_t from = lba > pstart ? lba : pstart;
+		uint64_t to = pstart + cache->page_blocks;
+		struct iscsi_cache_page *page;
+		struct iscsi_cache_waiter *w;
+		unsigned char *dst;
+
+		if (to > lba + num_blocks) {
+			to = lba + num_blocks;
+		}
+		dst = buf + (from - lba) * bs;
+
+		page = iscsi_cache_lookup(cache, index);
+		if (page != NULL && !page->filling) {
+			memcpy(dst, page->data + (from - pstart) * bs,
+			       (to - from) * bs);
+			page->referenced = 1;
+			cache->stats.hits++;
+			continue;
+		}
+
+		if (page != NULL) {
+			cache->stats.coalesced++;
+		} else {
+			page = iscsi_cache_insert(iscsi, cache, index);
+			if (page == NULL) {
+				/* every page of the shard is being filled,
+				 * so read this part around the cache */
+				rd->pending++;
+				if (iscsi_read_blocks_direct(iscsi, cache->lun,
+						from, to - from, dst,
+						iscsi_cache_bypass_cb,
+						rd) != 0) {
+					rd->pending--;
+					rd->status = SCSI_STATUS_ERROR;
+				}
+				continue;
+			}
+			if (iscsi_cache_fill_add(iscsi, cache, &fill,
+						 page) != 0) {
+				rd->status = SCSI_STATUS_ERROR;
+				break;
+			}
+			cache->stats.misses++;
+		}
+
+		w = iscsi_malloc(iscsi, sizeof(struct iscsi_cache_waiter));
+		if (w == NULL) {
+			iscsi_set_error(iscsi, "Out-of-memory: Failed to "
+					"allocate cache waiter.");
+			rd->status = SCSI_STATUS_ERROR;
+			break;
+		}
+		w->rd     = rd;
+		w->dst    = dst;
+		w->offset = (from - pstart) * bs;
+		w->len    = (to - from) * bs;
+		ISCSI_LIST_ADD(&page->waiters, w);
+		rd->pending++;
+	}
+	if (iscsi_cache_fill_flush(iscsi, &fill) != 0) {
+		rd->status = SCSI_STATUS_ERROR;
+	}
+
+	if (rd->status != SCSI_STATUS_GOOD && rd->pending == 1) {
+		/* nothing in flight, so fail it right here */
+		iscsi_free(iscsi, rd);
+		return -1;
+	}
+
+	if (rd->status == SCSI_STATUS_GOOD) {
+		iscsi_cache_readahead(iscsi, cache, lba, num_blocks);
+	}
+
+	/* This completes the read right away when it was all in the cache */
+	iscsi_cache_read_done(iscsi, rd, SCSI_STATUS_GOOD);
+
+	return 0;
+}
+
+static void
+iscsi_cache_invalidate(struct iscsi_context *iscsi,
+		       struct iscsi_read_cache *cache, uint64_t lba,
+		       uint64_t num_blocks)
+{
+	uint64_t first = lba / cache->page_blocks, last, index, npages = 0;
+	int i;
+
+	if (num_blocks == 0 || lba + num_blocks > cache->num_blocks
+	||  lba + num_blocks < lba) {
+		num_blocks = cache->num_blocks > lba ?
+			cache->num_blocks - lba : 1;
+	}
+	last = (lba + num_blocks - 1) / cache->page_blocks;
+	cache->stats.invalidations++;
+
+	for (i = 0; i < ISCSI_CACHE_SHARDS; i++) {
+		npages += cache->shard[i].npages;
+	}
+
+	if (last - first >= npages) {
+		/* cheaper to look at every page we have */
+		for (i = 0; i < ISCSI_CACHE_SHARDS; i++) {
+			struct iscsi_cache_shard *shard = &cache->shard[i];
+			uint32_t slot = 0;
+
+			while (slot < shard->npages) {
+				struct iscsi_cache_page *page =
+					shard->clock[slot];
+
+				if (page->index < first || page->index > last) {
+					slot++;
+				} else if (page->filling) {
+					page->stale = 1;
+					slot++;
+				} else {
+					/* the last page moves into this slot */
+					iscsi_cache_drop(iscsi, cache, page);
+				}
+			}
+		}
+		return;
+	}
+
+	for (index = first; index <= last; index++) {
+		struct iscsi_cache_page *page;
+
+		page = iscsi_cache_lookup(cache, index);
+		if (page == NULL) {
+			continue;
+		}
+		if (page->filling) {
+			page->stale = 1;
+		} else {
+			iscsi_cache_drop(iscsi, cache, page);
+		}
+	}
+}
+
+/* Called for every SCSI command when it is sent and when it completes */
+void
+iscsi_read_cache_task(struct iscsi_context *iscsi, int lun,
+		      struct scsi_task *task)
+{
+	struct iscsi_read_cache *cache;
+	unsigned char *cdb = task->cdb;
+	uint64_t lba = 0, num_blocks = 0;
+
+	cache = iscsi_get_read_cache(iscsi, lun);
+	if (cache == NULL || cache->disabled) {
+		return;
+	}
+
+	switch (cdb[0]) {
+	case SCSI_OPCODE_WRITE10:
+	case SCSI_OPCODE_WRITE_VERIFY10:
+	case SCSI_OPCODE_WRITE_SAME10:
+	case SCSI_OPCODE_XPWRITE10:
+	case SCSI_OPCODE_XDWRITEREAD10:
+		lba        = scsi_get_uint32(&cdb[2]);
+		num_blocks = scsi_get_uint16(&cdb[7]);
+		break;
+	case SCSI_OPCODE_WRITE12:
+	case SCSI_OPCODE_WRITE_VERIFY12:
+		lba        = scsi_get_uint32(&cdb[2]);
+		num_blocks = scsi_get_uint32(&cdb[6]);
+		break;
+	case SCSI_OPCODE_WRITE16:
+	case SCSI_OPCODE_WRITE_VERIFY16:
+	case SCSI_OPCODE_WRITE_SAME16:
+	case SCSI_OPCODE_ORWRITE:
+		lba        = scsi_get_uint64(&cdb[2]);
+		num_blocks = scsi_get_uint32(&cdb[10]);
+		break;
+	case SCSI_OPCODE_COMPARE_AND_WRITE:
+		lba        = scsi_get_uint64(&cdb[2]);
+		num_blocks = cdb[13];
+		break;
+	case SCSI_OPCODE_VARIABLE_LENGTH:
+		if (scsi_get_uint16(&cdb[8]) == SCSI_READ32) {
+			return;
+		}
+		if (scsi_get_uint16(&cdb[8]) == SCSI_WRITE32) {
+			lba        = scsi_get_uint64(&cdb[12]);
+			num_blocks = scsi_get_uint32(&cdb[28]);
+		}
+		break;
+	case SCSI_OPCODE_UNMAP:
+	case SCSI_OPCODE_SANITIZE:
+	case 0x04: /* FORMAT UNIT */
+	case 0x83: /* EXTENDED COPY and friends */
+		/* whatever they touch, drop it all */
+		break;
+	default:
+		return;
+	}
+
+	iscsi_cache_invalidate(iscsi, cache, lba, num_blocks);
+}
+
+int
+iscsi_enable_read_cache(struct iscsi_context *iscsi, int lun,
+			uint32_t page_size, uint32_t max_pages)
+{
+	struct iscsi_read_cache *cache;
+	uint32_t per_shard, buckets;
+	int i;
+
+	if (iscsi->limits.block_size == 0 || iscsi->limits.num_blocks == 0) {
+		iscsi_set_error(iscsi, "LUN size is not known, call "
+				"iscsi_discover_block_limits_sync() first");
+		return -1;
+	}
+	if (page_size == 0 || page_size % iscsi->limits.block_size
+	||  page_size > 16 * 1024 * 1024) {
+		iscsi_set_error(iscsi, "Invalid cache page size %u", page_size);
+		return -1;
+	}
+	if (max_pages == 0) {
+		iscsi_set_error(iscsi, "Read cache needs at least one page");
+		return -1;
+	}
+	if (iscsi_get_read_cache(iscsi, lun) != NULL) {
+		iscsi_set_error(iscsi, "LUN %d already has a read cache", lun);
+		return -1;
+	}
+
+	cache = iscsi_zmalloc(iscsi, sizeof(struct iscsi_read_cache));
+	if (cache == NULL) {
+		iscsi_set_error(iscsi, "Out-of-memory: Failed to allocate "
+				"read cache.");
+		return -1;
+	}
+	cache->lun         = lun;
+	cache->block_size  = iscsi->limits.block_size;
+	cache->page_blocks = page_size / iscsi->limits.block_size;
+	cache->num_blocks  = iscsi->limits.num_blocks;
+	cache->seq_next    = ~0ULL;
+
+	per_shard = (max_pages + ISCSI_CACHE_SHARDS - 1) / ISCSI_CACHE_SHARDS;
+	for (buckets = 1; buckets < per_shard; buckets <<= 1) {
+		;
+	}
+	for (i = 0; i < ISCSI_CACHE_SHARDS; i++) {
+		struct iscsi_cache_shard *shard = &cache->shard[i];
+
+		shard->max_pages = per_shard;
+		shard->hash_mask = buckets - 1;
+		shard->hash  = iscsi_zmalloc(iscsi, buckets *
+					sizeof(struct iscsi_cache_page *));
+		shard->clock = iscsi_zmalloc(iscsi, per_shard *
+					sizeof(struct iscsi_cache_page *));
+		if (shard->hash == NULL || shard->clock == NULL) {
+			iscsi_set_error(iscsi, "Out-of-memory: Failed to "
+					"allocate read cache.");
+			iscsi_cache_free(iscsi, cache);
+			return -1;
+		}
+	}
+
+	ISCSI_LIST_ADD(&iscsi->read_caches, cache);
+
+	return 0;
+}
+
+int
+iscsi_set_read_cache_readahead(struct iscsi_context *iscsi, int lun,
+			       uint32_t pages, int prefetch)
+{
+	struct iscsi_read_cache *cache = iscsi_get_read_cache(iscsi, lun);
+
+	if (cache == NULL) {
+		iscsi_set_error(iscsi, "LUN %d has no read cache", lun);
+		return -1;
+	}
+	cache->ra_pages    = pages;
+	cache->ra_prefetch = prefetch;
+	cache->ra_end      = 0;
+
+	return 0;
+}
+
+void
+iscsi_invalidate_read_cache(struct iscsi_context *iscsi, int lun)
+{
+	struct iscsi_read_cache *cache = iscsi_get_read_cache(iscsi, lun);
+
+	if (cache != NULL) {
+		iscsi_cache_invalidate(iscsi, cache, 0, 0);
+	}
+}
+
+int
+iscsi_get_read_cache_stats(struct iscsi_context *iscsi, int lun,
+			   struct iscsi_read_cache_stats *stats)
+{
+	struct iscsi_read_cache *cache = iscsi_get_read_cache(iscsi, lun);
+
+	if (cache == NULL) {
+		iscsi_set_error(iscsi, "LUN %d has no read cache", lun);
+		return -1;
+	}
+	*stats = cache->stats;
+
+	return 0;
+}
+
+static void
+iscsi_cache_disable(struct iscsi_context *iscsi,
+		    struct iscsi_read_cache *cache)
+{
+	ISCSI_LIST_REMOVE(&iscsi->read_caches, cache);
+	cache->disabled = 1;
+	if (cache->fills == 0) {
+		iscsi_cache_free(iscsi, cache);
+	}
+	/* otherwise the last fill to complete frees it */
+}
+
+void
+iscsi_disable_read_cache(struct iscsi_context *iscsi, int lun)
+{
+	struct iscsi_read_cache *cache = iscsi_get_read_cache(iscsi, lun);
+
+	if (cache != NULL) {
+		iscsi_cache_disable(iscsi, cache);
+	}
+}
+
+void
+iscsi_free_read_caches(struct iscsi_context *iscsi)
+{
+	while (iscsi->read_caches != NULL) {
+		iscsi_cache_disable(iscsi, iscsi->read_caches);
+	}
+}
@@ -0,0 +1,648 @@
+/*
+   Copyright (C) 2026 by agent <agent@local>
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU Lesser General Public License as published by
+   the Free Software Foundation; either version 2.1 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public License
+   along with this program; if not, see <http://www.gnu.org/licenses/>.
+*/
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#ifdef HAVE_SYS_TYPES_H
+#include <sys/types.h>
+#endif
+
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+
+#if defined(WIN32)
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#include "win32/win32_compat.h"
+#else
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <sys/time.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include "iscsi.h"
+#include "iscsi-private.h"
+#include "scsi-lowlevel.h"
+
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#endif
+
+/*
+ * PDU capture.
+ *
+ * Writes every PDU sent and received to a pcapng file as raw IPv4
+ * packets with made up TCP headers, so the iSCSI dissector in Wireshark
+ * can take them apart. The addresses and ports are those of the
+ * connection when it is over IPv4, otherwise 10.0.0.1 talking to
+ * 10.0.0.2 port 3260. PDUs that do not fit in one IP packet are split
+ * into several TCP segments, and the sequence numbers always advance by
+ * the full size of the PDU even when only part of it was captured.
+ *
+ * Packets are built in memory buffers. Full buffers are handed to a
+ * thread that writes them to the file, so iscsi_service() never waits
+ * for the disk. If the writer falls too far behind packets are dropped
+ * rather than letting the buffers grow. Without pthreads the buffers
+ * are written out as they fill up. Once a write to the file fails
+ * nothing more is captured, and the error is logged when the capture
+ * is stopped.
+ */
+
+#define ISCSI_CAPTURE_BUF_SIZE (1024 * 1024)
+#define ISCSI_CAPTURE_MAX_BUFS 16
+/* TCP payload per packet, so the IP total length fits in 16 bits */
+#define ISCSI_CAPTURE_MSS 65000
+#define ISCSI_CAPTURE_IP_TCP_LEN 40
+
+#define PCAPNG_SHB 0x0A0D0D0A
+#define PCAPNG_IDB 0x00000001
+#define PCAPNG_EPB 0x00000006
+#define PCAPNG_LINKTYPE_RAW 101
+#define PCAPNG_EPB_LEN 28
+
+struct iscsi_capture_buf {
+	struct iscsi_capture_buf *next;
+	size_t used;
+	unsigned char data[ISCSI_CAPTURE_BUF_SIZE];
+};
+
+struct iscsi_capture {
+	int fd;
+	uint32_t snaplen;
+
+	/* the connection the addresses and sequence numbers belong to */
+	int sock;
+	uint32_t addr[2];
+	uint16_t port[2];
+	uint32_t seq[2];
+	uint16_t ip_id;
+
+	struct iscsi_capture_buf *cur;
+	int nbufs;
+	uint64_t dropped;
+	/* errno of the first failed write to the file */
+	int error;
+	int failed;
+
+#ifdef HAVE_PTHREAD
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct iscsi_capture_buf *full;
+	struct iscsi_capture_buf *spare;
+	int stop;
+#endif
+};
+
+/* A piece of a PDU, either from a buffer, from an iovector or zeros */
+struct iscsi_capture_part {
+	const unsigned char *data;
+	struct scsi_iovector *iov;
+	size_t offset;
+	size_t len;
+};
+
+enum {
+	ISCSI_CAPTURE_OUT = 0,
+	ISCSI_CAPTURE_IN  = 1
+};
+
+static int
+iscsi_capture_write(int fd, const unsigned char *buf, size_t len)
+{
+	ssize_t count;
+
+	while (len > 0) {
+		count = write(fd, buf, len);
+		if (count < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return -1;
+		}
+		buf += count;
+		len -= count;
+	}
+	return 0;
+}
+
+#ifdef HAVE_PTHREAD
+static void *
+iscsi_capture_thread(void *arg)
+{
+	struct iscsi_capture *cap = arg;
+	struct iscsi_capture_buf *buf, *next;
+	int error = 0;
+
+	pthread_mutex_lock(&cap->lock);
+	for (;;) {
+		while (cap->full == NULL && !cap->stop) {
+			pthread_cond_wait(&cap->cond, &cap->lock);
+		}
+		if (cap->full == NULL) {
+			break;
+		}
+		buf = cap->full;
+		cap->full = NULL;
+		pthread_mutex_unlock(&cap->lock);
+
+		for (; buf != NULL; buf = next) {
+			next = buf->next;
+			if (error == 0
+			&&  iscsi_capture_write(cap->fd, buf->data,
+						buf->used) != 0) {
+				error = errno;
+			}
+			buf->used = 0;
+
+			pthread_mutex_lock(&cap->lock);
+			cap->error = error;
+			buf->next  = cap->spare;
+			cap->spare = buf;
+			pthread_mutex_unlock(&cap->lock);
+		}
+		pthread_mutex_lock(&cap->lock);
+	}
+	pthread_mutex_unlock(&cap->lock);
+
+	return NULL;
+}
+#endif
+
+/* Pass the current buffer on to be written and find an empty one */
+static int
+iscsi_capture_flush(struct iscsi_capture *cap)
+{
+#ifdef HAVE_PTHREAD
+	struct iscsi_capture_buf **tail;
+
+	pthread_mutex_lock(&cap->lock);
+	if (cap->error) {
+		/* the writer has given up, don't hand it any more */
+		cap->failed = 1;
+		pthread_mutex_unlock(&cap->lock);
+		return -1;
+	}
+	if (cap->cur != NULL && cap->cur->used > 0) {
+		cap->cur->next = NULL;
+		for (tail = &cap->full; *tail != NULL; tail = &(*tail)->next)
+			;
+		*tail = cap->cur;
+		cap->cur = NULL;
+		pthread_cond_signal(&cap->cond);
+	}
+	if (cap->cur == NULL && cap->spare != NULL) {
+		cap->cur   = cap->spare;
+		cap->spare = cap->spare->next;
+	}
+	pthread_mutex_unlock(&cap->lock);
+#else
+	if (cap->error) {
+		cap->failed = 1;
+		return -1;
+	}
+	if (cap->cur != NULL && cap->cur->used > 0) {
+		if (iscsi_capture_write(cap->fd, cap->cur->data,
+					cap->cur->used) != 0) {
+			cap->error = errno;
+		}
+		cap->cur->used = 0;
+	}
+#endif
+	if (cap->cur == NULL) {
+		if (cap->nbufs >= ISCSI_CAPTURE_MAX_BUFS) {
+			return -1;
+		}
+		cap->cur = malloc(sizeof(struct iscsi_capture_buf));
+		if (cap->cur == NULL) {
+			return -1;
+		}
+		cap->cur->used = 0;
+		cap->nbufs++;
+	}
+	return 0;
+}
+
+/* Room for len more bytes, NULL if there is none to be had */
+static unsigned char *
+iscsi_capture_reserve(struct iscsi_capture *cap, size_t len)
+{
+	unsigned char *p;
+
+	if (cap->failed) {
+		return NULL;
+	}
+	if (cap->cur == NULL
+	||  cap->cur->used + len > ISCSI_CAPTURE_BUF_SIZE) {
+		if (iscsi_capture_flush(cap) != 0) {
+			return NULL;
+		}
+	}
+	p = &cap->cur->data[cap->cur->used];
+	cap->cur->used += len;
+
+	return p;
+}
+
+static void
+iscsi_capture_put32(unsigned char *p, uint32_t val)
+{
+	memcpy(p, &val, 4);
+}
+
+static void
+iscsi_capture_put16(unsigned char *p, uint16_t val)
+{
+	memcpy(p, &val, 2);
+}
+
+static uint64_t
+iscsi_capture_time_ns(void)
+{
+#ifdef HAVE_CLOCK_GETTIME
+	struct timespec ts;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+#else
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return (uint64_t)tv.tv_sec * 1000000000 + tv.tv_usec * 1000;
+#endif
+}
+
+/* Section header and interface description, in host byte order */
+static int
+iscsi_capture_file_header(struct iscsi_capture *cap)
+{
+	unsigned char hdr[28 + 32], *p = hdr;
+
+	iscsi_capture_put32(p, PCAPNG_SHB);
+	iscsi_capture_put32(p + 4, 28);
+	iscsi_capture_put32(p + 8, 0x1A2B3C4D);
+	iscsi_capture_put16(p + 12, 1);
+	iscsi_capture_put16(p + 14, 0);
+	/* section length not known */
+	memset(p + 16, 0xff, 8);
+	iscsi_capture_put32(p + 24, 28);
+	p += 28;
+
+	iscsi_capture_put32(p, PCAPNG_IDB);
+	iscsi_capture_put32(p + 4, 32);
+	iscsi_capture_put16(p + 8, PCAPNG_LINKTYPE_RAW);
+	iscsi_capture_put16(p + 10, 0);
+	iscsi_capture_put32(p + 12, 0);
+	/* if_tsresol: nanoseconds */
+	iscsi_capture_put16(p + 16, 9);
+	iscsi_capture_put16(p + 18, 1);
+	p[20] = 9;
+	p[21] = p[22] = p[23] = 0;
+	/* opt_endofopt */
+	iscsi_capture_put32(p + 24, 0);
+	iscsi_capture_put32(p + 28, 32);
+
+	return iscsi_capture_write(cap->fd, hdr, sizeof(hdr));
+}
+
+/* Pick up the addresses of the connection, once per connection */
+static void
+iscsi_capture_addresses(struct iscsi_context *iscsi,
+			struct iscsi_capture *cap)
+{
+	struct sockaddr_storage ss;
+	struct sockaddr_in *sin = (struct sockaddr_in *)&ss;
+	socklen_t len;
+
+	if (cap->sock == iscsi->fd) {
+		return;
+	}
+	cap->sock    = iscsi->fd;
+	cap->addr[0] = htonl(0x0a000001);
+	cap->addr[1] = htonl(0x0a000002);
+	cap->port[0] = htons(49152);
+	cap->port[1] = htons(3260);
+	cap->seq[0]  = 1;
+	cap->seq[1]  = 1;
+
+	len = sizeof(ss);
+	if (getsockname(iscsi->fd, (struct sockaddr *)&ss, &len) == 0
+	&&  ss.ss_family == AF_INET) {
+		cap->addr[0] = sin->sin_addr.s_addr;
+		cap->port[0] = sin->sin_port;
+	}
+	len = sizeof(ss);
+	if (getpeername(iscsi->fd, (struct sockaddr *)&ss, &len) == 0
+	&&  ss.ss_family == AF_INET) {
+		cap->addr[1] = sin->sin_addr.s_addr;
+		cap->port[1] = sin->sin_port;
+	}
+}
+
+/* Copy bytes [from, from + len) of the concatenated parts to dst */
+static void
+iscsi_capture_copy(unsigned char *dst, const struct iscsi_capture_part *parts,
+		   int nparts, size_t from, size_t len)
+{
+	int i, j;
+
+	for (i = 0; i < nparts && len > 0; i++) {
+		const struct iscsi_capture_part *part = &parts[i];
+		size_t n, off;
+
+		if (from >= part->len) {
+			from -= part->len;
+			continue;
+		}
+		n = part->len - from < len ? part->len - from : len;
+
+		if (part->data != NULL) {
+			memcpy(dst, part->data + from, n);
+		} else if (part->iov == NULL) {
+			memset(dst, 0, n);
+		} else {
+			size_t left = n, skip = part->offset + from;
+
+			/* the iovector may be shorter than the data */
+			memset(dst, 0, n);
+			for (j = 0; j < part->iov->niov && left > 0; j++) {
+				struct scsi_iovec *v = &part->iov->iov[j];
+
+				if (skip >= v->iov_len) {
+					skip -= v->iov_len;
+					continue;
+				}
+				off = v->iov_len - skip < left ?
+					v->iov_len - skip : left;
+				memcpy(dst + (n - left),
+				       (unsigned char *)v->iov_base + skip, off);
+				left -= off;
+				skip  = 0;
+			}
+		}
+		dst  += n;
+		len  -= n;
+		from  = 0;
+	}
+}
+
+static uint16_t
+iscsi_capture_ip_csum(const unsigned char *ip)
+{
+	uint32_t sum = 0;
+	int i;
+
+	for (i = 0; i < 20; i += 2) {
+		sum += (ip[i] << 8) | ip[i + 1];
+	}
+	while (sum >> 16) {
+		sum = (sum & 0xffff) + (sum >> 16);
+	}
+	return ~sum & 0xffff;
+}
+
+/* Write a PDU of len bytes as one or more TCP segments */
+static void
+iscsi_capture_pdu(struct iscsi_context *iscsi, int dir,
+		  const struct iscsi_capture_part *parts, int nparts,
+		  size_t hdr_len, size_t len)
+{
+	struct iscsi_capture *cap = iscsi->capture;
+	size_t caplen = hdr_len + cap->snaplen, pos, seg, got, rec;
+	uint64_t ns = iscsi_capture_time_ns();
+	unsigned char *p, *ip, *tcp;
+
+	iscsi_capture_addresses(iscsi, cap);
+	if (caplen > len) {
+		caplen = len;
+	}
+
+	for (pos = 0; pos < len; pos += seg) {
+		seg = len - pos < ISCSI_CAPTURE_MSS ? len - pos
+			: ISCSI_CAPTURE_MSS;
+		got = pos < caplen ? caplen - pos : 0;
+		if (got > seg) {
+			got = seg;
+		}
+		rec = PCAPNG_EPB_LEN + ((ISCSI_CAPTURE_IP_TCP_LEN + got + 3) & ~3)
+			+ 4;
+
+		p = iscsi_capture_reserve(cap, rec);
+		if (p == NULL) {
+			cap->dropped++;
+			cap->seq[dir] += seg;
+			continue;
+		}
+		memset(p, 0, rec);
+		iscsi_capture_put32(p, PCAPNG_EPB);
+		iscsi_capture_put32(p + 4, rec);
+		iscsi_capture_put32(p + 8, 0);
+		iscsi_capture_put32(p + 12, ns >> 32);
+		iscsi_capture_put32(p + 16, ns & 0xffffffff);
+		iscsi_capture_put32(p + 20, ISCSI_CAPTURE_IP_TCP_LEN + got);
+		iscsi_capture_put32(p + 24, ISCSI_CAPTURE_IP_TCP_LEN + seg);
+		iscsi_capture_put32(p + rec - 4, rec);
+
+		ip = p + PCAPNG_EPB_LEN;
+		ip[0] = 0x45;
+		scsi_set_uint16(&ip[2], ISCSI_CAPTURE_IP_TCP_LEN + seg);
+		scsi_set_uint16(&ip[4], cap->ip_id++);
+		/* don't fragment */
+		ip[6] = 0x40;
+		ip[8] = 64;
+		ip[9] = 6;
+		memcpy(&ip[12], &cap->addr[dir], 4);
+		memcpy(&ip[16], &cap->addr[!dir], 4);
+		scsi_set_uint16(&ip[10], iscsi_capture_ip_csum(ip));
+
+		tcp = ip + 20;
+		memcpy(&tcp[0], &cap->port[dir], 2);
+		memcpy(&tcp[2], &cap->port[!dir], 2);
+		scsi_set_uint32(&tcp[4], cap->seq[dir]);
+		scsi_set_uint32(&tcp[8], cap->seq[!dir]);
+		tcp[12] = 5 << 4;
+		/* PSH, ACK */
+		tcp[13] = 0x18;
+		scsi_set_uint16(&tcp[14], 0xffff);
+
+		iscsi_capture_copy(tcp + 20, parts, nparts, pos, got);
+		cap->seq[dir] += seg;
+	}
+}
+
+void
+iscsi_capture_out(struct iscsi_context *iscsi, struct iscsi_pdu *pdu)
+{
+	struct iscsi_capture_part parts[3];
+	size_t payload = 0, padding = 0;
+
+	memset(parts, 0, sizeof(parts));
+	parts[0].data = pdu->outdata.data;
+	parts[0].len  = pdu->outdata.size;
+	if (pdu->payload_len > 0) {
+		payload = pdu->payload_len;
+		padding = ((payload + 3) & ~3) - payload;
+		parts[1].iov    = iscsi_get_scsi_task_iovector_out(iscsi, pdu);
+		parts[1].offset = pdu->payload_offset;
+		parts[1].len    = payload;
+		parts[2].len    = padding;
+	}
+
+	/* the header of a PDU with immediate data is followed by it */
+	iscsi_capture_pdu(iscsi, ISCSI_CAPTURE_OUT, parts, 3,
+			  ISCSI_HEADER_SIZE + pdu->outdata.data[4] * 4,
+			  pdu->outdata.size + payload + padding);
+}
+
+void
+iscsi_capture_in(struct iscsi_context *iscsi, struct iscsi_in_pdu *in)
+{
+	struct iscsi_capture_part parts[5];
+	size_t ahs_size = in->hdr[4] * 4;
+	size_t data_size = iscsi_get_pdu_data_size(&in->hdr[0]);
+	size_t padding = iscsi_get_pdu_padding_size(&in->hdr[0]);
+
+	memset(parts, 0, sizeof(parts));
+	parts[0].data = in->hdr;
+	parts[0].len  = ISCSI_RAW_HEADER_SIZE;
+	parts[1].data = in->ahs;
+	parts[1].len  = ahs_size;
+	parts[2].data = &in->hdr[ISCSI_RAW_HEADER_SIZE];
+	parts[2].len  = ISCSI_HEADER_SIZE - ISCSI_RAW_HEADER_SIZE;
+	parts[3].len  = data_size;
+	parts[4].len  = padding;
+	if (in->data != NULL) {
+		parts[3].data = in->data;
+	} else if (data_size > 0 && iscsi->capture->snaplen > 0) {
+		/* Data-In that went straight to the task buffers */
+		parts[3].iov    = iscsi_get_scsi_task_iovector_in(iscsi, in);
+		parts[3].offset = scsi_get_uint32(&in->hdr[40]);
+	}
+
+	iscsi_capture_pdu(iscsi, ISCSI_CAPTURE_IN, parts, 5,
+			  ISCSI_HEADER_SIZE + ahs_size,
+			  ISCSI_HEADER_SIZE + ahs_size + data_size + padding);
+}
+
+int
+iscsi_start_capture(struct iscsi_context *iscsi, const char *filename,
+		    uint32_t snaplen)
+{
+	struct iscsi_capture *cap;
+
+	if (iscsi->capture != NULL) {
+		iscsi_set_error(iscsi, "Capture is already running");
+		return -1;
+	}
+
+	cap = calloc(1, sizeof(struct iscsi_capture));
+	if (cap == NULL) {
+		iscsi_set_error(iscsi, "Out-of-memory: Failed to allocate "
+				"capture.");
+		return -1;
+	}
+	cap->snaplen = snaplen;
+	cap->sock    = -1;
+	cap->fd = open(filename, O_WRONLY|O_CREAT|O_TRUNC, 0644);
+	if (cap->fd == -1) {
+		iscsi_set_error(iscsi, "Failed to open capture file %s: %s",
+				filename, strerror(errno));
+		free(cap);
+		return -1;
+	}
+	if (iscsi_capture_file_header(cap) != 0) {
+		iscsi_set_error(iscsi, "Failed to write capture file %s: %s",
+				filename, strerror(errno));
+		close(cap->fd);
+		free(cap);
+		return -1;
+	}
+
+#ifdef HAVE_PTHREAD
+	pthread_mutex_init(&cap->lock, NULL);
+	pthread_cond_init(&cap->cond, NULL);
+	if (pthread_create(&cap->thread, NULL, iscsi_capture_thread,
+			   cap) != 0) {
+		iscsi_set_error(iscsi, "Failed to start capture thread");
+		pthread_cond_destroy(&cap->cond);
+		pthread_mutex_destroy(&cap->lock);
+		close(cap->fd);
+		free(cap);
+		return -1;
+	}
+#endif
+
+	iscsi->capture = cap;
+	return 0;
+}
+
+void
+iscsi_stop_capture(struct iscsi_context *iscsi)
+{
+	struct iscsi_capture *cap = iscsi->capture;
+#ifdef HAVE_PTHREAD
+	struct iscsi_capture_buf *buf, **tail;
+#endif
+
+	if (cap == NULL) {
+		return;
+	}
+	iscsi->capture = NULL;
+
+#ifdef HAVE_PTHREAD
+	pthread_mutex_lock(&cap->lock);
+	if (cap->cur != NULL && cap->cur->used > 0 && !cap->error) {
+		cap->cur->next = NULL;
+		for (tail = &cap->full; *tail != NULL; tail = &(*tail)->next)
+			;
+		*tail    = cap->cur;
+		cap->cur = NULL;
+	}
+	cap->stop = 1;
+	pthread_cond_signal(&cap->cond);
+	pthread_mutex_unlock(&cap->lock);
+	pthread_join(cap->thread, NULL);
+	pthread_cond_destroy(&cap->cond);
+	pthread_mutex_destroy(&cap->lock);
+
+	while ((buf = cap->spare) != NULL) {
+		cap->spare = buf->next;
+		free(buf);
+	}
+#else
+	iscsi_capture_flush(cap);
+#endif
+	free(cap->cur);
+	close(cap->fd);
+
+	if (cap->error) {
+		ISCSI_LOG(iscsi, 1, "Capture stopped, failed to write to "
+			  "the capture file: %s", strerror(cap->error));
+	}
+	if (cap->dropped) {
+		ISCSI_LOG(iscsi, 1, "Capture dropped %llu packets",
+			  (unsigned long long)cap->dropped);
+	}
+	free(cap);
+}
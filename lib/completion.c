@@ -0,0 +1,195 @@
+/*
+   Copyright (C) 2026 by agent <agent@local>
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU Lesser General Public License as published by
+   the Free Software Foundation; either version 2.1 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public License
+   along with this program; if not, see <http://www.gnu.org/licenses/>.
+*/
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <string.h>
+#include "iscsi.h"
+#include "iscsi-private.h"
+#include "scsi-lowlevel.h"
+
+/*
+ * The completion queue is a ring of completed tasks that the application
+ * reaps with iscsi_get_completions() instead of getting a callback for
+ * each task. It is allocated separately from the context so that the
+ * context copies made while reconnecting all share the same ring.
+ */
+struct iscsi_completion_queue {
+	struct iscsi_completion *entries;
+	int size;
+	int head;
+	int count;
+};
+
+int
+iscsi_set_completion_queue(struct iscsi_context *iscsi, int size)
+{
+	struct iscsi_completion_queue *cq = iscsi->cq;
+
+	if (size < 0) {
+		iscsi_set_error(iscsi, "Invalid completion queue size %d",
+				size);
+		return -1;
+	}
+
+	if (size == 0) {
+		if (cq != NULL && cq->count != 0) {
+			iscsi_set_error(iscsi, "Completion queue still holds "
+					"%d completions", cq->count);
+			return -1;
+		}
+		iscsi_free_completion_queue(iscsi);
+		return 0;
+	}
+
+	if (cq != NULL) {
+		/* already enabled, the ring grows on demand */
+		return 0;
+	}
+
+	cq = iscsi_zmalloc(iscsi, sizeof(struct iscsi_completion_queue));
+	if (cq == NULL) {
+		iscsi_set_error(iscsi, "Out-of-memory: failed to allocate "
+				"completion queue");
+		return -1;
+	}
+	cq->entries = iscsi_malloc(iscsi, size * sizeof(struct iscsi_completion));
+	if (cq->entries == NULL) {
+		iscsi_free(iscsi, cq);
+		iscsi_set_error(iscsi, "Out-of-memory: failed to allocate "
+				"completion queue");
+		return -1;
+	}
+	cq->size = size;
+	iscsi->cq = cq;
+
+	return 0;
+}
+
+/* Double the ring, moving the entries so that they start at index 0 */
+static int
+iscsi_grow_completion_queue(struct iscsi_context *iscsi,
+			    struct iscsi_completion_queue *cq)
+{
+	struct iscsi_completion *entries;
+	int first;
+
+	entries = iscsi_malloc(iscsi, 2 * cq->size * sizeof(struct iscsi_completion));
+	if (entries == NULL) {
+		return -1;
+	}
+	first = cq->size - cq->head;
+	memcpy(entries, &cq->entries[cq->head],
+	       first * sizeof(struct iscsi_completion));
+	memcpy(&entries[first], cq->entries,
+	       cq->head * sizeof(struct iscsi_completion));
+	iscsi_free(iscsi, cq->entries);
+
+	cq->entries = entries;
+	cq->head    = 0;
+	cq->size   *= 2;
+
+	return 0;
+}
+
+/* This is the task callback for tasks submitted without one while the
+ * completion queue is enabled.
+ */
+void
+iscsi_completion_queue_cb(struct iscsi_context *iscsi, int status,
+			  void *command_data, void *private_data)
+{
+	struct iscsi_completion_queue *cq = iscsi->cq;
+	struct iscsi_completion *c;
+
+	if (cq == NULL) {
+		/* Nobody can reap it, release it like a destroyed queue does */
+		ISCSI_LOG(iscsi, 1, "Completion for task %p without a "
+			  "completion queue", command_data);
+		if (command_data != NULL) {
+			scsi_free_scsi_task(command_data);
+		}
+		return;
+	}
+
+	if (cq->count == cq->size
+	&&  iscsi_grow_completion_queue(iscsi, cq) != 0) {
+		/* There is no way to hand this completion back, so the best
+		 * we can do is to make some noise about it.
+		 */
+		ISCSI_LOG(iscsi, 1, "Out-of-memory: dropping completion for "
+			  "task %p", command_data);
+		return;
+	}
+
+	c = &cq->entries[(cq->head + cq->count) % cq->size];
+	c->task         = command_data;
+	c->status       = status;
+	c->private_data = private_data;
+	cq->count++;
+}
+
+int
+iscsi_get_completions(struct iscsi_context *iscsi,
+		      struct iscsi_completion *completions, int max)
+{
+	struct iscsi_completion_queue *cq = iscsi->cq;
+	int n = 0;
+
+	if (cq == NULL) {
+		iscsi_set_error(iscsi, "Completion queue is not enabled");
+		return -1;
+	}
+
+	while (n < max && cq->count > 0) {
+		completions[n++] = cq->entries[cq->head];
+		cq->head = (cq->head + 1) % cq->size;
+		cq->count--;
+	}
+	if (cq->count == 0) {
+		cq->head = 0;
+	}
+
+	return n;
+}
+
+void
+iscsi_free_completion_queue(struct iscsi_context *iscsi)
+{
+	struct iscsi_completion_queue *cq = iscsi->cq;
+
+	if (cq == NULL) {
+		return;
+	}
+
+	/* Nobody is left to reap these, so release the tasks as well */
+	while (cq->count > 0) {
+		struct iscsi_completion *c = &cq->entries[cq->head];
+
+		if (c->task != NULL) {
+			scsi_free_scsi_task(c->task);
+		}
+		cq->head = (cq->head + 1) % cq->size;
+		cq->count--;
+	}
+
+	iscsi_free(iscsi, cq->entries);
+	iscsi_free(iscsi, cq);
+	iscsi->cq = NULL;
+}
@@ -28,6 +28,7 @@
 #include "slist.h"
 #include "iscsi.h"
 #include "iscsi-private.h"
+#include "iscsi-trace.h"
 #include "scsi-lowlevel.h"
 
 struct connect_task {
@@ -108,6 +109,18 @@ iscsi_testunitready_cb(struct iscsi_context *iscsi, int status,
 	iscsi_free(iscsi, ct);
 }
 
+static void
+iscsi_pipelined_testunitready_cb(struct iscsi_context *iscsi _U_, int status _U_,
+				 void *command_data, void *private_data _U_)
+{
+	struct scsi_task *task = command_data;
+
+	/* Nobody is waiting for this one. It only exists to soak up the
+	 * unit attention that follows a fresh login.
+	 */
+	scsi_free_scsi_task(task);
+}
+
 static void
 iscsi_login_cb(struct iscsi_context *iscsi, int status, void *command_data _U_,
 	       void *private_data)
@@ -130,7 +143,19 @@ iscsi_login_cb(struct iscsi_context *iscsi, int status, void *command_data _U_,
 		return;
 	}
 
-	if (ct->lun != -1 && !iscsi->old_iscsi) {
+	if (ct->lun != -1 && !iscsi->old_iscsi
+	&& iscsi->post_login_tur == ISCSI_POST_LOGIN_TUR_PIPELINE) {
+		if (iscsi_testunitready_task(iscsi, ct->lun,
+				iscsi_pipelined_testunitready_cb, NULL) == NULL) {
+			iscsi_set_error(iscsi, "iscsi_testunitready_async failed.");
+			ct->cb(iscsi, SCSI_STATUS_ERROR, NULL, ct->private_data);
+			iscsi_free(iscsi, ct);
+			return;
+		}
+		ct->cb(iscsi, SCSI_STATUS_GOOD, NULL, ct->private_data);
+		iscsi_free(iscsi, ct);
+	} else if (ct->lun != -1 && !iscsi->old_iscsi
+	&& iscsi->post_login_tur == ISCSI_POST_LOGIN_TUR_WAIT) {
 		if (iscsi_testunitready_task(iscsi, ct->lun,
 						  iscsi_testunitready_cb, ct) == NULL) {
 			iscsi_set_error(iscsi, "iscsi_testunitready_async failed.");
@@ -224,7 +249,7 @@ void iscsi_defer_reconnect(struct iscsi_context *iscsi)
 	ISCSI_LOG(iscsi, 2, "reconnect deferred, cancelling all tasks");
 
 	while ((pdu = iscsi->outqueue)) {
-		ISCSI_LIST_REMOVE(&iscsi->outqueue, pdu);
+		iscsi_outqueue_remove(iscsi, pdu);
 		if ( !(pdu->flags & ISCSI_PDU_NO_CALLBACK)) {
 			/* If an error happened during connect/login,
 			   we don't want to call any of the callbacks.
@@ -247,6 +272,7 @@ void iscsi_defer_reconnect(struct iscsi_context *iscsi)
 		}
 		iscsi_free_pdu(iscsi, pdu);
 	}
+	iscsi_cancel_held_commands(iscsi);
 }
 
 void iscsi_reconnect_cb(struct iscsi_context *iscsi _U_, int status,
@@ -278,12 +304,13 @@ void iscsi_reconnect_cb(struct iscsi_context *iscsi _U_, int status,
 
 	while (old_iscsi->outqueue) {
 		struct iscsi_pdu *pdu = old_iscsi->outqueue;
-		ISCSI_LIST_REMOVE(&old_iscsi->outqueue, pdu);
+		iscsi_outqueue_remove(old_iscsi, pdu);
 		ISCSI_LIST_ADD_END(&old_iscsi->waitpdu, pdu);
 	}
 
 	while (old_iscsi->waitpdu) {
 		struct iscsi_pdu *pdu = old_iscsi->waitpdu;
+		uint64_t submitted;
 
 		ISCSI_LIST_REMOVE(&old_iscsi->waitpdu, pdu);
 		if (pdu->itt == 0xffffffff) {
@@ -307,7 +334,9 @@ void iscsi_reconnect_cb(struct iscsi_context *iscsi _U_, int status,
 		/* We pass NULL as 'd' since any databuffer has already
 		 * been converted to a task-> iovector first time this
 		 * PDU was sent.
+		 * The task still counts as submitted when it first was.
 		 */
+		submitted = pdu->scsi_cbdata.task->times.submitted;
 		if (iscsi_scsi_command_async(iscsi, pdu->lun,
 					     pdu->scsi_cbdata.task,
 					     pdu->scsi_cbdata.callback,
@@ -315,9 +344,13 @@ void iscsi_reconnect_cb(struct iscsi_context *iscsi _U_, int status,
 					     pdu->scsi_cbdata.private_data)) {
 			/* not much we can really do at this point */
 		}
+		pdu->scsi_cbdata.task->times.submitted = submitted;
 		iscsi_free_pdu(old_iscsi, pdu);
 	}
 
+	/* held commands have no CmdSN yet so they just queue up behind */
+	iscsi_move_held_commands(iscsi, old_iscsi);
+
 	if (old_iscsi->incoming != NULL) {
 		iscsi_free_iscsi_in_pdu(old_iscsi, old_iscsi->incoming);
 	}
@@ -341,6 +374,8 @@ void iscsi_reconnect_cb(struct iscsi_context *iscsi _U_, int status,
 	/* avoid a reconnect faster than 3 seconds */
 	iscsi->next_reconnect = time(NULL) + 3;
 
+	iscsi->stats.reconnects++;
+	ISCSI_TRACE(reconnect, iscsi->itt, iscsi->cmdsn, iscsi->lun, 0, 0);
 	ISCSI_LOG(iscsi, 2, "reconnect was successful");
 
 	iscsi->pending_reconnect = 0;
@@ -406,6 +441,8 @@ int iscsi_reconnect(struct iscsi_context *old_iscsi)
 	
 	iscsi->log_level = old_iscsi->log_level;
 	iscsi->log_fn = old_iscsi->log_fn;
+	iscsi->log_ring = old_iscsi->log_ring;
+	iscsi->capture = old_iscsi->capture;
 	iscsi->tcp_user_timeout = old_iscsi->tcp_user_timeout;
 	iscsi->tcp_keepidle = old_iscsi->tcp_keepidle;
 	iscsi->tcp_keepcnt = old_iscsi->tcp_keepcnt;
@@ -414,6 +451,23 @@ int iscsi_reconnect(struct iscsi_context *old_iscsi)
 	iscsi->cache_allocations = old_iscsi->cache_allocations;
 
 	iscsi->reconnect_max_retries = old_iscsi->reconnect_max_retries;
+	iscsi->post_login_tur = old_iscsi->post_login_tur;
+	iscsi->dataout_quantum = old_iscsi->dataout_quantum;
+	iscsi->cq = old_iscsi->cq;
+	iscsi->io_thread = old_iscsi->io_thread;
+	iscsi->limits = old_iscsi->limits;
+	iscsi->split_depth = old_iscsi->split_depth;
+	iscsi->byte_io_locked = old_iscsi->byte_io_locked;
+	iscsi->byte_io_waiting = old_iscsi->byte_io_waiting;
+	iscsi->merge_max_bytes = old_iscsi->merge_max_bytes;
+	iscsi->read_caches = old_iscsi->read_caches;
+	iscsi->write_backs = old_iscsi->write_backs;
+	iscsi->lba_maps = old_iscsi->lba_maps;
+	iscsi->discards = old_iscsi->discards;
+	iscsi->zero_detects = old_iscsi->zero_detects;
+	iscsi->nop_keepalive_interval = old_iscsi->nop_keepalive_interval;
+	iscsi->nop_keepalive_max_missed = old_iscsi->nop_keepalive_max_missed;
+	iscsi->stats = old_iscsi->stats;
 
 	if (old_iscsi->old_iscsi) {
 		int i;
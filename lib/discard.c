@@ -0,0 +1,562 @@
+/*
+   Copyright (C) 2026 by agent <agent@local>
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU Lesser General Public License as published by
+   the Free Software Foundation; either version 2.1 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public License
+   along with this program; if not, see <http://www.gnu.org/licenses/>.
+*/
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "iscsi.h"
+#include "iscsi-private.h"
+#include "scsi-lowlevel.h"
+#include "slist.h"
+
+/*
+ * Discard batching.
+ *
+ * Ranges passed to iscsi_discard_async() are only collected. Once enough
+ * of them have piled up, or the oldest one gets too old, they are sorted,
+ * overlapping and adjacent ones are merged, and the result is sent as a
+ * few UNMAPs with as many block descriptors each as the Block Limits page
+ * allows.
+ *
+ * With an optimal unmap granularity, every merged range is trimmed to the
+ * whole granules it covers, since the target is free to ignore the rest
+ * anyway. A range that is trimmed away completely completes without
+ * anything being sent.
+ *
+ * A range completes once every UNMAP that covers some of it has, and
+ * fails if any of them did.
+ */
+
+/* flush once this many ranges are waiting, whatever their size */
+#define ISCSI_DISCARD_MAX_RANGES 4096
+
+/* descriptors per UNMAP if the target does not tell us */
+#define ISCSI_DISCARD_DEFAULT_BDC 64
+
+/* what fits in the 16 bit parameter list length */
+#define ISCSI_DISCARD_MAX_BDC ((0xffff - 8) / 16)
+
+struct iscsi_discard_range {
+	uint64_t lba;
+	uint64_t end;
+	iscsi_command_cb cb;
+	void *private_data;
+	/* UNMAPs covering this range that have not completed */
+	int pending;
+	int status;
+};
+
+struct iscsi_discard_cmd {
+	uint64_t lba;
+	uint64_t end;
+	struct unmap_list *list;
+	int nlist;
+	struct iscsi_discard_range **ranges;
+	int nranges;
+	int max_ranges;
+};
+
+struct iscsi_discard {
+	struct iscsi_discard *next;
+	int lun;
+
+	uint32_t gran;
+	uint32_t align;
+	uint32_t max_bdc;
+	/* blocks per UNMAP, and per descriptor */
+	uint64_t max_blocks;
+	uint32_t max_desc_blocks;
+
+	uint64_t flush_blocks;
+	int max_age;
+
+	struct iscsi_discard_range **ranges;
+	int nranges;
+	int max_ranges;
+	uint64_t blocks;
+	time_t oldest;
+};
+
+static struct iscsi_discard *
+iscsi_get_discard(struct iscsi_context *iscsi, int lun)
+{
+	struct iscsi_discard *dc;
+
+	for (dc = iscsi->discards; dc != NULL; dc = dc->next) {
+		if (dc->lun == lun) {
+			return dc;
+		}
+	}
+	return NULL;
+}
+
+static int
+iscsi_discard_compare(const void *a, const void *b)
+{
+	const struct iscsi_discard_range *ra =
+		*(struct iscsi_discard_range * const *)a;
+	const struct iscsi_discard_range *rb =
+		*(struct iscsi_discard_range * const *)b;
+
+	if (ra->lba != rb->lba) {
+		return ra->lba < rb->lba ? -1 : 1;
+	}
+	return 0;
+}
+
+static void
+iscsi_discard_range_done(struct iscsi_context *iscsi,
+			 struct iscsi_discard_range *range, int status)
+{
+	if (status != SCSI_STATUS_GOOD && range->status == SCSI_STATUS_GOOD) {
+		range->status = status;
+	}
+	if (--range->pending > 0) {
+		return;
+	}
+	range->cb(iscsi, range->status, NULL, range->private_data);
+	iscsi_free(iscsi, range);
+}
+
+static void
+iscsi_discard_cmd_free(struct iscsi_context *iscsi,
+		       struct iscsi_discard_cmd *cmd)
+{
+	iscsi_free(iscsi, cmd->list);
+	iscsi_free(iscsi, cmd->ranges);
+	iscsi_free(iscsi, cmd);
+}
+
+static void
+iscsi_discard_cmd_done(struct iscsi_context *iscsi,
+		       struct iscsi_discard_cmd *cmd, int status)
+{
+	int i;
+
+	for (i = 0; i < cmd->nranges; i++) {
+		iscsi_discard_range_done(iscsi, cmd->ranges[i], status);
+	}
+	iscsi_discard_cmd_free(iscsi, cmd);
+}
+
+static void
+iscsi_discard_cb(struct iscsi_context *iscsi, int status,
+		 void *command_data, void *private_data)
+{
+	struct scsi_task *task = command_data;
+
+	if (status != SCSI_STATUS_GOOD && status != SCSI_STATUS_CANCELLED) {
+		iscsi_set_error(iscsi, "UNMAP failed: %s",
+				iscsi_get_error(iscsi));
+	}
+	if (task != NULL) {
+		scsi_free_scsi_task(task);
+	}
+	iscsi_discard_cmd_done(iscsi, private_data, status);
+}
+
+/* Start a new UNMAP, or add a descriptor to the current one */
+static struct iscsi_discard_cmd *
+iscsi_discard_add(struct iscsi_context *iscsi, struct iscsi_discard *dc,
+		  struct iscsi_discard_cmd ***cmds, int *ncmds, int *max_cmds,
+		  uint64_t *cmd_blocks, uint64_t lba, uint32_t num_blocks)
+{
+	struct iscsi_discard_cmd *cmd = *ncmds ? (*cmds)[*ncmds - 1] : NULL;
+
+	if (cmd == NULL || cmd->nlist == (int)dc->max_bdc
+	||  *cmd_blocks + num_blocks > dc->max_blocks) {
+		if (*ncmds == *max_cmds) {
+			struct iscsi_discard_cmd **n;
+			int max = *max_cmds ? *max_cmds * 2 : 4;
+
+			if (*cmds == NULL) {
+				n = iscsi_malloc(iscsi, max * sizeof(*n));
+			} else {
+				n = iscsi_realloc(iscsi, *cmds,
+						  max * sizeof(*n));
+			}
+			if (n == NULL) {
+				return NULL;
+			}
+			*cmds = n;
+			*max_cmds = max;
+		}
+		cmd = iscsi_zmalloc(iscsi, sizeof(struct iscsi_discard_cmd));
+		if (cmd == NULL) {
+			return NULL;
+		}
+		cmd->list = iscsi_malloc(iscsi, dc->max_bdc *
+					 sizeof(struct unmap_list));
+		if (cmd->list == NULL) {
+			iscsi_free(iscsi, cmd);
+			return NULL;
+		}
+		cmd->lba = lba;
+		(*cmds)[(*ncmds)++] = cmd;
+		*cmd_blocks = 0;
+	}
+
+	cmd->list[cmd->nlist].lba = lba;
+	cmd->list[cmd->nlist].num = num_blocks;
+	cmd->nlist++;
+	cmd->end = lba + num_blocks;
+	*cmd_blocks += num_blocks;
+
+	return cmd;
+}
+
+/* Index of the first command that ends after lba */
+static int
+iscsi_discard_find(struct iscsi_discard_cmd **cmds, int ncmds, uint64_t lba)
+{
+	int lo = 0, hi = ncmds;
+
+	while (lo < hi) {
+		int mid = lo + (hi - lo) / 2;
+
+		if (cmds[mid]->end <= lba) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	return lo;
+}
+
+static int
+iscsi_discard_attach(struct iscsi_context *iscsi,
+		     struct iscsi_discard_cmd *cmd,
+		     struct iscsi_discard_range *range)
+{
+	if (cmd->nranges == cmd->max_ranges) {
+		struct iscsi_discard_range **n;
+		int max = cmd->max_ranges ? cmd->max_ranges * 2 : 8;
+
+		if (cmd->ranges == NULL) {
+			n = iscsi_malloc(iscsi, max * sizeof(*n));
+		} else {
+			n = iscsi_realloc(iscsi, cmd->ranges,
+					  max * sizeof(*n));
+		}
+		if (n == NULL) {
+			return -1;
+		}
+		cmd->ranges     = n;
+		cmd->max_ranges = max;
+	}
+	cmd->ranges[cmd->nranges++] = range;
+	range->pending++;
+
+	return 0;
+}
+
+static int
+iscsi_discard_flush(struct iscsi_context *iscsi, struct iscsi_discard *dc)
+{
+	struct iscsi_discard_range **ranges = dc->ranges;
+	struct iscsi_discard_cmd **cmds = NULL;
+	int nranges = dc->nranges, ncmds = 0, max_cmds = 0, lun = dc->lun;
+	uint64_t cmd_blocks = 0;
+	int i, c;
+
+	if (nranges == 0) {
+		return 0;
+	}
+
+	qsort(ranges, nranges, sizeof(ranges[0]), iscsi_discard_compare);
+
+	/* merge, trim to whole granules and cut into UNMAPs */
+	for (i = 0; i < nranges; ) {
+		uint64_t lba = ranges[i]->lba, end = ranges[i]->end;
+
+		for (i++; i < nranges && ranges[i]->lba <= end; i++) {
+			if (ranges[i]->end > end) {
+				end = ranges[i]->end;
+			}
+		}
+		if (dc->gran > 1) {
+			lba = lba <= dc->align ? dc->align :
+				dc->align + (lba - dc->align + dc->gran - 1)
+				/ dc->gran * dc->gran;
+			end = end < dc->align ? 0 :
+				dc->align + (end - dc->align)
+				/ dc->gran * dc->gran;
+		}
+		while (lba < end) {
+			uint64_t num = end - lba;
+
+			if (num > dc->max_desc_blocks) {
+				num = dc->max_desc_blocks;
+			}
+			if (num > dc->max_blocks) {
+				num = dc->max_blocks;
+			}
+			if (iscsi_discard_add(iscsi, dc, &cmds, &ncmds,
+					      &max_cmds, &cmd_blocks, lba,
+					      num) == NULL) {
+				goto oom;
+			}
+			lba += num;
+		}
+	}
+
+	for (i = 0; i < nranges; i++) {
+		c = iscsi_discard_find(cmds, ncmds, ranges[i]->lba);
+		for (; c < ncmds && cmds[c]->lba < ranges[i]->end; c++) {
+			if (iscsi_discard_attach(iscsi, cmds[c],
+						 ranges[i]) != 0) {
+				goto oom;
+			}
+		}
+	}
+
+	/* the ranges now belong to the commands, new ones start afresh */
+	dc->ranges     = NULL;
+	dc->nranges    = 0;
+	dc->max_ranges = 0;
+	dc->blocks     = 0;
+
+	/* those that had nothing left after trimming are done */
+	for (i = 0; i < nranges; i++) {
+		if (ranges[i]->pending == 0) {
+			ranges[i]->pending = 1;
+			iscsi_discard_range_done(iscsi, ranges[i],
+						 SCSI_STATUS_GOOD);
+		}
+	}
+	iscsi_free(iscsi, ranges);
+
+	/* callbacks may have disabled dc, so don't look at it again */
+	for (c = 0; c < ncmds; c++) {
+		if (iscsi_unmap_task(iscsi, lun, 0, 0, cmds[c]->list,
+				     cmds[c]->nlist, iscsi_discard_cb,
+				     cmds[c]) == NULL) {
+			iscsi_discard_cmd_done(iscsi, cmds[c],
+					       SCSI_STATUS_ERROR);
+		}
+	}
+	iscsi_free(iscsi, cmds);
+
+	return 0;
+
+ oom:
+	for (c = 0; c < ncmds; c++) {
+		iscsi_discard_cmd_free(iscsi, cmds[c]);
+	}
+	iscsi_free(iscsi, cmds);
+	for (i = 0; i < nranges; i++) {
+		ranges[i]->pending = 0;
+	}
+	iscsi_set_error(iscsi, "Out-of-memory: Failed to build UNMAP "
+			"batch.");
+	return -1;
+}
+
+int
+iscsi_discard_async(struct iscsi_context *iscsi, int lun, uint64_t lba,
+		    uint64_t num_blocks, iscsi_command_cb cb,
+		    void *private_data)
+{
+	struct iscsi_discard *dc = iscsi_get_discard(iscsi, lun);
+	struct iscsi_discard_range *range;
+
+	if (dc == NULL) {
+		iscsi_set_error(iscsi, "LUN %d has no discard batching", lun);
+		return -1;
+	}
+	if (cb == NULL) {
+		iscsi_set_error(iscsi, "Discard needs a callback");
+		return -1;
+	}
+	if (num_blocks == 0 || lba + num_blocks < lba) {
+		iscsi_set_error(iscsi, "Invalid discard range");
+		return -1;
+	}
+
+	if (dc->nranges == dc->max_ranges) {
+		struct iscsi_discard_range **n;
+		int max = dc->max_ranges ? dc->max_ranges * 2 : 64;
+
+		if (dc->ranges == NULL) {
+			n = iscsi_malloc(iscsi, max * sizeof(*n));
+		} else {
+			n = iscsi_realloc(iscsi, dc->ranges,
+					  max * sizeof(*n));
+		}
+		if (n == NULL) {
+			iscsi_set_error(iscsi, "Out-of-memory: Failed to "
+					"queue discard.");
+			return -1;
+		}
+		dc->ranges     = n;
+		dc->max_ranges = max;
+	}
+	range = iscsi_zmalloc(iscsi, sizeof(struct iscsi_discard_range));
+	if (range == NULL) {
+		iscsi_set_error(iscsi, "Out-of-memory: Failed to queue "
+				"discard.");
+		return -1;
+	}
+	range->lba          = lba;
+	range->end          = lba + num_blocks;
+	range->cb           = cb;
+	range->private_data = private_data;
+	range->status       = SCSI_STATUS_GOOD;
+
+	if (dc->nranges == 0) {
+		dc->oldest = time(NULL);
+	}
+	dc->ranges[dc->nranges++] = range;
+	dc->blocks += num_blocks;
+
+	if (dc->blocks >= dc->flush_blocks
+	||  dc->nranges >= ISCSI_DISCARD_MAX_RANGES) {
+		/* the range is queued either way, a failed flush is
+		 * retried on the next one */
+		iscsi_discard_flush(iscsi, dc);
+	}
+
+	return 0;
+}
+
+int
+iscsi_flush_discards(struct iscsi_context *iscsi, int lun)
+{
+	struct iscsi_discard *dc = iscsi_get_discard(iscsi, lun);
+
+	if (dc == NULL) {
+		iscsi_set_error(iscsi, "LUN %d has no discard batching", lun);
+		return -1;
+	}
+	return iscsi_discard_flush(iscsi, dc);
+}
+
+/* Called from iscsi_service() to send ranges that got too old */
+void
+iscsi_discard_scan(struct iscsi_context *iscsi)
+{
+	struct iscsi_discard *dc;
+	time_t now = time(NULL);
+
+	for (dc = iscsi->discards; dc != NULL; dc = dc->next) {
+		if (dc->max_age == 0 || dc->nranges == 0
+		||  now - dc->oldest < dc->max_age) {
+			continue;
+		}
+		iscsi_discard_flush(iscsi, dc);
+	}
+}
+
+int
+iscsi_enable_discard(struct iscsi_context *iscsi, int lun,
+		     uint64_t flush_blocks, int max_age)
+{
+	struct iscsi_block_limits *limits = &iscsi->limits;
+	struct iscsi_discard *dc;
+
+	if (flush_blocks == 0 || max_age < 0) {
+		iscsi_set_error(iscsi, "Invalid discard limits");
+		return -1;
+	}
+	if (iscsi_get_discard(iscsi, lun) != NULL) {
+		iscsi_set_error(iscsi, "LUN %d already has discard batching",
+				lun);
+		return -1;
+	}
+
+	dc = iscsi_zmalloc(iscsi, sizeof(struct iscsi_discard));
+	if (dc == NULL) {
+		iscsi_set_error(iscsi, "Out-of-memory: Failed to allocate "
+				"discard batching.");
+		return -1;
+	}
+	dc->lun          = lun;
+	dc->flush_blocks = flush_blocks;
+	dc->max_age      = max_age;
+
+	/* 0 and 0xffffffff both mean there is no limit */
+	dc->max_bdc = limits->max_unmap_bdc;
+	if (dc->max_bdc == 0) {
+		dc->max_bdc = ISCSI_DISCARD_DEFAULT_BDC;
+	}
+	if (dc->max_bdc > ISCSI_DISCARD_MAX_BDC) {
+		dc->max_bdc = ISCSI_DISCARD_MAX_BDC;
+	}
+	dc->max_blocks = limits->max_unmap;
+	if (dc->max_blocks == 0 || dc->max_blocks == 0xffffffff) {
+		dc->max_blocks = ~0ULL;
+	}
+	dc->max_desc_blocks = 0xffffffff;
+	if (limits->opt_unmap_gran > 1) {
+		dc->gran  = limits->opt_unmap_gran;
+		dc->align = limits->unmap_gran_align % dc->gran;
+		/* keep the pieces of a long range on granule boundaries */
+		dc->max_desc_blocks -= dc->max_desc_blocks % dc->gran;
+		if (dc->max_blocks >= dc->gran) {
+			dc->max_blocks -= dc->max_blocks % dc->gran;
+		}
+	}
+
+	ISCSI_LIST_ADD(&iscsi->discards, dc);
+
+	return 0;
+}
+
+static void
+iscsi_discard_free(struct iscsi_context *iscsi, struct iscsi_discard *dc,
+		   int status)
+{
+	int i;
+
+	ISCSI_LIST_REMOVE(&iscsi->discards, dc);
+	for (i = 0; i < dc->nranges; i++) {
+		dc->ranges[i]->pending = 1;
+		iscsi_discard_range_done(iscsi, dc->ranges[i], status);
+	}
+	iscsi_free(iscsi, dc->ranges);
+	iscsi_free(iscsi, dc);
+}
+
+int
+iscsi_disable_discard(struct iscsi_context *iscsi, int lun)
+{
+	struct iscsi_discard *dc = iscsi_get_discard(iscsi, lun);
+
+	if (dc == NULL) {
+		return 0;
+	}
+	/* what is already sent completes on its own */
+	if (iscsi_discard_flush(iscsi, dc) != 0) {
+		return -1;
+	}
+	iscsi_discard_free(iscsi, dc, SCSI_STATUS_GOOD);
+
+	return 0;
+}
+
+void
+iscsi_free_discards(struct iscsi_context *iscsi)
+{
+	while (iscsi->discards != NULL) {
+		iscsi_discard_free(iscsi, iscsi->discards,
+				   SCSI_STATUS_CANCELLED);
+	}
+}
@@ -287,22 +287,13 @@ iscsi_set_targetname(struct iscsi_context *iscsi, const char *target_name)
 	return 0;
 }
 
-int
-iscsi_destroy_context(struct iscsi_context *iscsi)
+static void
+iscsi_destroy_cancel_pdus(struct iscsi_context *iscsi)
 {
 	struct iscsi_pdu *pdu;
-	int i;
-
-	if (iscsi == NULL) {
-		return 0;
-	}
-
-	if (iscsi->fd != -1) {
-		iscsi_disconnect(iscsi);
-	}
 
 	while ((pdu = iscsi->outqueue)) {
-		ISCSI_LIST_REMOVE(&iscsi->outqueue, pdu);
+		iscsi_outqueue_remove(iscsi, pdu);
 		if ( !(pdu->flags & ISCSI_PDU_NO_CALLBACK)) {
 			/* If an error happened during connect/login, we don't want to
 			   call any of the callbacks.
@@ -325,6 +316,41 @@ iscsi_destroy_context(struct iscsi_context *iscsi)
 		}
 		iscsi_free_pdu(iscsi, pdu);
 	}
+	iscsi_cancel_held_commands(iscsi);
+}
+
+int
+iscsi_destroy_context(struct iscsi_context *iscsi)
+{
+	int i;
+
+	if (iscsi == NULL) {
+		return 0;
+	}
+
+	if (iscsi->io_thread != NULL) {
+		iscsi_stop_io_thread(iscsi);
+	}
+
+	if (iscsi->fd != -1) {
+		iscsi_disconnect(iscsi);
+	}
+
+	iscsi_destroy_cancel_pdus(iscsi);
+	if (iscsi->old_iscsi) {
+		/* Commands still on the context we are reconnecting complete
+		 * into the completion queue, the write-backs and the rest of
+		 * what we took over from it, so cancel them before any of
+		 * that goes away.
+		 */
+		iscsi->old_iscsi->cq = iscsi->cq;
+		iscsi_destroy_cancel_pdus(iscsi->old_iscsi);
+	}
+	iscsi_free_read_caches(iscsi);
+	iscsi_free_write_backs(iscsi);
+	iscsi_free_lba_maps(iscsi);
+	iscsi_free_discards(iscsi);
+	iscsi_free_zero_detects(iscsi);
 
 	if (iscsi->outqueue_current != NULL && iscsi->outqueue_current->flags & ISCSI_PDU_DELETE_WHEN_SENT) {
 		iscsi_free_pdu(iscsi, iscsi->outqueue_current);
@@ -339,11 +365,21 @@ iscsi_destroy_context(struct iscsi_context *iscsi)
 
 	iscsi->connect_data = NULL;
 
+	iscsi_free_completion_queue(iscsi);
+
 	for (i=0;i<iscsi->smalloc_free;i++) {
 		iscsi_free(iscsi, iscsi->smalloc_ptrs[i]);
 	}
 
-	if (iscsi->mallocs != iscsi->frees) {
+	if (iscsi->old_iscsi) {
+		/* Part of what we free was allocated on the context we are
+		 * reconnecting, so check both together when it goes.
+		 */
+		iscsi->old_iscsi->mallocs += iscsi->mallocs;
+		iscsi->old_iscsi->reallocs += iscsi->reallocs;
+		iscsi->old_iscsi->frees += iscsi->frees;
+		iscsi->old_iscsi->smallocs += iscsi->smallocs;
+	} else if (iscsi->mallocs != iscsi->frees) {
 		ISCSI_LOG(iscsi,1,"%d memory blocks lost at iscsi_destroy_context() after %d malloc(s), %d realloc(s), %d free(s) and %d reused small allocations",iscsi->mallocs-iscsi->frees,iscsi->mallocs,iscsi->reallocs,iscsi->frees,iscsi->smallocs);
 	} else {
 		ISCSI_LOG(iscsi,5,"memory is clean at iscsi_destroy_context() after %d mallocs, %d realloc(s), %d free(s) and %d reused small allocations",iscsi->mallocs,iscsi->reallocs,iscsi->frees,iscsi->smallocs);
@@ -351,8 +387,20 @@ iscsi_destroy_context(struct iscsi_context *iscsi)
 
 	if (iscsi->old_iscsi) {
 		iscsi->old_iscsi->fd = -1;
+		/* these belong to the context we are reconnecting */
+		iscsi->old_iscsi->log_ring = NULL;
+		iscsi->old_iscsi->capture = NULL;
+		iscsi->old_iscsi->cq = NULL;
+		iscsi->old_iscsi->io_thread = NULL;
+		iscsi->old_iscsi->read_caches = NULL;
+		iscsi->old_iscsi->write_backs = NULL;
+		iscsi->old_iscsi->lba_maps = NULL;
+		iscsi->old_iscsi->discards = NULL;
+		iscsi->old_iscsi->zero_detects = NULL;
 		iscsi_destroy_context(iscsi->old_iscsi);
 	}
+	iscsi_stop_capture(iscsi);
+	free(iscsi->log_ring);
 
 	memset(iscsi, 0, sizeof(struct iscsi_context));
 	free(iscsi);
@@ -706,6 +754,48 @@ iscsi_set_initial_r2t(struct iscsi_context *iscsi, enum iscsi_initial_r2t initia
 	return 0;
 }
 
+int
+iscsi_set_post_login_tur(struct iscsi_context *iscsi, enum iscsi_post_login_tur mode)
+{
+	switch (mode) {
+	case ISCSI_POST_LOGIN_TUR_WAIT:
+	case ISCSI_POST_LOGIN_TUR_PIPELINE:
+	case ISCSI_POST_LOGIN_TUR_SKIP:
+		break;
+	default:
+		iscsi_set_error(iscsi, "invalid post login tur mode %d", mode);
+		return -1;
+	}
+
+	iscsi->post_login_tur = mode;
+	return 0;
+}
+
+int
+iscsi_set_dataout_quantum(struct iscsi_context *iscsi, uint32_t quantum)
+{
+	struct iscsi_pdu *pdu;
+
+	if (quantum == iscsi->dataout_quantum) {
+		return 0;
+	}
+	iscsi_drr_clear(iscsi);
+	iscsi->dataout_quantum = quantum;
+	if (quantum == 0) {
+		return 0;
+	}
+
+	/* index what is already queued */
+	for (pdu = iscsi->outqueue; pdu != NULL; pdu = pdu->next) {
+		if (iscsi_drr_queued(iscsi, pdu) != 0) {
+			iscsi_drr_clear(iscsi);
+			iscsi->dataout_quantum = 0;
+			return -1;
+		}
+	}
+	return 0;
+}
+
 int
 iscsi_set_timeout(struct iscsi_context *iscsi, int timeout)
 {
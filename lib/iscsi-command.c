@@ -35,6 +35,7 @@
 #include <string.h>
 #include "iscsi.h"
 #include "iscsi-private.h"
+#include "iscsi-trace.h"
 #include "scsi-lowlevel.h"
 #include "slist.h"
 
@@ -57,7 +58,28 @@ iscsi_scsi_response_cb(struct iscsi_context *iscsi, int status,
 	case SCSI_STATUS_ERROR:
 	case SCSI_STATUS_CANCELLED:
 	case SCSI_STATUS_TIMEOUT:
+		if (status == SCSI_STATUS_BUSY) {
+			iscsi->stats.busy++;
+		} else if (status == SCSI_STATUS_TASK_SET_FULL) {
+			iscsi->stats.task_set_full++;
+		}
+		if (status != SCSI_STATUS_CANCELLED) {
+			iscsi_stats_latency(iscsi, scsi_cbdata->task,
+					    scsi_cbdata->task->times.submitted);
+		}
+		if (iscsi->read_caches != NULL) {
+			iscsi_read_cache_task(iscsi, scsi_cbdata->task->lun,
+					      scsi_cbdata->task);
+		}
+		if (iscsi->lba_maps != NULL) {
+			iscsi_lba_map_task(iscsi, scsi_cbdata->task->lun,
+					   scsi_cbdata->task);
+		}
 		scsi_cbdata->task->status = status;
+		ISCSI_TRACE(command__callback, scsi_cbdata->task->itt,
+			    scsi_cbdata->task->cmdsn, scsi_cbdata->task->lun,
+			    scsi_cbdata->task->cdb[0],
+			    scsi_cbdata->task->datain.size);
 		scsi_cbdata->callback(iscsi, status, scsi_cbdata->task,
 				      scsi_cbdata->private_data);
 		return;
@@ -89,7 +111,7 @@ iscsi_send_data_out(struct iscsi_context *iscsi, struct iscsi_pdu *cmd_pdu,
 		if (pdu == NULL) {
 			iscsi_set_error(iscsi, "Out-of-memory, Failed to allocate "
 				"scsi data out pdu.");
-			ISCSI_LIST_REMOVE(&iscsi->outqueue, cmd_pdu);
+			iscsi_outqueue_remove(iscsi, cmd_pdu);
 			ISCSI_LIST_REMOVE(&iscsi->waitpdu, cmd_pdu);
 			cmd_pdu->callback(iscsi, SCSI_STATUS_ERROR, NULL,
 				     cmd_pdu->private_data);
@@ -98,6 +120,7 @@ iscsi_send_data_out(struct iscsi_context *iscsi, struct iscsi_pdu *cmd_pdu,
 
 		}
 		pdu->scsi_cbdata.task         = cmd_pdu->scsi_cbdata.task;
+		pdu->flags |= cmd_pdu->flags & ISCSI_PDU_URGENT;
 		/* set the cmdsn in the pdu struct so we can compare with
 		 * maxcmdsn when sending to socket even if data-out pdus
 		 * do not carry a cmdsn on the wire */
@@ -136,7 +159,7 @@ iscsi_send_data_out(struct iscsi_context *iscsi, struct iscsi_pdu *cmd_pdu,
 		if (iscsi_queue_pdu(iscsi, pdu) != 0) {
 			iscsi_set_error(iscsi, "Out-of-memory: failed to queue iscsi "
 				"scsi pdu.");
-			ISCSI_LIST_REMOVE(&iscsi->outqueue, cmd_pdu);
+			iscsi_outqueue_remove(iscsi, cmd_pdu);
 			ISCSI_LIST_REMOVE(&iscsi->waitpdu, cmd_pdu);
 			cmd_pdu->callback(iscsi, SCSI_STATUS_ERROR, NULL,
 				     cmd_pdu->private_data);
@@ -160,17 +183,12 @@ iscsi_send_unsolicited_data_out(struct iscsi_context *iscsi, struct iscsi_pdu *p
 				   pdu->payload_len, len);
 }
 
-/* Using 'struct iscsi_data *d' for data-out is optional
- * and will be converted into a one element data-out iovector.
+/* Returns the context commands should be queued on, or NULL if we can
+ * not send commands right now.
  */
-int
-iscsi_scsi_command_async(struct iscsi_context *iscsi, int lun,
-			 struct scsi_task *task, iscsi_command_cb cb,
-			 struct iscsi_data *d, void *private_data)
+static struct iscsi_context *
+iscsi_scsi_command_context(struct iscsi_context *iscsi)
 {
-	struct iscsi_pdu *pdu;
-	int flags;
-
 	if (iscsi->old_iscsi) {
 		iscsi = iscsi->old_iscsi;
 		ISCSI_LOG(iscsi, 2, "iscsi_scsi_command_async: queuing cmd to old_iscsi while reconnecting");
@@ -179,13 +197,33 @@ iscsi_scsi_command_async(struct iscsi_context *iscsi, int lun,
 	if (iscsi->session_type != ISCSI_SESSION_NORMAL) {
 		iscsi_set_error(iscsi, "Trying to send command on "
 				"discovery session.");
-		return -1;
+		return NULL;
 	}
 
 	if (iscsi->is_loggedin == 0 && !iscsi->pending_reconnect) {
 		iscsi_set_error(iscsi, "Trying to send command while "
 				"not logged in.");
-		return -1;
+		return NULL;
+	}
+
+	return iscsi;
+}
+
+/* Build the SCSI command PDU for a task. Everything but the CmdSN is
+ * filled in, and the PDU is not queued yet.
+ */
+static struct iscsi_pdu *
+iscsi_scsi_command_pdu(struct iscsi_context *iscsi, int lun,
+		       struct scsi_task *task, iscsi_command_cb cb,
+		       struct iscsi_data *d, void *private_data)
+{
+	struct iscsi_pdu *pdu;
+	int flags;
+
+	if (cb == NULL && iscsi->cq == NULL) {
+		iscsi_set_error(iscsi, "No callback for task and no "
+				"completion queue.");
+		return NULL;
 	}
 
 	/* We got an actual buffer from the application. Convert it to
@@ -196,7 +234,7 @@ iscsi_scsi_command_async(struct iscsi_context *iscsi, int lun,
 
 		iov = scsi_malloc(task, sizeof(struct scsi_iovec));
 		if (iov == NULL) {
-			return -1;
+			return NULL;
 		}
 		iov->iov_base = d->data;
 		iov->iov_len  = d->size;
@@ -211,7 +249,12 @@ iscsi_scsi_command_async(struct iscsi_context *iscsi, int lun,
 	if (pdu == NULL) {
 		iscsi_set_error(iscsi, "Out-of-memory, Failed to allocate "
 				"scsi pdu.");
-		return -1;
+		return NULL;
+	}
+
+	/* without a callback the task completes into the completion queue */
+	if (cb == NULL) {
+		cb = iscsi_completion_queue_cb;
 	}
 
 	pdu->scsi_cbdata.task         = task;
@@ -224,13 +267,36 @@ iscsi_scsi_command_async(struct iscsi_context *iscsi, int lun,
 	scsi_set_task_private_ptr(task, &pdu->scsi_cbdata);
 	
 	/* flags */
-	flags = ISCSI_PDU_SCSI_FINAL|ISCSI_PDU_SCSI_ATTR_SIMPLE;
+	flags = ISCSI_PDU_SCSI_FINAL;
+	switch (task->task_attr) {
+	case SCSI_TASK_ATTR_ORDERED:
+		flags |= ISCSI_PDU_SCSI_ATTR_ORDERED;
+		break;
+	case SCSI_TASK_ATTR_HEAD_OF_QUEUE:
+		flags |= ISCSI_PDU_SCSI_ATTR_HEADOFQUEUE;
+		pdu->flags |= ISCSI_PDU_URGENT;
+		break;
+	default:
+		flags |= ISCSI_PDU_SCSI_ATTR_SIMPLE;
+		break;
+	}
+	/* command priority, RFC 7143 CmdPri */
+	if (task->task_priority != SCSI_TASK_PRIORITY_NONE) {
+		pdu->outdata.data[2] = task->task_priority & 0x0f;
+		if (task->task_priority <= ISCSI_URGENT_TASK_PRIORITY) {
+			pdu->flags |= ISCSI_PDU_URGENT;
+		}
+	}
 	switch (task->xfer_dir) {
 	case SCSI_XFER_NONE:
 		break;
 	case SCSI_XFER_READ:
 		flags |= ISCSI_PDU_SCSI_READ;
 		break;
+	case SCSI_XFER_BIDIRECTIONAL:
+		/* the data-out side is the same as for writes */
+		flags |= ISCSI_PDU_SCSI_READ;
+		/* fall through */
 	case SCSI_XFER_WRITE:
 		flags |= ISCSI_PDU_SCSI_WRITE;
 
@@ -271,28 +337,54 @@ iscsi_scsi_command_async(struct iscsi_context *iscsi, int lun,
 	/* expxferlen */
 	iscsi_pdu_set_expxferlen(pdu, task->expxferlen);
 
-	/* cmdsn */
-	iscsi_pdu_set_cmdsn(pdu, iscsi->cmdsn++);
+	/* cdb, this has to come after the data segment length is set since
+	 * long cdbs go in an AHS.
+	 */
+	if (iscsi_pdu_set_cdb(iscsi, pdu, task) != 0) {
+		iscsi_free_pdu(iscsi, pdu);
+		return NULL;
+	}
+
+	/* bidirectional commands tell the target how much data-in we expect */
+	if (task->xfer_dir == SCSI_XFER_BIDIRECTIONAL) {
+		unsigned char buf[4];
 
-	/* cdb */
-	iscsi_pdu_set_cdb(pdu, task);
+		scsi_set_uint32(buf, task->bidi_read_xferlen);
+		if (iscsi_pdu_add_ahs(iscsi, pdu, ISCSI_AHS_BIDI_READ_LENGTH,
+				      buf, 4) != 0) {
+			iscsi_free_pdu(iscsi, pdu);
+			return NULL;
+		}
+	}
 
 	pdu->callback     = iscsi_scsi_response_cb;
 	pdu->private_data = &pdu->scsi_cbdata;
 
-	if (iscsi_queue_pdu(iscsi, pdu) != 0) {
-		iscsi_set_error(iscsi, "Out-of-memory: failed to queue iscsi "
-				"scsi pdu.");
-		iscsi_free_pdu(iscsi, pdu);
-		return -1;
+	/* writes drop whatever they cover from the read cache and update
+	 * the provisioning map */
+	if (iscsi->read_caches != NULL) {
+		iscsi_read_cache_task(iscsi, lun, task);
+	}
+	if (iscsi->lba_maps != NULL) {
+		iscsi_lba_map_task(iscsi, lun, task);
 	}
 
+	return pdu;
+}
+
+/* Things to do once the command PDU is on the outqueue */
+static void
+iscsi_scsi_command_queued(struct iscsi_context *iscsi, int lun,
+			  struct iscsi_pdu *pdu)
+{
+	struct scsi_task *task = pdu->scsi_cbdata.task;
+
 	/* The F flag is not set. This means we haven't sent all the unsolicited
 	 * data yet. Sent as much as we are allowed as a train of DATA-OUT PDUs.
 	 * We might already have sent some data as immediate data, which we must
 	 * subtract from first_burst_length.
 	 */
-	if (!(flags & ISCSI_PDU_SCSI_FINAL)) {
+	if (!(pdu->outdata.data[1] & ISCSI_PDU_SCSI_FINAL)) {
 		iscsi_send_unsolicited_data_out(iscsi, pdu);
 	}
 
@@ -300,6 +392,146 @@ iscsi_scsi_command_async(struct iscsi_context *iscsi, int lun,
 	task->cmdsn = pdu->cmdsn;
 	task->itt   = pdu->itt;
 	task->lun   = lun;
+}
+
+/* Build, number and queue the command PDU for a task on a context that
+ * is able to take it.
+ */
+int
+iscsi_scsi_command_send(struct iscsi_context *iscsi, int lun,
+			struct scsi_task *task, iscsi_command_cb cb,
+			struct iscsi_data *d, void *private_data)
+{
+	struct iscsi_pdu *pdu;
+
+	pdu = iscsi_scsi_command_pdu(iscsi, lun, task, cb, d, private_data);
+	if (pdu == NULL) {
+		return -1;
+	}
+
+	/* cmdsn */
+	iscsi_pdu_set_cmdsn(pdu, iscsi->cmdsn++);
+	ISCSI_TRACE_TASK(command__submit, pdu, task, task->expxferlen);
+
+	if (iscsi_queue_pdu(iscsi, pdu) != 0) {
+		iscsi_set_error(iscsi, "Out-of-memory: failed to queue iscsi "
+				"scsi pdu.");
+		iscsi_free_pdu(iscsi, pdu);
+		return -1;
+	}
+
+	iscsi_scsi_command_queued(iscsi, lun, pdu);
+
+	return 0;
+}
+
+void
+iscsi_task_times_start(struct scsi_task *task)
+{
+	memset(&task->times, 0, sizeof(task->times));
+	task->times.submitted = iscsi_clock_ns();
+}
+
+/* Using 'struct iscsi_data *d' for data-out is optional
+ * and will be converted into a one element data-out iovector.
+ */
+int
+iscsi_scsi_command_async(struct iscsi_context *iscsi, int lun,
+			 struct scsi_task *task, iscsi_command_cb cb,
+			 struct iscsi_data *d, void *private_data)
+{
+	int ret;
+
+	iscsi = iscsi_scsi_command_context(iscsi);
+	if (iscsi == NULL) {
+		return -1;
+	}
+	iscsi_task_times_start(task);
+
+	/* With merging enabled, commands that would have to wait for the
+	 * CmdSN window are held back unnumbered so they can be merged.
+	 */
+	ret = iscsi_hold_command(iscsi, lun, task, cb, d, private_data);
+	if (ret != 0) {
+		return ret < 0 ? -1 : 0;
+	}
+
+	return iscsi_scsi_command_send(iscsi, lun, task, cb, d, private_data);
+}
+
+int
+iscsi_submit_batch(struct iscsi_context *iscsi, int lun,
+		   struct scsi_task **tasks, int n, iscsi_command_cb cb,
+		   void **private_data)
+{
+	struct iscsi_pdu **pdus;
+	int i;
+
+	if (n <= 0) {
+		iscsi_set_error(iscsi, "Invalid batch size %d", n);
+		return -1;
+	}
+
+	iscsi = iscsi_scsi_command_context(iscsi);
+	if (iscsi == NULL) {
+		return -1;
+	}
+	for (i = 0; i < n; i++) {
+		iscsi_task_times_start(tasks[i]);
+	}
+
+	/* Keep the batch behind any commands that are being held back */
+	if (iscsi_must_hold_commands(iscsi)) {
+		return iscsi_hold_batch(iscsi, lun, tasks, n, cb,
+					private_data);
+	}
+
+	pdus = iscsi_malloc(iscsi, n * sizeof(struct iscsi_pdu *));
+	if (pdus == NULL) {
+		iscsi_set_error(iscsi, "Out-of-memory: failed to allocate "
+				"batch of %d pdus", n);
+		return -1;
+	}
+
+	for (i = 0; i < n; i++) {
+		pdus[i] = iscsi_scsi_command_pdu(iscsi, lun, tasks[i], cb, NULL,
+				private_data ? private_data[i] : NULL);
+		if (pdus[i] == NULL) {
+			while (i-- > 0) {
+				iscsi_free_pdu(iscsi, pdus[i]);
+			}
+			iscsi_free(iscsi, pdus);
+			return -1;
+		}
+	}
+
+	/* The batch takes a consecutive range of CmdSNs */
+	for (i = 0; i < n; i++) {
+		iscsi_pdu_set_cmdsn(pdus[i], iscsi->cmdsn++);
+		ISCSI_TRACE_TASK(command__submit, pdus[i], tasks[i],
+				 tasks[i]->expxferlen);
+	}
+
+	if (iscsi_queue_pdus(iscsi, pdus, n) != 0) {
+		iscsi->cmdsn -= n;
+		for (i = 0; i < n; i++) {
+			iscsi_free_pdu(iscsi, pdus[i]);
+		}
+		iscsi_free(iscsi, pdus);
+		return -1;
+	}
+
+	for (i = 0; i < n; i++) {
+		iscsi_scsi_command_queued(iscsi, lun, pdus[i]);
+	}
+	iscsi_free(iscsi, pdus);
+
+	/* Start pushing the batch out right away rather than waiting for
+	 * the application to get back to iscsi_service().
+	 */
+	if (iscsi->is_loggedin && iscsi->old_iscsi == NULL) {
+		iscsi_flush_outqueue(iscsi);
+	}
 
 	return 0;
 }
@@ -368,6 +600,10 @@ iscsi_process_scsi_reply(struct iscsi_context *iscsi, struct iscsi_pdu *pdu,
 	struct iscsi_scsi_cbdata *scsi_cbdata = &pdu->scsi_cbdata;
 	struct scsi_task *task = scsi_cbdata->task;
 
+	ISCSI_TRACE_TASK(response__received, pdu, task,
+			 scsi_get_uint32(&in->hdr[4]) & 0x00ffffff);
+	task->times.status = iscsi_clock_ns();
+
 	flags = in->hdr[1];
 	if ((flags&ISCSI_PDU_DATA_FINAL) == 0) {
 		iscsi_set_error(iscsi, "scsi response pdu but Final bit is "
@@ -490,6 +726,13 @@ iscsi_process_scsi_data_in(struct iscsi_context *iscsi, struct iscsi_pdu *pdu,
 	struct scsi_task *task = scsi_cbdata->task;
 	int dsl;
 
+	iscsi->stats.data_in++;
+	dsl = scsi_get_uint32(&in->hdr[4]) & 0x00ffffff;
+	ISCSI_TRACE_TASK(datain__received, pdu, task, dsl);
+	if (task->times.first_response == 0) {
+		task->times.first_response = iscsi_clock_ns();
+	}
+
 	flags = in->hdr[1];
 	if ((flags&ISCSI_PDU_DATA_ACK_REQUESTED) != 0) {
 		iscsi_set_error(iscsi, "scsi response asked for ACK "
@@ -498,7 +741,6 @@ iscsi_process_scsi_data_in(struct iscsi_context *iscsi, struct iscsi_pdu *pdu,
 			      pdu->private_data);
 		return -1;
 	}
-	dsl = scsi_get_uint32(&in->hdr[4]) & 0x00ffffff;
 
 	/* Don't add to reassembly buffer if we already have a user buffer */
 	if (task->iovector_in.iov == NULL) {
@@ -539,6 +781,8 @@ iscsi_process_scsi_data_in(struct iscsi_context *iscsi, struct iscsi_pdu *pdu,
 	/* this was the final data-in packet in the sequence and it has
 	 * the s-bit set, so invoke the callback.
 	 */
+	ISCSI_TRACE_TASK(response__received, pdu, task, dsl);
+	task->times.status = iscsi_clock_ns();
 	status = in->hdr[3];
 	task->datain.data = pdu->indata.data;
 	task->datain.size = pdu->indata.size;
@@ -567,6 +811,12 @@ iscsi_process_r2t(struct iscsi_context *iscsi, struct iscsi_pdu *pdu,
 	offset = scsi_get_uint32(&in->hdr[40]);
 	len    = scsi_get_uint32(&in->hdr[44]);
 
+	iscsi->stats.r2ts++;
+	ISCSI_TRACE_TASK(r2t__received, pdu, pdu->scsi_cbdata.task, len);
+	if (pdu->scsi_cbdata.task->times.first_response == 0) {
+		pdu->scsi_cbdata.task->times.first_response = iscsi_clock_ns();
+	}
+
 	pdu->datasn = 0;
 	iscsi_send_data_out(iscsi, pdu, ttt, offset, len);
 	return 0;
@@ -1102,6 +1352,140 @@ iscsi_writeverify16_task(struct iscsi_context *iscsi, int lun, uint64_t lba,
 	return task;
 }
 
+struct scsi_task *
+iscsi_xdwriteread10_task(struct iscsi_context *iscsi, int lun, uint32_t lba,
+		   unsigned char *data, uint32_t datalen, int blocksize,
+		   int wrprotect, int dpo, int fua, int disable_write, int fua_nv,
+		   int group_number,
+		   iscsi_command_cb cb, void *private_data)
+{
+	struct scsi_task *task;
+	struct iscsi_data d;
+
+	if (datalen % blocksize != 0) {
+		iscsi_set_error(iscsi, "Datalen:%d is not a multiple of the "
+				"blocksize:%d.", datalen, blocksize);
+		return NULL;
+	}
+
+	task = scsi_cdb_xdwriteread10(lba, datalen, blocksize, wrprotect, dpo, fua, disable_write, fua_nv, group_number);
+	if (task == NULL) {
+		iscsi_set_error(iscsi, "Out-of-memory: Failed to create "
+				"xdwriteread10 cdb.");
+		return NULL;
+	}
+	d.data = data;
+	d.size = datalen;
+
+	if (iscsi_scsi_command_async(iscsi, lun, task, cb,
+				     &d, private_data) != 0) {
+		scsi_free_scsi_task(task);
+		return NULL;
+	}
+
+	return task;
+}
+
+struct scsi_task *
+iscsi_xdwriteread32_task(struct iscsi_context *iscsi, int lun, uint64_t lba,
+		   unsigned char *data, uint32_t datalen, int blocksize,
+		   int wrprotect, int dpo, int fua, int disable_write, int fua_nv,
+		   int group_number,
+		   iscsi_command_cb cb, void *private_data)
+{
+	struct scsi_task *task;
+	struct iscsi_data d;
+
+	if (datalen % blocksize != 0) {
+		iscsi_set_error(iscsi, "Datalen:%d is not a multiple of the "
+				"blocksize:%d.", datalen, blocksize);
+		return NULL;
+	}
+
+	task = scsi_cdb_xdwriteread32(lba, datalen, blocksize, wrprotect, dpo, fua, disable_write, fua_nv, group_number);
+	if (task == NULL) {
+		iscsi_set_error(iscsi, "Out-of-memory: Failed to create "
+				"xdwriteread32 cdb.");
+		return NULL;
+	}
+	d.data = data;
+	d.size = datalen;
+
+	if (iscsi_scsi_command_async(iscsi, lun, task, cb,
+				     &d, private_data) != 0) {
+		scsi_free_scsi_task(task);
+		return NULL;
+	}
+
+	return task;
+}
+
+struct scsi_task *
+iscsi_xpwrite10_task(struct iscsi_context *iscsi, int lun, uint32_t lba,
+		   unsigned char *data, uint32_t datalen, int blocksize,
+		   int dpo, int fua, int fua_nv, int xorpinfo, int group_number,
+		   iscsi_command_cb cb, void *private_data)
+{
+	struct scsi_task *task;
+	struct iscsi_data d;
+
+	if (datalen % blocksize != 0) {
+		iscsi_set_error(iscsi, "Datalen:%d is not a multiple of the "
+				"blocksize:%d.", datalen, blocksize);
+		return NULL;
+	}
+
+	task = scsi_cdb_xpwrite10(lba, datalen, blocksize, dpo, fua, fua_nv, xorpinfo, group_number);
+	if (task == NULL) {
+		iscsi_set_error(iscsi, "Out-of-memory: Failed to create "
+				"xpwrite10 cdb.");
+		return NULL;
+	}
+	d.data = data;
+	d.size = datalen;
+
+	if (iscsi_scsi_command_async(iscsi, lun, task, cb,
+				     &d, private_data) != 0) {
+		scsi_free_scsi_task(task);
+		return NULL;
+	}
+
+	return task;
+}
+
+struct scsi_task *
+iscsi_xpwrite32_task(struct iscsi_context *iscsi, int lun, uint64_t lba,
+		   unsigned char *data, uint32_t datalen, int blocksize,
+		   int dpo, int fua, int fua_nv, int xorpinfo, int group_number,
+		   iscsi_command_cb cb, void *private_data)
+{
+	struct scsi_task *task;
+	struct iscsi_data d;
+
+	if (datalen % blocksize != 0) {
+		iscsi_set_error(iscsi, "Datalen:%d is not a multiple of the "
+				"blocksize:%d.", datalen, blocksize);
+		return NULL;
+	}
+
+	task = scsi_cdb_xpwrite32(lba, datalen, blocksize, dpo, fua, fua_nv, xorpinfo, group_number);
+	if (task == NULL) {
+		iscsi_set_error(iscsi, "Out-of-memory: Failed to create "
+				"xpwrite32 cdb.");
+		return NULL;
+	}
+	d.data = data;
+	d.size = datalen;
+
+	if (iscsi_scsi_command_async(iscsi, lun, task, cb,
+				     &d, private_data) != 0) {
+		scsi_free_scsi_task(task);
+		return NULL;
+	}
+
+	return task;
+}
+
 struct scsi_task *
 iscsi_verify10_task(struct iscsi_context *iscsi, int lun, unsigned char *data,
 		    uint32_t datalen, uint32_t lba, int vprotect, int dpo, int bytchk, int blocksize,
@@ -1626,6 +2010,173 @@ iscsi_unmap_task(struct iscsi_context *iscsi, int lun, int anchor, int group,
 	return task;
 }
 
+struct scsi_task *
+iscsi_extended_copy_task(struct iscsi_context *iscsi, int lun,
+			 int list_id, int list_id_usage,
+			 struct scsi_copy_target_descriptor *targets,
+			 int num_targets,
+			 struct scsi_copy_segment_descriptor *segments,
+			 int num_segments,
+			 iscsi_command_cb cb, void *private_data)
+{
+	struct scsi_task *task;
+
+	task = scsi_cdb_extended_copy(list_id, list_id_usage, 0,
+				      targets, num_targets,
+				      segments, num_segments);
+	if (task == NULL) {
+		iscsi_set_error(iscsi, "Failed to create extended-copy cdb.");
+		return NULL;
+	}
+	if (iscsi_scsi_command_async(iscsi, lun, task, cb,
+				     NULL, private_data) != 0) {
+		scsi_free_scsi_task(task);
+		return NULL;
+	}
+
+	return task;
+}
+
+struct scsi_task *
+iscsi_receive_copy_results_task(struct iscsi_context *iscsi, int lun,
+				int sa, uint32_t list_id, uint32_t alloc_len,
+				iscsi_command_cb cb, void *private_data)
+{
+	struct scsi_task *task;
+
+	task = scsi_cdb_receive_copy_results(sa, list_id, alloc_len);
+	if (task == NULL) {
+		iscsi_set_error(iscsi, "Out-of-memory: Failed to create "
+				"receive-copy-results cdb.");
+		return NULL;
+	}
+	if (iscsi_scsi_command_async(iscsi, lun, task, cb,
+				     NULL, private_data) != 0) {
+		scsi_free_scsi_task(task);
+		return NULL;
+	}
+
+	return task;
+}
+
+/* block device range descriptors share their layout with UNMAP */
+static int
+iscsi_set_range_descriptors(struct iscsi_context *iscsi,
+			    struct scsi_task *task, unsigned char *data,
+			    int xferlen, int offset,
+			    struct unmap_list *list, int list_len)
+{
+	struct scsi_iovec *iov;
+	int i;
+
+	scsi_set_uint16(&data[0], xferlen - 2);
+	scsi_set_uint16(&data[offset - 2], list_len * 16);
+	for (i = 0; i < list_len; i++) {
+		scsi_set_uint64(&data[offset + 16 * i], list[i].lba);
+		scsi_set_uint32(&data[offset + 16 * i + 8], list[i].num);
+	}
+
+	iov = scsi_malloc(task, sizeof(struct scsi_iovec));
+	if (iov == NULL) {
+		iscsi_set_error(iscsi, "Out-of-memory: Failed to create "
+				"token parameters.");
+		return -1;
+	}
+	iov->iov_base = data;
+	iov->iov_len  = xferlen;
+	scsi_task_set_iov_out(task, iov, 1);
+
+	return 0;
+}
+
+struct scsi_task *
+iscsi_populate_token_task(struct iscsi_context *iscsi, int lun,
+			  uint32_t list_id, uint32_t inactivity_timeout,
+			  struct unmap_list *list, int list_len,
+			  iscsi_command_cb cb, void *private_data)
+{
+	struct scsi_task *task;
+	unsigned char *data;
+	int xferlen;
+
+	xferlen = 16 + list_len * 16;
+
+	task = scsi_cdb_populate_token(list_id, xferlen);
+	if (task == NULL) {
+		iscsi_set_error(iscsi, "Out-of-memory: Failed to create "
+				"populate-token cdb.");
+		return NULL;
+	}
+
+	data = scsi_malloc(task, xferlen);
+	if (data == NULL) {
+		iscsi_set_error(iscsi, "Out-of-memory: Failed to create "
+				"populate-token parameters.");
+		scsi_free_scsi_task(task);
+		return NULL;
+	}
+	memset(data, 0, xferlen);
+	scsi_set_uint32(&data[4], inactivity_timeout);
+	if (iscsi_set_range_descriptors(iscsi, task, data, xferlen, 16,
+					list, list_len) != 0) {
+		scsi_free_scsi_task(task);
+		return NULL;
+	}
+
+	if (iscsi_scsi_command_async(iscsi, lun, task, cb,
+				     NULL, private_data) != 0) {
+		scsi_free_scsi_task(task);
+		return NULL;
+	}
+
+	return task;
+}
+
+struct scsi_task *
+iscsi_write_using_token_task(struct iscsi_context *iscsi, int lun,
+			     uint32_t list_id, uint64_t offset,
+			     const unsigned char *token,
+			     struct unmap_list *list, int list_len,
+			     iscsi_command_cb cb, void *private_data)
+{
+	struct scsi_task *task;
+	unsigned char *data;
+	int xferlen;
+
+	xferlen = 536 + list_len * 16;
+
+	task = scsi_cdb_write_using_token(list_id, xferlen);
+	if (task == NULL) {
+		iscsi_set_error(iscsi, "Out-of-memory: Failed to create "
+				"write-using-token cdb.");
+		return NULL;
+	}
+
+	data = scsi_malloc(task, xferlen);
+	if (data == NULL) {
+		iscsi_set_error(iscsi, "Out-of-memory: Failed to create "
+				"write-using-token parameters.");
+		scsi_free_scsi_task(task);
+		return NULL;
+	}
+	memset(data, 0, xferlen);
+	scsi_set_uint64(&data[8], offset);
+	memcpy(&data[16], token, SCSI_ROD_TOKEN_LEN);
+	if (iscsi_set_range_descriptors(iscsi, task, data, xferlen, 536,
+					list, list_len) != 0) {
+		scsi_free_scsi_task(task);
+		return NULL;
+	}
+
+	if (iscsi_scsi_command_async(iscsi, lun, task, cb,
+				     NULL, private_data) != 0) {
+		scsi_free_scsi_task(task);
+		return NULL;
+	}
+
+	return task;
+}
+
 struct scsi_iovector *
 iscsi_get_scsi_task_iovector_in(struct iscsi_context *iscsi, struct iscsi_in_pdu *in)
 {
@@ -1856,6 +2407,9 @@ iscsi_scsi_cancel_task(struct iscsi_context *iscsi,
 {
 	struct iscsi_pdu *pdu;
 
+	if (iscsi_cancel_held_command(iscsi, task) == 0) {
+		return 0;
+	}
 	for (pdu = iscsi->waitpdu; pdu; pdu = pdu->next) {
 		if (pdu->itt == task->itt) {
 			ISCSI_LIST_REMOVE(&iscsi->waitpdu, pdu);
@@ -1869,7 +2423,7 @@ iscsi_scsi_cancel_task(struct iscsi_context *iscsi,
 	}
 	for (pdu = iscsi->outqueue; pdu; pdu = pdu->next) {
 		if (pdu->itt == task->itt) {
-			ISCSI_LIST_REMOVE(&iscsi->outqueue, pdu);
+			iscsi_outqueue_remove(iscsi, pdu);
 			if ( !(pdu->flags & ISCSI_PDU_NO_CALLBACK)) {
 				pdu->callback(iscsi, SCSI_STATUS_CANCELLED, NULL,
 				      pdu->private_data);
@@ -1886,6 +2440,7 @@ iscsi_scsi_cancel_all_tasks(struct iscsi_context *iscsi)
 {
 	struct iscsi_pdu *pdu;
 
+	iscsi_cancel_held_commands(iscsi);
 	while ((pdu = iscsi->waitpdu)) {
 		ISCSI_LIST_REMOVE(&iscsi->waitpdu, pdu);
 		if ( !(pdu->flags & ISCSI_PDU_NO_CALLBACK)) {
@@ -1895,7 +2450,7 @@ iscsi_scsi_cancel_all_tasks(struct iscsi_context *iscsi)
 		iscsi_free_pdu(iscsi, pdu);
 	}
 	while ((pdu = iscsi->outqueue)) {
-		ISCSI_LIST_REMOVE(&iscsi->outqueue, pdu);
+		iscsi_outqueue_remove(iscsi, pdu);
 		if ( !(pdu->flags & ISCSI_PDU_NO_CALLBACK)) {
 			pdu->callback(iscsi, SCSI_STATUS_CANCELLED, NULL,
 				      pdu->private_data);
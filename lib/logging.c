@@ -35,7 +35,10 @@
 #endif
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <stdarg.h>
+#include <stddef.h>
 #include "iscsi.h"
 #include "iscsi-private.h"
 #include "scsi-lowlevel.h"
@@ -52,13 +55,460 @@ iscsi_set_log_fn(struct iscsi_context *iscsi, iscsi_log_fn fn)
 	iscsi->log_fn = fn;
 }
 
+/*
+ * Binary logging.
+ *
+ * With a log ring set, ISCSI_LOG() does not format anything. It stores
+ * the time, the level, the format string pointer and the arguments in
+ * the next record of a per-context ring, overwriting the oldest. The
+ * format strings are all literals so the pointer stays good; %s
+ * arguments are copied into the record since they often point at
+ * buffers that change.
+ *
+ * The context is only ever driven by one thread, so there is a single
+ * writer. Readers run in any thread and do not block it: each record
+ * carries a sequence number that is odd while the record is being
+ * written, and a reader that sees it change while copying the record
+ * knows it was overwritten and counts it as dropped.
+ */
+
+#define ISCSI_LOG_RING_ARGS 8
+#define ISCSI_LOG_RING_STRINGS 128
+
+union iscsi_log_arg {
+	long long i;
+	double d;
+	const void *p;
+};
+
+struct iscsi_log_record {
+	/* 2n + 1 while record n is written, 2n + 2 once it is done */
+	uint64_t seq;
+	uint64_t ns;
+	const char *format;
+	int level;
+	int nargs;
+	union iscsi_log_arg args[ISCSI_LOG_RING_ARGS];
+	/* %s arguments, back to back, args[] has their offset */
+	char strings[ISCSI_LOG_RING_STRINGS];
+};
+
+struct iscsi_log_ring {
+	uint64_t mask;
+	/* number of records written so far */
+	uint64_t head;
+	/* records up to here have been shown by the dump hook */
+	uint64_t dumped;
+	int dump_level;
+	struct iscsi_log_record records[1];
+};
+
+/* One conversion in a format string */
+struct iscsi_log_spec {
+	const char *start;
+	size_t len;
+	int stars;
+	/* 'H' hh, 'h', 'l', 'q' ll, 'L', 'j', 'z', 't' or 0 */
+	char length;
+	char conv;
+};
+
+/* Find the next conversion from p on, NULL if there are no more */
+static const char *
+iscsi_log_next_spec(const char *p, struct iscsi_log_spec *spec)
+{
+	const char *q;
+
+	while (*p && *p != '%') {
+		p++;
+	}
+	if (*p == 0) {
+		return NULL;
+	}
+	spec->start  = p;
+	spec->stars  = 0;
+	spec->length = 0;
+
+	q = p + 1;
+	while (*q && strchr("-+ #0'", *q)) {
+		q++;
+	}
+	if (*q == '*') {
+		spec->stars++;
+		q++;
+	}
+	while (*q >= '0' && *q <= '9') {
+		q++;
+	}
+	if (*q == '.') {
+		q++;
+		if (*q == '*') {
+			spec->stars++;
+			q++;
+		}
+		while (*q >= '0' && *q <= '9') {
+			q++;
+		}
+	}
+	switch (*q) {
+	case 'h':
+		spec->length = q[1] == 'h' ? 'H' : 'h';
+		q += spec->length == 'H' ? 2 : 1;
+		break;
+	case 'l':
+		spec->length = q[1] == 'l' ? 'q' : 'l';
+		q += spec->length == 'q' ? 2 : 1;
+		break;
+	case 'L':
+	case 'j':
+	case 'z':
+	case 't':
+		spec->length = *q++;
+		break;
+	}
+	spec->conv = *q;
+	if (*q) {
+		q++;
+	}
+	spec->len = q - p;
+
+	return q;
+}
+
+static void
+iscsi_log_record(struct iscsi_log_ring *ring, int level, const char *format,
+		 va_list ap)
+{
+	struct iscsi_log_record *r;
+	struct iscsi_log_spec spec;
+	const char *p = format;
+	uint64_t n = ring->head;
+	size_t used = 0;
+	int i;
+
+	r = &ring->records[n & ring->mask];
+	__atomic_store_n(&r->seq, 2 * n + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+
+	r->ns     = iscsi_clock_ns();
+	r->format = format;
+	r->level  = level;
+	r->nargs  = 0;
+
+	while ((p = iscsi_log_next_spec(p, &spec)) != NULL) {
+		union iscsi_log_arg *a;
+
+		if (spec.conv == '%') {
+			continue;
+		}
+		if (r->nargs + spec.stars + 1 > ISCSI_LOG_RING_ARGS) {
+			break;
+		}
+		for (i = 0; i < spec.stars; i++) {
+			r->args[r->nargs++].i = va_arg(ap, int);
+		}
+		a = &r->args[r->nargs++];
+
+		switch (spec.conv) {
+		case 'd':
+		case 'i':
+			switch (spec.length) {
+			case 'l': a->i = va_arg(ap, long); break;
+			case 'q': a->i = va_arg(ap, long long); break;
+			case 'j': a->i = va_arg(ap, intmax_t); break;
+			case 'z': a->i = va_arg(ap, ssize_t); break;
+			case 't': a->i = va_arg(ap, ptrdiff_t); break;
+			default:  a->i = va_arg(ap, int); break;
+			}
+			break;
+		case 'o':
+		case 'u':
+		case 'x':
+		case 'X':
+			switch (spec.length) {
+			case 'l': a->i = va_arg(ap, unsigned long); break;
+			case 'q': a->i = va_arg(ap, unsigned long long); break;
+			case 'j': a->i = va_arg(ap, uintmax_t); break;
+			case 'z': a->i = va_arg(ap, size_t); break;
+			case 't': a->i = va_arg(ap, ptrdiff_t); break;
+			default:  a->i = va_arg(ap, unsigned int); break;
+			}
+			break;
+		case 'c':
+			a->i = va_arg(ap, int);
+			break;
+		case 'e': case 'E': case 'f': case 'F':
+		case 'g': case 'G': case 'a': case 'A':
+			if (spec.length == 'L') {
+				a->d = va_arg(ap, long double);
+			} else {
+				a->d = va_arg(ap, double);
+			}
+			break;
+		case 's': {
+			const char *str = va_arg(ap, const char *);
+			size_t len;
+
+			if (str == NULL) {
+				str = "(null)";
+			}
+			len = strlen(str);
+			if (len > ISCSI_LOG_RING_STRINGS - 1 - used) {
+				len = ISCSI_LOG_RING_STRINGS - 1 - used;
+			}
+			memcpy(&r->strings[used], str, len);
+			r->strings[used + len] = 0;
+			a->i  = used;
+			used += len + 1;
+			if (used >= ISCSI_LOG_RING_STRINGS) {
+				used = ISCSI_LOG_RING_STRINGS - 1;
+			}
+			break;
+		}
+		default:
+			/* %p, and %n which we never write through */
+			a->p = va_arg(ap, void *);
+			break;
+		}
+	}
+
+	__atomic_store_n(&r->seq, 2 * n + 2, __ATOMIC_RELEASE);
+	__atomic_store_n(&ring->head, n + 1, __ATOMIC_RELEASE);
+}
+
+#define ISCSI_LOG_SNPRINTF(v)						\
+	(spec.stars == 0 ? snprintf(out, room, fmt, v) :		\
+	 spec.stars == 1 ? snprintf(out, room, fmt, star[0], v) :	\
+	 snprintf(out, room, fmt, star[0], star[1], v))
+
+/* Format a record the way vsnprintf() would have */
+static void
+iscsi_log_format(const struct iscsi_log_record *r, char *buf, size_t size)
+{
+	struct iscsi_log_spec spec;
+	const char *p = r->format, *next;
+	char fmt[32], *out = buf;
+	size_t room = size;
+	int arg = 0, star[2] = { 0, 0 }, i, ret;
+
+	buf[0] = 0;
+	while (room > 1) {
+		next = iscsi_log_next_spec(p, &spec);
+		if (next == NULL) {
+			spec.start = p + strlen(p);
+		}
+		/* the text up to the conversion */
+		ret = spec.start - p;
+		if ((size_t)ret >= room) {
+			ret = room - 1;
+		}
+		memcpy(out, p, ret);
+		out  += ret;
+		room -= ret;
+		*out  = 0;
+		if (next == NULL || room <= 1) {
+			break;
+		}
+		p = next;
+
+		if (spec.conv == '%') {
+			*out++ = '%';
+			*out   = 0;
+			room--;
+			continue;
+		}
+		if (arg + spec.stars + 1 > r->nargs
+		||  spec.len >= sizeof(fmt)) {
+			/* more than the record could hold, show it as is */
+			ret = spec.len < room - 1 ? spec.len : room - 1;
+			memcpy(out, spec.start, ret);
+			out  += ret;
+			room -= ret;
+			*out  = 0;
+			continue;
+		}
+		for (i = 0; i < spec.stars; i++) {
+			star[i] = r->args[arg++].i;
+		}
+		memcpy(fmt, spec.start, spec.len);
+		fmt[spec.len] = 0;
+
+		switch (spec.conv) {
+		case 'd':
+		case 'i':
+			switch (spec.length) {
+			case 'l': ret = ISCSI_LOG_SNPRINTF((long)r->args[arg].i); break;
+			case 'q': ret = ISCSI_LOG_SNPRINTF((long long)r->args[arg].i); break;
+			case 'j': ret = ISCSI_LOG_SNPRINTF((intmax_t)r->args[arg].i); break;
+			case 'z': ret = ISCSI_LOG_SNPRINTF((ssize_t)r->args[arg].i); break;
+			case 't': ret = ISCSI_LOG_SNPRINTF((ptrdiff_t)r->args[arg].i); break;
+			default:  ret = ISCSI_LOG_SNPRINTF((int)r->args[arg].i); break;
+			}
+			break;
+		case 'o':
+		case 'u':
+		case 'x':
+		case 'X':
+			switch (spec.length) {
+			case 'l': ret = ISCSI_LOG_SNPRINTF((unsigned long)r->args[arg].i); break;
+			case 'q': ret = ISCSI_LOG_SNPRINTF((unsigned long long)r->args[arg].i); break;
+			case 'j': ret = ISCSI_LOG_SNPRINTF((uintmax_t)r->args[arg].i); break;
+			case 'z': ret = ISCSI_LOG_SNPRINTF((size_t)r->args[arg].i); break;
+			case 't': ret = ISCSI_LOG_SNPRINTF((ptrdiff_t)r->args[arg].i); break;
+			default:  ret = ISCSI_LOG_SNPRINTF((unsigned int)r->args[arg].i); break;
+			}
+			break;
+		case 'c':
+			ret = ISCSI_LOG_SNPRINTF((int)r->args[arg].i);
+			break;
+		case 'e': case 'E': case 'f': case 'F':
+		case 'g': case 'G': case 'a': case 'A':
+			if (spec.length == 'L') {
+				ret = ISCSI_LOG_SNPRINTF((long double)r->args[arg].d);
+			} else {
+				ret = ISCSI_LOG_SNPRINTF(r->args[arg].d);
+			}
+			break;
+		case 's':
+			ret = ISCSI_LOG_SNPRINTF(&r->strings[r->args[arg].i]);
+			break;
+		case 'p':
+			ret = ISCSI_LOG_SNPRINTF(r->args[arg].p);
+			break;
+		default:
+			ret = 0;
+			break;
+		}
+		arg++;
+
+		if (ret < 0) {
+			ret = 0;
+		}
+		if ((size_t)ret >= room) {
+			ret = room - 1;
+		}
+		out  += ret;
+		room -= ret;
+	}
+}
+
+int
+iscsi_set_log_ring(struct iscsi_context *iscsi, int records, int dump_level)
+{
+	struct iscsi_log_ring *ring = NULL;
+	uint64_t n = 1;
+
+	if (records < 0) {
+		iscsi_set_error(iscsi, "Invalid log ring size %d", records);
+		return -1;
+	}
+	if (records > 0) {
+		while (n < (uint64_t)records) {
+			n <<= 1;
+		}
+		ring = calloc(1, sizeof(struct iscsi_log_ring)
+			      + (n - 1) * sizeof(struct iscsi_log_record));
+		if (ring == NULL) {
+			iscsi_set_error(iscsi, "Out-of-memory: Failed to "
+					"allocate log ring.");
+			return -1;
+		}
+		ring->mask       = n - 1;
+		ring->dump_level = dump_level;
+	}
+
+	free(iscsi->log_ring);
+	iscsi->log_ring = ring;
+
+	return 0;
+}
+
+int
+iscsi_log_ring_read(struct iscsi_context *iscsi, uint64_t *cursor,
+		    struct iscsi_log_entry *entry)
+{
+	struct iscsi_log_ring *ring = iscsi->log_ring;
+	struct iscsi_log_record r;
+	uint64_t head, n, seq;
+
+	if (ring == NULL) {
+		return 0;
+	}
+
+	entry->dropped = 0;
+	for (;;) {
+		head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+		n = *cursor;
+		if (n >= head) {
+			return 0;
+		}
+		if (head - n > ring->mask + 1) {
+			entry->dropped += head - (ring->mask + 1) - n;
+			n = head - (ring->mask + 1);
+		}
+		*cursor = n + 1;
+
+		seq = __atomic_load_n(&ring->records[n & ring->mask].seq,
+				      __ATOMIC_ACQUIRE);
+		memcpy(&r, &ring->records[n & ring->mask], sizeof(r));
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (seq != 2 * n + 2
+		||  __atomic_load_n(&ring->records[n & ring->mask].seq,
+				    __ATOMIC_RELAXED) != seq) {
+			/* overwritten under us */
+			entry->dropped++;
+			continue;
+		}
+		break;
+	}
+
+	entry->ns    = r.ns;
+	entry->level = r.level;
+	iscsi_log_format(&r, entry->message, sizeof(entry->message));
+	if (iscsi->target_name[0]) {
+		size_t len = strlen(entry->message);
+
+		snprintf(entry->message + len, sizeof(entry->message) - len,
+			 " [%s]", iscsi->target_name);
+	}
+
+	return 1;
+}
+
+void
+iscsi_dump_log_ring(struct iscsi_context *iscsi)
+{
+	struct iscsi_log_ring *ring = iscsi->log_ring;
+	struct iscsi_log_entry entry;
+	uint64_t cursor;
+
+	if (ring == NULL || iscsi->log_fn == NULL) {
+		return;
+	}
+	cursor = ring->dumped;
+	while (iscsi_log_ring_read(iscsi, &cursor, &entry)) {
+		iscsi->log_fn(entry.level, entry.message);
+	}
+	ring->dumped = cursor;
+}
+
 void
 iscsi_log_message(struct iscsi_context *iscsi, int level, const char *format, ...)
 {
         va_list ap;
-	static char message[1024];
+	char message[1024];
 	int ret;
 
+	if (iscsi->log_ring != NULL) {
+		va_start(ap, format);
+		iscsi_log_record(iscsi->log_ring, level, format, ap);
+		va_end(ap);
+		if (level <= iscsi->log_ring->dump_level) {
+			iscsi_dump_log_ring(iscsi);
+		}
+		return;
+	}
+
 	if (iscsi->log_fn == NULL) {
 		return;
 	}
@@ -72,7 +522,7 @@ iscsi_log_message(struct iscsi_context *iscsi, int level, const char *format, ..
 	}
 
 	if (iscsi->target_name[0]) {
-		static char message2[1024];
+		char message2[1024];
 
 		snprintf(message2, 1024, "%s [%s]", message, iscsi->target_name);
 		iscsi->log_fn(level, message2);
@@ -80,5 +530,3 @@ iscsi_log_message(struct iscsi_context *iscsi, int level, const char *format, ..
 	else
 		iscsi->log_fn(level, message);
 }
-
-
@@ -157,354 +157,80 @@ iscsi_login_add_sessiontype(struct iscsi_context *iscsi, struct iscsi_pdu *pdu)
 	return 0;
 }
 
+/* Operational keys that we always offer with the same value. These are
+ * serialized once, at compile time, and appended to the login PDU with a
+ * single copy instead of one snprintf/add_data round per key.
+ */
+static const char iscsi_login_opneg_const_keys[] =
+	"DataDigest=None\0"
+	"DefaultTime2Wait=2\0"
+	"DefaultTime2Retain=0\0"
+	"MaxOutstandingR2T=1\0"
+	"ErrorRecoveryLevel=0\0"
+	"IFMarker=No\0"
+	"OFMarker=No\0"
+	"MaxConnections=1\0"
+	"DataPDUInOrder=Yes\0"
+	"DataSequenceInOrder=Yes";
+
 static int
-iscsi_login_add_headerdigest(struct iscsi_context *iscsi, struct iscsi_pdu *pdu)
+iscsi_login_add_opneg_keys(struct iscsi_context *iscsi, struct iscsi_pdu *pdu)
 {
-	char str[MAX_STRING_SIZE+1];
+	char str[MAX_STRING_SIZE+1 + sizeof(iscsi_login_opneg_const_keys)];
+	const char *hd;
+	int len;
 
-	/* We only send HeaderDigest during opneg */
+	/* We only send the operational keys during opneg */
 	if (iscsi->current_phase != ISCSI_PDU_LOGIN_CSG_OPNEG) {
 		return 0;
 	}
 
 	switch (iscsi->want_header_digest) {
 	case ISCSI_HEADER_DIGEST_NONE:
-		strncpy(str,"HeaderDigest=None",MAX_STRING_SIZE);
+		hd = "None";
 		break;
 	case ISCSI_HEADER_DIGEST_NONE_CRC32C:
-		strncpy(str,"HeaderDigest=None,CRC32C",MAX_STRING_SIZE);
+		hd = "None,CRC32C";
 		break;
 	case ISCSI_HEADER_DIGEST_CRC32C_NONE:
-		strncpy(str,"HeaderDigest=CRC32C,None",MAX_STRING_SIZE);
+		hd = "CRC32C,None";
 		break;
 	case ISCSI_HEADER_DIGEST_CRC32C:
-		strncpy(str,"HeaderDigest=CRC32C",MAX_STRING_SIZE);
+		hd = "CRC32C";
 		break;
 	default:
 		iscsi_set_error(iscsi, "invalid header digest value");
 		return -1;
 	}
 
-	if (iscsi_pdu_add_data(iscsi, pdu, (unsigned char *)str, strlen(str)+1)
-	    != 0) {
-		iscsi_set_error(iscsi, "Out-of-memory: pdu add data failed.");
-		return -1;
-	}
-
-	return 0;
-}
-
-static int
-iscsi_login_add_datadigest(struct iscsi_context *iscsi, struct iscsi_pdu *pdu)
-{
-	char str[MAX_STRING_SIZE+1];
-
-	/* We only send DataDigest during opneg */
-	if (iscsi->current_phase != ISCSI_PDU_LOGIN_CSG_OPNEG) {
-		return 0;
-	}
-
-	strncpy(str,"DataDigest=None",MAX_STRING_SIZE);
-	if (iscsi_pdu_add_data(iscsi, pdu, (unsigned char *)str, strlen(str)+1)
-	    != 0) {
-		iscsi_set_error(iscsi, "Out-of-memory: pdu add data failed.");
-		return -1;
-	}
-
-	return 0;
-}
-
-static int
-iscsi_login_add_initialr2t(struct iscsi_context *iscsi, struct iscsi_pdu *pdu)
-{
-	char str[MAX_STRING_SIZE+1];
-
-	/* We only send InitialR2T during opneg */
-	if (iscsi->current_phase != ISCSI_PDU_LOGIN_CSG_OPNEG) {
-		return 0;
-	}
-
-	if (snprintf(str, MAX_STRING_SIZE, "InitialR2T=%s", iscsi->want_initial_r2t == ISCSI_INITIAL_R2T_NO ?
-		       "No" : "Yes") == -1) {
-		iscsi_set_error(iscsi, "Out-of-memory: aprintf failed.");
-		return -1;
-	}
-
-	if (iscsi_pdu_add_data(iscsi, pdu, (unsigned char *)str, strlen(str)+1)
-	    != 0) {
-		iscsi_set_error(iscsi, "Out-of-memory: pdu add data failed.");
-		return -1;
-	}
-
-	return 0;
-}
-
-static int
-iscsi_login_add_immediatedata(struct iscsi_context *iscsi, struct iscsi_pdu *pdu)
-{
-	char str[MAX_STRING_SIZE+1];
-
-	/* We only send ImmediateData during opneg */
-	if (iscsi->current_phase != ISCSI_PDU_LOGIN_CSG_OPNEG) {
-		return 0;
-	}
-
-	if (snprintf(str, MAX_STRING_SIZE, "ImmediateData=%s", iscsi->want_immediate_data == ISCSI_IMMEDIATE_DATA_NO ?
-		       "No" : "Yes") == -1) {
-		iscsi_set_error(iscsi, "Out-of-memory: aprintf failed.");
-		return -1;
-	}
-
-	if (iscsi_pdu_add_data(iscsi, pdu, (unsigned char *)str, strlen(str)+1)
-	    != 0) {
-		iscsi_set_error(iscsi, "Out-of-memory: pdu add data failed.");
-		return -1;
-	}
-
-	return 0;
-}
-
-static int
-iscsi_login_add_maxburstlength(struct iscsi_context *iscsi, struct iscsi_pdu *pdu)
-{
-	char str[MAX_STRING_SIZE+1];
-
-	/* We only send MaxBurstLength during opneg */
-	if (iscsi->current_phase != ISCSI_PDU_LOGIN_CSG_OPNEG) {
-		return 0;
-	}
-
-	if (snprintf(str, MAX_STRING_SIZE, "MaxBurstLength=%d", iscsi->max_burst_length) == -1) {
-		iscsi_set_error(iscsi, "Out-of-memory: aprintf failed.");
-		return -1;
-	}
-
-	if (iscsi_pdu_add_data(iscsi, pdu, (unsigned char *)str, strlen(str)+1)
-	    != 0) {
-		iscsi_set_error(iscsi, "Out-of-memory: pdu add data failed.");
-		return -1;
-	}
-	return 0;
-}
-
-static int
-iscsi_login_add_firstburstlength(struct iscsi_context *iscsi, struct iscsi_pdu *pdu)
-{
-	char str[MAX_STRING_SIZE+1];
-
-	/* We only send FirstBurstLength during opneg */
-	if (iscsi->current_phase != ISCSI_PDU_LOGIN_CSG_OPNEG) {
-		return 0;
-	}
-
-	if (snprintf(str, MAX_STRING_SIZE, "FirstBurstLength=%d", iscsi->first_burst_length) == -1) {
+	/* The negotiable keys are rendered back to back into one buffer,
+	 * each one NUL terminated, followed by the constant block.
+	 */
+	len = snprintf(str, MAX_STRING_SIZE,
+		       "HeaderDigest=%s%c"
+		       "InitialR2T=%s%c"
+		       "ImmediateData=%s%c"
+		       "MaxBurstLength=%d%c"
+		       "FirstBurstLength=%d%c"
+		       "MaxRecvDataSegmentLength=%d",
+		       hd, 0,
+		       iscsi->want_initial_r2t == ISCSI_INITIAL_R2T_NO ?
+		       "No" : "Yes", 0,
+		       iscsi->want_immediate_data == ISCSI_IMMEDIATE_DATA_NO ?
+		       "No" : "Yes", 0,
+		       iscsi->max_burst_length, 0,
+		       iscsi->first_burst_length, 0,
+		       iscsi->initiator_max_recv_data_segment_length);
+	if (len < 0 || len >= MAX_STRING_SIZE) {
 		iscsi_set_error(iscsi, "Out-of-memory: aprintf failed.");
 		return -1;
 	}
+	len++;
+	memcpy(&str[len], iscsi_login_opneg_const_keys,
+	       sizeof(iscsi_login_opneg_const_keys));
+	len += sizeof(iscsi_login_opneg_const_keys);
 
-	if (iscsi_pdu_add_data(iscsi, pdu, (unsigned char *)str, strlen(str)+1)
-	    != 0) {
-		iscsi_set_error(iscsi, "Out-of-memory: pdu add data failed.");
-		return -1;
-	}
-	return 0;
-}
-
-static int
-iscsi_login_add_maxrecvdatasegmentlength(struct iscsi_context *iscsi, struct iscsi_pdu *pdu)
-{
-	char str[MAX_STRING_SIZE+1];
-
-	/* We only send MaxRecvDataSegmentLength during opneg */
-	if (iscsi->current_phase != ISCSI_PDU_LOGIN_CSG_OPNEG) {
-		return 0;
-	}
-
-	if (snprintf(str, MAX_STRING_SIZE, "MaxRecvDataSegmentLength=%d", iscsi->initiator_max_recv_data_segment_length) == -1) {
-		iscsi_set_error(iscsi, "Out-of-memory: aprintf failed.");
-		return -1;
-	}
-
-	if (iscsi_pdu_add_data(iscsi, pdu, (unsigned char *)str, strlen(str)+1)
-	    != 0) {
-		iscsi_set_error(iscsi, "Out-of-memory: pdu add data failed.");
-		return -1;
-	}
-	return 0;
-}
-
-static int
-iscsi_login_add_datapduinorder(struct iscsi_context *iscsi, struct iscsi_pdu *pdu)
-{
-	char str[MAX_STRING_SIZE+1];
-
-	/* We only send DataPduInOrder during opneg */
-	if (iscsi->current_phase != ISCSI_PDU_LOGIN_CSG_OPNEG) {
-		return 0;
-	}
-
-	strncpy(str,"DataPDUInOrder=Yes",MAX_STRING_SIZE);
-	if (iscsi_pdu_add_data(iscsi, pdu, (unsigned char *)str, strlen(str)+1)
-	    != 0) {
-		iscsi_set_error(iscsi, "Out-of-memory: pdu add data failed.");
-		return -1;
-	}
-
-	return 0;
-}
-
-static int
-iscsi_login_add_defaulttime2wait(struct iscsi_context *iscsi, struct iscsi_pdu *pdu)
-{
-	char str[MAX_STRING_SIZE+1];
-
-	/* We only send DefaultTime2Wait during opneg */
-	if (iscsi->current_phase != ISCSI_PDU_LOGIN_CSG_OPNEG) {
-		return 0;
-	}
-
-	strncpy(str,"DefaultTime2Wait=2",MAX_STRING_SIZE);
-	if (iscsi_pdu_add_data(iscsi, pdu, (unsigned char *)str, strlen(str)+1)
-	    != 0) {
-		iscsi_set_error(iscsi, "Out-of-memory: pdu add data failed.");
-		return -1;
-	}
-
-	return 0;
-}
-
-static int
-iscsi_login_add_defaulttime2retain(struct iscsi_context *iscsi, struct iscsi_pdu *pdu)
-{
-	char str[MAX_STRING_SIZE+1];
-
-	/* We only send DefaultTime2Retain during opneg */
-	if (iscsi->current_phase != ISCSI_PDU_LOGIN_CSG_OPNEG) {
-		return 0;
-	}
-
-	strncpy(str,"DefaultTime2Retain=0",MAX_STRING_SIZE);
-	if (iscsi_pdu_add_data(iscsi, pdu, (unsigned char *)str, strlen(str)+1)
-	    != 0) {
-		iscsi_set_error(iscsi, "Out-of-memory: pdu add data failed.");
-		return -1;
-	}
-
-	return 0;
-}
-
-static int
-iscsi_login_add_ifmarker(struct iscsi_context *iscsi, struct iscsi_pdu *pdu)
-{
-	char str[MAX_STRING_SIZE+1];
-
-	/* We only send IFMarker during opneg */
-	if (iscsi->current_phase != ISCSI_PDU_LOGIN_CSG_OPNEG) {
-		return 0;
-	}
-
-	strncpy(str,"IFMarker=No",MAX_STRING_SIZE);
-	if (iscsi_pdu_add_data(iscsi, pdu, (unsigned char *)str, strlen(str)+1)
-	    != 0) {
-		iscsi_set_error(iscsi, "Out-of-memory: pdu add data failed.");
-		return -1;
-	}
-
-	return 0;
-}
-
-static int
-iscsi_login_add_ofmarker(struct iscsi_context *iscsi, struct iscsi_pdu *pdu)
-{
-	char str[MAX_STRING_SIZE+1];
-
-	/* We only send OFMarker during opneg */
-	if (iscsi->current_phase != ISCSI_PDU_LOGIN_CSG_OPNEG) {
-		return 0;
-	}
-
-	strncpy(str,"OFMarker=No",MAX_STRING_SIZE);
-	if (iscsi_pdu_add_data(iscsi, pdu, (unsigned char *)str, strlen(str)+1)
-	    != 0) {
-		iscsi_set_error(iscsi, "Out-of-memory: pdu add data failed.");
-		return -1;
-	}
-
-	return 0;
-}
-
-static int
-iscsi_login_add_maxconnections(struct iscsi_context *iscsi, struct iscsi_pdu *pdu)
-{
-	char str[MAX_STRING_SIZE+1];
-
-	/* We only send MaxConnections during opneg */
-	if (iscsi->current_phase != ISCSI_PDU_LOGIN_CSG_OPNEG) {
-		return 0;
-	}
-
-	strncpy(str,"MaxConnections=1",MAX_STRING_SIZE);
-	if (iscsi_pdu_add_data(iscsi, pdu, (unsigned char *)str, strlen(str)+1)
-	    != 0) {
-		iscsi_set_error(iscsi, "Out-of-memory: pdu add data failed.");
-		return -1;
-	}
-
-	return 0;
-}
-
-static int
-iscsi_login_add_maxoutstandingr2t(struct iscsi_context *iscsi, struct iscsi_pdu *pdu)
-{
-	char str[MAX_STRING_SIZE+1];
-
-	/* We only send MaxOutstandingR2T during opneg */
-	if (iscsi->current_phase != ISCSI_PDU_LOGIN_CSG_OPNEG) {
-		return 0;
-	}
-
-	strncpy(str,"MaxOutstandingR2T=1",MAX_STRING_SIZE);
-	if (iscsi_pdu_add_data(iscsi, pdu, (unsigned char *)str, strlen(str)+1)
-	    != 0) {
-		iscsi_set_error(iscsi, "Out-of-memory: pdu add data failed.");
-		return -1;
-	}
-
-	return 0;
-}
-
-static int
-iscsi_login_add_errorrecoverylevel(struct iscsi_context *iscsi, struct iscsi_pdu *pdu)
-{
-	char str[MAX_STRING_SIZE+1];
-
-	/* We only send ErrorRecoveryLevel during opneg */
-	if (iscsi->current_phase != ISCSI_PDU_LOGIN_CSG_OPNEG) {
-		return 0;
-	}
-
-	strncpy(str,"ErrorRecoveryLevel=0",MAX_STRING_SIZE);
-	if (iscsi_pdu_add_data(iscsi, pdu, (unsigned char *)str, strlen(str)+1)
-	    != 0) {
-		iscsi_set_error(iscsi, "Out-of-memory: pdu add data failed.");
-		return -1;
-	}
-
-	return 0;
-}
-
-static int
-iscsi_login_add_datasequenceinorder(struct iscsi_context *iscsi, struct iscsi_pdu *pdu)
-{
-	char str[MAX_STRING_SIZE+1];
-
-	/* We only send DataSequenceInOrder during opneg */
-	if (iscsi->current_phase != ISCSI_PDU_LOGIN_CSG_OPNEG) {
-		return 0;
-	}
-
-	strncpy(str,"DataSequenceInOrder=Yes",MAX_STRING_SIZE);
-	if (iscsi_pdu_add_data(iscsi, pdu, (unsigned char *)str, strlen(str)+1)
+	if (iscsi_pdu_add_data(iscsi, pdu, (unsigned char *)str, len)
 	    != 0) {
 		iscsi_set_error(iscsi, "Out-of-memory: pdu add data failed.");
 		return -1;
@@ -814,6 +540,10 @@ iscsi_login_async(struct iscsi_context *iscsi, iscsi_command_cb cb,
 	/* cmdsn is not increased if Immediate delivery*/
 	iscsi_pdu_set_cmdsn(pdu, iscsi->cmdsn);
 
+	/* Without CHAP there is nothing to negotiate in SecNeg so start
+	 * straight in OpNeg and ask to transit to FullFeature, which lets
+	 * the whole login complete in a single round trip.
+	 */
 	if (!iscsi->user[0]) {
 		iscsi->current_phase = ISCSI_PDU_LOGIN_CSG_OPNEG;
 	}
@@ -872,12 +602,6 @@ iscsi_login_async(struct iscsi_context *iscsi, iscsi_command_cb cb,
 		return -1;
 	}
 
-	/* header digest */
-	if (iscsi_login_add_headerdigest(iscsi, pdu) != 0) {
-		iscsi_free_pdu(iscsi, pdu);
-		return -1;
-	}
-
 	/* auth method */
 	if (iscsi_login_add_authmethod(iscsi, pdu) != 0) {
 		iscsi_free_pdu(iscsi, pdu);
@@ -902,92 +626,8 @@ iscsi_login_async(struct iscsi_context *iscsi, iscsi_command_cb cb,
 		return -1;
 	}
 
-	/* data digest */
-	if (iscsi_login_add_datadigest(iscsi, pdu) != 0) {
-		iscsi_free_pdu(iscsi, pdu);
-		return -1;
-	}
-
-	/* initial r2t */
-	if (iscsi_login_add_initialr2t(iscsi, pdu) != 0) {
-		iscsi_free_pdu(iscsi, pdu);
-		return -1;
-	}
-
-	/* immediate data */
-	if (iscsi_login_add_immediatedata(iscsi, pdu) != 0) {
-		iscsi_free_pdu(iscsi, pdu);
-		return -1;
-	}
-
-	/* max burst length */
-	if (iscsi_login_add_maxburstlength(iscsi, pdu) != 0) {
-		iscsi_free_pdu(iscsi, pdu);
-		return -1;
-	}
-
-	/* first burst length */
-	if (iscsi_login_add_firstburstlength(iscsi, pdu) != 0) {
-		iscsi_free_pdu(iscsi, pdu);
-		return -1;
-	}
-
-	/* default time 2 wait */
-	if (iscsi_login_add_defaulttime2wait(iscsi, pdu) != 0) {
-		iscsi_free_pdu(iscsi, pdu);
-		return -1;
-	}
-
-	/* default time 2 retain */
-	if (iscsi_login_add_defaulttime2retain(iscsi, pdu) != 0) {
-		iscsi_free_pdu(iscsi, pdu);
-		return -1;
-	}
-
-	/* max outstanding r2t */
-	if (iscsi_login_add_maxoutstandingr2t(iscsi, pdu) != 0) {
-		iscsi_free_pdu(iscsi, pdu);
-		return -1;
-	}
-
-	/* errorrecoverylevel */
-	if (iscsi_login_add_errorrecoverylevel(iscsi, pdu) != 0) {
-		iscsi_free_pdu(iscsi, pdu);
-		return -1;
-	}
-
-	/* ifmarker */
-	if (iscsi_login_add_ifmarker(iscsi, pdu) != 0) {
-		iscsi_free_pdu(iscsi, pdu);
-		return -1;
-	}
-
-	/* ofmarker */
-	if (iscsi_login_add_ofmarker(iscsi, pdu) != 0) {
-		iscsi_free_pdu(iscsi, pdu);
-		return -1;
-	}
-
-	/* maxconnections */
-	if (iscsi_login_add_maxconnections(iscsi, pdu) != 0) {
-		iscsi_free_pdu(iscsi, pdu);
-		return -1;
-	}
-
-	/* max recv data segment length */
-	if (iscsi_login_add_maxrecvdatasegmentlength(iscsi, pdu) != 0) {
-		iscsi_free_pdu(iscsi, pdu);
-		return -1;
-	}
-
-	/* data pdu in order */
-	if (iscsi_login_add_datapduinorder(iscsi, pdu) != 0) {
-		iscsi_free_pdu(iscsi, pdu);
-		return -1;
-	}
-
-	/* data sequence in order */
-	if (iscsi_login_add_datasequenceinorder(iscsi, pdu) != 0) {
+	/* operational keys */
+	if (iscsi_login_add_opneg_keys(iscsi, pdu) != 0) {
 		iscsi_free_pdu(iscsi, pdu);
 		return -1;
 	}
@@ -0,0 +1,544 @@
+/*
+   Copyright (C) 2026 by agent <agent@local>
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU Lesser General Public License as published by
+   the Free Software Foundation; either version 2.1 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public License
+   along with this program; if not, see <http://www.gnu.org/licenses/>.
+*/
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "iscsi.h"
+#include "iscsi-private.h"
+#include "scsi-lowlevel.h"
+#include "slist.h"
+
+/*
+ * Command merging.
+ *
+ * Once the CmdSN window is closed, new commands are held back on the
+ * context without a CmdSN instead of being numbered and queued. When
+ * the target opens the window again the held commands are numbered in
+ * the order they were submitted, and runs of READ16 or WRITE16 commands
+ * to consecutive LBAs are sent as a single command whose data iovector
+ * is the concatenation of theirs. When the merged command completes its
+ * status, sense and residual are handed back to each of the original
+ * tasks.
+ */
+
+struct iscsi_held_cmd {
+	struct iscsi_held_cmd *next;
+	struct scsi_task *task;
+	iscsi_command_cb cb;
+	void *private_data;
+	int lun;
+};
+
+int
+iscsi_set_command_merging(struct iscsi_context *iscsi, uint32_t max_bytes)
+{
+	iscsi->merge_max_bytes = max_bytes;
+	return 0;
+}
+
+int
+iscsi_must_hold_commands(struct iscsi_context *iscsi)
+{
+	if (iscsi->held_cmds != NULL) {
+		/* nothing may overtake a held command */
+		return 1;
+	}
+	return iscsi->merge_max_bytes != 0
+		&& iscsi_serial32_compare(iscsi->cmdsn, iscsi->maxcmdsn) > 0;
+}
+
+static void
+iscsi_held_cmd_complete(struct iscsi_context *iscsi,
+			struct iscsi_held_cmd *c, int status)
+{
+	iscsi_command_cb cb = c->cb ? c->cb : iscsi_completion_queue_cb;
+
+	c->task->status = status;
+	cb(iscsi, status, c->task, c->private_data);
+	iscsi_free(iscsi, c);
+}
+
+static struct iscsi_held_cmd *
+iscsi_held_cmd_alloc(struct iscsi_context *iscsi, int lun,
+		     struct scsi_task *task, iscsi_command_cb cb,
+		     void *private_data)
+{
+	struct iscsi_held_cmd *c;
+
+	c = iscsi_malloc(iscsi, sizeof(struct iscsi_held_cmd));
+	if (c == NULL) {
+		iscsi_set_error(iscsi, "Out-of-memory: failed to hold "
+				"command");
+		return NULL;
+	}
+	c->next         = NULL;
+	c->task         = task;
+	c->cb           = cb;
+	c->private_data = private_data;
+	c->lun          = lun;
+
+	return c;
+}
+
+/* Returns 1 if the command was held back, 0 if it should be sent right
+ * away and -1 on error.
+ */
+int
+iscsi_hold_command(struct iscsi_context *iscsi, int lun,
+		   struct scsi_task *task, iscsi_command_cb cb,
+		   struct iscsi_data *d, void *private_data)
+{
+	struct iscsi_held_cmd *c;
+
+	if (!iscsi_must_hold_commands(iscsi)) {
+		return 0;
+	}
+	if (cb == NULL && iscsi->cq == NULL) {
+		/* let iscsi_scsi_command_send() report this */
+		return 0;
+	}
+	/* urgent tasks would have jumped the queue anyway */
+	if (task->task_attr == SCSI_TASK_ATTR_HEAD_OF_QUEUE
+	|| (task->task_priority != SCSI_TASK_PRIORITY_NONE
+	    && task->task_priority <= ISCSI_URGENT_TASK_PRIORITY)) {
+		return 0;
+	}
+
+	/* d usually lives on the caller's stack */
+	if (d != NULL && d->data != NULL) {
+		struct scsi_iovec *iov;
+
+		iov = scsi_malloc(task, sizeof(struct scsi_iovec));
+		if (iov == NULL) {
+			iscsi_set_error(iscsi, "Out-of-memory: failed to "
+					"allocate iovector");
+			return -1;
+		}
+		iov->iov_base = d->data;
+		iov->iov_len  = d->size;
+		scsi_task_set_iov_out(task, iov, 1);
+	}
+
+	c = iscsi_held_cmd_alloc(iscsi, lun, task, cb, private_data);
+	if (c == NULL) {
+		return -1;
+	}
+	task->lun = lun;
+	ISCSI_LIST_ADD_END(&iscsi->held_cmds, c);
+
+	return 1;
+}
+
+int
+iscsi_hold_batch(struct iscsi_context *iscsi, int lun,
+		 struct scsi_task **tasks, int n, iscsi_command_cb cb,
+		 void **private_data)
+{
+	struct iscsi_held_cmd *head = NULL, *tail = NULL, *c;
+	int i;
+
+	if (cb == NULL && iscsi->cq == NULL) {
+		iscsi_set_error(iscsi, "No callback for task and no "
+				"completion queue.");
+		return -1;
+	}
+
+	for (i = 0; i < n; i++) {
+		c = iscsi_held_cmd_alloc(iscsi, lun, tasks[i], cb,
+				private_data ? private_data[i] : NULL);
+		if (c == NULL) {
+			while ((c = head) != NULL) {
+				head = c->next;
+				iscsi_free(iscsi, c);
+			}
+			return -1;
+		}
+		tasks[i]->lun = lun;
+		if (tail == NULL) {
+			head = c;
+		} else {
+			tail->next = c;
+		}
+		tail = c;
+	}
+
+	if (iscsi->held_cmds == NULL) {
+		iscsi->held_cmds = head;
+	} else {
+		for (c = iscsi->held_cmds; c->next != NULL; c = c->next) {
+			;
+		}
+		c->next = head;
+	}
+
+	return 0;
+}
+
+/* Only plain READ16 and WRITE16 with their data in iovectors are merged */
+static int
+iscsi_held_cmd_mergeable(struct iscsi_held_cmd *c, uint64_t *lba,
+			 uint32_t *num_blocks);
+
+static void
+iscsi_merged_cb(struct iscsi_context *iscsi, int status, void *command_data,
+		void *private_data)
+{
+	struct scsi_task *merged = command_data;
+	struct iscsi_held_cmd *c = private_data, *next;
+	size_t total = merged->expxferlen, offset = 0, short_from;
+
+	/* an underflow means the tail of the transfer is missing */
+	short_from = total;
+	if (merged->residual_status == SCSI_RESIDUAL_UNDERFLOW
+	&&  merged->residual < total) {
+		short_from = total - merged->residual;
+	} else if (merged->residual_status == SCSI_RESIDUAL_UNDERFLOW) {
+		short_from = 0;
+	}
+
+	for (; c != NULL; c = next) {
+		struct scsi_task *task = c->task;
+		size_t len = task->expxferlen;
+
+		next = c->next;
+		task->times.header_sent    = merged->times.header_sent;
+		task->times.dataout_sent   = merged->times.dataout_sent;
+		task->times.first_response = merged->times.first_response;
+		task->times.status         = merged->times.status;
+
+		task->sense           = merged->sense;
+		task->residual_status = SCSI_RESIDUAL_NO_RESIDUAL;
+		task->residual        = 0;
+		if (offset + len > short_from) {
+			task->residual_status = SCSI_RESIDUAL_UNDERFLOW;
+			task->residual = offset + len -
+				(short_from > offset ? short_from : offset);
+		}
+		if (next == NULL
+		&&  merged->residual_status == SCSI_RESIDUAL_OVERFLOW) {
+			task->residual_status = SCSI_RESIDUAL_OVERFLOW;
+			task->residual        = merged->residual;
+		}
+		if (task->xfer_dir == SCSI_XFER_READ
+		&&  task->iovector_in.niov == 0
+		&&  task->residual_status == SCSI_RESIDUAL_UNDERFLOW) {
+			task->datain.size = len - task->residual;
+		}
+		offset += len;
+
+		iscsi_held_cmd_complete(iscsi, c, status);
+	}
+
+	scsi_free_scsi_task(merged);
+}
+
+static int
+iscsi_held_cmd_mergeable(struct iscsi_held_cmd *c, uint64_t *lba,
+			 uint32_t *num_blocks)
+{
+	struct scsi_task *task = c->task;
+
+	if (c->cb == iscsi_merged_cb) {
+		return 0;
+	}
+	if (task->task_attr != SCSI_TASK_ATTR_SIMPLE
+	||  task->task_priority != SCSI_TASK_PRIORITY_NONE) {
+		return 0;
+	}
+	switch (task->cdb[0]) {
+	case SCSI_OPCODE_READ16:
+		if (task->xfer_dir != SCSI_XFER_READ) {
+			return 0;
+		}
+		break;
+	case SCSI_OPCODE_WRITE16:
+		if (task->xfer_dir != SCSI_XFER_WRITE
+		||  task->iovector_out.niov == 0) {
+			return 0;
+		}
+		break;
+	default:
+		return 0;
+	}
+
+	*lba = (uint64_t)scsi_get_uint32(&task->cdb[2]) << 32
+		| scsi_get_uint32(&task->cdb[6]);
+	*num_blocks = scsi_get_uint32(&task->cdb[10]);
+	if (*num_blocks == 0 || task->expxferlen <= 0
+	||  task->expxferlen % *num_blocks) {
+		return 0;
+	}
+
+	return 1;
+}
+
+/* Returns how many held commands, starting at first, can be sent as one
+ * and the size of the transfer they make up.
+ */
+static int
+iscsi_merge_run(struct iscsi_context *iscsi, struct iscsi_held_cmd *first,
+		uint64_t *bytes)
+{
+	struct iscsi_held_cmd *c = first;
+	uint64_t lba, next_lba, blocks;
+	uint32_t num_blocks, block_size;
+	int count = 1;
+
+	*bytes = first->task->expxferlen;
+	if (!iscsi_held_cmd_mergeable(first, &lba, &num_blocks)) {
+		return 1;
+	}
+	block_size = first->task->expxferlen / num_blocks;
+	next_lba   = lba + num_blocks;
+	blocks     = num_blocks;
+
+	while (c->next != NULL) {
+		struct scsi_task *a = first->task, *b = c->next->task;
+
+		if (!iscsi_held_cmd_mergeable(c->next, &lba, &num_blocks)
+		||  c->next->lun != first->lun
+		||  memcmp(a->cdb, b->cdb, 2)
+		||  a->cdb[14] != b->cdb[14]
+		||  (uint32_t)b->expxferlen / num_blocks != block_size
+		||  lba != next_lba
+		||  *bytes + b->expxferlen > iscsi->merge_max_bytes
+		||  *bytes + b->expxferlen > 0x7fffffff
+		||  (iscsi->limits.max_xfer_len != 0
+		     && blocks + num_blocks > iscsi->limits.max_xfer_len)) {
+			break;
+		}
+		*bytes   += b->expxferlen;
+		blocks   += num_blocks;
+		next_lba += num_blocks;
+		c = c->next;
+		count++;
+	}
+
+	return count;
+}
+
+/* Drop the buffers iscsi_send_merged() gave to reads that had none */
+static void
+iscsi_merge_undo_datain(struct iscsi_held_cmd *c)
+{
+	for (; c != NULL; c = c->next) {
+		if (c->task->xfer_dir == SCSI_XFER_READ
+		&&  c->task->iovector_in.niov == 0) {
+			free(c->task->datain.data);
+			c->task->datain.data = NULL;
+			c->task->datain.size = 0;
+		}
+	}
+}
+
+/* Send the list of held commands starting at first as a single command */
+static int
+iscsi_send_merged(struct iscsi_context *iscsi, struct iscsi_held_cmd *first,
+		  uint64_t bytes)
+{
+	struct scsi_task *task, *t = first->task;
+	uint32_t block_size = t->expxferlen / scsi_get_uint32(&t->cdb[10]);
+	uint64_t lba = (uint64_t)scsi_get_uint32(&t->cdb[2]) << 32
+		| scsi_get_uint32(&t->cdb[6]);
+	struct iscsi_held_cmd *c;
+	int is_write = t->cdb[0] == SCSI_OPCODE_WRITE16;
+	int niov;
+
+	task = is_write ?
+		scsi_cdb_write16(lba, bytes, block_size, 0, 0, 0, 0, 0) :
+		scsi_cdb_read16(lba, bytes, block_size, 0, 0, 0, 0, 0);
+	if (task == NULL) {
+		iscsi_set_error(iscsi, "Out-of-memory: Failed to create "
+				"merged cdb.");
+		return -1;
+	}
+	iscsi_task_times_start(task);
+
+	/* the protect/DPO/FUA bits and the group number are the same for
+	 * all of them */
+	task->cdb[1]  = t->cdb[1];
+	task->cdb[14] = t->cdb[14];
+
+	/* size the iovector once rather than growing it as we go */
+	for (c = first, niov = 0; c != NULL; c = c->next) {
+		struct scsi_iovector *v = is_write ?
+			&c->task->iovector_out : &c->task->iovector_in;
+
+		niov += v->niov ? v->niov : 1;
+	}
+	if ((is_write ?
+	     scsi_task_reserve_data_out_buffers(task, niov) :
+	     scsi_task_reserve_data_in_buffers(task, niov)) != 0) {
+		iscsi_set_error(iscsi, "Out-of-memory: Failed to allocate "
+				"merged iovector.");
+		scsi_free_scsi_task(task);
+		return -1;
+	}
+
+	for (c = first; c != NULL; c = c->next) {
+		struct scsi_iovector *v = is_write ?
+			&c->task->iovector_out : &c->task->iovector_in;
+		int i;
+
+		if (!is_write && v->niov == 0) {
+			/* no buffer of its own, read into datain like an
+			 * unmerged read would */
+			free(c->task->datain.data);
+			c->task->datain.data = malloc(c->task->expxferlen);
+			if (c->task->datain.data == NULL) {
+				c->task->datain.size = 0;
+				goto err;
+			}
+			c->task->datain.size = c->task->expxferlen;
+			if (scsi_task_add_data_in_buffer(task,
+					c->task->expxferlen,
+					c->task->datain.data) != 0) {
+				goto err;
+			}
+			continue;
+		}
+		for (i = 0; i < v->niov; i++) {
+			if ((is_write ?
+			     scsi_task_add_data_out_buffer(task,
+					v->iov[i].iov_len,
+					v->iov[i].iov_base) :
+			     scsi_task_add_data_in_buffer(task,
+					v->iov[i].iov_len,
+					v->iov[i].iov_base)) != 0) {
+				goto err;
+			}
+		}
+	}
+
+	if (iscsi_scsi_command_send(iscsi, first->lun, task, iscsi_merged_cb,
+				    NULL, first) != 0) {
+		scsi_free_scsi_task(task);
+		iscsi_merge_undo_datain(first);
+		return -1;
+	}
+
+	/* task management on any of them applies to the merged command */
+	for (c = first; c != NULL; c = c->next) {
+		c->task->itt   = task->itt;
+		c->task->cmdsn = task->cmdsn;
+	}
+
+	return 0;
+
+err:
+	iscsi_set_error(iscsi, "Out-of-memory: Failed to build merged "
+			"iovector.");
+	scsi_free_scsi_task(task);
+	iscsi_merge_undo_datain(first);
+	return -1;
+}
+
+void
+iscsi_flush_held_commands(struct iscsi_context *iscsi)
+{
+	while (iscsi->held_cmds != NULL
+	&&     iscsi_serial32_compare(iscsi->cmdsn, iscsi->maxcmdsn) <= 0) {
+		struct iscsi_held_cmd *first = iscsi->held_cmds, *last, *c;
+		uint64_t bytes;
+		int count, i;
+
+		count = iscsi_merge_run(iscsi, first, &bytes);
+		for (last = first, i = 1; i < count; i++) {
+			last = last->next;
+		}
+		iscsi->held_cmds = last->next;
+		last->next = NULL;
+
+		if (count > 1) {
+			ISCSI_LOG(iscsi, 6, "merging %d commands into one of "
+				  "%d bytes", count, (int)bytes);
+			if (iscsi_send_merged(iscsi, first, bytes) == 0) {
+				continue;
+			}
+			/* fall back to sending them one by one */
+			last->next = iscsi->held_cmds;
+			iscsi->held_cmds = first->next;
+			first->next = NULL;
+		}
+
+		c = first;
+		if (iscsi_scsi_command_send(iscsi, c->lun, c->task, c->cb,
+					    NULL, c->private_data) != 0) {
+			iscsi_held_cmd_complete(iscsi, c, SCSI_STATUS_ERROR);
+			continue;
+		}
+		iscsi_free(iscsi, c);
+	}
+}
+
+int
+iscsi_cancel_held_command(struct iscsi_context *iscsi,
+			  struct scsi_task *task)
+{
+	struct iscsi_held_cmd *c;
+
+	for (c = iscsi->held_cmds; c != NULL; c = c->next) {
+		if (c->task == task) {
+			ISCSI_LIST_REMOVE(&iscsi->held_cmds, c);
+			iscsi_held_cmd_complete(iscsi, c,
+						SCSI_STATUS_CANCELLED);
+			return 0;
+		}
+	}
+	return -1;
+}
+
+void
+iscsi_cancel_held_commands(struct iscsi_context *iscsi)
+{
+	struct iscsi_held_cmd *c;
+
+	while ((c = iscsi->held_cmds) != NULL) {
+		iscsi->held_cmds = c->next;
+		iscsi_held_cmd_complete(iscsi, c, SCSI_STATUS_CANCELLED);
+	}
+}
+
+/* Commands held while reconnecting go to the end of the new context */
+void
+iscsi_move_held_commands(struct iscsi_context *to,
+			 struct iscsi_context *from)
+{
+	struct iscsi_held_cmd **tail = &to->held_cmds;
+
+	while (*tail != NULL) {
+		tail = &(*tail)->next;
+	}
+	*tail = from->held_cmds;
+	from->held_cmds = NULL;
+}
+
+uint32_t
+iscsi_held_command_count(struct iscsi_context *iscsi)
+{
+	struct iscsi_held_cmd *c;
+	uint32_t n = 0;
+
+	for (c = iscsi->held_cmds; c != NULL; c = c->next) {
+		n++;
+	}
+	return n;
+}
@@ -15,6 +15,10 @@
    along with this program; if not, see <http://www.gnu.org/licenses/>.
 */
 
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
 #if defined(WIN32)
 #else
 #include <unistd.h>
@@ -22,6 +26,8 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
 #include "iscsi.h"
 #include "iscsi-private.h"
 
@@ -176,3 +182,155 @@ int iscsi_get_nops_in_flight(struct iscsi_context *iscsi)
 {
 	return iscsi->nops_in_flight;
 }
+
+int
+iscsi_set_nop_keepalive(struct iscsi_context *iscsi, int interval,
+			int max_missed)
+{
+	if (interval < 0 || max_missed < 1) {
+		iscsi_set_error(iscsi, "invalid nop keepalive settings, "
+				"interval %d max_missed %d",
+				interval, max_missed);
+		return -1;
+	}
+
+	iscsi->nop_keepalive_interval   = interval;
+	iscsi->nop_keepalive_max_missed = max_missed;
+	iscsi->nop_keepalive_missed     = 0;
+	iscsi->next_nop_keepalive       = 0;
+
+	return 0;
+}
+
+static void
+iscsi_nop_rtt_add_sample(struct iscsi_context *iscsi, uint32_t us)
+{
+	if (iscsi->nop_rtt_samples == 0 || us < iscsi->nop_rtt_min_us) {
+		iscsi->nop_rtt_min_us = us;
+	}
+	if (us > iscsi->nop_rtt_max_us) {
+		iscsi->nop_rtt_max_us = us;
+	}
+	iscsi->nop_rtt_last_us = us;
+	iscsi->nop_rtt_sum_us += us;
+	iscsi->nop_rtt_window[iscsi->nop_rtt_samples % ISCSI_NOP_RTT_WINDOW] = us;
+	iscsi->nop_rtt_samples++;
+}
+
+static void
+iscsi_nop_keepalive_cb(struct iscsi_context *iscsi, int status,
+		       void *command_data _U_, void *private_data _U_)
+{
+	uint64_t ns;
+
+	iscsi->nop_keepalive_pending = 0;
+
+	if (status != SCSI_STATUS_GOOD) {
+		return;
+	}
+
+	ns = iscsi_clock_ns() - iscsi->nop_keepalive_sent_ns;
+	iscsi_nop_rtt_add_sample(iscsi, ns / 1000);
+	iscsi->nop_keepalive_missed = 0;
+}
+
+/*
+ * Called from iscsi_service(). Returns -1 if the path should be considered
+ * dead.
+ */
+int
+iscsi_nop_keepalive_scan(struct iscsi_context *iscsi)
+{
+	time_t t;
+
+	if (iscsi->nop_keepalive_interval == 0 || !iscsi->is_loggedin
+	    || iscsi->old_iscsi || iscsi->pending_reconnect) {
+		return 0;
+	}
+
+	t = time(NULL);
+	if (t < iscsi->next_nop_keepalive) {
+		return 0;
+	}
+
+	/* The target has sent us something recently so the path is alive.
+	 * Don't add a NOP to a session that is busy anyway.
+	 */
+	if (t < iscsi->last_rx_time + iscsi->nop_keepalive_interval) {
+		iscsi->nop_keepalive_missed = 0;
+		iscsi->next_nop_keepalive = iscsi->last_rx_time
+			+ iscsi->nop_keepalive_interval;
+		return 0;
+	}
+	iscsi->next_nop_keepalive = t + iscsi->nop_keepalive_interval;
+
+	/* Only one keepalive is kept in flight. If it is still unanswered
+	 * this interval counts as missed.
+	 */
+	if (iscsi->nop_keepalive_pending) {
+		iscsi->nop_keepalive_missed++;
+		ISCSI_LOG(iscsi, 2, "NOP keepalive unanswered for %d interval(s)",
+			  iscsi->nop_keepalive_missed);
+		if (iscsi->nop_keepalive_missed < iscsi->nop_keepalive_max_missed) {
+			return 0;
+		}
+		iscsi_set_error(iscsi, "No response to NOP keepalive for %d "
+				"seconds, path is dead",
+				iscsi->nop_keepalive_missed
+				* iscsi->nop_keepalive_interval);
+		ISCSI_LOG(iscsi, 1, "%s", iscsi_get_error(iscsi));
+		iscsi->nop_keepalive_missed = 0;
+		iscsi->nop_keepalive_pending = 0;
+		return -1;
+	}
+
+	iscsi->nop_keepalive_sent_ns = iscsi_clock_ns();
+	if (iscsi_nop_out_async(iscsi, iscsi_nop_keepalive_cb, NULL, 0,
+				NULL) != 0) {
+		ISCSI_LOG(iscsi, 1, "failed to send NOP keepalive: %s",
+			  iscsi_get_error(iscsi));
+		return 0;
+	}
+	iscsi->nop_keepalive_pending = 1;
+
+	return 0;
+}
+
+static int
+iscsi_nop_rtt_compare(const void *a, const void *b)
+{
+	uint32_t x = *(const uint32_t *)a;
+	uint32_t y = *(const uint32_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+int
+iscsi_get_nop_rtt(struct iscsi_context *iscsi, struct iscsi_nop_rtt *rtt)
+{
+	uint32_t sorted[ISCSI_NOP_RTT_WINDOW];
+	uint32_t n;
+
+	memset(rtt, 0, sizeof(struct iscsi_nop_rtt));
+	rtt->missed = iscsi->nop_keepalive_missed;
+
+	if (iscsi->nop_rtt_samples == 0) {
+		return 0;
+	}
+
+	rtt->samples = iscsi->nop_rtt_samples;
+	rtt->last_us = iscsi->nop_rtt_last_us;
+	rtt->min_us  = iscsi->nop_rtt_min_us;
+	rtt->max_us  = iscsi->nop_rtt_max_us;
+	rtt->avg_us  = iscsi->nop_rtt_sum_us / iscsi->nop_rtt_samples;
+
+	n = iscsi->nop_rtt_samples;
+	if (n > ISCSI_NOP_RTT_WINDOW) {
+		n = ISCSI_NOP_RTT_WINDOW;
+	}
+	memcpy(sorted, iscsi->nop_rtt_window, n * sizeof(uint32_t));
+	qsort(sorted, n, sizeof(uint32_t), iscsi_nop_rtt_compare);
+	rtt->p99_us = sorted[(n * 99 + 99) / 100 - 1];
+
+	return 0;
+}
@@ -37,6 +37,7 @@
 #include <string.h>
 #include "iscsi.h"
 #include "iscsi-private.h"
+#include "iscsi-trace.h"
 #include "scsi-lowlevel.h"
 #include "slist.h"
 
@@ -215,9 +216,12 @@ iscsi_pdu_add_data(struct iscsi_context *iscsi, struct iscsi_pdu *pdu,
 		return -1;
 	}
 
-	/* update data segment length */
+	/* update data segment length, any AHS sits between the BHS and the
+	 * data segment and is not part of it.
+	 */
 	scsi_set_uint32(&pdu->outdata.data[4], pdu->outdata.size
-					       - ISCSI_HEADER_SIZE);
+					       - ISCSI_HEADER_SIZE
+					       - pdu->outdata.data[4] * 4);
 
 	return 0;
 }
@@ -422,8 +426,11 @@ iscsi_process_pdu(struct iscsi_context *iscsi, struct iscsi_in_pdu *in)
 	struct iscsi_pdu *pdu;
 
 	if (ahslen != 0) {
-		iscsi_set_error(iscsi, "cant handle expanded headers yet");
-		return -1;
+		/* None of the target PDUs we handle carry an AHS we need,
+		 * so just note it and carry on with the BHS.
+		 */
+		ISCSI_LOG(iscsi, 6, "Ignoring %d bytes of AHS in PDU with "
+			  "opcode 0x%02x", ahslen * 4, opcode);
 	}
 
 	/* All target PDUs update the serials */
@@ -667,11 +674,73 @@ iscsi_pdu_set_bufferoffset(struct iscsi_pdu *pdu, uint32_t bufferoffset)
 	scsi_set_uint32(&pdu->outdata.data[40], bufferoffset);
 }
 
-void
-iscsi_pdu_set_cdb(struct iscsi_pdu *pdu, struct scsi_task *task)
+int
+iscsi_pdu_add_ahs(struct iscsi_context *iscsi, struct iscsi_pdu *pdu,
+		  int type, unsigned char *dptr, int dsize)
 {
+	unsigned char *ahs;
+	int ahs_size, padded, ahs_offset;
+
+	ahs_size = 4 + dsize;
+	padded = (ahs_size + 3) & ~3;
+	if (pdu->outdata.data[4] + padded / 4 > 0xff) {
+		iscsi_set_error(iscsi, "Too much AHS for PDU");
+		return -1;
+	}
+	if (pdu->outdata.size != (size_t)(ISCSI_HEADER_SIZE
+					  + pdu->outdata.data[4] * 4)) {
+		iscsi_set_error(iscsi, "AHS must be added before any data");
+		return -1;
+	}
+
+	ahs = iscsi_zmalloc(iscsi, padded);
+	if (ahs == NULL) {
+		iscsi_set_error(iscsi, "Out-of-memory: failed to allocate AHS");
+		return -1;
+	}
+	if (iscsi_add_data(iscsi, &pdu->outdata, ahs, padded, 0) != 0) {
+		iscsi_free(iscsi, ahs);
+		iscsi_set_error(iscsi, "failed to add AHS to pdu buffer");
+		return -1;
+	}
+	iscsi_free(iscsi, ahs);
+
+	/* The AHS goes straight after the BHS and any AHS already added,
+	 * while the header digest, if used, has to follow the last AHS.
+	 */
+	ahs_offset = ISCSI_RAW_HEADER_SIZE + pdu->outdata.data[4] * 4;
+	ahs = &pdu->outdata.data[ahs_offset];
+	if (iscsi->header_digest != ISCSI_HEADER_DIGEST_NONE) {
+		memmove(ahs + padded, ahs, ISCSI_DIGEST_SIZE);
+	}
+	memset(ahs, 0, padded);
+	/* AHSLength counts the type specific bytes including the reserved
+	 * byte, but not the padding.
+	 */
+	scsi_set_uint16(&ahs[0], dsize + 1);
+	ahs[2] = type;
+	memcpy(&ahs[4], dptr, dsize);
+
+	pdu->outdata.data[4] += padded / 4;
+
+	return 0;
+}
+
+int
+iscsi_pdu_set_cdb(struct iscsi_context *iscsi, struct iscsi_pdu *pdu,
+		  struct scsi_task *task)
+{
+	int bhs_size = task->cdb_size < 16 ? task->cdb_size : 16;
+
 	memset(&pdu->outdata.data[32], 0, 16);
-	memcpy(&pdu->outdata.data[32], task->cdb, task->cdb_size);
+	memcpy(&pdu->outdata.data[32], task->cdb, bhs_size);
+
+	/* Anything that does not fit in the BHS goes in an extended CDB AHS */
+	if (task->cdb_size > 16) {
+		return iscsi_pdu_add_ahs(iscsi, pdu, ISCSI_AHS_EXTENDED_CDB,
+					 &task->cdb[16], task->cdb_size - 16);
+	}
+	return 0;
 }
 
 void
@@ -705,7 +774,9 @@ iscsi_timeout_scan(struct iscsi_context *iscsi)
 			/* not expired yet */
 			continue;
 		}
-		ISCSI_LIST_REMOVE(&iscsi->outqueue, pdu);
+		iscsi_outqueue_remove(iscsi, pdu);
+		iscsi->stats.timeouts++;
+		ISCSI_TRACE_PDU(pdu__timeout, pdu, pdu->payload_len);
 		pdu->callback(iscsi, SCSI_STATUS_TIMEOUT,
 			      NULL, pdu->private_data);
 	}
@@ -721,6 +792,8 @@ iscsi_timeout_scan(struct iscsi_context *iscsi)
 			continue;
 		}
 		ISCSI_LIST_REMOVE(&iscsi->waitpdu, pdu);
+		iscsi->stats.timeouts++;
+		ISCSI_TRACE_PDU(pdu__timeout, pdu, pdu->payload_len);
 		pdu->callback(iscsi, SCSI_STATUS_TIMEOUT,
 			      NULL, pdu->private_data);
 	}
@@ -0,0 +1,433 @@
+/*
+   Copyright (C) 2026 by agent <agent@local>
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU Lesser General Public License as published by
+   the Free Software Foundation; either version 2.1 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public License
+   along with this program; if not, see <http://www.gnu.org/licenses/>.
+*/
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <time.h>
+#include "iscsi.h"
+#include "iscsi-private.h"
+#include "scsi-lowlevel.h"
+
+#ifdef HAVE_PTHREAD
+
+/*
+ * A session pool is a set of contexts that all log in to the same LUN and
+ * are each driven by their own I/O thread. The pool itself is only touched
+ * by the application thread: it picks a session for each task and hands it
+ * to that session's I/O thread, and every I/O thread completes into the
+ * one shared iscsi_thread_queue.
+ */
+
+#define ISCSI_POOL_DEFAULT_STRIPE 2048
+
+struct iscsi_pool_session {
+	struct iscsi_context *iscsi;
+	/* what we submit to, the context belongs to it while it runs */
+	struct iscsi_io_thread *io;
+	/* updated by the I/O thread as tasks complete */
+	int outstanding;
+};
+
+struct iscsi_session_pool {
+	struct iscsi_pool_session *sessions;
+	int nsessions;
+	int lun;
+	int connected;
+	enum iscsi_pool_dispatch dispatch;
+	uint64_t stripe;
+	/* where the least outstanding scan starts, to spread out ties */
+	int next;
+	struct iscsi_thread_queue *queue;
+	char error[MAX_STRING_SIZE + 1];
+};
+
+static void
+iscsi_session_pool_set_error(struct iscsi_session_pool *pool,
+			     const char *error_string, ...)
+{
+	va_list ap;
+
+	va_start(ap, error_string);
+	vsnprintf(pool->error, sizeof(pool->error), error_string, ap);
+	va_end(ap);
+}
+
+struct iscsi_session_pool *
+iscsi_session_pool_create(const char *initiator_name, int nsessions)
+{
+	struct iscsi_session_pool *pool;
+	uint32_t rnd;
+	int i;
+
+	if (nsessions < 1 || nsessions > 0xffff) {
+		return NULL;
+	}
+
+	pool = calloc(1, sizeof(struct iscsi_session_pool));
+	if (pool == NULL) {
+		return NULL;
+	}
+	pool->sessions = calloc(nsessions, sizeof(struct iscsi_pool_session));
+	if (pool->sessions == NULL) {
+		free(pool);
+		return NULL;
+	}
+	pool->nsessions = nsessions;
+	pool->dispatch  = ISCSI_POOL_DISPATCH_LEAST_OUTSTANDING;
+	pool->stripe    = ISCSI_POOL_DEFAULT_STRIPE;
+
+	/* All sessions share the random part of the ISID and use the
+	 * qualifier to tell themselves apart, so the target sees them as
+	 * separate sessions from the same initiator.
+	 */
+	rnd = rand() ^ time(NULL);
+	for (i = 0; i < nsessions; i++) {
+		struct iscsi_context *iscsi;
+
+		iscsi = iscsi_create_context(initiator_name);
+		if (iscsi == NULL) {
+			iscsi_session_pool_destroy(pool);
+			return NULL;
+		}
+		pool->sessions[i].iscsi = iscsi;
+		iscsi_set_isid_random(iscsi, rnd, i);
+		iscsi_set_session_type(iscsi, ISCSI_SESSION_NORMAL);
+		iscsi_set_header_digest(iscsi, ISCSI_HEADER_DIGEST_NONE_CRC32C);
+	}
+
+	pool->queue = iscsi_thread_queue_create(pool->sessions[0].iscsi);
+	if (pool->queue == NULL) {
+		iscsi_session_pool_destroy(pool);
+		return NULL;
+	}
+
+	return pool;
+}
+
+void
+iscsi_session_pool_destroy(struct iscsi_session_pool *pool)
+{
+	int i;
+
+	if (pool == NULL) {
+		return;
+	}
+
+	for (i = 0; i < pool->nsessions; i++) {
+		if (pool->sessions[i].io != NULL) {
+			iscsi_stop_io_thread(pool->sessions[i].iscsi);
+			pool->sessions[i].io = NULL;
+		}
+	}
+	for (i = 0; i < pool->nsessions; i++) {
+		struct iscsi_context *iscsi = pool->sessions[i].iscsi;
+
+		if (iscsi == NULL) {
+			continue;
+		}
+		if (iscsi->is_loggedin) {
+			iscsi_logout_sync(iscsi);
+		}
+		/* anything still in flight completes into the queue here */
+		iscsi_destroy_context(iscsi);
+	}
+	iscsi_thread_queue_destroy(pool->queue);
+	free(pool->sessions);
+	free(pool);
+}
+
+const char *
+iscsi_session_pool_get_error(struct iscsi_session_pool *pool)
+{
+	return pool->error;
+}
+
+struct iscsi_context *
+iscsi_session_pool_get_context(struct iscsi_session_pool *pool, int session)
+{
+	if (session < 0 || session >= pool->nsessions) {
+		iscsi_session_pool_set_error(pool, "Invalid session %d",
+					     session);
+		return NULL;
+	}
+	return pool->sessions[session].iscsi;
+}
+
+int
+iscsi_session_pool_set_dispatch(struct iscsi_session_pool *pool,
+				enum iscsi_pool_dispatch dispatch,
+				uint64_t stripe)
+{
+	switch (dispatch) {
+	case ISCSI_POOL_DISPATCH_LEAST_OUTSTANDING:
+		break;
+	case ISCSI_POOL_DISPATCH_LBA_HASH:
+		if (stripe == 0) {
+			iscsi_session_pool_set_error(pool, "Stripe size "
+						     "must not be 0");
+			return -1;
+		}
+		pool->stripe = stripe;
+		break;
+	default:
+		iscsi_session_pool_set_error(pool, "Invalid dispatch mode "
+					     "%d", dispatch);
+		return -1;
+	}
+	pool->dispatch = dispatch;
+
+	return 0;
+}
+
+int
+iscsi_session_pool_connect(struct iscsi_session_pool *pool, const char *url)
+{
+	int i;
+
+	if (pool->connected) {
+		iscsi_session_pool_set_error(pool, "Pool is already "
+					     "connected");
+		return -1;
+	}
+
+	for (i = 0; i < pool->nsessions; i++) {
+		struct iscsi_context *iscsi = pool->sessions[i].iscsi;
+		struct iscsi_url *iscsi_url;
+
+		iscsi_url = iscsi_parse_full_url(iscsi, url);
+		if (iscsi_url == NULL) {
+			iscsi_session_pool_set_error(pool, "Failed to parse "
+						     "URL: %s",
+						     iscsi_get_error(iscsi));
+			return -1;
+		}
+		pool->lun = iscsi_url->lun;
+
+		if (iscsi_full_connect_sync(iscsi, iscsi_url->portal,
+					    iscsi_url->lun) != 0) {
+			iscsi_session_pool_set_error(pool, "Session %d: login "
+						     "failed: %s", i,
+						     iscsi_get_error(iscsi));
+			iscsi_destroy_url(iscsi_url);
+			return -1;
+		}
+		iscsi_destroy_url(iscsi_url);
+
+		pool->sessions[i].io = iscsi_thread_start(iscsi);
+		if (pool->sessions[i].io == NULL) {
+			iscsi_session_pool_set_error(pool, "Session %d: %s", i,
+						     iscsi_get_error(iscsi));
+			return -1;
+		}
+	}
+	pool->connected = 1;
+
+	return 0;
+}
+
+int
+iscsi_session_pool_get_lun(struct iscsi_session_pool *pool)
+{
+	return pool->lun;
+}
+
+int
+iscsi_session_pool_get_fd(struct iscsi_session_pool *pool)
+{
+	return iscsi_thread_queue_get_fd(pool->queue);
+}
+
+/* Returns the starting LBA of the task, or -1 if it does not have one */
+static int64_t
+iscsi_pool_task_lba(struct scsi_task *task)
+{
+	switch (task->cdb[0]) {
+	case SCSI_OPCODE_READ6:
+		return ((task->cdb[1] & 0x1f) << 16) | (task->cdb[2] << 8)
+			| task->cdb[3];
+	case SCSI_OPCODE_READ10:
+	case SCSI_OPCODE_WRITE10:
+	case SCSI_OPCODE_WRITE_VERIFY10:
+	case SCSI_OPCODE_VERIFY10:
+	case SCSI_OPCODE_PREFETCH10:
+	case SCSI_OPCODE_WRITE_SAME10:
+	case SCSI_OPCODE_READ12:
+	case SCSI_OPCODE_WRITE12:
+	case SCSI_OPCODE_WRITE_VERIFY12:
+	case SCSI_OPCODE_VERIFY12:
+		return scsi_get_uint32(&task->cdb[2]);
+	case SCSI_OPCODE_READ16:
+	case SCSI_OPCODE_WRITE16:
+	case SCSI_OPCODE_COMPARE_AND_WRITE:
+	case SCSI_OPCODE_ORWRITE:
+	case SCSI_OPCODE_WRITE_VERIFY16:
+	case SCSI_OPCODE_VERIFY16:
+	case SCSI_OPCODE_PREFETCH16:
+	case SCSI_OPCODE_WRITE_SAME16:
+		return (int64_t)(((uint64_t)scsi_get_uint32(&task->cdb[2]) << 32
+				  | scsi_get_uint32(&task->cdb[6]))
+				 & 0x7fffffffffffffffULL);
+	default:
+		return -1;
+	}
+}
+
+static int
+iscsi_pool_least_outstanding(struct iscsi_session_pool *pool)
+{
+	int i, best = -1, best_count = 0;
+
+	for (i = 0; i < pool->nsessions; i++) {
+		int s = (pool->next + i) % pool->nsessions;
+		int count;
+
+		count = __atomic_load_n(&pool->sessions[s].outstanding,
+					__ATOMIC_RELAXED);
+		if (best == -1 || count < best_count) {
+			best = s;
+			best_count = count;
+		}
+	}
+	pool->next = (best + 1) % pool->nsessions;
+
+	return best;
+}
+
+static int
+iscsi_pool_pick_session(struct iscsi_session_pool *pool,
+			struct scsi_task *task)
+{
+	int64_t lba;
+
+	if (pool->dispatch == ISCSI_POOL_DISPATCH_LBA_HASH
+	&&  (lba = iscsi_pool_task_lba(task)) >= 0) {
+		/* Fibonacci hashing so that neighbouring stripes end up on
+		 * different sessions even when nsessions is a power of 2 */
+		uint64_t h = (uint64_t)lba / pool->stripe;
+
+		h *= 0x9E3779B97F4A7C15ULL;
+		return (h >> 32) % pool->nsessions;
+	}
+
+	return iscsi_pool_least_outstanding(pool);
+}
+
+int
+iscsi_session_pool_submit(struct iscsi_session_pool *pool,
+			  struct scsi_task *task, void *private_data)
+{
+	struct iscsi_pool_session *session;
+
+	if (!pool->connected) {
+		iscsi_session_pool_set_error(pool, "Pool is not connected");
+		return -1;
+	}
+
+	session = &pool->sessions[iscsi_pool_pick_session(pool, task)];
+	if (iscsi_thread_submit(session->io, pool->queue, pool->lun, task,
+				private_data, &session->outstanding) != 0) {
+		iscsi_session_pool_set_error(pool, "Out-of-memory: failed to "
+					     "submit task");
+		return -1;
+	}
+
+	return 0;
+}
+
+int
+iscsi_session_pool_get_completions(struct iscsi_session_pool *pool,
+				   struct iscsi_completion *completions,
+				   int max)
+{
+	return iscsi_thread_queue_get_completions(pool->queue, completions,
+						  max);
+}
+
+#else /* HAVE_PTHREAD */
+
+struct iscsi_session_pool *
+iscsi_session_pool_create(const char *initiator_name _U_, int nsessions _U_)
+{
+	return NULL;
+}
+
+void
+iscsi_session_pool_destroy(struct iscsi_session_pool *pool _U_)
+{
+}
+
+const char *
+iscsi_session_pool_get_error(struct iscsi_session_pool *pool _U_)
+{
+	return "libiscsi was built without thread support";
+}
+
+struct iscsi_context *
+iscsi_session_pool_get_context(struct iscsi_session_pool *pool _U_,
+			       int session _U_)
+{
+	return NULL;
+}
+
+int
+iscsi_session_pool_set_dispatch(struct iscsi_session_pool *pool _U_,
+				enum iscsi_pool_dispatch dispatch _U_,
+				uint64_t stripe _U_)
+{
+	return -1;
+}
+
+int
+iscsi_session_pool_connect(struct iscsi_session_pool *pool _U_,
+			   const char *url _U_)
+{
+	return -1;
+}
+
+int
+iscsi_session_pool_get_lun(struct iscsi_session_pool *pool _U_)
+{
+	return -1;
+}
+
+int
+iscsi_session_pool_get_fd(struct iscsi_session_pool *pool _U_)
+{
+	return -1;
+}
+
+int
+iscsi_session_pool_submit(struct iscsi_session_pool *pool _U_,
+			  struct scsi_task *task _U_, void *private_data _U_)
+{
+	return -1;
+}
+
+int
+iscsi_session_pool_get_completions(struct iscsi_session_pool *pool _U_,
+				   struct iscsi_completion *completions _U_,
+				   int max _U_)
+{
+	return -1;
+}
+
+#endif /* HAVE_PTHREAD */
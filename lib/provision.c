@@ -0,0 +1,763 @@
+/*
+   Copyright (C) 2026 by agent <agent@local>
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU Lesser General Public License as published by
+   the Free Software Foundation; either version 2.1 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public License
+   along with this program; if not, see <http://www.gnu.org/licenses/>.
+*/
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "iscsi.h"
+#include "iscsi-private.h"
+#include "scsi-lowlevel.h"
+#include "slist.h"
+
+/*
+ * Provisioning map.
+ *
+ * Remembers which ranges of a thin provisioned LUN are mapped and which
+ * are deallocated, as a sorted array of non-overlapping extents. Ranges
+ * that are not in the array are unknown. Reads through
+ * iscsi_read_blocks_async() fill the deallocated parts with zeros
+ * themselves and only send the rest to the target.
+ *
+ * The map is filled lazily. A read that touches an unknown range starts
+ * GET LBA STATUS commands for it and then goes to the target as usual.
+ * A few of them are kept in flight at once, each one starting where the
+ * range covered by the last one is expected to end, and each one carries
+ * on from where its own answer stopped until it runs into something that
+ * is already known or gets too far ahead of the reads.
+ *
+ * Writes sent through the context mark the blocks they cover as mapped,
+ * both when they are sent and when they complete, and anything that may
+ * deallocate blocks makes them unknown again. The same changes are
+ * replayed on top of the GET LBA STATUS answers that were in flight
+ * while they happened, so an answer never brings back a stale state.
+ */
+
+/* alloc_len for GET LBA STATUS, room for 4095 descriptors */
+#define ISCSI_LBA_MAP_ALLOC_LEN (64 * 1024)
+
+/* GET LBA STATUS commands in flight per LUN */
+#define ISCSI_LBA_MAP_DEPTH 4
+
+/* how far ahead of the last read the map is filled, in bytes */
+#define ISCSI_LBA_MAP_SCAN_AHEAD (4ULL * 1024 * 1024 * 1024)
+
+#define ISCSI_LBA_MAP_MAX_EXTENTS (1024 * 1024)
+
+#define ISCSI_LBA_UNKNOWN -1
+
+struct iscsi_lba_extent {
+	uint64_t lba;
+	uint64_t end;
+	int state;
+};
+
+struct iscsi_lba_fill {
+	struct iscsi_lba_fill *next;
+	struct iscsi_lba_map *map;
+	uint64_t start;
+	/* changes made while the command was in flight */
+	struct iscsi_lba_extent *replay;
+	int nreplay;
+	int max_replay;
+	int spoiled;
+};
+
+struct iscsi_lba_map {
+	struct iscsi_lba_map *next;
+	int lun;
+	uint64_t num_blocks;
+
+	struct iscsi_lba_extent *ext;
+	uint32_t n;
+	uint32_t max;
+
+	struct iscsi_lba_fill *fills;
+	int nfills;
+	/* blocks the last answer covered */
+	uint64_t stride;
+	uint64_t scan_ahead;
+	uint64_t scan_end;
+	int failed;
+	int disabled;
+};
+
+struct iscsi_lba_read {
+	iscsi_command_cb cb;
+	void *private_data;
+	int pending;
+	int status;
+};
+
+/* Index of the first extent that ends after lba */
+static uint32_t
+iscsi_lba_map_find(struct iscsi_lba_map *map, uint64_t lba)
+{
+	uint32_t lo = 0, hi = map->n;
+
+	while (lo < hi) {
+		uint32_t mid = lo + (hi - lo) / 2;
+
+		if (map->ext[mid].end <= lba) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	return lo;
+}
+
+static int
+iscsi_lba_map_state(struct iscsi_lba_map *map, uint64_t lba)
+{
+	uint32_t i = iscsi_lba_map_find(map, lba);
+
+	if (i < map->n && map->ext[i].lba <= lba) {
+		return map->ext[i].state;
+	}
+	return ISCSI_LBA_UNKNOWN;
+}
+
+/* Set [lba, end) to state. If the map gets too big everything else is
+ * forgotten, it will be filled again as needed.
+ */
+static void
+iscsi_lba_map_set(struct iscsi_context *iscsi, struct iscsi_lba_map *map,
+		  uint64_t lba, uint64_t end, int state)
+{
+	struct iscsi_lba_extent tmp[3];
+	uint32_t i, j, n;
+	int k = 0, l;
+
+	if (end > map->num_blocks) {
+		end = map->num_blocks;
+	}
+	if (lba >= end) {
+		return;
+	}
+
+	i = iscsi_lba_map_find(map, lba);
+	for (j = i; j < map->n && map->ext[j].lba < end; j++) {
+		;
+	}
+
+	if (i < j && map->ext[i].lba < lba) {
+		tmp[k].lba   = map->ext[i].lba;
+		tmp[k].end   = lba;
+		tmp[k].state = map->ext[i].state;
+		k++;
+	}
+	if (state != ISCSI_LBA_UNKNOWN) {
+		tmp[k].lba   = lba;
+		tmp[k].end   = end;
+		tmp[k].state = state;
+		k++;
+	}
+	if (i < j && map->ext[j - 1].end > end) {
+		tmp[k].lba   = end;
+		tmp[k].end   = map->ext[j - 1].end;
+		tmp[k].state = map->ext[j - 1].state;
+		k++;
+	}
+
+	/* join up with the neighbours and with each other */
+	if (k > 0 && i > 0 && map->ext[i - 1].end == tmp[0].lba
+	&&  map->ext[i - 1].state == tmp[0].state) {
+		i--;
+		tmp[0].lba = map->ext[i].lba;
+	}
+	if (k > 0 && j < map->n && map->ext[j].lba == tmp[k - 1].end
+	&&  map->ext[j].state == tmp[k - 1].state) {
+		tmp[k - 1].end = map->ext[j].end;
+		j++;
+	}
+	for (l = 1; l < k; l++) {
+		if (tmp[l - 1].end == tmp[l].lba
+		&&  tmp[l - 1].state == tmp[l].state) {
+			tmp[l - 1].end = tmp[l].end;
+			memmove(&tmp[l], &tmp[l + 1],
+				(k - l - 1) * sizeof(tmp[0]));
+			k--;
+			l--;
+		}
+	}
+
+	n = map->n - (j - i) + k;
+	if (n > map->max) {
+		struct iscsi_lba_extent *ext = NULL;
+		uint32_t max = map->max ? map->max * 2 : 64;
+
+		if (max > ISCSI_LBA_MAP_MAX_EXTENTS) {
+			max = ISCSI_LBA_MAP_MAX_EXTENTS;
+		}
+		if (n <= max && map->ext == NULL) {
+			ext = iscsi_malloc(iscsi, max * sizeof(*ext));
+		} else if (n <= max) {
+			ext = iscsi_realloc(iscsi, map->ext,
+					    max * sizeof(*ext));
+		}
+		if (ext == NULL) {
+			map->n = 0;
+			if (map->max < (uint32_t)k) {
+				return;
+			}
+			i = j = 0;
+			n = k;
+		} else {
+			map->ext = ext;
+			map->max = max;
+		}
+	}
+
+	memmove(&map->ext[i + k], &map->ext[j],
+		(map->n - j) * sizeof(map->ext[0]));
+	memcpy(&map->ext[i], tmp, k * sizeof(tmp[0]));
+	map->n = n;
+}
+
+/* Make a change to the map, and remember it for the answers in flight */
+static void
+iscsi_lba_map_change(struct iscsi_context *iscsi, struct iscsi_lba_map *map,
+		     uint64_t lba, uint64_t end, int state)
+{
+	struct iscsi_lba_fill *fill;
+
+	iscsi_lba_map_set(iscsi, map, lba, end, state);
+
+	for (fill = map->fills; fill != NULL; fill = fill->next) {
+		if (fill->spoiled) {
+			continue;
+		}
+		if (fill->nreplay == fill->max_replay) {
+			struct iscsi_lba_extent *replay;
+			int max = fill->max_replay ? fill->max_replay * 2 : 8;
+
+			if (fill->replay == NULL) {
+				replay = iscsi_malloc(iscsi,
+						      max * sizeof(*replay));
+			} else {
+				replay = iscsi_realloc(iscsi, fill->replay,
+						       max * sizeof(*replay));
+			}
+			if (replay == NULL) {
+				fill->spoiled = 1;
+				continue;
+			}
+			fill->replay     = replay;
+			fill->max_replay = max;
+		}
+		fill->replay[fill->nreplay].lba   = lba;
+		fill->replay[fill->nreplay].end   = end;
+		fill->replay[fill->nreplay].state = state;
+		fill->nreplay++;
+	}
+}
+
+static void
+iscsi_lba_map_free(struct iscsi_context *iscsi, struct iscsi_lba_map *map)
+{
+	iscsi_free(iscsi, map->ext);
+	iscsi_free(iscsi, map);
+}
+
+/* Is there a fill running that should cover lba */
+static int
+iscsi_lba_map_pending(struct iscsi_lba_map *map, uint64_t lba)
+{
+	struct iscsi_lba_fill *fill;
+
+	for (fill = map->fills; fill != NULL; fill = fill->next) {
+		if (lba >= fill->start && lba - fill->start < map->stride) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+static void
+iscsi_lba_map_fill_cb(struct iscsi_context *iscsi, int status,
+		      void *command_data, void *private_data);
+
+static int
+iscsi_lba_map_fill(struct iscsi_context *iscsi, struct iscsi_lba_map *map,
+		   uint64_t start)
+{
+	struct iscsi_lba_fill *fill;
+
+	fill = iscsi_zmalloc(iscsi, sizeof(struct iscsi_lba_fill));
+	if (fill == NULL) {
+		return -1;
+	}
+	fill->map   = map;
+	fill->start = start;
+
+	if (iscsi_get_lba_status_task(iscsi, map->lun, start,
+				      ISCSI_LBA_MAP_ALLOC_LEN,
+				      iscsi_lba_map_fill_cb, fill) == NULL) {
+		iscsi_free(iscsi, fill);
+		return -1;
+	}
+	ISCSI_LIST_ADD(&map->fills, fill);
+	map->nfills++;
+
+	return 0;
+}
+
+/* Start filling the map from lba onwards */
+static void
+iscsi_lba_map_kick(struct iscsi_context *iscsi, struct iscsi_lba_map *map,
+		   uint64_t lba)
+{
+	uint64_t pos = lba;
+
+	if (map->failed) {
+		return;
+	}
+	if (map->scan_end < lba + map->scan_ahead) {
+		map->scan_end = lba + map->scan_ahead;
+	}
+
+	while (map->nfills < ISCSI_LBA_MAP_DEPTH && pos < map->num_blocks
+	&&     pos < map->scan_end) {
+		if (iscsi_lba_map_state(map, pos) == ISCSI_LBA_UNKNOWN
+		&&  !iscsi_lba_map_pending(map, pos)) {
+			if (iscsi_lba_map_fill(iscsi, map, pos) != 0) {
+				return;
+			}
+		}
+		pos += map->stride;
+	}
+}
+
+static void
+iscsi_lba_map_fill_cb(struct iscsi_context *iscsi, int status,
+		      void *command_data, void *private_data)
+{
+	struct iscsi_lba_fill *fill = private_data;
+	struct iscsi_lba_map *map = fill->map;
+	struct scsi_task *task = command_data;
+	struct scsi_get_lba_status *lbas = NULL;
+	uint64_t start = fill->start, end = start;
+	uint32_t i;
+	int r;
+
+	ISCSI_LIST_REMOVE(&map->fills, fill);
+	map->nfills--;
+
+	if (status == SCSI_STATUS_GOOD) {
+		lbas = scsi_datain_unmarshall(task);
+	}
+	if (lbas == NULL) {
+		/* most likely not supported, don't keep asking */
+		if (status != SCSI_STATUS_CANCELLED) {
+			map->failed = 1;
+		}
+	} else if (!fill->spoiled && !map->disabled) {
+		for (i = 0; i < lbas->num_descriptors; i++) {
+			struct scsi_lba_status_descriptor *lbasd =
+				&lbas->descriptors[i];
+
+			if (lbasd->lba != end || lbasd->num_blocks == 0) {
+				break;
+			}
+			if (lbasd->provisioning > SCSI_PROVISIONING_TYPE_ANCHORED) {
+				break;
+			}
+			iscsi_lba_map_set(iscsi, map, end,
+					  end + lbasd->num_blocks,
+					  lbasd->provisioning);
+			end += lbasd->num_blocks;
+		}
+		for (r = 0; r < fill->nreplay; r++) {
+			iscsi_lba_map_set(iscsi, map, fill->replay[r].lba,
+					  fill->replay[r].end,
+					  fill->replay[r].state);
+		}
+		if (end > start) {
+			map->stride = end - start;
+		}
+	}
+	scsi_free_scsi_task(task);
+	iscsi_free(iscsi, fill->replay);
+	iscsi_free(iscsi, fill);
+
+	if (map->disabled) {
+		if (map->nfills == 0) {
+			iscsi_lba_map_free(iscsi, map);
+		}
+		return;
+	}
+
+	/* carry on where this one stopped */
+	if (end > start && end < map->num_blocks && end < map->scan_end
+	&&  iscsi_lba_map_state(map, end) == ISCSI_LBA_UNKNOWN
+	&&  !iscsi_lba_map_pending(map, end) && !map->failed) {
+		iscsi_lba_map_fill(iscsi, map, end);
+	}
+}
+
+struct iscsi_lba_map *
+iscsi_get_lba_map(struct iscsi_context *iscsi, int lun)
+{
+	struct iscsi_lba_map *map;
+
+	for (map = iscsi->lba_maps; map != NULL; map = map->next) {
+		if (map->lun == lun) {
+			return map;
+		}
+	}
+	return NULL;
+}
+
+static void
+iscsi_lba_map_read_cb(struct iscsi_context *iscsi, int status,
+		      void *command_data _U_, void *private_data)
+{
+	struct iscsi_lba_read *rd = private_data;
+
+	if (status != SCSI_STATUS_GOOD && rd->status == SCSI_STATUS_GOOD) {
+		rd->status = status;
+	}
+	if (--rd->pending > 0) {
+		return;
+	}
+	rd->cb(iscsi, rd->status, NULL, rd->private_data);
+	iscsi_free(iscsi, rd);
+}
+
+int
+iscsi_lba_map_read(struct iscsi_context *iscsi, struct iscsi_lba_map *map,
+		   uint64_t lba, uint32_t num_blocks, unsigned char *buf,
+		   iscsi_command_cb cb, void *private_data)
+{
+	uint32_t block_size = iscsi->limits.block_size;
+	uint64_t end = lba + num_blocks, pos, run = 0;
+	struct iscsi_lba_read *rd;
+	uint32_t i;
+	int kicked = 0;
+
+	if (end > map->num_blocks) {
+		return iscsi_read_blocks_cached(iscsi, map->lun, lba,
+						num_blocks, buf, cb,
+						private_data);
+	}
+
+	/* the common cases need no bookkeeping */
+	i = iscsi_lba_map_find(map, lba);
+	if (i < map->n && map->ext[i].lba <= lba && map->ext[i].end >= end) {
+		if (map->ext[i].state != SCSI_PROVISIONING_TYPE_DEALLOCATED) {
+			return iscsi_read_blocks_cached(iscsi, map->lun, lba,
+							num_blocks, buf, cb,
+							private_data);
+		}
+		memset(buf, 0, (size_t)num_blocks * block_size);
+		cb(iscsi, SCSI_STATUS_GOOD, NULL, private_data);
+		return 0;
+	}
+	if (i == map->n || map->ext[i].lba >= end) {
+		iscsi_lba_map_kick(iscsi, map, lba);
+		return iscsi_read_blocks_cached(iscsi, map->lun, lba,
+						num_blocks, buf, cb,
+						private_data);
+	}
+
+	rd = iscsi_zmalloc(iscsi, sizeof(struct iscsi_lba_read));
+	if (rd == NULL) {
+		iscsi_set_error(iscsi, "Out-of-memory: Failed to allocate "
+				"provisioning map read.");
+		return -1;
+	}
+	rd->cb           = cb;
+	rd->private_data = private_data;
+	rd->status       = SCSI_STATUS_GOOD;
+	/* held until everything has been sent */
+	rd->pending      = 1;
+
+	/* zero the deallocated pieces and read the runs in between */
+	for (pos = lba; pos < end; ) {
+		uint64_t next = end;
+		int state = ISCSI_LBA_UNKNOWN;
+
+		if (i < map->n && map->ext[i].lba <= pos) {
+			state = map->ext[i].state;
+			if (map->ext[i].end < end) {
+				next = map->ext[i].end;
+			}
+			i++;
+		} else if (i < map->n && map->ext[i].lba < end) {
+			next = map->ext[i].lba;
+		}
+		if (state == ISCSI_LBA_UNKNOWN && !kicked) {
+			iscsi_lba_map_kick(iscsi, map, pos);
+			kicked = 1;
+		}
+
+		if (state != SCSI_PROVISIONING_TYPE_DEALLOCATED) {
+			run += next - pos;
+		} else {
+			memset(buf + (pos - lba) * block_size, 0,
+			       (size_t)(next - pos) * block_size);
+		}
+		if (run > 0
+		&&  (state == SCSI_PROVISIONING_TYPE_DEALLOCATED
+		     || next == end)) {
+			uint64_t first = (state == SCSI_PROVISIONING_TYPE_DEALLOCATED ? pos : next) - run;
+
+			rd->pending++;
+			if (iscsi_read_blocks_cached(iscsi, map->lun, first,
+						     run,
+						     buf + (first - lba) * block_size,
+						     iscsi_lba_map_read_cb,
+						     rd) != 0) {
+				rd->pending--;
+				rd->status = SCSI_STATUS_ERROR;
+				break;
+			}
+			run = 0;
+		}
+		pos = next;
+	}
+
+	if (rd->pending == 1 && rd->status != SCSI_STATUS_GOOD) {
+		/* nothing went out */
+		iscsi_free(iscsi, rd);
+		return -1;
+	}
+	iscsi_lba_map_read_cb(iscsi, SCSI_STATUS_GOOD, NULL, rd);
+
+	return 0;
+}
+
+/* Make the ranges in an UNMAP parameter list unknown */
+static int
+iscsi_lba_map_unmap(struct iscsi_context *iscsi, struct iscsi_lba_map *map,
+		    struct scsi_task *task)
+{
+	struct scsi_iovec *iov = task->iovector_out.iov;
+	unsigned char *data;
+	size_t len, i;
+
+	if (task->iovector_out.niov != 1 || iov->iov_len < 8) {
+		return -1;
+	}
+	data = iov->iov_base;
+	len  = scsi_get_uint16(&data[2]);
+	if (len > iov->iov_len - 8) {
+		return -1;
+	}
+
+	for (i = 8; i + 16 <= len + 8; i += 16) {
+		uint64_t lba = scsi_get_uint64(&data[i]);
+
+		iscsi_lba_map_change(iscsi, map, lba,
+				     lba + scsi_get_uint32(&data[i + 8]),
+				     ISCSI_LBA_UNKNOWN);
+	}
+	return 0;
+}
+
+/* Called for every SCSI command when it is sent and when it completes */
+void
+iscsi_lba_map_task(struct iscsi_context *iscsi, int lun,
+		   struct scsi_task *task)
+{
+	struct iscsi_lba_map *map;
+	unsigned char *cdb = task->cdb;
+	uint64_t lba, num_blocks;
+	int state = SCSI_PROVISIONING_TYPE_MAPPED;
+
+	map = iscsi_get_lba_map(iscsi, lun);
+	if (map == NULL || map->disabled) {
+		return;
+	}
+
+	switch (cdb[0]) {
+	case SCSI_OPCODE_WRITE_SAME10:
+		state = ISCSI_LBA_UNKNOWN;
+		/* fallthrough */
+	case SCSI_OPCODE_WRITE10:
+	case SCSI_OPCODE_WRITE_VERIFY10:
+	case SCSI_OPCODE_XPWRITE10:
+	case SCSI_OPCODE_XDWRITEREAD10:
+		lba        = scsi_get_uint32(&cdb[2]);
+		num_blocks = scsi_get_uint16(&cdb[7]);
+		break;
+	case SCSI_OPCODE_WRITE12:
+	case SCSI_OPCODE_WRITE_VERIFY12:
+		lba        = scsi_get_uint32(&cdb[2]);
+		num_blocks = scsi_get_uint32(&cdb[6]);
+		break;
+	case SCSI_OPCODE_WRITE_SAME16:
+		/* with UNMAP or ANCHOR set, or zeros, it may deallocate */
+		state = ISCSI_LBA_UNKNOWN;
+		/* fallthrough */
+	case SCSI_OPCODE_WRITE16:
+	case SCSI_OPCODE_WRITE_VERIFY16:
+	case SCSI_OPCODE_ORWRITE:
+		lba        = scsi_get_uint64(&cdb[2]);
+		num_blocks = scsi_get_uint32(&cdb[10]);
+		break;
+	case SCSI_OPCODE_COMPARE_AND_WRITE:
+		lba        = scsi_get_uint64(&cdb[2]);
+		num_blocks = cdb[13];
+		break;
+	case SCSI_OPCODE_VARIABLE_LENGTH:
+		if (scsi_get_uint16(&cdb[8]) == SCSI_READ32) {
+			return;
+		}
+		if (scsi_get_uint16(&cdb[8]) == SCSI_WRITE32) {
+			lba        = scsi_get_uint64(&cdb[12]);
+			num_blocks = scsi_get_uint32(&cdb[28]);
+			break;
+		}
+		iscsi_lba_map_change(iscsi, map, 0, map->num_blocks,
+				     ISCSI_LBA_UNKNOWN);
+		return;
+	case SCSI_OPCODE_UNMAP:
+		if (iscsi_lba_map_unmap(iscsi, map, task) == 0) {
+			return;
+		}
+		/* fallthrough */
+	case SCSI_OPCODE_SANITIZE:
+	case 0x04: /* FORMAT UNIT */
+	case 0x83: /* EXTENDED COPY and friends */
+		iscsi_lba_map_change(iscsi, map, 0, map->num_blocks,
+				     ISCSI_LBA_UNKNOWN);
+		return;
+	default:
+		return;
+	}
+
+	if (num_blocks == 0) {
+		/* WRITE SAME to the end of the LUN */
+		num_blocks = map->num_blocks > lba ? map->num_blocks - lba : 0;
+	}
+	iscsi_lba_map_change(iscsi, map, lba, lba + num_blocks, state);
+}
+
+int
+iscsi_enable_lba_map(struct iscsi_context *iscsi, int lun)
+{
+	struct iscsi_lba_map *map;
+
+	if (iscsi->limits.block_size == 0 || iscsi->limits.num_blocks == 0) {
+		iscsi_set_error(iscsi, "LUN size is not known, call "
+				"iscsi_discover_block_limits_sync() first");
+		return -1;
+	}
+	if (!iscsi->limits.lbpme) {
+		iscsi_set_error(iscsi, "LUN is not thin provisioned");
+		return -1;
+	}
+	if (!iscsi->limits.lbprz) {
+		iscsi_set_error(iscsi, "LUN does not read deallocated blocks "
+				"as zero");
+		return -1;
+	}
+	if (iscsi_get_lba_map(iscsi, lun) != NULL) {
+		iscsi_set_error(iscsi, "LUN %d already has a provisioning map",
+				lun);
+		return -1;
+	}
+
+	map = iscsi_zmalloc(iscsi, sizeof(struct iscsi_lba_map));
+	if (map == NULL) {
+		iscsi_set_error(iscsi, "Out-of-memory: Failed to allocate "
+				"provisioning map.");
+		return -1;
+	}
+	map->lun        = lun;
+	map->num_blocks = iscsi->limits.num_blocks;
+	map->scan_ahead = ISCSI_LBA_MAP_SCAN_AHEAD / iscsi->limits.block_size;
+	/* until we know better, spread the first fills over the window */
+	map->stride     = map->scan_ahead / ISCSI_LBA_MAP_DEPTH;
+
+	ISCSI_LIST_ADD(&iscsi->lba_maps, map);
+
+	return 0;
+}
+
+int
+iscsi_lba_map_lookup(struct iscsi_context *iscsi, int lun, uint64_t lba,
+		     uint64_t *num_blocks)
+{
+	struct iscsi_lba_map *map = iscsi_get_lba_map(iscsi, lun);
+	uint32_t i;
+
+	if (map == NULL) {
+		iscsi_set_error(iscsi, "LUN %d has no provisioning map", lun);
+		return -1;
+	}
+	if (lba >= map->num_blocks) {
+		iscsi_set_error(iscsi, "LBA %llu is beyond the end of the LUN",
+				(unsigned long long)lba);
+		return -1;
+	}
+
+	i = iscsi_lba_map_find(map, lba);
+	if (i < map->n && map->ext[i].lba <= lba) {
+		*num_blocks = map->ext[i].end - lba;
+		return map->ext[i].state;
+	}
+	*num_blocks = (i < map->n ? map->ext[i].lba : map->num_blocks) - lba;
+	iscsi_lba_map_kick(iscsi, map, lba);
+
+	return ISCSI_LBA_UNKNOWN;
+}
+
+void
+iscsi_invalidate_lba_map(struct iscsi_context *iscsi, int lun)
+{
+	struct iscsi_lba_map *map = iscsi_get_lba_map(iscsi, lun);
+
+	if (map != NULL) {
+		iscsi_lba_map_change(iscsi, map, 0, map->num_blocks,
+				     ISCSI_LBA_UNKNOWN);
+		map->failed = 0;
+	}
+}
+
+static void
+iscsi_lba_map_disable(struct iscsi_context *iscsi, struct iscsi_lba_map *map)
+{
+	ISCSI_LIST_REMOVE(&iscsi->lba_maps, map);
+	map->disabled = 1;
+	if (map->nfills == 0) {
+		iscsi_lba_map_free(iscsi, map);
+	}
+	/* otherwise the last fill to complete frees it */
+}
+
+void
+iscsi_disable_lba_map(struct iscsi_context *iscsi, int lun)
+{
+	struct iscsi_lba_map *map = iscsi_get_lba_map(iscsi, lun);
+
+	if (map != NULL) {
+		iscsi_lba_map_disable(iscsi, map);
+	}
+}
+
+void
+iscsi_free_lba_maps(struct iscsi_context *iscsi)
+{
+	while (iscsi->lba_maps != NULL) {
+		iscsi_lba_map_disable(iscsi, iscsi->lba_maps);
+	}
+}
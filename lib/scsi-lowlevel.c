@@ -74,6 +74,8 @@ scsi_free_scsi_task(struct scsi_task *task)
 		   free(mem);
 	}
 
+	free(task->iovector_in.index);
+	free(task->iovector_out.index);
 	free(task->datain.data);
 	free(task);
 }
@@ -83,6 +85,10 @@ scsi_create_task(int cdb_size, unsigned char *cdb, int xfer_dir, int expxferlen)
 {
 	struct scsi_task *task;
 
+	if (cdb_size < 0 || cdb_size > SCSI_CDB_MAX_SIZE) {
+		return NULL;
+	}
+
 	task = malloc(sizeof(struct scsi_task));
 	if (task == NULL) {
 		return NULL;
@@ -173,6 +179,12 @@ scsi_sense_ascq_str(int ascq)
 	struct value_string ascqs[] = {
 		{SCSI_SENSE_ASCQ_SANITIZE_IN_PROGRESS,
 		 "SANITIZE_IN_PROGRESS"},
+		{SCSI_SENSE_ASCQ_LOGICAL_BLOCK_GUARD_CHECK_FAILED,
+		 "LOGICAL_BLOCK_GUARD_CHECK_FAILED"},
+		{SCSI_SENSE_ASCQ_LOGICAL_BLOCK_APPTAG_CHECK_FAILED,
+		 "LOGICAL_BLOCK_APPTAG_CHECK_FAILED"},
+		{SCSI_SENSE_ASCQ_LOGICAL_BLOCK_REFTAG_CHECK_FAILED,
+		 "LOGICAL_BLOCK_REFTAG_CHECK_FAILED"},
 		{SCSI_SENSE_ASCQ_WRITE_AFTER_SANITIZE_REQUIRED,
 		 "WRITE_AFTER_SANITIZE_REQUIRED"},
 		{SCSI_SENSE_ASCQ_INVALID_OPERATION_CODE,
@@ -1086,6 +1098,301 @@ scsi_cdb_report_supported_opcodes(int rctd, int options, enum scsi_opcode opcode
 	return task;
 }
 
+/*
+ * EXTENDED COPY (LID1)
+ */
+struct scsi_task *
+scsi_cdb_extended_copy(int list_id, enum scsi_list_id_usage list_id_usage, int priority, struct scsi_copy_target_descriptor *targets, int num_targets, struct scsi_copy_segment_descriptor *segments, int num_segments)
+{
+	struct scsi_task *task;
+	struct scsi_iovec *iov;
+	unsigned char *buf, *d;
+	int xferlen, i;
+
+	if (num_targets < 1 || num_segments < 1) {
+		return NULL;
+	}
+	for (i = 0; i < num_targets; i++) {
+		if (targets[i].designator_length < 0
+		||  targets[i].designator_length > SCSI_XCOPY_MAX_DESIGNATOR_LEN) {
+			return NULL;
+		}
+	}
+
+	task = malloc(sizeof(struct scsi_task));
+	if (task == NULL)
+		goto err;
+
+	memset(task, 0, sizeof(struct scsi_task));
+
+	iov = scsi_malloc(task, sizeof(struct scsi_iovec));
+	if (iov == NULL)
+		goto err;
+
+	xferlen = 16 + num_targets * SCSI_XCOPY_TARGET_DESC_LEN
+		+ num_segments * SCSI_XCOPY_SEGMENT_DESC_LEN;
+	buf = scsi_malloc(task, xferlen);
+	if (buf == NULL)
+		goto err;
+
+	memset(buf, 0, xferlen);
+	buf[0] = list_id;
+	buf[1] = ((list_id_usage & 0x03) << 3) | (priority & 0x07);
+	scsi_set_uint16(&buf[2], num_targets * SCSI_XCOPY_TARGET_DESC_LEN);
+	scsi_set_uint32(&buf[8], num_segments * SCSI_XCOPY_SEGMENT_DESC_LEN);
+
+	d = &buf[16];
+	for (i = 0; i < num_targets; i++) {
+		d[0] = 0xe4;
+		d[1] = targets[i].device_type & 0x1f;
+		scsi_set_uint16(&d[2], targets[i].relative_port);
+		/* designation descriptor */
+		d[4] = targets[i].code_set & 0x0f;
+		d[5] = ((targets[i].association & 0x03) << 4)
+			| (targets[i].designator_type & 0x0f);
+		d[7] = targets[i].designator_length;
+		memcpy(&d[8], targets[i].designator,
+		       targets[i].designator_length);
+		/* block device parameters */
+		d[29] = (targets[i].block_length >> 16) & 0xff;
+		d[30] = (targets[i].block_length >> 8) & 0xff;
+		d[31] = targets[i].block_length & 0xff;
+		d += SCSI_XCOPY_TARGET_DESC_LEN;
+	}
+	for (i = 0; i < num_segments; i++) {
+		d[0] = 0x02;
+		scsi_set_uint16(&d[2], SCSI_XCOPY_SEGMENT_DESC_LEN - 4);
+		scsi_set_uint16(&d[4], segments[i].src_index);
+		scsi_set_uint16(&d[6], segments[i].dst_index);
+		scsi_set_uint16(&d[10], segments[i].num_blocks);
+		scsi_set_uint64(&d[12], segments[i].src_lba);
+		scsi_set_uint64(&d[20], segments[i].dst_lba);
+		d += SCSI_XCOPY_SEGMENT_DESC_LEN;
+	}
+
+	task->cdb[0] = SCSI_OPCODE_EXTENDED_COPY;
+	task->cdb[1] = SCSI_EXTENDED_COPY_LID1;
+	scsi_set_uint32(&task->cdb[10], xferlen);
+
+	task->cdb_size = 16;
+	task->xfer_dir = SCSI_XFER_WRITE;
+	task->expxferlen = xferlen;
+
+	iov->iov_base = buf;
+	iov->iov_len  = xferlen;
+	scsi_task_set_iov_out(task, iov, 1);
+
+	return task;
+
+err:
+	scsi_free_scsi_task(task);
+	return NULL;
+}
+
+/*
+ * POPULATE TOKEN
+ */
+struct scsi_task *
+scsi_cdb_populate_token(uint32_t list_id, uint32_t xferlen)
+{
+	struct scsi_task *task;
+
+	task = malloc(sizeof(struct scsi_task));
+	if (task == NULL) {
+		return NULL;
+	}
+
+	memset(task, 0, sizeof(struct scsi_task));
+	task->cdb[0] = SCSI_OPCODE_EXTENDED_COPY;
+	task->cdb[1] = SCSI_POPULATE_TOKEN;
+	scsi_set_uint32(&task->cdb[6], list_id);
+	scsi_set_uint32(&task->cdb[10], xferlen);
+
+	task->cdb_size = 16;
+	if (xferlen != 0) {
+		task->xfer_dir = SCSI_XFER_WRITE;
+	} else {
+		task->xfer_dir = SCSI_XFER_NONE;
+	}
+	task->expxferlen = xferlen;
+
+	return task;
+}
+
+/*
+ * WRITE USING TOKEN
+ */
+struct scsi_task *
+scsi_cdb_write_using_token(uint32_t list_id, uint32_t xferlen)
+{
+	struct scsi_task *task;
+
+	task = scsi_cdb_populate_token(list_id, xferlen);
+	if (task == NULL) {
+		return NULL;
+	}
+	task->cdb[1] = SCSI_WRITE_USING_TOKEN;
+
+	return task;
+}
+
+/*
+ * RECEIVE COPY RESULTS
+ */
+struct scsi_task *
+scsi_cdb_receive_copy_results(enum scsi_receive_copy_results_sa sa, uint32_t list_id, uint32_t alloc_len)
+{
+	struct scsi_task *task;
+
+	task = malloc(sizeof(struct scsi_task));
+	if (task == NULL) {
+		return NULL;
+	}
+
+	memset(task, 0, sizeof(struct scsi_task));
+	task->cdb[0] = SCSI_OPCODE_RECEIVE_COPY_RESULTS;
+	task->cdb[1] = sa & 0x1f;
+
+	/* the LID4 service actions take a 32 bit list identifier */
+	if (sa == SCSI_COPY_RESULTS_ROD_TOKEN_INFO) {
+		scsi_set_uint32(&task->cdb[2], list_id);
+	} else {
+		task->cdb[2] = list_id & 0xff;
+	}
+	scsi_set_uint32(&task->cdb[10], alloc_len);
+
+	task->cdb_size = 16;
+	if (alloc_len != 0) {
+		task->xfer_dir = SCSI_XFER_READ;
+	} else {
+		task->xfer_dir = SCSI_XFER_NONE;
+	}
+	task->expxferlen = alloc_len;
+
+	return task;
+}
+
+static inline uint8_t
+scsi_receivecopyresults_sa(const struct scsi_task *task)
+{
+	return task->cdb[1] & 0x1f;
+}
+
+static int
+scsi_receivecopyresults_datain_getfullsize(struct scsi_task *task)
+{
+	switch (scsi_receivecopyresults_sa(task)) {
+	case SCSI_COPY_RESULTS_COPY_STATUS:
+	case SCSI_COPY_RESULTS_OP_PARAMS:
+	case SCSI_COPY_RESULTS_ROD_TOKEN_INFO:
+		return task_get_uint32(task, 0) + 4;
+	default:
+		return -1;
+	}
+}
+
+static void *
+scsi_receivecopyresults_datain_unmarshall(struct scsi_task *task)
+{
+	switch (scsi_receivecopyresults_sa(task)) {
+	case SCSI_COPY_RESULTS_COPY_STATUS: {
+		struct scsi_copy_results_copy_status *cs;
+
+		if (task->datain.size < 12) {
+			return NULL;
+		}
+		cs = scsi_malloc(task, sizeof(*cs));
+		if (cs == NULL) {
+			return NULL;
+		}
+		cs->hdd                  = !!(task_get_uint8(task, 4) & 0x80);
+		cs->copy_manager_status  = task_get_uint8(task, 4) & 0x7f;
+		cs->segments_processed   = task_get_uint16(task, 5);
+		cs->transfer_count_units = task_get_uint8(task, 7);
+		cs->transfer_count       = task_get_uint32(task, 8);
+		return cs;
+	}
+	case SCSI_COPY_RESULTS_OP_PARAMS: {
+		struct scsi_copy_results_op_params *op;
+		int i, len;
+
+		if (task->datain.size < 44) {
+			return NULL;
+		}
+		op = scsi_malloc(task, sizeof(*op));
+		if (op == NULL) {
+			return NULL;
+		}
+		op->snlid                    = task_get_uint8(task, 4) & 0x01;
+		op->max_target_desc_count    = task_get_uint16(task, 8);
+		op->max_segment_desc_count   = task_get_uint16(task, 10);
+		op->max_desc_list_length     = task_get_uint32(task, 12);
+		op->max_segment_length       = task_get_uint32(task, 16);
+		op->max_inline_data_length   = task_get_uint32(task, 20);
+		op->held_data_limit          = task_get_uint32(task, 24);
+		op->max_stream_device_transfer_size = task_get_uint32(task, 28);
+		op->total_concurrent_copies  = task_get_uint16(task, 34);
+		op->max_concurrent_copies    = task_get_uint8(task, 36);
+		op->data_segment_granularity = task_get_uint8(task, 37);
+		op->inline_data_granularity  = task_get_uint8(task, 38);
+		op->held_data_granularity    = task_get_uint8(task, 39);
+
+		len = task_get_uint8(task, 43);
+		if (len > task->datain.size - 44) {
+			len = task->datain.size - 44;
+		}
+		op->num_desc_type_codes = len;
+		op->desc_type_codes = scsi_malloc(task, len + 1);
+		if (op->desc_type_codes == NULL) {
+			return NULL;
+		}
+		for (i = 0; i < len; i++) {
+			op->desc_type_codes[i] = task_get_uint8(task, 44 + i);
+		}
+		return op;
+	}
+	case SCSI_COPY_RESULTS_ROD_TOKEN_INFO: {
+		struct scsi_copy_results_rod_token_info *rti;
+		int sense_len, pos;
+
+		if (task->datain.size < 32) {
+			return NULL;
+		}
+		rti = scsi_malloc(task, sizeof(*rti));
+		if (rti == NULL) {
+			return NULL;
+		}
+		memset(rti, 0, sizeof(*rti));
+		rti->response_to_service_action = task_get_uint8(task, 4) & 0x1f;
+		rti->copy_operation_status = task_get_uint8(task, 5) & 0x7f;
+		rti->operation_counter     = task_get_uint16(task, 6);
+		rti->estimated_status_update_delay = task_get_uint32(task, 8);
+		rti->extended_copy_completion_status = task_get_uint8(task, 12);
+		rti->transfer_count_units  = task_get_uint8(task, 15);
+		rti->transfer_count        = task_get_uint64(task, 16);
+		rti->segments_processed    = task_get_uint16(task, 24);
+
+		sense_len = task_get_uint8(task, 13);
+		if (sense_len > 0 && task->datain.size >= 32 + sense_len) {
+			rti->has_sense = 1;
+			scsi_parse_sense_data(&rti->sense, &task->datain.data[32]);
+		}
+
+		/* ROD token descriptors length, reserved, then the token */
+		pos = 32 + sense_len;
+		if (task_get_uint32(task, pos) >= 2 + SCSI_ROD_TOKEN_LEN
+		&&  task->datain.size >= pos + 6 + SCSI_ROD_TOKEN_LEN) {
+			rti->has_rod_token = 1;
+			memcpy(rti->rod_token, &task->datain.data[pos + 6],
+			       SCSI_ROD_TOKEN_LEN);
+		}
+		return rti;
+	}
+	default:
+		return NULL;
+	}
+}
+
 /*
  * parse the data in blob and calculate the size of a full
  * readcapacity10 datain structure
@@ -3230,6 +3537,259 @@ scsi_cdb_writeverify16(uint64_t lba, uint32_t xferlen, int blocksize, int wrprot
 	return task;
 }
 
+/*
+ * XDWRITEREAD10
+ */
+struct scsi_task *
+scsi_cdb_xdwriteread10(uint32_t lba, uint32_t xferlen, int blocksize, int wrprotect, int dpo, int fua, int disable_write, int fua_nv, int group_number)
+{
+	struct scsi_task *task;
+
+	task = malloc(sizeof(struct scsi_task));
+	if (task == NULL) {
+		return NULL;
+	}
+
+	memset(task, 0, sizeof(struct scsi_task));
+	task->cdb[0]   = SCSI_OPCODE_XDWRITEREAD10;
+
+	task->cdb[1] |= ((wrprotect & 0x07) << 5);
+	if (dpo) {
+		task->cdb[1] |= 0x10;
+	}
+	if (fua) {
+		task->cdb[1] |= 0x08;
+	}
+	if (disable_write) {
+		task->cdb[1] |= 0x04;
+	}
+	if (fua_nv) {
+		task->cdb[1] |= 0x02;
+	}
+
+	scsi_set_uint32(&task->cdb[2], lba);
+	scsi_set_uint16(&task->cdb[7], xferlen/blocksize);
+
+	task->cdb[6] |= (group_number & 0x1f);
+
+	task->cdb_size = 10;
+	if (xferlen != 0) {
+		task->xfer_dir = SCSI_XFER_BIDIRECTIONAL;
+	} else {
+		task->xfer_dir = SCSI_XFER_NONE;
+	}
+	task->expxferlen = xferlen;
+	task->bidi_read_xferlen = xferlen;
+
+	return task;
+}
+
+/*
+ * XDWRITEREAD32
+ */
+struct scsi_task *
+scsi_cdb_xdwriteread32(uint64_t lba, uint32_t xferlen, int blocksize, int wrprotect, int dpo, int fua, int disable_write, int fua_nv, int group_number)
+{
+	struct scsi_task *task;
+
+	task = malloc(sizeof(struct scsi_task));
+	if (task == NULL) {
+		return NULL;
+	}
+
+	memset(task, 0, sizeof(struct scsi_task));
+	task->cdb[0]   = SCSI_OPCODE_VARIABLE_LENGTH;
+	task->cdb[6] |= (group_number & 0x1f);
+	task->cdb[7]   = 0x18;
+	scsi_set_uint16(&task->cdb[8], SCSI_XDWRITEREAD32);
+
+	task->cdb[10] |= ((wrprotect & 0x07) << 5);
+	if (dpo) {
+		task->cdb[10] |= 0x10;
+	}
+	if (fua) {
+		task->cdb[10] |= 0x08;
+	}
+	if (disable_write) {
+		task->cdb[10] |= 0x04;
+	}
+	if (fua_nv) {
+		task->cdb[10] |= 0x02;
+	}
+
+	scsi_set_uint32(&task->cdb[12], lba >> 32);
+	scsi_set_uint32(&task->cdb[16], lba & 0xffffffff);
+	scsi_set_uint32(&task->cdb[28], xferlen/blocksize);
+
+	task->cdb_size = 32;
+	if (xferlen != 0) {
+		task->xfer_dir = SCSI_XFER_BIDIRECTIONAL;
+	} else {
+		task->xfer_dir = SCSI_XFER_NONE;
+	}
+	task->expxferlen = xferlen;
+	task->bidi_read_xferlen = xferlen;
+
+	return task;
+}
+
+/*
+ * XPWRITE10
+ */
+struct scsi_task *
+scsi_cdb_xpwrite10(uint32_t lba, uint32_t xferlen, int blocksize, int dpo, int fua, int fua_nv, int xorpinfo, int group_number)
+{
+	struct scsi_task *task;
+
+	task = malloc(sizeof(struct scsi_task));
+	if (task == NULL) {
+		return NULL;
+	}
+
+	memset(task, 0, sizeof(struct scsi_task));
+	task->cdb[0]   = SCSI_OPCODE_XPWRITE10;
+
+	if (dpo) {
+		task->cdb[1] |= 0x10;
+	}
+	if (fua) {
+		task->cdb[1] |= 0x08;
+	}
+	if (fua_nv) {
+		task->cdb[1] |= 0x02;
+	}
+	if (xorpinfo) {
+		task->cdb[1] |= 0x01;
+	}
+
+	scsi_set_uint32(&task->cdb[2], lba);
+	scsi_set_uint16(&task->cdb[7], xferlen/blocksize);
+
+	task->cdb[6] |= (group_number & 0x1f);
+
+	task->cdb_size = 10;
+	if (xferlen != 0) {
+		task->xfer_dir = SCSI_XFER_WRITE;
+	} else {
+		task->xfer_dir = SCSI_XFER_NONE;
+	}
+	task->expxferlen = xferlen;
+
+	return task;
+}
+
+/*
+ * XPWRITE32
+ */
+struct scsi_task *
+scsi_cdb_xpwrite32(uint64_t lba, uint32_t xferlen, int blocksize, int dpo, int fua, int fua_nv, int xorpinfo, int group_number)
+{
+	struct scsi_task *task;
+
+	task = malloc(sizeof(struct scsi_task));
+	if (task == NULL) {
+		return NULL;
+	}
+
+	memset(task, 0, sizeof(struct scsi_task));
+	task->cdb[0]   = SCSI_OPCODE_VARIABLE_LENGTH;
+	task->cdb[6] |= (group_number & 0x1f);
+	task->cdb[7]   = 0x18;
+	scsi_set_uint16(&task->cdb[8], SCSI_XPWRITE32);
+
+	if (dpo) {
+		task->cdb[10] |= 0x10;
+	}
+	if (fua) {
+		task->cdb[10] |= 0x08;
+	}
+	if (fua_nv) {
+		task->cdb[10] |= 0x02;
+	}
+	if (xorpinfo) {
+		task->cdb[10] |= 0x01;
+	}
+
+	scsi_set_uint32(&task->cdb[12], lba >> 32);
+	scsi_set_uint32(&task->cdb[16], lba & 0xffffffff);
+	scsi_set_uint32(&task->cdb[28], xferlen/blocksize);
+
+	task->cdb_size = 32;
+	if (xferlen != 0) {
+		task->xfer_dir = SCSI_XFER_WRITE;
+	} else {
+		task->xfer_dir = SCSI_XFER_NONE;
+	}
+	task->expxferlen = xferlen;
+
+	return task;
+}
+
+/*
+ * READ32 / WRITE32
+ */
+static struct scsi_task *
+scsi_cdb_rw32(int sa, uint64_t lba, uint32_t xferlen, int blocksize, int protect, int dpo, int fua, int fua_nv, int group_number, uint32_t ref_tag, uint16_t app_tag, uint16_t app_tag_mask)
+{
+	struct scsi_task *task;
+
+	task = malloc(sizeof(struct scsi_task));
+	if (task == NULL) {
+		return NULL;
+	}
+
+	memset(task, 0, sizeof(struct scsi_task));
+	task->cdb[0]   = SCSI_OPCODE_VARIABLE_LENGTH;
+	task->cdb[6] |= (group_number & 0x1f);
+	task->cdb[7]   = 0x18;
+	scsi_set_uint16(&task->cdb[8], sa);
+
+	task->cdb[10] |= ((protect & 0x07) << 5);
+	if (dpo) {
+		task->cdb[10] |= 0x10;
+	}
+	if (fua) {
+		task->cdb[10] |= 0x08;
+	}
+	if (fua_nv) {
+		task->cdb[10] |= 0x02;
+	}
+
+	scsi_set_uint32(&task->cdb[12], lba >> 32);
+	scsi_set_uint32(&task->cdb[16], lba & 0xffffffff);
+	scsi_set_uint32(&task->cdb[20], ref_tag);
+	scsi_set_uint16(&task->cdb[24], app_tag);
+	scsi_set_uint16(&task->cdb[26], app_tag_mask);
+	scsi_set_uint32(&task->cdb[28], xferlen/blocksize);
+
+	task->cdb_size = 32;
+	if (xferlen != 0) {
+		task->xfer_dir = sa == SCSI_READ32 ? SCSI_XFER_READ
+			: SCSI_XFER_WRITE;
+	} else {
+		task->xfer_dir = SCSI_XFER_NONE;
+	}
+	task->expxferlen = xferlen;
+
+	return task;
+}
+
+struct scsi_task *
+scsi_cdb_read32(uint64_t lba, uint32_t xferlen, int blocksize, int rdprotect, int dpo, int fua, int fua_nv, int group_number, uint32_t ref_tag, uint16_t app_tag, uint16_t app_tag_mask)
+{
+	return scsi_cdb_rw32(SCSI_READ32, lba, xferlen, blocksize, rdprotect,
+			     dpo, fua, fua_nv, group_number,
+			     ref_tag, app_tag, app_tag_mask);
+}
+
+struct scsi_task *
+scsi_cdb_write32(uint64_t lba, uint32_t xferlen, int blocksize, int wrprotect, int dpo, int fua, int fua_nv, int group_number, uint32_t ref_tag, uint16_t app_tag, uint16_t app_tag_mask)
+{
+	return scsi_cdb_rw32(SCSI_WRITE32, lba, xferlen, blocksize, wrprotect,
+			     dpo, fua, fua_nv, group_number,
+			     ref_tag, app_tag, app_tag_mask);
+}
+
 int
 scsi_datain_getfullsize(struct scsi_task *task)
 {
@@ -3252,6 +3812,8 @@ scsi_datain_getfullsize(struct scsi_task *task)
 		return scsi_persistentreservein_datain_getfullsize(task);
 	case SCSI_OPCODE_MAINTENANCE_IN:
 		return scsi_maintenancein_datain_getfullsize(task);
+	case SCSI_OPCODE_RECEIVE_COPY_RESULTS:
+		return scsi_receivecopyresults_datain_getfullsize(task);
 	}
 	return -1;
 }
@@ -3281,6 +3843,8 @@ scsi_datain_unmarshall(struct scsi_task *task)
 		return scsi_persistentreservein_datain_unmarshall(task);
 	case SCSI_OPCODE_MAINTENANCE_IN:
 		return scsi_maintenancein_datain_unmarshall(task);
+	case SCSI_OPCODE_RECEIVE_COPY_RESULTS:
+		return scsi_receivecopyresults_datain_unmarshall(task);
 	}
 	return NULL;
 }
@@ -3803,11 +4367,36 @@ scsi_get_task_private_ptr(struct scsi_task *task)
 	return task->ptr;
 }
 
+void
+scsi_task_get_times(struct scsi_task *task, struct scsi_task_times *times)
+{
+	*times = task->times;
+}
+
+int
+scsi_task_set_attribute(struct scsi_task *task,
+			enum scsi_task_attribute attr, int priority)
+{
+	if (priority < SCSI_TASK_PRIORITY_NONE
+	||  priority > SCSI_TASK_PRIORITY_LOWEST) {
+		return -1;
+	}
+	task->task_attr     = attr;
+	task->task_priority = priority;
+
+	return 0;
+}
+
 void
 scsi_task_set_iov_out(struct scsi_task *task, struct scsi_iovec *iov, int niov) 
 {
 	task->iovector_out.iov = iov;
 	task->iovector_out.niov = niov;
+	/* the caller owns iov, adding to it has to copy it */
+	task->iovector_out.nalloc = niov;
+	task->iovector_out.nindex = 0;
+	task->iovector_out.offset = 0;
+	task->iovector_out.consumed = 0;
 }
 
 void
@@ -3815,6 +4404,10 @@ scsi_task_set_iov_in(struct scsi_task *task, struct scsi_iovec *iov, int niov)
 {
 	task->iovector_in.iov = iov;
 	task->iovector_in.niov = niov;
+	task->iovector_in.nalloc = niov;
+	task->iovector_in.nindex = 0;
+	task->iovector_in.offset = 0;
+	task->iovector_in.consumed = 0;
 }
 
 void
@@ -3826,30 +4419,46 @@ scsi_task_reset_iov(struct scsi_iovector *iovector)
 
 #define IOVECTOR_INITAL_ALLOC (16)
 
+static int
+scsi_iovector_reserve(struct scsi_task *task, struct scsi_iovector *iovector, int nalloc)
+{
+	struct scsi_iovec *iov;
+
+	if (nalloc <= iovector->nalloc) {
+		return 0;
+	}
+
+	iov = scsi_malloc(task, nalloc * sizeof(struct scsi_iovec));
+	if (iov == NULL) {
+		return -1;
+	}
+	if (iovector->niov > 0) {
+		memcpy(iov, iovector->iov, iovector->niov * sizeof(struct scsi_iovec));
+	}
+	iovector->iov = iov;
+	iovector->nalloc = nalloc;
+
+	return 0;
+}
+
 static int
 scsi_iovector_add(struct scsi_task *task, struct scsi_iovector *iovector, int len, unsigned char *buf)
 {
 	if (len < 0) {
 		return -1;
 	}
-	
-	if (iovector->iov == NULL) {
-		iovector->iov = scsi_malloc(task, IOVECTOR_INITAL_ALLOC*sizeof(struct iovec));
-		if (iovector->iov == NULL) {
-			return -1;
-		}
-		iovector->nalloc = IOVECTOR_INITAL_ALLOC;
-	}
 
 	/* iovec allocation is too small */
 	if (iovector->nalloc < iovector->niov + 1) {
-		struct scsi_iovec *old_iov = iovector->iov;
-		iovector->iov = scsi_malloc(task, 2 * iovector->nalloc * sizeof(struct iovec));
-		if (iovector->iov == NULL) {
+		int nalloc = iovector->nalloc < IOVECTOR_INITAL_ALLOC ?
+			IOVECTOR_INITAL_ALLOC : 2 * iovector->nalloc;
+
+		while (nalloc < iovector->niov + 1) {
+			nalloc <<= 1;
+		}
+		if (scsi_iovector_reserve(task, iovector, nalloc) != 0) {
 			return -1;
 		}
-		memcpy(iovector->iov, old_iov, iovector->niov * sizeof(struct iovec));
-		iovector->nalloc <<= 1;
 	}
 
 	iovector->iov[iovector->niov].iov_len = len;
@@ -3871,6 +4480,18 @@ scsi_task_add_data_out_buffer(struct scsi_task *task, int len, unsigned char *bu
 	return scsi_iovector_add(task, &task->iovector_out, len, buf);
 }
 
+int
+scsi_task_reserve_data_in_buffers(struct scsi_task *task, int niov)
+{
+	return scsi_iovector_reserve(task, &task->iovector_in, niov);
+}
+
+int
+scsi_task_reserve_data_out_buffers(struct scsi_task *task, int niov)
+{
+	return scsi_iovector_reserve(task, &task->iovector_out, niov);
+}
+
 int
 scsi_task_get_status(struct scsi_task *task, struct scsi_sense *sense)
 {
@@ -58,6 +58,7 @@
 #endif
 
 #include <sys/uio.h>
+#include <limits.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -65,9 +66,13 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <time.h>
+#ifndef HAVE_CLOCK_GETTIME
+#include <sys/time.h>
+#endif
 #include "scsi-lowlevel.h"
 #include "iscsi.h"
 #include "iscsi-private.h"
+#include "iscsi-trace.h"
 #include "slist.h"
 
 static uint32_t iface_rr = 0;
@@ -100,6 +105,34 @@ iscsi_add_to_outqueue(struct iscsi_context *iscsi, struct iscsi_pdu *pdu)
 		iscsi_pdu_set_cmdsn(pdu, current->cmdsn);
 	}
 
+	/* Urgent PDUs go ahead of any DATA-OUT that is queued behind the
+	 * last command PDU, but never ahead of a command PDU, which would
+	 * break CmdSN order, nor ahead of an earlier urgent PDU, which
+	 * would break DataSN order of urgent writes.
+	 * Only do this while the command fits in the CmdSN window, or it
+	 * would block the DATA-OUT that earlier commands are waiting for.
+	 */
+	if (pdu->flags & ISCSI_PDU_URGENT
+	&& !(pdu->outdata.data[0] & ISCSI_PDU_IMMEDIATE)
+	&& iscsi_serial32_compare(pdu->cmdsn, iscsi->maxcmdsn) <= 0) {
+		struct iscsi_pdu *insert_after = NULL;
+
+		for (; current != NULL; current = current->next) {
+			if ((current->outdata.data[0] & 0x3f) != ISCSI_PDU_DATA_OUT
+			||  current->flags & ISCSI_PDU_URGENT) {
+				insert_after = current;
+			}
+		}
+		if (insert_after == NULL) {
+			pdu->next = iscsi->outqueue;
+			iscsi->outqueue = pdu;
+		} else {
+			pdu->next = insert_after->next;
+			insert_after->next = pdu;
+		}
+		return;
+	}
+
 	do {
 		if (iscsi_serial32_compare(pdu->cmdsn, current->cmdsn) < 0 ||
 			(pdu->outdata.data[0] & ISCSI_PDU_IMMEDIATE && !(current->outdata.data[0] & ISCSI_PDU_IMMEDIATE))) {
@@ -438,84 +471,147 @@ iscsi_queue_length(struct iscsi_context *iscsi)
 	return i;
 }
 
-ssize_t
-iscsi_iovector_readv_writev(struct iscsi_context *iscsi, struct scsi_iovector *iovector, uint32_t pos, ssize_t count, int do_write)
+/* Most iovecs handed to one readv/writev */
+#if defined(IOV_MAX) && IOV_MAX < 1024
+#define ISCSI_IOV_BATCH IOV_MAX
+#else
+#define ISCSI_IOV_BATCH 1024
+#endif
+
+/* Bring the offsets of the iovecs up to date with the ones added since */
+static int
+iscsi_iovector_index(struct scsi_iovector *iovector)
 {
-	if (iovector->iov == NULL) {
-		errno = EINVAL;
+	size_t *index;
+	int i;
+
+	if (iovector->nindex > iovector->niov) {
+		iovector->nindex = 0;
+	}
+	index = realloc(iovector->index,
+			(iovector->niov + 1) * sizeof(size_t));
+	if (index == NULL) {
 		return -1;
 	}
+	if (iovector->nindex == 0) {
+		index[0] = 0;
+	}
+	for (i = iovector->nindex; i < iovector->niov; i++) {
+		index[i + 1] = index[i] + iovector->iov[i].iov_len;
+	}
+	iovector->index  = index;
+	iovector->nindex = iovector->niov;
 
-	if (pos < iovector->offset) {
-		iscsi_set_error(iscsi, "iovector reset. pos is smaller than"
-				"current offset");
-		errno = EINVAL;
-		return -1;
+	return 0;
+}
+
+/*
+ * Move the cursor to the iovec that pos falls in. Going through the data
+ * in order only ever moves it on to the next iovec, anything else is a
+ * binary search of the iovec offsets.
+ */
+static int
+iscsi_iovector_seek(struct iscsi_context *iscsi,
+		    struct scsi_iovector *iovector, size_t pos)
+{
+	struct scsi_iovec *iov = iovector->iov;
+	size_t end;
+	int i = iovector->consumed, lo, hi;
+
+	if (i < iovector->niov && pos >= iovector->offset) {
+		end = iovector->offset + iov[i].iov_len;
+		if (pos < end) {
+			return 0;
+		}
+		if (i + 1 < iovector->niov && pos < end + iov[i + 1].iov_len) {
+			iovector->offset = end;
+			iovector->consumed++;
+			return 0;
+		}
 	}
 
-	if (iovector->niov <= iovector->consumed) {
-		/* someone issued a read/write but did not provide enough user buffers for all the data.
-		 * maybe someone tried to read just 512 bytes off a MMC device?
+	if (iovector->nindex != iovector->niov
+	&&  iscsi_iovector_index(iovector) != 0) {
+		iscsi_set_error(iscsi, "Out-of-memory: failed to index "
+				"iovector");
+		return -1;
+	}
+	if (pos >= iovector->index[iovector->niov]) {
+		/* someone issued a read/write but did not provide enough
+		 * user buffers for all the data. maybe someone tried to
+		 * read just 512 bytes off a MMC device?
 		 */
-		errno = EINVAL;
+		iscsi_set_error(iscsi, "iovector too short for offset %zu",
+				pos);
 		return -1;
 	}
 
-	/* iov is a pointer to the first iovec to pass */
-	struct scsi_iovec *iov = &iovector->iov[iovector->consumed];
-	pos -= iovector->offset;
+	/* index[lo] <= pos < index[hi] */
+	lo = 0;
+	hi = iovector->niov;
+	while (hi - lo > 1) {
+		int mid = lo + (hi - lo) / 2;
 
-	/* forward until iov points to the first iov to pass */
-	while (pos >= iov->iov_len) {
-		iovector->offset += iov->iov_len;
-		iovector->consumed++;
-		pos -= iov->iov_len;
-		if (iovector->niov <= iovector->consumed) {
-			errno = EINVAL;
-			return -1;
+		if (iovector->index[mid] <= pos) {
+			lo = mid;
+		} else {
+			hi = mid;
 		}
-		iov = &iovector->iov[iovector->consumed];
 	}
+	iovector->consumed = lo;
+	iovector->offset   = iovector->index[lo];
 
-	/* iov2 is a pointer to the last iovec to pass */
-	struct scsi_iovec *iov2 = iov;
+	return 0;
+}
 
-	int niov=1; /* number of iovectors to pass */
-	uint32_t len2 = pos + count; /* adjust length of iov2 */
+ssize_t
+iscsi_iovector_readv_writev(struct iscsi_context *iscsi, struct scsi_iovector *iovector, uint32_t pos, ssize_t count, int do_write)
+{
+	struct iovec iov[ISCSI_IOV_BATCH];
+	size_t skip, len;
+	ssize_t left, n;
+	int i, niov;
 
-	/* forward until iov2 points to the last iovec we pass later. it might
-	   happen that we have a lot of iovectors but are limited by count */
-	while (len2 > iov2->iov_len) {
-		niov++;
-		if (iovector->niov < iovector->consumed + niov) {
+	if (iovector->iov == NULL) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (iscsi_iovector_seek(iscsi, iovector, pos) != 0) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	/* gather up to count bytes from pos on, without touching the
+	 * caller's iovecs */
+	skip = pos - iovector->offset;
+	left = count;
+	for (i = iovector->consumed, niov = 0;
+	     left > 0 && niov < ISCSI_IOV_BATCH; i++) {
+		if (i >= iovector->niov) {
 			errno = EINVAL;
 			return -1;
 		}
-		len2 -= iov2->iov_len;
-		iov2 = &iovector->iov[iovector->consumed + niov - 1];
+		len = iovector->iov[i].iov_len - skip;
+		if (len == 0) {
+			continue;
+		}
+		if ((size_t)left < len) {
+			len = left;
+		}
+		iov[niov].iov_base = (char *)iovector->iov[i].iov_base + skip;
+		iov[niov].iov_len  = len;
+		niov++;
+		left -= len;
+		skip  = 0;
 	}
 
-	/* we might limit the length of the last iovec we pass to readv/writev
-	   store its orignal length to restore it later */
-	size_t _len2 = iov2->iov_len;
-
-	/* adjust base+len of start iovec and len of last iovec */
-	iov2->iov_len = len2;
-	iov->iov_base = (void*) ((uintptr_t)iov->iov_base + pos);
-	iov->iov_len -= pos;
-
-	ssize_t n;
 	if (do_write) {
-		n = writev(iscsi->fd, (struct iovec*) iov, niov);
+		n = writev(iscsi->fd, iov, niov);
 	} else {
-		n = readv(iscsi->fd, (struct iovec*) iov, niov);
+		n = readv(iscsi->fd, iov, niov);
 	}
 
-	/* restore original values */
-	iov->iov_base = (void*) ((uintptr_t)iov->iov_base - pos);
-	iov->iov_len += pos;
-	iov2->iov_len = _len2;
-
 	if (n > count) {
 		/* we read/write more bytes than expected, this MUST not happen */
 		errno = EINVAL;
@@ -528,7 +624,7 @@ static int
 iscsi_read_from_socket(struct iscsi_context *iscsi)
 {
 	struct iscsi_in_pdu *in;
-	ssize_t data_size, count, padding_size;
+	ssize_t data_size, count, padding_size, ahs_size;
 
 	if (iscsi->incoming == NULL) {
 		iscsi->incoming = iscsi_szmalloc(iscsi, sizeof(struct iscsi_in_pdu));
@@ -565,6 +661,48 @@ iscsi_read_from_socket(struct iscsi_context *iscsi)
 		return 0;
 	}
 
+	/* any AHS sits between the BHS and the header digest */
+	ahs_size = in->hdr[4] * 4;
+	if (in->ahs_pos < ahs_size) {
+		if (in->ahs == NULL) {
+			in->ahs = iscsi_malloc(iscsi, ahs_size);
+			if (in->ahs == NULL) {
+				iscsi_set_error(iscsi, "Out-of-memory: failed to malloc iscsi_in_pdu->ahs(%d)", (int)ahs_size);
+				return -1;
+			}
+			/* what we read as the digest is the start of the AHS,
+			 * the real digest is read again once the AHS is in.
+			 */
+			in->ahs_pos = in->hdr_pos - ISCSI_RAW_HEADER_SIZE;
+			memcpy(in->ahs, &in->hdr[ISCSI_RAW_HEADER_SIZE], in->ahs_pos);
+			in->hdr_pos = ISCSI_RAW_HEADER_SIZE;
+		}
+	}
+	if (in->ahs_pos < ahs_size) {
+		count = recv(iscsi->fd, &in->ahs[in->ahs_pos],
+			     ahs_size - in->ahs_pos, 0);
+		if (count == 0) {
+			return -1;
+		}
+		if (count < 0) {
+			if (errno == EINTR || errno == EAGAIN) {
+				return 0;
+			}
+			iscsi_set_error(iscsi, "read from socket failed, "
+				"errno:%d", errno);
+			return -1;
+		}
+		in->ahs_pos += count;
+		if (in->ahs_pos < ahs_size) {
+			return 0;
+		}
+	}
+
+	if (in->hdr_pos < ISCSI_HEADER_SIZE) {
+		/* still need the header digest that follows the AHS */
+		return 0;
+	}
+
 	padding_size = iscsi_get_pdu_padding_size(&in->hdr[0]);
 	data_size = iscsi_get_pdu_data_size(&in->hdr[0]) + padding_size;
 
@@ -618,8 +756,16 @@ iscsi_read_from_socket(struct iscsi_context *iscsi)
 		return 0;
 	}
 
+	if (iscsi->capture != NULL) {
+		iscsi_capture_in(iscsi, in);
+	}
+	iscsi->stats.rx[in->hdr[0] & 0x3f].pdus++;
+	iscsi->stats.rx[in->hdr[0] & 0x3f].bytes +=
+		ISCSI_HEADER_SIZE + ahs_size + data_size;
+
 	ISCSI_LIST_ADD_END(&iscsi->inqueue, in);
 	iscsi->incoming = NULL;
+	iscsi->last_rx_time = time(NULL);
 
 
 	while (iscsi->inqueue != NULL) {
@@ -636,6 +782,250 @@ iscsi_read_from_socket(struct iscsi_context *iscsi)
 	return 0;
 }
 
+static int
+iscsi_pdu_is_dataout(struct iscsi_pdu *pdu)
+{
+	return (pdu->outdata.data[0] & 0x3f) == ISCSI_PDU_DATA_OUT;
+}
+
+/* The PDU a flow would send next, if it may send it right now. flow is
+ * NULL for the command PDUs. Command PDUs can only be sent in CmdSN order
+ * and DATA-OUT only once their command PDU has gone, i.e. when their
+ * CmdSN is lower than that of the first queued command.
+ */
+static struct iscsi_pdu *
+iscsi_drr_head(struct iscsi_context *iscsi, struct iscsi_drr_flow *flow)
+{
+	struct iscsi_pdu *cmd = iscsi->drr_cmd;
+	struct iscsi_pdu *pdu = flow == NULL ? cmd : flow->head;
+
+	if (pdu == NULL
+	||  iscsi_serial32_compare(pdu->cmdsn, iscsi->maxcmdsn) > 0) {
+		return NULL;
+	}
+	if (flow != NULL && cmd != NULL
+	&&  iscsi_serial32_compare(pdu->cmdsn, cmd->cmdsn) >= 0) {
+		return NULL;
+	}
+	return pdu;
+}
+
+static int64_t *
+iscsi_drr_deficit(struct iscsi_context *iscsi, struct iscsi_drr_flow *flow)
+{
+	return flow == NULL ? &iscsi->drr_cmd_deficit : &flow->deficit;
+}
+
+static struct iscsi_drr_flow *
+iscsi_drr_next_flow(struct iscsi_context *iscsi, struct iscsi_drr_flow *flow)
+{
+	return flow == NULL ? iscsi->drr_flows : flow->next;
+}
+
+/* Index a PDU that was just added to the outqueue */
+int
+iscsi_drr_queued(struct iscsi_context *iscsi, struct iscsi_pdu *pdu)
+{
+	struct iscsi_drr_flow *flow, *last = NULL;
+	struct iscsi_pdu *p;
+
+	if (!iscsi_pdu_is_dataout(pdu)) {
+		if (iscsi->drr_cmd == NULL) {
+			iscsi->drr_cmd = pdu;
+			return 0;
+		}
+		/* did it go in ahead of the first one */
+		for (p = pdu->next; p != NULL && p != iscsi->drr_cmd;
+		     p = p->next)
+			;
+		if (p != NULL) {
+			iscsi->drr_cmd = pdu;
+		}
+		return 0;
+	}
+
+	for (flow = iscsi->drr_flows; flow != NULL; flow = flow->next) {
+		if (flow->itt == pdu->itt) {
+			break;
+		}
+		last = flow;
+	}
+	if (flow == NULL) {
+		flow = iscsi_zmalloc(iscsi, sizeof(struct iscsi_drr_flow));
+		if (flow == NULL) {
+			iscsi_set_error(iscsi, "Out-of-memory: failed to "
+					"allocate DATA-OUT flow.");
+			return -1;
+		}
+		flow->itt = pdu->itt;
+		/* new flows get their first turn after all the others */
+		if (last == NULL) {
+			iscsi->drr_flows = flow;
+		} else {
+			last->next = flow;
+		}
+		iscsi->drr_nflows++;
+	}
+
+	pdu->drr_flow = flow;
+	pdu->drr_next = NULL;
+	if (flow->tail == NULL) {
+		flow->head = pdu;
+	} else {
+		flow->tail->drr_next = pdu;
+	}
+	flow->tail = pdu;
+
+	return 0;
+}
+
+static void
+iscsi_drr_free_flow(struct iscsi_context *iscsi, struct iscsi_drr_flow *flow)
+{
+	if (iscsi->drr_current == flow) {
+		iscsi->drr_current = flow->next;
+		iscsi->drr_in_turn = 0;
+	}
+	ISCSI_LIST_REMOVE(&iscsi->drr_flows, flow);
+	iscsi->drr_nflows--;
+	iscsi_free(iscsi, flow);
+}
+
+static void
+iscsi_drr_removed(struct iscsi_context *iscsi, struct iscsi_pdu *pdu)
+{
+	struct iscsi_drr_flow *flow = pdu->drr_flow;
+	struct iscsi_pdu *p, *prev = NULL;
+
+	if (pdu == iscsi->drr_cmd) {
+		for (p = pdu->next; p != NULL && iscsi_pdu_is_dataout(p);
+		     p = p->next)
+			;
+		iscsi->drr_cmd = p;
+		return;
+	}
+	if (flow == NULL) {
+		return;
+	}
+
+	/* almost always the head, unless it was cancelled or timed out */
+	for (p = flow->head; p != NULL && p != pdu; p = p->drr_next) {
+		prev = p;
+	}
+	if (p == NULL) {
+		return;
+	}
+	if (prev == NULL) {
+		flow->head = pdu->drr_next;
+	} else {
+		prev->drr_next = pdu->drr_next;
+	}
+	if (flow->tail == pdu) {
+		flow->tail = prev;
+	}
+	pdu->drr_flow = NULL;
+	pdu->drr_next = NULL;
+
+	if (flow->head == NULL) {
+		/* an idle flow does not keep its deficit */
+		iscsi_drr_free_flow(iscsi, flow);
+	}
+}
+
+void
+iscsi_drr_clear(struct iscsi_context *iscsi)
+{
+	struct iscsi_pdu *pdu;
+
+	for (pdu = iscsi->outqueue; pdu != NULL; pdu = pdu->next) {
+		pdu->drr_flow = NULL;
+		pdu->drr_next = NULL;
+	}
+	while (iscsi->drr_flows != NULL) {
+		iscsi_drr_free_flow(iscsi, iscsi->drr_flows);
+	}
+	iscsi->drr_cmd         = NULL;
+	iscsi->drr_cmd_deficit = 0;
+	iscsi->drr_current     = NULL;
+	iscsi->drr_in_turn     = 0;
+}
+
+void
+iscsi_outqueue_remove(struct iscsi_context *iscsi, struct iscsi_pdu *pdu)
+{
+	if (iscsi->dataout_quantum != 0) {
+		iscsi_drr_removed(iscsi, pdu);
+	}
+	ISCSI_LIST_REMOVE(&iscsi->outqueue, pdu);
+}
+
+/* Pick the PDU to send next. Without a quantum this is always the head of
+ * the outqueue. With one, the command PDUs and the DATA-OUT train of each
+ * task are served deficit round robin by bytes: each flow that has
+ * something it may send gets another quantum added to its deficit when
+ * its turn comes, and sends for as long as the next PDU fits in it.
+ */
+static struct iscsi_pdu *
+iscsi_outqueue_next(struct iscsi_context *iscsi)
+{
+	int64_t quantum = iscsi->dataout_quantum, *deficit, size, need;
+	struct iscsi_drr_flow *flow;
+	struct iscsi_pdu *pdu;
+	int i;
+
+	if (quantum == 0
+	||  iscsi->outqueue->outdata.data[0] & ISCSI_PDU_IMMEDIATE) {
+		return iscsi->outqueue;
+	}
+
+	for (;;) {
+		need = 0;
+		flow = iscsi->drr_current;
+		for (i = 0; i <= iscsi->drr_nflows; i++) {
+			pdu = iscsi_drr_head(iscsi, flow);
+			deficit = iscsi_drr_deficit(iscsi, flow);
+			if (pdu != NULL) {
+				size = pdu->outdata.size + pdu->payload_len;
+				if (!iscsi->drr_in_turn) {
+					*deficit += quantum;
+					iscsi->drr_in_turn = 1;
+				}
+				if (size <= *deficit) {
+					*deficit -= size;
+					iscsi->drr_current = flow;
+					return pdu;
+				}
+				if (need == 0 || size - *deficit < need) {
+					need = size - *deficit;
+				}
+			} else if (flow == NULL && iscsi->drr_cmd == NULL) {
+				iscsi->drr_cmd_deficit = 0;
+			}
+			iscsi->drr_in_turn = 0;
+			flow = iscsi_drr_next_flow(iscsi, flow);
+		}
+		iscsi->drr_current = flow;
+
+		if (need == 0) {
+			/* nothing we are allowed to send yet, leave it to
+			 * the CmdSN window checks on the head of the queue */
+			return iscsi->outqueue;
+		}
+
+		/* Nothing fitted. Rather than going round and round, give
+		 * every flow that can send the rounds it takes until the
+		 * first of them fits, less the turn it is about to get.
+		 */
+		need = (need + quantum - 1) / quantum - 1;
+		for (i = 0; need > 0 && i <= iscsi->drr_nflows; i++) {
+			if (iscsi_drr_head(iscsi, flow) != NULL) {
+				*iscsi_drr_deficit(iscsi, flow) += need * quantum;
+			}
+			flow = iscsi_drr_next_flow(iscsi, flow);
+		}
+	}
+}
+
 static int
 iscsi_write_to_socket(struct iscsi_context *iscsi)
 {
@@ -651,35 +1041,43 @@ iscsi_write_to_socket(struct iscsi_context *iscsi)
 
 	while (iscsi->outqueue != NULL || iscsi->outqueue_current != NULL) {
 		if (iscsi->outqueue_current == NULL) {
+			struct iscsi_pdu *next;
+
 			if (iscsi->is_corked) {
 				/* connection is corked we are not allowed to send
 				 * additional PDUs */
 				ISCSI_LOG(iscsi, 6, "iscsi_write_to_socket: socket is corked");
 				return 0;
 			}
-			
-			if (iscsi_serial32_compare(iscsi->outqueue->cmdsn, iscsi->maxcmdsn) > 0
-				&& !(iscsi->outqueue->outdata.data[0] & ISCSI_PDU_IMMEDIATE)) {
+
+			next = iscsi_outqueue_next(iscsi);
+			if (iscsi_serial32_compare(next->cmdsn, iscsi->maxcmdsn) > 0
+				&& !(next->outdata.data[0] & ISCSI_PDU_IMMEDIATE)) {
 				/* stop sending for non-immediate PDUs. maxcmdsn is reached */
 				ISCSI_LOG(iscsi, 6,
 				          "iscsi_write_to_socket: maxcmdsn reached (outqueue[0]->cmdsnd %08x > maxcmdsn %08x)",
-				          iscsi->outqueue->cmdsn, iscsi->maxcmdsn);
+				          next->cmdsn, iscsi->maxcmdsn);
+				if (!iscsi->cmdsn_stalled) {
+					iscsi->cmdsn_stalled = 1;
+					iscsi->stats.cmdsn_stalls++;
+				}
 				return 0;
 			}
+			iscsi->cmdsn_stalled = 0;
 
-			/* pop first element of the outqueue */
-			if (iscsi_serial32_compare(iscsi->outqueue->cmdsn, iscsi->expcmdsn) < 0 &&
-				(iscsi->outqueue->outdata.data[0] & 0x3f) != ISCSI_PDU_DATA_OUT) {
+			/* pop the next element of the outqueue */
+			if (iscsi_serial32_compare(next->cmdsn, iscsi->expcmdsn) < 0 &&
+				(next->outdata.data[0] & 0x3f) != ISCSI_PDU_DATA_OUT) {
 				iscsi_set_error(iscsi, "iscsi_write_to_scoket: outqueue[0]->cmdsn < expcmdsn (%08x < %08x) opcode %02x",
-				                iscsi->outqueue->cmdsn, iscsi->expcmdsn, iscsi->outqueue->outdata.data[0] & 0x3f);
+				                next->cmdsn, iscsi->expcmdsn, next->outdata.data[0] & 0x3f);
 				return -1;
 			}
-			iscsi->outqueue_current = iscsi->outqueue;
+			iscsi->outqueue_current = next;
 			
 			/* set exp statsn */
 			iscsi_pdu_set_expstatsn(iscsi->outqueue_current, iscsi->statsn + 1);
 			
-			ISCSI_LIST_REMOVE(&iscsi->outqueue, iscsi->outqueue_current);
+			iscsi_outqueue_remove(iscsi, iscsi->outqueue_current);
 			if (!(iscsi->outqueue_current->flags & ISCSI_PDU_DELETE_WHEN_SENT)) {
 				/* we have to add the pdu to the waitqueue already here
 				   since the storage might sent a R2T as soon as it has
@@ -707,6 +1105,10 @@ iscsi_write_to_socket(struct iscsi_context *iscsi)
 				return -1;
 			}
 			pdu->outdata_written += count;
+			if (pdu->outdata_written == pdu->outdata.size) {
+				ISCSI_TRACE_PDU(pdu__header__sent, pdu,
+						pdu->outdata.size);
+			}
 		}
 		/* if we havent written the full header yet. */
 		if (pdu->outdata_written != pdu->outdata.size) {
@@ -761,6 +1163,26 @@ iscsi_write_to_socket(struct iscsi_context *iscsi)
 		if (pdu->payload_written != total) {
 			return 0;
 		}
+		if (pdu->payload_len != 0) {
+			ISCSI_TRACE_PDU(pdu__payload__sent, pdu,
+					pdu->payload_len);
+		}
+		if ((pdu->outdata.data[0] & 0x3f) == ISCSI_PDU_SCSI_REQUEST
+		&&  pdu->scsi_cbdata.task != NULL) {
+			pdu->scsi_cbdata.task->times.header_sent =
+				iscsi_clock_ns();
+		}
+		if (iscsi_pdu_is_dataout(pdu) && pdu->scsi_cbdata.task != NULL) {
+			pdu->scsi_cbdata.task->times.dataout_sent =
+				iscsi_clock_ns();
+		}
+		if (iscsi->capture != NULL) {
+			iscsi_capture_out(iscsi, pdu);
+		}
+		iscsi->stats.tx[pdu->outdata.data[0] & 0x3f].pdus++;
+		iscsi->stats.tx[pdu->outdata.data[0] & 0x3f].bytes +=
+			pdu->outdata.size + total;
+
 		if (pdu->flags & ISCSI_PDU_CORK_WHEN_SENT) {
 			iscsi->is_corked = 1;
 		}
@@ -772,7 +1194,16 @@ iscsi_write_to_socket(struct iscsi_context *iscsi)
 	return 0;
 }
 
-static int
+int
+iscsi_flush_outqueue(struct iscsi_context *iscsi)
+{
+	if (iscsi->fd == -1) {
+		return 0;
+	}
+	return iscsi_write_to_socket(iscsi);
+}
+
+int
 iscsi_service_reconnect_if_loggedin(struct iscsi_context *iscsi)
 {
 	if (iscsi->is_loggedin) {
@@ -791,6 +1222,22 @@ iscsi_service_reconnect_if_loggedin(struct iscsi_context *iscsi)
 	return -1;
 }
 
+uint64_t
+iscsi_clock_ns(void)
+{
+#ifdef HAVE_CLOCK_GETTIME
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+#else
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return (uint64_t)tv.tv_sec * 1000000000 + tv.tv_usec * 1000;
+#endif
+}
+
 int
 iscsi_service(struct iscsi_context *iscsi, int revents)
 {
@@ -884,12 +1331,51 @@ iscsi_service(struct iscsi_context *iscsi, int revents)
 			return iscsi_service_reconnect_if_loggedin(iscsi);
 		}
 	}
+	if (iscsi->held_cmds != NULL) {
+		/* the target may have opened the CmdSN window */
+		iscsi_flush_held_commands(iscsi);
+	}
 	if (revents & POLLOUT) {
 		if (iscsi_write_to_socket(iscsi) != 0) {
 			return iscsi_service_reconnect_if_loggedin(iscsi);
 		}
 	}
 	iscsi_timeout_scan(iscsi);
+	if (iscsi->write_backs != NULL) {
+		iscsi_write_back_scan(iscsi);
+	}
+	if (iscsi->discards != NULL) {
+		iscsi_discard_scan(iscsi);
+	}
+
+	if (iscsi_nop_keepalive_scan(iscsi) != 0) {
+		return iscsi_service_reconnect_if_loggedin(iscsi);
+	}
+
+	return 0;
+}
+
+static int
+iscsi_pdu_set_header_digest(struct iscsi_context *iscsi, struct iscsi_pdu *pdu)
+{
+	if (iscsi->header_digest != ISCSI_HEADER_DIGEST_NONE) {
+		unsigned long crc;
+		/* the digest covers the BHS and any AHS */
+		int hdr_size = ISCSI_RAW_HEADER_SIZE + pdu->outdata.data[4] * 4;
+
+		if (pdu->outdata.size < (size_t)hdr_size + 4) {
+			iscsi_set_error(iscsi, "PDU too small (%u) to contain header digest",
+					(unsigned int) pdu->outdata.size);
+			return -1;
+		}
+
+		crc = crc32c((char *)pdu->outdata.data, hdr_size);
+
+		pdu->outdata.data[hdr_size+3] = (crc >> 24)&0xff;
+		pdu->outdata.data[hdr_size+2] = (crc >> 16)&0xff;
+		pdu->outdata.data[hdr_size+1] = (crc >>  8)&0xff;
+		pdu->outdata.data[hdr_size+0] = (crc)      &0xff;
+	}
 
 	return 0;
 }
@@ -902,24 +1388,77 @@ iscsi_queue_pdu(struct iscsi_context *iscsi, struct iscsi_pdu *pdu)
 		return -1;
 	}
 
-	if (iscsi->header_digest != ISCSI_HEADER_DIGEST_NONE) {
-		unsigned long crc;
+	if (iscsi_pdu_set_header_digest(iscsi, pdu) != 0) {
+		return -1;
+	}
 
-		if (pdu->outdata.size < ISCSI_RAW_HEADER_SIZE + 4) {
-			iscsi_set_error(iscsi, "PDU too small (%u) to contain header digest",
-					(unsigned int) pdu->outdata.size);
+	iscsi_add_to_outqueue(iscsi, pdu);
+	if (iscsi->dataout_quantum != 0 && iscsi_drr_queued(iscsi, pdu) != 0) {
+		ISCSI_LIST_REMOVE(&iscsi->outqueue, pdu);
+		return -1;
+	}
+	ISCSI_TRACE_PDU(pdu__enqueue, pdu, pdu->payload_len);
+
+	return 0;
+}
+
+/* Queue a block of new command PDUs with ascending CmdSNs, all newer than
+ * anything already queued. They can be appended to the tail of the
+ * outqueue in one go instead of being sorted in one at a time.
+ */
+int
+iscsi_queue_pdus(struct iscsi_context *iscsi, struct iscsi_pdu **pdus, int n)
+{
+	struct iscsi_pdu *last;
+	int i;
+
+	for (i = 0; i < n; i++) {
+		if (iscsi_pdu_set_header_digest(iscsi, pdus[i]) != 0) {
 			return -1;
 		}
+	}
 
-		crc = crc32c((char *)pdu->outdata.data, ISCSI_RAW_HEADER_SIZE);
+	for (last = iscsi->outqueue; last != NULL && last->next != NULL;
+	     last = last->next)
+		;
 
-		pdu->outdata.data[ISCSI_RAW_HEADER_SIZE+3] = (crc >> 24)&0xff;
-		pdu->outdata.data[ISCSI_RAW_HEADER_SIZE+2] = (crc >> 16)&0xff;
-		pdu->outdata.data[ISCSI_RAW_HEADER_SIZE+1] = (crc >>  8)&0xff;
-		pdu->outdata.data[ISCSI_RAW_HEADER_SIZE+0] = (crc)      &0xff;
-	}
+	for (i = 0; i < n; i++) {
+		struct iscsi_pdu *pdu = pdus[i];
 
-	iscsi_add_to_outqueue(iscsi, pdu);
+		ISCSI_TRACE_PDU(pdu__enqueue, pdu, pdu->payload_len);
+
+		if (pdu->flags & ISCSI_PDU_URGENT) {
+			/* these need to go ahead of queued DATA-OUT */
+			iscsi_add_to_outqueue(iscsi, pdu);
+			if (iscsi->dataout_quantum != 0) {
+				/* can't fail for command PDUs */
+				iscsi_drr_queued(iscsi, pdu);
+			}
+			if (last == NULL) {
+				last = iscsi->outqueue;
+			}
+			while (last->next != NULL) {
+				last = last->next;
+			}
+			continue;
+		}
+
+		if (iscsi->scsi_timeout > 0) {
+			pdu->scsi_timeout = time(NULL) + iscsi->scsi_timeout;
+		} else {
+			pdu->scsi_timeout = 0;
+		}
+		pdu->next = NULL;
+		if (last == NULL) {
+			iscsi->outqueue = pdu;
+		} else {
+			last->next = pdu;
+		}
+		last = pdu;
+		if (iscsi->dataout_quantum != 0) {
+			iscsi_drr_queued(iscsi, pdu);
+		}
+	}
 
 	return 0;
 }
@@ -927,6 +1466,8 @@ iscsi_queue_pdu(struct iscsi_context *iscsi, struct iscsi_pdu *pdu)
 void
 iscsi_free_iscsi_in_pdu(struct iscsi_context *iscsi, struct iscsi_in_pdu *in)
 {
+	iscsi_free(iscsi, in->ahs);
+	in->ahs=NULL;
 	iscsi_free(iscsi, in->data);
 	in->data=NULL;
 	iscsi_sfree(iscsi, in);
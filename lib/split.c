@@ -0,0 +1,444 @@
+/*
+   Copyright (C) 2026 by agent <agent@local>
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU Lesser General Public License as published by
+   the Free Software Foundation; either version 2.1 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public License
+   along with this program; if not, see <http://www.gnu.org/licenses/>.
+*/
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "iscsi.h"
+#include "iscsi-private.h"
+#include "scsi-lowlevel.h"
+
+#define ISCSI_SPLIT_DEFAULT_DEPTH 8
+
+/* Keep each command well clear of the int sized transfer lengths */
+#define ISCSI_SPLIT_MAX_BYTES (1024 * 1024 * 1024)
+
+struct iscsi_split_io {
+	iscsi_command_cb cb;
+	void *private_data;
+	int lun;
+	int is_write;
+	unsigned char *buf;
+	/* the next command starts here */
+	uint64_t lba;
+	uint32_t remaining;
+	uint32_t chunk;
+	int in_flight;
+	int status;
+};
+
+int
+iscsi_set_block_limits(struct iscsi_context *iscsi, uint32_t block_size,
+		       struct scsi_inquiry_block_limits *bl)
+{
+	if (block_size == 0 || block_size > ISCSI_SPLIT_MAX_BYTES) {
+		iscsi_set_error(iscsi, "Invalid block size %u", block_size);
+		return -1;
+	}
+
+	memset(&iscsi->limits, 0, sizeof(iscsi->limits));
+	iscsi->limits.block_size = block_size;
+	if (bl != NULL) {
+		iscsi->limits.max_xfer_len = bl->max_xfer_len;
+		iscsi->limits.opt_xfer_len = bl->opt_xfer_len;
+		iscsi->limits.opt_gran     = bl->opt_gran;
+		iscsi->limits.max_unmap    = bl->max_unmap;
+		iscsi->limits.max_unmap_bdc  = bl->max_unmap_bdc;
+		iscsi->limits.opt_unmap_gran = bl->opt_unmap_gran;
+		if (bl->ugavalid) {
+			iscsi->limits.unmap_gran_align = bl->unmap_gran_align;
+		}
+		iscsi->limits.max_ws_len   = bl->max_ws_len;
+	}
+
+	return 0;
+}
+
+int
+iscsi_discover_block_limits_sync(struct iscsi_context *iscsi, int lun)
+{
+	struct scsi_inquiry_block_limits *bl = NULL;
+	struct scsi_readcapacity16 *rc16;
+	struct scsi_task *task, *inq;
+	uint64_t num_blocks;
+	uint32_t block_size;
+	int lbpme, lbprz, prot_type, p_i_exp, ret;
+
+	task = iscsi_readcapacity16_sync(iscsi, lun);
+	if (task == NULL || task->status != SCSI_STATUS_GOOD) {
+		iscsi_set_error(iscsi, "READ CAPACITY16 failed: %s",
+				iscsi_get_error(iscsi));
+		if (task != NULL) {
+			scsi_free_scsi_task(task);
+		}
+		return -1;
+	}
+	rc16 = scsi_datain_unmarshall(task);
+	if (rc16 == NULL) {
+		iscsi_set_error(iscsi, "Failed to unmarshall READ CAPACITY16 "
+				"data");
+		scsi_free_scsi_task(task);
+		return -1;
+	}
+	block_size = rc16->block_length;
+	num_blocks = rc16->returned_lba + 1;
+	lbpme      = rc16->lbpme;
+	lbprz      = rc16->lbprz;
+	prot_type  = rc16->prot_en ? rc16->p_type + 1 : 0;
+	p_i_exp    = rc16->p_i_exp;
+	scsi_free_scsi_task(task);
+
+	/* Not all targets have the Block Limits page, so carry on with just
+	 * the block size if it is missing.
+	 */
+	inq = iscsi_inquiry_sync(iscsi, lun, 1,
+				 SCSI_INQUIRY_PAGECODE_BLOCK_LIMITS, 64);
+	if (inq != NULL && inq->status == SCSI_STATUS_GOOD) {
+		bl = scsi_datain_unmarshall(inq);
+	}
+
+	ret = iscsi_set_block_limits(iscsi, block_size, bl);
+	iscsi->limits.num_blocks = num_blocks;
+	iscsi->limits.lbpme      = lbpme;
+	iscsi->limits.lbprz      = lbprz;
+	iscsi->limits.prot_type  = prot_type;
+	iscsi->limits.p_i_exp    = p_i_exp;
+	if (inq != NULL) {
+		scsi_free_scsi_task(inq);
+	}
+
+	/* and whether WRITE SAME16 can unmap */
+	if (ret == 0 && lbpme) {
+		struct scsi_inquiry_logical_block_provisioning *lbp = NULL;
+
+		inq = iscsi_inquiry_sync(iscsi, lun, 1,
+				SCSI_INQUIRY_PAGECODE_LOGICAL_BLOCK_PROVISIONING,
+				64);
+		if (inq != NULL && inq->status == SCSI_STATUS_GOOD) {
+			lbp = scsi_datain_unmarshall(inq);
+		}
+		if (lbp != NULL) {
+			iscsi->limits.lbpws = lbp->lbpws;
+		}
+		if (inq != NULL) {
+			scsi_free_scsi_task(inq);
+		}
+	}
+
+	return ret;
+}
+
+int
+iscsi_set_split_depth(struct iscsi_context *iscsi, int depth)
+{
+	if (depth < 1) {
+		iscsi_set_error(iscsi, "Invalid split depth %d", depth);
+		return -1;
+	}
+	iscsi->split_depth = depth;
+	return 0;
+}
+
+/* Number of blocks to put in each command */
+static uint32_t
+iscsi_split_chunk(struct iscsi_context *iscsi)
+{
+	struct iscsi_block_limits *limits = &iscsi->limits;
+	uint32_t chunk;
+
+	chunk = limits->opt_xfer_len;
+	if (chunk == 0) {
+		/* a single burst per command lets the target move each one
+		 * with a single R2T or Data-In sequence */
+		chunk = iscsi->max_burst_length / limits->block_size;
+	}
+	if (limits->max_xfer_len != 0 && chunk > limits->max_xfer_len) {
+		chunk = limits->max_xfer_len;
+	}
+	if (chunk > ISCSI_SPLIT_MAX_BYTES / limits->block_size) {
+		chunk = ISCSI_SPLIT_MAX_BYTES / limits->block_size;
+	}
+	if (chunk == 0) {
+		chunk = 1;
+	}
+
+	return chunk;
+}
+
+static void
+iscsi_split_cb(struct iscsi_context *iscsi, int status, void *command_data,
+	       void *private_data);
+
+static int
+iscsi_split_issue_one(struct iscsi_context *iscsi, struct iscsi_split_io *sio)
+{
+	uint32_t block_size = iscsi->limits.block_size;
+	uint32_t num_blocks = sio->remaining < sio->chunk ?
+		sio->remaining : sio->chunk;
+	uint32_t len = num_blocks * block_size;
+	struct scsi_task *task;
+	int cdb16;
+
+	/* READ/WRITE 10 only have 32 bits of LBA and 16 bits of length */
+	cdb16 = num_blocks > 0xffff
+		|| sio->lba + num_blocks - 1 > 0xffffffffULL;
+
+	if (sio->is_write) {
+		task = cdb16 ?
+			scsi_cdb_write16(sio->lba, len, block_size,
+					 0, 0, 0, 0, 0) :
+			scsi_cdb_write10(sio->lba, len, block_size,
+					 0, 0, 0, 0, 0);
+	} else {
+		task = cdb16 ?
+			scsi_cdb_read16(sio->lba, len, block_size,
+					0, 0, 0, 0, 0) :
+			scsi_cdb_read10(sio->lba, len, block_size,
+					0, 0, 0, 0, 0);
+	}
+	if (task == NULL) {
+		iscsi_set_error(iscsi, "Out-of-memory: Failed to create "
+				"split cdb.");
+		return -1;
+	}
+
+	if ((sio->is_write ?
+	     scsi_task_add_data_out_buffer(task, len, sio->buf) :
+	     scsi_task_add_data_in_buffer(task, len, sio->buf)) != 0) {
+		iscsi_set_error(iscsi, "Out-of-memory: Failed to add split "
+				"buffer.");
+		scsi_free_scsi_task(task);
+		return -1;
+	}
+
+	if (iscsi_scsi_command_async(iscsi, sio->lun, task, iscsi_split_cb,
+				     NULL, sio) != 0) {
+		scsi_free_scsi_task(task);
+		return -1;
+	}
+
+	sio->lba       += num_blocks;
+	sio->remaining -= num_blocks;
+	sio->buf       += len;
+	sio->in_flight++;
+
+	return 0;
+}
+
+/* Top up the commands in flight, stopping at the first failure */
+static int
+iscsi_split_issue(struct iscsi_context *iscsi, struct iscsi_split_io *sio)
+{
+	int depth = iscsi->split_depth > 0 ?
+		iscsi->split_depth : ISCSI_SPLIT_DEFAULT_DEPTH;
+
+	while (sio->status == SCSI_STATUS_GOOD
+	&&     sio->remaining > 0 && sio->in_flight < depth) {
+		if (iscsi_split_issue_one(iscsi, sio) != 0) {
+			return -1;
+		}
+	}
+	return 0;
+}
+
+static void
+iscsi_split_cb(struct iscsi_context *iscsi, int status, void *command_data,
+	       void *private_data)
+{
+	struct iscsi_split_io *sio = private_data;
+	struct scsi_task *task = command_data;
+
+	sio->in_flight--;
+	if (status != SCSI_STATUS_GOOD && sio->status == SCSI_STATUS_GOOD) {
+		iscsi_set_error(iscsi, "Split %s failed: %s",
+				sio->is_write ? "write" : "read",
+				iscsi_get_error(iscsi));
+		sio->status = status;
+	}
+	scsi_free_scsi_task(task);
+
+	if (iscsi_split_issue(iscsi, sio) != 0) {
+		sio->status = SCSI_STATUS_ERROR;
+	}
+	if (sio->in_flight > 0
+	|| (sio->remaining > 0 && sio->status == SCSI_STATUS_GOOD)) {
+		return;
+	}
+
+	sio->cb(iscsi, sio->status, NULL, sio->private_data);
+	iscsi_free(iscsi, sio);
+}
+
+static int
+iscsi_split_io_async(struct iscsi_context *iscsi, int lun, int is_write,
+		     uint64_t lba, uint32_t num_blocks, unsigned char *buf,
+		     iscsi_command_cb cb, void *private_data)
+{
+	struct iscsi_split_io *sio;
+
+	if (iscsi->limits.block_size == 0) {
+		iscsi_set_error(iscsi, "Block size is not known, call "
+				"iscsi_set_block_limits() first");
+		return -1;
+	}
+	if (cb == NULL) {
+		iscsi_set_error(iscsi, "Split I/O needs a callback");
+		return -1;
+	}
+	if (num_blocks == 0) {
+		iscsi_set_error(iscsi, "Split I/O of 0 blocks");
+		return -1;
+	}
+
+	sio = iscsi_zmalloc(iscsi, sizeof(struct iscsi_split_io));
+	if (sio == NULL) {
+		iscsi_set_error(iscsi, "Out-of-memory: Failed to allocate "
+				"split I/O.");
+		return -1;
+	}
+	sio->cb           = cb;
+	sio->private_data = private_data;
+	sio->lun          = lun;
+	sio->is_write     = is_write;
+	sio->buf          = buf;
+	sio->lba          = lba;
+	sio->remaining    = num_blocks;
+	sio->chunk        = iscsi_split_chunk(iscsi);
+	sio->status       = SCSI_STATUS_GOOD;
+
+	if (iscsi_split_issue(iscsi, sio) != 0) {
+		if (sio->in_flight == 0) {
+			iscsi_free(iscsi, sio);
+			return -1;
+		}
+		/* the ones already queued will finish it off */
+		sio->status = SCSI_STATUS_ERROR;
+	}
+
+	return 0;
+}
+
+/* Read around the read cache */
+int
+iscsi_read_blocks_direct(struct iscsi_context *iscsi, int lun, uint64_t lba,
+			 uint32_t num_blocks, unsigned char *buf,
+			 iscsi_command_cb cb, void *private_data)
+{
+	return iscsi_split_io_async(iscsi, lun, 0, lba, num_blocks, buf,
+				    cb, private_data);
+}
+
+/* Read through the read cache, if there is one */
+int
+iscsi_read_blocks_cached(struct iscsi_context *iscsi, int lun, uint64_t lba,
+			 uint32_t num_blocks, unsigned char *buf,
+			 iscsi_command_cb cb, void *private_data)
+{
+	struct iscsi_read_cache *cache;
+
+	cache = iscsi->read_caches ? iscsi_get_read_cache(iscsi, lun) : NULL;
+	if (cache != NULL) {
+		return iscsi_read_cache_read(iscsi, cache, lba, num_blocks,
+					     buf, cb, private_data);
+	}
+
+	return iscsi_split_io_async(iscsi, lun, 0, lba, num_blocks, buf,
+				    cb, private_data);
+}
+
+/* Read what the target has, without the dirty write-back data on top */
+int
+iscsi_read_blocks_clean(struct iscsi_context *iscsi, int lun, uint64_t lba,
+			uint32_t num_blocks, unsigned char *buf,
+			iscsi_command_cb cb, void *private_data)
+{
+	struct iscsi_lba_map *map;
+
+	map = iscsi->lba_maps ? iscsi_get_lba_map(iscsi, lun) : NULL;
+	if (map != NULL) {
+		return iscsi_lba_map_read(iscsi, map, lba, num_blocks, buf,
+					  cb, private_data);
+	}
+
+	return iscsi_read_blocks_cached(iscsi, lun, lba, num_blocks, buf,
+					cb, private_data);
+}
+
+int
+iscsi_read_blocks_async(struct iscsi_context *iscsi, int lun, uint64_t lba,
+			uint32_t num_blocks, unsigned char *buf,
+			iscsi_command_cb cb, void *private_data)
+{
+	struct iscsi_write_back *wb;
+
+	wb = iscsi->write_backs ? iscsi_get_write_back(iscsi, lun) : NULL;
+	if (wb != NULL) {
+		return iscsi_write_back_read(iscsi, wb, lba, num_blocks, buf,
+					     cb, private_data);
+	}
+
+	return iscsi_read_blocks_clean(iscsi, lun, lba, num_blocks, buf,
+				       cb, private_data);
+}
+
+/* Write without looking for zero blocks */
+int
+iscsi_write_blocks_split(struct iscsi_context *iscsi, int lun, uint64_t lba,
+			 uint32_t num_blocks, unsigned char *buf,
+			 iscsi_command_cb cb, void *private_data)
+{
+	return iscsi_split_io_async(iscsi, lun, 1, lba, num_blocks, buf,
+				    cb, private_data);
+}
+
+/* Write around the write-back layer */
+int
+iscsi_write_blocks_direct(struct iscsi_context *iscsi, int lun, uint64_t lba,
+			  uint32_t num_blocks, unsigned char *buf,
+			  iscsi_command_cb cb, void *private_data)
+{
+	struct iscsi_zero_detect *zd;
+
+	zd = iscsi->zero_detects ? iscsi_get_zero_detect(iscsi, lun) : NULL;
+	if (zd != NULL) {
+		return iscsi_zero_detect_write(iscsi, zd, lba, num_blocks, buf,
+					       cb, private_data);
+	}
+
+	return iscsi_split_io_async(iscsi, lun, 1, lba, num_blocks, buf,
+				    cb, private_data);
+}
+
+int
+iscsi_write_blocks_async(struct iscsi_context *iscsi, int lun, uint64_t lba,
+			 uint32_t num_blocks, unsigned char *buf,
+			 iscsi_command_cb cb, void *private_data)
+{
+	struct iscsi_write_back *wb;
+
+	wb = iscsi->write_backs ? iscsi_get_write_back(iscsi, lun) : NULL;
+	if (wb != NULL) {
+		return iscsi_write_back_write(iscsi, wb, lba, num_blocks, buf,
+					      cb, private_data);
+	}
+
+	return iscsi_write_blocks_direct(iscsi, lun, lba, num_blocks, buf,
+					 cb, private_data);
+}
@@ -0,0 +1,93 @@
+/*
+   Copyright (C) 2026 by agent <agent@local>
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU Lesser General Public License as published by
+   the Free Software Foundation; either version 2.1 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public License
+   along with this program; if not, see <http://www.gnu.org/licenses/>.
+*/
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "iscsi.h"
+#include "iscsi-private.h"
+#include "scsi-lowlevel.h"
+
+/*
+ * Statistics.
+ *
+ * The counters live in the context and are bumped where things happen,
+ * without locking: a context is only ever driven by one thread at a
+ * time. Only the latency histograms need a bit of work, which is here.
+ */
+
+static int
+iscsi_latency_bucket(uint64_t us)
+{
+	int b = 0;
+
+	if (us >> 16) {
+		us >>= 16;
+		b += 16;
+	}
+	if (us >> 8) {
+		us >>= 8;
+		b += 8;
+	}
+	while (us >>= 1) {
+		b++;
+	}
+	return b < ISCSI_STATS_LATENCY_BUCKETS ? b
+		: ISCSI_STATS_LATENCY_BUCKETS - 1;
+}
+
+void
+iscsi_stats_latency(struct iscsi_context *iscsi, struct scsi_task *task,
+		    uint64_t submit_ns)
+{
+	struct iscsi_latency_histogram *h;
+	uint64_t now = iscsi_clock_ns(), us;
+
+	if (task == NULL || submit_ns == 0 || now < submit_ns) {
+		return;
+	}
+	us = (now - submit_ns) / 1000;
+
+	h = &iscsi->stats.latency[task->cdb[0]];
+	h->count++;
+	h->total_us += us;
+	h->buckets[iscsi_latency_bucket(us)]++;
+}
+
+static uint32_t
+iscsi_stats_list_length(struct iscsi_pdu *pdu)
+{
+	uint32_t n = 0;
+
+	for (; pdu != NULL; pdu = pdu->next) {
+		n++;
+	}
+	return n;
+}
+
+void
+iscsi_get_stats(struct iscsi_context *iscsi, struct iscsi_stats *stats)
+{
+	*stats = iscsi->stats;
+
+	stats->outqueue_depth = iscsi_stats_list_length(iscsi->outqueue);
+	stats->waitpdu_depth  = iscsi_stats_list_length(iscsi->waitpdu);
+	stats->held_depth     = iscsi_held_command_count(iscsi);
+}
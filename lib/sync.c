@@ -167,6 +167,95 @@ int iscsi_logout_sync(struct iscsi_context *iscsi)
 	return state.status;
 }
 
+int
+iscsi_read_blocks_sync(struct iscsi_context *iscsi, int lun, uint64_t lba,
+		       uint32_t num_blocks, unsigned char *buf)
+{
+	struct iscsi_sync_state state;
+
+	memset(&state, 0, sizeof(state));
+
+	if (iscsi_read_blocks_async(iscsi, lun, lba, num_blocks, buf,
+				    iscsi_sync_cb, &state) != 0) {
+		return -1;
+	}
+
+	event_loop(iscsi, &state);
+
+	return state.status == SCSI_STATUS_GOOD ? 0 : -1;
+}
+
+int
+iscsi_write_blocks_sync(struct iscsi_context *iscsi, int lun, uint64_t lba,
+			uint32_t num_blocks, unsigned char *buf)
+{
+	struct iscsi_sync_state state;
+
+	memset(&state, 0, sizeof(state));
+
+	if (iscsi_write_blocks_async(iscsi, lun, lba, num_blocks, buf,
+				     iscsi_sync_cb, &state) != 0) {
+		return -1;
+	}
+
+	event_loop(iscsi, &state);
+
+	return state.status == SCSI_STATUS_GOOD ? 0 : -1;
+}
+
+int
+iscsi_write_back_barrier_sync(struct iscsi_context *iscsi, int lun)
+{
+	struct iscsi_sync_state state;
+
+	memset(&state, 0, sizeof(state));
+
+	if (iscsi_write_back_barrier_async(iscsi, lun, iscsi_sync_cb,
+					   &state) != 0) {
+		return -1;
+	}
+
+	event_loop(iscsi, &state);
+
+	return state.status == SCSI_STATUS_GOOD ? 0 : -1;
+}
+
+int
+iscsi_pread_sync(struct iscsi_context *iscsi, int lun, uint64_t offset,
+		 unsigned char *buf, size_t count)
+{
+	struct iscsi_sync_state state;
+
+	memset(&state, 0, sizeof(state));
+
+	if (iscsi_pread_async(iscsi, lun, offset, buf, count,
+			      iscsi_sync_cb, &state) != 0) {
+		return -1;
+	}
+
+	event_loop(iscsi, &state);
+
+	return state.status == SCSI_STATUS_GOOD ? 0 : -1;
+}
+
+int
+iscsi_pwrite_sync(struct iscsi_context *iscsi, int lun, uint64_t offset,
+		  unsigned char *buf, size_t count)
+{
+	struct iscsi_sync_state state;
+
+	memset(&state, 0, sizeof(state));
+
+	if (iscsi_pwrite_async(iscsi, lun, offset, buf, count,
+			       iscsi_sync_cb, &state) != 0) {
+		return -1;
+	}
+
+	event_loop(iscsi, &state);
+
+	return state.status == SCSI_STATUS_GOOD ? 0 : -1;
+}
+
 static void
 reconnect_event_loop(struct iscsi_context *iscsi, struct iscsi_sync_state *state)
 {
@@ -940,6 +1029,100 @@ iscsi_writeverify16_sync(struct iscsi_context *iscsi, int lun, uint64_t lba,
 	return state.task;
 }
 
+struct scsi_task *
+iscsi_xdwriteread10_sync(struct iscsi_context *iscsi, int lun, uint32_t lba,
+		   unsigned char *data, uint32_t datalen, int blocksize,
+		   int wrprotect, int dpo, int fua, int disable_write, int fua_nv,
+		   int group_number)
+{
+	struct iscsi_sync_state state;
+
+	memset(&state, 0, sizeof(state));
+
+	if (iscsi_xdwriteread10_task(iscsi, lun, lba,
+			       data, datalen, blocksize,
+			       wrprotect, dpo, fua, disable_write, fua_nv, group_number,
+			       scsi_sync_cb, &state) == NULL) {
+		iscsi_set_error(iscsi,
+				"Failed to send XDWriteRead10 command");
+		return NULL;
+	}
+
+	event_loop(iscsi, &state);
+
+	return state.task;
+}
+
+struct scsi_task *
+iscsi_xdwriteread32_sync(struct iscsi_context *iscsi, int lun, uint64_t lba,
+		   unsigned char *data, uint32_t datalen, int blocksize,
+		   int wrprotect, int dpo, int fua, int disable_write, int fua_nv,
+		   int group_number)
+{
+	struct iscsi_sync_state state;
+
+	memset(&state, 0, sizeof(state));
+
+	if (iscsi_xdwriteread32_task(iscsi, lun, lba,
+			       data, datalen, blocksize,
+			       wrprotect, dpo, fua, disable_write, fua_nv, group_number,
+			       scsi_sync_cb, &state) == NULL) {
+		iscsi_set_error(iscsi,
+				"Failed to send XDWriteRead32 command");
+		return NULL;
+	}
+
+	event_loop(iscsi, &state);
+
+	return state.task;
+}
+
+struct scsi_task *
+iscsi_xpwrite10_sync(struct iscsi_context *iscsi, int lun, uint32_t lba,
+		   unsigned char *data, uint32_t datalen, int blocksize,
+		   int dpo, int fua, int fua_nv, int xorpinfo, int group_number)
+{
+	struct iscsi_sync_state state;
+
+	memset(&state, 0, sizeof(state));
+
+	if (iscsi_xpwrite10_task(iscsi, lun, lba,
+			       data, datalen, blocksize,
+			       dpo, fua, fua_nv, xorpinfo, group_number,
+			       scsi_sync_cb, &state) == NULL) {
+		iscsi_set_error(iscsi,
+				"Failed to send XPWrite10 command");
+		return NULL;
+	}
+
+	event_loop(iscsi, &state);
+
+	return state.task;
+}
+
+struct scsi_task *
+iscsi_xpwrite32_sync(struct iscsi_context *iscsi, int lun, uint64_t lba,
+		   unsigned char *data, uint32_t datalen, int blocksize,
+		   int dpo, int fua, int fua_nv, int xorpinfo, int group_number)
+{
+	struct iscsi_sync_state state;
+
+	memset(&state, 0, sizeof(state));
+
+	if (iscsi_xpwrite32_task(iscsi, lun, lba,
+			       data, datalen, blocksize,
+			       dpo, fua, fua_nv, xorpinfo, group_number,
+			       scsi_sync_cb, &state) == NULL) {
+		iscsi_set_error(iscsi,
+				"Failed to send XPWrite32 command");
+		return NULL;
+	}
+
+	event_loop(iscsi, &state);
+
+	return state.task;
+}
+
 struct scsi_task *
 iscsi_verify10_sync(struct iscsi_context *iscsi, int lun, unsigned char *data, uint32_t datalen, uint32_t lba,
 		    int vprotect, int dpo, int bytchk, int blocksize)
@@ -1109,6 +1292,139 @@ iscsi_unmap_sync(struct iscsi_context *iscsi, int lun, int anchor, int group,
 	return state.task;
 }
 
+struct scsi_task *
+iscsi_read_pi_sync(struct iscsi_context *iscsi, int lun, uint64_t lba,
+		   unsigned char *buf, uint32_t num_blocks)
+{
+	struct iscsi_sync_state state;
+
+	memset(&state, 0, sizeof(state));
+
+	if (iscsi_read_pi_task(iscsi, lun, lba, buf, num_blocks,
+			       scsi_sync_cb, &state) == NULL) {
+		iscsi_set_error(iscsi, "Failed to send protected read: %s",
+				iscsi_get_error(iscsi));
+		return NULL;
+	}
+
+	event_loop(iscsi, &state);
+
+	return state.task;
+}
+
+struct scsi_task *
+iscsi_write_pi_sync(struct iscsi_context *iscsi, int lun, uint64_t lba,
+		    const unsigned char *buf, uint32_t num_blocks,
+		    uint16_t app_tag)
+{
+	struct iscsi_sync_state state;
+
+	memset(&state, 0, sizeof(state));
+
+	if (iscsi_write_pi_task(iscsi, lun, lba, buf, num_blocks, app_tag,
+				scsi_sync_cb, &state) == NULL) {
+		iscsi_set_error(iscsi, "Failed to send protected write: %s",
+				iscsi_get_error(iscsi));
+		return NULL;
+	}
+
+	event_loop(iscsi, &state);
+
+	return state.task;
+}
+
+struct scsi_task *
+iscsi_extended_copy_sync(struct iscsi_context *iscsi, int lun,
+			 int list_id, int list_id_usage,
+			 struct scsi_copy_target_descriptor *targets,
+			 int num_targets,
+			 struct scsi_copy_segment_descriptor *segments,
+			 int num_segments)
+{
+	struct iscsi_sync_state state;
+
+	memset(&state, 0, sizeof(state));
+
+	if (iscsi_extended_copy_task(iscsi, lun, list_id, list_id_usage,
+				     targets, num_targets,
+				     segments, num_segments,
+				     scsi_sync_cb, &state) == NULL) {
+		iscsi_set_error(iscsi,
+				"Failed to send EXTENDED COPY command");
+		return NULL;
+	}
+
+	event_loop(iscsi, &state);
+
+	return state.task;
+}
+
+struct scsi_task *
+iscsi_receive_copy_results_sync(struct iscsi_context *iscsi, int lun,
+				int sa, uint32_t list_id, uint32_t alloc_len)
+{
+	struct iscsi_sync_state state;
+
+	memset(&state, 0, sizeof(state));
+
+	if (iscsi_receive_copy_results_task(iscsi, lun, sa, list_id,
+					    alloc_len,
+					    scsi_sync_cb, &state) == NULL) {
+		iscsi_set_error(iscsi,
+				"Failed to send RECEIVE COPY RESULTS command");
+		return NULL;
+	}
+
+	event_loop(iscsi, &state);
+
+	return state.task;
+}
+
+struct scsi_task *
+iscsi_populate_token_sync(struct iscsi_context *iscsi, int lun,
+			  uint32_t list_id, uint32_t inactivity_timeout,
+			  struct unmap_list *list, int list_len)
+{
+	struct iscsi_sync_state state;
+
+	memset(&state, 0, sizeof(state));
+
+	if (iscsi_populate_token_task(iscsi, lun, list_id,
+				      inactivity_timeout, list, list_len,
+				      scsi_sync_cb, &state) == NULL) {
+		iscsi_set_error(iscsi,
+				"Failed to send POPULATE TOKEN command");
+		return NULL;
+	}
+
+	event_loop(iscsi, &state);
+
+	return state.task;
+}
+
+struct scsi_task *
+iscsi_write_using_token_sync(struct iscsi_context *iscsi, int lun,
+			     uint32_t list_id, uint64_t offset,
+			     const unsigned char *token,
+			     struct unmap_list *list, int list_len)
+{
+	struct iscsi_sync_state state;
+
+	memset(&state, 0, sizeof(state));
+
+	if (iscsi_write_using_token_task(iscsi, lun, list_id, offset, token,
+					 list, list_len,
+					 scsi_sync_cb, &state) == NULL) {
+		iscsi_set_error(iscsi,
+				"Failed to send WRITE USING TOKEN command");
+		return NULL;
+	}
+
+	event_loop(iscsi, &state);
+
+	return state.task;
+}
+
 struct scsi_task *
 iscsi_readtoc_sync(struct iscsi_context *iscsi, int lun, int msf, int format, 
 		   int track_session, int maxsize)
@@ -0,0 +1,589 @@
+/*
+   Copyright (C) 2026 by agent <agent@local>
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU Lesser General Public License as published by
+   the Free Software Foundation; either version 2.1 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public License
+   along with this program; if not, see <http://www.gnu.org/licenses/>.
+*/
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#ifdef HAVE_POLL_H
+#include <poll.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "iscsi.h"
+#include "iscsi-private.h"
+#include "scsi-lowlevel.h"
+
+#ifdef HAVE_PTHREAD
+
+#include <pthread.h>
+#include <sched.h>
+#ifdef HAVE_SYS_EVENTFD_H
+#include <sys/eventfd.h>
+#endif
+
+/*
+ * Threaded mode.
+ *
+ * Application threads hand tasks to the I/O thread through a lock-free
+ * multi producer queue and kick it through an eventfd. The I/O thread owns
+ * the context: it submits the tasks, runs iscsi_service() and pushes each
+ * completed task back onto the queue of the thread that submitted it.
+ *
+ * Both directions use the same queue: producers push onto a singly linked
+ * stack with a compare-and-swap and the consumer takes the whole stack in
+ * one atomic exchange and reverses it to get FIFO order back. Since the
+ * consumer never pops single entries there is no ABA problem.
+ */
+
+struct iscsi_thread_request {
+	struct iscsi_thread_request *next;
+	struct iscsi_thread_queue *queue;
+	struct scsi_task *task;
+	void *private_data;
+	/* decremented when the task completes, may be NULL */
+	int *outstanding;
+	int lun;
+	int status;
+};
+
+/* eventfd where we have it, a pipe everywhere else */
+struct iscsi_wakeup {
+	int rfd;
+	int wfd;
+	int pending;
+};
+
+struct iscsi_thread_queue {
+	/* bound when the queue is created, so submitting never has to look
+	 * at the context the I/O thread may be rewriting in a reconnect */
+	struct iscsi_io_thread *io;
+	struct iscsi_thread_request *completed;
+	/* taken off completed but not reaped yet, owned by the consumer */
+	struct iscsi_thread_request *ready;
+	struct iscsi_wakeup wakeup;
+	/* the I/O thread is between pushing a completion and signalling */
+	int completing;
+};
+
+struct iscsi_io_thread {
+	pthread_t thread;
+	int stop;
+	/* iscsi_service() failed for good, everything fails from now on */
+	int failed;
+	struct iscsi_thread_request *submitted;
+	struct iscsi_wakeup wakeup;
+	/* one for the context and one for each queue bound to it */
+	int refs;
+};
+
+static void
+iscsi_mpsc_push(struct iscsi_thread_request **head,
+		struct iscsi_thread_request *req)
+{
+	struct iscsi_thread_request *old;
+
+	old = __atomic_load_n(head, __ATOMIC_RELAXED);
+	do {
+		req->next = old;
+	} while (!__atomic_compare_exchange_n(head, &old, req, 1,
+					      __ATOMIC_RELEASE,
+					      __ATOMIC_RELAXED));
+}
+
+/* Take everything that has been pushed so far, oldest first */
+static struct iscsi_thread_request *
+iscsi_mpsc_take_all(struct iscsi_thread_request **head)
+{
+	struct iscsi_thread_request *req, *fifo = NULL;
+
+	req = __atomic_exchange_n(head, NULL, __ATOMIC_ACQUIRE);
+	while (req != NULL) {
+		struct iscsi_thread_request *next = req->next;
+
+		req->next = fifo;
+		fifo = req;
+		req = next;
+	}
+	return fifo;
+}
+
+static int
+iscsi_wakeup_init(struct iscsi_wakeup *w)
+{
+#ifdef HAVE_SYS_EVENTFD_H
+	w->rfd = w->wfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (w->rfd == -1) {
+		return -1;
+	}
+#else
+	int fds[2];
+
+	if (pipe(fds) != 0) {
+		return -1;
+	}
+	fcntl(fds[0], F_SETFL, O_NONBLOCK);
+	fcntl(fds[1], F_SETFL, O_NONBLOCK);
+	w->rfd = fds[0];
+	w->wfd = fds[1];
+#endif
+	w->pending = 0;
+	return 0;
+}
+
+static void
+iscsi_wakeup_close(struct iscsi_wakeup *w)
+{
+	if (w->wfd != w->rfd) {
+		close(w->wfd);
+	}
+	close(w->rfd);
+}
+
+/* Only the first of a series of wakeups before the consumer gets around
+ * to it needs to touch the file descriptor.
+ *
+ * The producer stores the request then loads pending, the consumer stores
+ * pending then loads the queue head. Without a full fence on both sides
+ * each can miss the other's store: the producer sees pending still set and
+ * skips the write while the consumer, having cleared it, finds the queue
+ * empty and goes back to sleep with the request stranded.
+ */
+static void
+iscsi_wakeup_signal(struct iscsi_wakeup *w)
+{
+	uint64_t one = 1;
+
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_exchange_n(&w->pending, 1, __ATOMIC_SEQ_CST)) {
+		return;
+	}
+	if (write(w->wfd, &one, sizeof(one)) < 0) {
+		/* EAGAIN means it is already readable, which is all we want */
+	}
+}
+
+static void
+iscsi_wakeup_clear(struct iscsi_wakeup *w)
+{
+	uint64_t buf[8];
+
+	__atomic_store_n(&w->pending, 0, __ATOMIC_SEQ_CST);
+	/* before the caller looks at the queue, see above */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	while (read(w->rfd, buf, sizeof(buf)) > 0) {
+		;
+	}
+}
+
+static void
+iscsi_thread_complete(struct iscsi_thread_request *req, int status)
+{
+	struct iscsi_thread_queue *queue = req->queue;
+
+	req->status = status;
+	if (req->outstanding != NULL) {
+		__atomic_sub_fetch(req->outstanding, 1, __ATOMIC_RELAXED);
+	}
+	__atomic_add_fetch(&queue->completing, 1, __ATOMIC_ACQ_REL);
+	iscsi_mpsc_push(&queue->completed, req);
+	iscsi_wakeup_signal(&queue->wakeup);
+	__atomic_sub_fetch(&queue->completing, 1, __ATOMIC_RELEASE);
+}
+
+static void
+iscsi_thread_task_cb(struct iscsi_context *iscsi, int status,
+		     void *command_data _U_, void *private_data)
+{
+	struct iscsi_thread_request *req = private_data;
+
+	/* to the submitter a task we had to give up on has failed */
+	if (status == SCSI_STATUS_CANCELLED && iscsi->io_thread != NULL
+	&&  iscsi->io_thread->failed) {
+		status = SCSI_STATUS_ERROR;
+		req->task->status = status;
+	}
+	iscsi_thread_complete(req, status);
+}
+
+static void
+iscsi_thread_fail_pending(struct iscsi_io_thread *io)
+{
+	struct iscsi_thread_request *req;
+
+	req = iscsi_mpsc_take_all(&io->submitted);
+	while (req != NULL) {
+		struct iscsi_thread_request *next = req->next;
+
+		req->task->status = SCSI_STATUS_ERROR;
+		iscsi_thread_complete(req, SCSI_STATUS_ERROR);
+		req = next;
+	}
+}
+
+static void
+iscsi_thread_submit_pending(struct iscsi_context *iscsi,
+			    struct iscsi_io_thread *io)
+{
+	struct iscsi_thread_request *req;
+
+	req = iscsi_mpsc_take_all(&io->submitted);
+	while (req != NULL) {
+		struct iscsi_thread_request *next = req->next;
+
+		if (iscsi_scsi_command_async(iscsi, req->lun, req->task,
+					     iscsi_thread_task_cb, NULL,
+					     req) != 0) {
+			req->task->status = SCSI_STATUS_ERROR;
+			iscsi_thread_complete(req, SCSI_STATUS_ERROR);
+		}
+		req = next;
+	}
+}
+
+static void *
+iscsi_io_thread_main(void *arg)
+{
+	struct iscsi_context *iscsi = arg;
+	struct iscsi_io_thread *io = iscsi->io_thread;
+
+	while (!__atomic_load_n(&io->stop, __ATOMIC_ACQUIRE)) {
+		struct pollfd pfd[2];
+		int ret;
+
+		pfd[0].fd = io->wakeup.rfd;
+		pfd[0].events = POLLIN;
+		pfd[1].fd = iscsi_get_fd(iscsi);
+		pfd[1].events = iscsi_which_events(iscsi);
+		pfd[0].revents = pfd[1].revents = 0;
+
+		/* once failed only wait for submissions to fail back */
+		ret = poll(pfd, io->failed ? 1 : 2, 1000);
+		if (ret < 0 && errno != EINTR) {
+			ISCSI_LOG(iscsi, 1, "I/O thread poll failed, errno:%d",
+				  errno);
+			break;
+		}
+
+		if (pfd[0].revents) {
+			iscsi_wakeup_clear(&io->wakeup);
+		}
+		if (io->failed) {
+			iscsi_thread_fail_pending(io);
+			continue;
+		}
+		iscsi_thread_submit_pending(iscsi, io);
+
+		/* with no events this still drives the timers */
+		if (iscsi_service(iscsi, ret > 0 ? pfd[1].revents : 0) < 0) {
+			/* The connection is gone and could not be brought
+			 * back. Going round again would only spin on the
+			 * dead socket, so fail everything instead.
+			 */
+			ISCSI_LOG(iscsi, 1, "I/O thread: iscsi_service failed "
+				  "with : %s, failing all tasks",
+				  iscsi_get_error(iscsi));
+			io->failed = 1;
+			if (iscsi->old_iscsi != NULL) {
+				/* what was in flight when it dropped */
+				iscsi_scsi_cancel_all_tasks(iscsi->old_iscsi);
+			}
+			iscsi_scsi_cancel_all_tasks(iscsi);
+			iscsi_thread_fail_pending(io);
+		}
+	}
+
+	/* Do not strand anything that was queued while we were stopping */
+	if (io->failed) {
+		iscsi_thread_fail_pending(io);
+	} else {
+		iscsi_thread_submit_pending(iscsi, io);
+	}
+
+	return NULL;
+}
+
+static void
+iscsi_io_thread_put(struct iscsi_io_thread *io)
+{
+	if (__atomic_sub_fetch(&io->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+		iscsi_wakeup_close(&io->wakeup);
+		free(io);
+	}
+}
+
+/* Like iscsi_start_io_thread() but hands back the I/O thread, for callers
+ * that submit to it themselves.
+ */
+struct iscsi_io_thread *
+iscsi_thread_start(struct iscsi_context *iscsi)
+{
+	struct iscsi_io_thread *io;
+
+	if (iscsi->io_thread != NULL) {
+		iscsi_set_error(iscsi, "I/O thread is already running");
+		return NULL;
+	}
+
+	io = calloc(1, sizeof(struct iscsi_io_thread));
+	if (io == NULL) {
+		iscsi_set_error(iscsi, "Out-of-memory: failed to allocate "
+				"I/O thread");
+		return NULL;
+	}
+	if (iscsi_wakeup_init(&io->wakeup) != 0) {
+		iscsi_set_error(iscsi, "Failed to create wakeup fd, "
+				"errno:%d", errno);
+		free(io);
+		return NULL;
+	}
+	io->refs = 1;
+
+	iscsi->io_thread = io;
+	if (pthread_create(&io->thread, NULL, iscsi_io_thread_main,
+			   iscsi) != 0) {
+		iscsi->io_thread = NULL;
+		iscsi_wakeup_close(&io->wakeup);
+		free(io);
+		iscsi_set_error(iscsi, "Failed to start I/O thread");
+		return NULL;
+	}
+
+	return io;
+}
+
+int
+iscsi_start_io_thread(struct iscsi_context *iscsi)
+{
+	return iscsi_thread_start(iscsi) != NULL ? 0 : -1;
+}
+
+int
+iscsi_stop_io_thread(struct iscsi_context *iscsi)
+{
+	struct iscsi_io_thread *io = iscsi->io_thread;
+
+	if (io == NULL) {
+		iscsi_set_error(iscsi, "No I/O thread running");
+		return -1;
+	}
+
+	__atomic_store_n(&io->stop, 1, __ATOMIC_RELEASE);
+	iscsi_wakeup_signal(&io->wakeup);
+	pthread_join(io->thread, NULL);
+
+	iscsi->io_thread = NULL;
+	/* queues still bound to it see it stopped and fail submissions */
+	iscsi_io_thread_put(io);
+
+	return 0;
+}
+
+struct iscsi_thread_queue *
+iscsi_thread_queue_create(struct iscsi_context *iscsi)
+{
+	struct iscsi_thread_queue *queue;
+
+	queue = calloc(1, sizeof(struct iscsi_thread_queue));
+	if (queue == NULL) {
+		return NULL;
+	}
+	if (iscsi_wakeup_init(&queue->wakeup) != 0) {
+		free(queue);
+		return NULL;
+	}
+	queue->io = iscsi->io_thread;
+	if (queue->io != NULL) {
+		__atomic_add_fetch(&queue->io->refs, 1, __ATOMIC_RELAXED);
+	}
+
+	return queue;
+}
+
+void
+iscsi_thread_queue_destroy(struct iscsi_thread_queue *queue)
+{
+	struct iscsi_thread_request *req;
+
+	if (queue == NULL) {
+		return;
+	}
+
+	/* the last completion may have been reaped before the I/O thread
+	 * got around to signalling it */
+	while (__atomic_load_n(&queue->completing, __ATOMIC_ACQUIRE)) {
+		sched_yield();
+	}
+
+	while (queue->ready != NULL
+	||  (queue->ready = iscsi_mpsc_take_all(&queue->completed)) != NULL) {
+		req = queue->ready;
+		queue->ready = req->next;
+		scsi_free_scsi_task(req->task);
+		free(req);
+	}
+	iscsi_wakeup_close(&queue->wakeup);
+	if (queue->io != NULL) {
+		iscsi_io_thread_put(queue->io);
+	}
+	free(queue);
+}
+
+int
+iscsi_thread_queue_get_fd(struct iscsi_thread_queue *queue)
+{
+	return queue->wakeup.rfd;
+}
+
+/* Hand a task to the I/O thread io and have the completion delivered to
+ * queue, which does not need to be bound to the same I/O thread.
+ */
+int
+iscsi_thread_submit(struct iscsi_io_thread *io,
+		    struct iscsi_thread_queue *queue, int lun,
+		    struct scsi_task *task, void *private_data,
+		    int *outstanding)
+{
+	struct iscsi_thread_request *req;
+
+	if (io == NULL || __atomic_load_n(&io->stop, __ATOMIC_ACQUIRE)) {
+		return -1;
+	}
+
+	req = malloc(sizeof(struct iscsi_thread_request));
+	if (req == NULL) {
+		return -1;
+	}
+	req->queue        = queue;
+	req->task         = task;
+	req->private_data = private_data;
+	req->outstanding  = outstanding;
+	req->lun          = lun;
+	req->status       = 0;
+
+	if (outstanding != NULL) {
+		__atomic_add_fetch(outstanding, 1, __ATOMIC_RELAXED);
+	}
+	iscsi_mpsc_push(&io->submitted, req);
+	iscsi_wakeup_signal(&io->wakeup);
+
+	return 0;
+}
+
+int
+iscsi_submit_threaded(struct iscsi_thread_queue *queue, int lun,
+		      struct scsi_task *task, void *private_data)
+{
+	return iscsi_thread_submit(queue->io, queue, lun, task,
+				   private_data, NULL);
+}
+
+int
+iscsi_thread_queue_get_completions(struct iscsi_thread_queue *queue,
+				   struct iscsi_completion *completions,
+				   int max)
+{
+	struct iscsi_thread_request *req;
+	int n = 0;
+
+	if (queue->ready == NULL) {
+		iscsi_wakeup_clear(&queue->wakeup);
+		queue->ready = iscsi_mpsc_take_all(&queue->completed);
+	}
+
+	while (n < max && (req = queue->ready) != NULL) {
+		queue->ready = req->next;
+
+		completions[n].task         = req->task;
+		completions[n].status       = req->status;
+		completions[n].private_data = req->private_data;
+		n++;
+		free(req);
+	}
+
+	return n;
+}
+
+#else /* HAVE_PTHREAD */
+
+struct iscsi_io_thread *
+iscsi_thread_start(struct iscsi_context *iscsi)
+{
+	iscsi_set_error(iscsi, "libiscsi was built without thread support");
+	return NULL;
+}
+
+int
+iscsi_start_io_thread(struct iscsi_context *iscsi)
+{
+	iscsi_set_error(iscsi, "libiscsi was built without thread support");
+	return -1;
+}
+
+int
+iscsi_stop_io_thread(struct iscsi_context *iscsi)
+{
+	iscsi_set_error(iscsi, "libiscsi was built without thread support");
+	return -1;
+}
+
+struct iscsi_thread_queue *
+iscsi_thread_queue_create(struct iscsi_context *iscsi _U_)
+{
+	return NULL;
+}
+
+void
+iscsi_thread_queue_destroy(struct iscsi_thread_queue *queue _U_)
+{
+}
+
+int
+iscsi_thread_queue_get_fd(struct iscsi_thread_queue *queue _U_)
+{
+	return -1;
+}
+
+int
+iscsi_thread_submit(struct iscsi_io_thread *io _U_,
+		    struct iscsi_thread_queue *queue _U_, int lun _U_,
+		    struct scsi_task *task _U_, void *private_data _U_,
+		    int *outstanding _U_)
+{
+	return -1;
+}
+
+int
+iscsi_submit_threaded(struct iscsi_thread_queue *queue _U_, int lun _U_,
+		      struct scsi_task *task _U_, void *private_data _U_)
+{
+	return -1;
+}
+
+int
+iscsi_thread_queue_get_completions(struct iscsi_thread_queue *queue _U_,
+				   struct iscsi_completion *completions _U_,
+				   int max _U_)
+{
+	return -1;
+}
+
+#endif /* HAVE_PTHREAD */
@@ -0,0 +1,1008 @@
+/*
+   Copyright (C) 2026 by agent <agent@local>
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU Lesser General Public License as published by
+   the Free Software Foundation; either version 2.1 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public License
+   along with this program; if not, see <http://www.gnu.org/licenses/>.
+*/
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "iscsi.h"
+#include "iscsi-private.h"
+#include "scsi-lowlevel.h"
+#include "slist.h"
+
+/*
+ * Write-back.
+ *
+ * Writes through iscsi_write_blocks_async() are copied into dirty
+ * extents and completed straight away. The dirty extents are kept sorted
+ * by LBA and never overlap: a new write first punches its range out of
+ * the extents already there and then merges with its neighbours, up to
+ * ISCSI_WB_MAX_EXTENT bytes.
+ *
+ * Extents are written out when the dirty data reaches flush_bytes, when
+ * they get older than max_age seconds and when a barrier is waiting for
+ * them. While an extent is being written it sits on the flushing list,
+ * and no dirty extent that overlaps it is written until it is done, so
+ * the target always sees the writes to a block in order. A written
+ * extent stays on the list for as long as there are reads in flight that
+ * were sent before it completed.
+ *
+ * Reads go to the target, or the read cache, and then have the flushing
+ * and the dirty extents copied over them, oldest first.
+ *
+ * Writes that do not fit in the memory budget wait, in order, until
+ * enough has been flushed, and writes bigger than the whole budget go
+ * straight to the target once nothing they overlap is being flushed.
+ *
+ * Every write gets a sequence number. A barrier completes once every
+ * write submitted before it has reached the target, and all barriers
+ * that complete together share a single SYNCHRONIZE CACHE16 covering
+ * the blocks written since the last one. Like fsync() a barrier reports
+ * any write-back error since the previous barrier.
+ */
+
+#define ISCSI_WB_MAX_EXTENT (1024 * 1024)
+
+struct iscsi_write_back;
+
+struct iscsi_wb_extent {
+	struct iscsi_wb_extent *next;
+	struct iscsi_write_back *wb;
+	uint64_t lba;
+	uint32_t num_blocks;
+	unsigned char *data;
+	/* oldest write that has data in here */
+	uint64_t min_seq;
+	time_t dirtied;
+	/* written straight from the caller's buffer */
+	int through;
+	iscsi_command_cb cb;
+	void *private_data;
+	int done;
+};
+
+struct iscsi_wb_write {
+	struct iscsi_wb_write *next;
+	uint64_t lba;
+	uint32_t num_blocks;
+	unsigned char *buf;
+	iscsi_command_cb cb;
+	void *private_data;
+	uint64_t seq;
+};
+
+struct iscsi_wb_barrier {
+	struct iscsi_wb_barrier *next;
+	uint64_t seq;
+	iscsi_command_cb cb;
+	void *private_data;
+};
+
+struct iscsi_write_back {
+	struct iscsi_write_back *next;
+	int lun;
+	uint32_t block_size;
+	size_t max_bytes;
+	size_t flush_bytes;
+	int max_age;
+	time_t next_age_scan;
+
+	/* sorted by LBA, never overlapping */
+	struct iscsi_wb_extent **dirty;
+	int ndirty;
+	int dirty_size;
+	size_t dirty_bytes;
+
+	/* in the order they were sent */
+	struct iscsi_wb_extent *flushing;
+	size_t flushing_bytes;
+
+	struct iscsi_wb_write *waiting;
+	struct iscsi_wb_barrier *barriers;
+	uint64_t seq;
+
+	/* written since the last SYNCHRONIZE CACHE */
+	uint64_t sync_lo;
+	uint64_t sync_hi;
+
+	int reads;
+	/* WRITEs in flight, the last one frees a disabled write-back */
+	int writes;
+	int disabled;
+	int admitting;
+	/* reported by the next barrier */
+	int error;
+};
+
+struct iscsi_wb_read {
+	struct iscsi_write_back *wb;
+	uint64_t lba;
+	uint32_t num_blocks;
+	unsigned char *buf;
+	iscsi_command_cb cb;
+	void *private_data;
+};
+
+static inline uint64_t
+iscsi_wb_end(struct iscsi_wb_extent *ext)
+{
+	return ext->lba + ext->num_blocks;
+}
+
+static size_t
+iscsi_wb_bytes(struct iscsi_write_back *wb, struct iscsi_wb_extent *ext)
+{
+	return (size_t)ext->num_blocks * wb->block_size;
+}
+
+struct iscsi_write_back *
+iscsi_get_write_back(struct iscsi_context *iscsi, int lun)
+{
+	struct iscsi_write_back *wb;
+
+	for (wb = iscsi->write_backs; wb != NULL; wb = wb->next) {
+		if (wb->lun == lun) {
+			return wb;
+		}
+	}
+	return NULL;
+}
+
+/* Index of the first dirty extent that ends after lba */
+static int
+iscsi_wb_search(struct iscsi_write_back *wb, uint64_t lba)
+{
+	int lo = 0, hi = wb->ndirty;
+
+	while (lo < hi) {
+		int mid = (lo + hi) / 2;
+
+		if (iscsi_wb_end(wb->dirty[mid]) <= lba) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	return lo;
+}
+
+static int
+iscsi_wb_insert_at(struct iscsi_context *iscsi, struct iscsi_write_back *wb,
+		   int i, struct iscsi_wb_extent *ext)
+{
+	if (wb->ndirty == wb->dirty_size) {
+		int size = wb->dirty_size ? wb->dirty_size * 2 : 64;
+		struct iscsi_wb_extent **dirty;
+
+		if (wb->dirty == NULL) {
+			dirty = iscsi_malloc(iscsi, size * sizeof(*dirty));
+		} else {
+			dirty = iscsi_realloc(iscsi, wb->dirty,
+					      size * sizeof(*dirty));
+		}
+		if (dirty == NULL) {
+			return -1;
+		}
+		wb->dirty      = dirty;
+		wb->dirty_size = size;
+	}
+	memmove(&wb->dirty[i + 1], &wb->dirty[i],
+		(wb->ndirty - i) * sizeof(*wb->dirty));
+	wb->dirty[i] = ext;
+	wb->ndirty++;
+	wb->dirty_bytes += iscsi_wb_bytes(wb, ext);
+
+	return 0;
+}
+
+static struct iscsi_wb_extent *
+iscsi_wb_remove_at(struct iscsi_write_back *wb, int i)
+{
+	struct iscsi_wb_extent *ext = wb->dirty[i];
+
+	wb->ndirty--;
+	memmove(&wb->dirty[i], &wb->dirty[i + 1],
+		(wb->ndirty - i) * sizeof(*wb->dirty));
+	wb->dirty_bytes -= iscsi_wb_bytes(wb, ext);
+
+	return ext;
+}
+
+static void
+iscsi_wb_free_extent(struct iscsi_context *iscsi, struct iscsi_wb_extent *ext)
+{
+	if (!ext->through) {
+		iscsi_free(iscsi, ext->data);
+	}
+	iscsi_free(iscsi, ext);
+}
+
+/* Drop [lba, end) from the dirty extents, it is about to be overwritten */
+static int
+iscsi_wb_punch(struct iscsi_context *iscsi, struct iscsi_write_back *wb,
+	       uint64_t lba, uint64_t end)
+{
+	uint32_t bs = wb->block_size;
+	int i = iscsi_wb_search(wb, lba);
+
+	while (i < wb->ndirty && wb->dirty[i]->lba < end) {
+		struct iscsi_wb_extent *ext = wb->dirty[i];
+		uint64_t ext_end = iscsi_wb_end(ext);
+
+		if (ext->lba >= lba && ext_end <= end) {
+			iscsi_wb_free_extent(iscsi, iscsi_wb_remove_at(wb, i));
+			continue;
+		}
+		if (ext->lba < lba && ext_end > end) {
+			/* split in two */
+			struct iscsi_wb_extent *tail;
+
+			tail = iscsi_zmalloc(iscsi,
+					     sizeof(struct iscsi_wb_extent));
+			if (tail == NULL) {
+				return -1;
+			}
+			tail->lba        = end;
+			tail->num_blocks = ext_end - end;
+			tail->min_seq    = ext->min_seq;
+			tail->dirtied    = ext->dirtied;
+			tail->data       = iscsi_malloc(iscsi,
+						(size_t)tail->num_blocks * bs);
+			if (tail->data == NULL) {
+				iscsi_free(iscsi, tail);
+				return -1;
+			}
+			memcpy(tail->data, ext->data + (end - ext->lba) * bs,
+			       (size_t)tail->num_blocks * bs);
+			wb->dirty_bytes -= (ext_end - lba) * bs;
+			ext->num_blocks = lba - ext->lba;
+			return iscsi_wb_insert_at(iscsi, wb, i + 1, tail);
+		}
+		if (ext->lba < lba) {
+			/* keep the head */
+			wb->dirty_bytes -= (ext_end - lba) * bs;
+			ext->num_blocks = lba - ext->lba;
+			i++;
+			continue;
+		}
+		/* keep the tail */
+		wb->dirty_bytes -= (end - ext->lba) * bs;
+		memmove(ext->data, ext->data + (end - ext->lba) * bs,
+			(ext_end - end) * bs);
+		ext->num_blocks = ext_end - end;
+		ext->lba        = end;
+		i++;
+	}
+	return 0;
+}
+
+/* Append b to a, which ends where b starts */
+static int
+iscsi_wb_append(struct iscsi_context *iscsi, struct iscsi_write_back *wb,
+		struct iscsi_wb_extent *a, struct iscsi_wb_extent *b)
+{
+	uint32_t bs = wb->block_size;
+	unsigned char *data;
+
+	data = iscsi_realloc(iscsi, a->data,
+			     ((size_t)a->num_blocks + b->num_blocks) * bs);
+	if (data == NULL) {
+		return -1;
+	}
+	memcpy(data + (size_t)a->num_blocks * bs, b->data,
+	       (size_t)b->num_blocks * bs);
+	a->data        = data;
+	a->num_blocks += b->num_blocks;
+	if (b->min_seq < a->min_seq) {
+		a->min_seq = b->min_seq;
+	}
+	if (b->dirtied < a->dirtied) {
+		a->dirtied = b->dirtied;
+	}
+	return 0;
+}
+
+/* Merge the extent at i with whichever neighbours it touches */
+static void
+iscsi_wb_coalesce(struct iscsi_context *iscsi, struct iscsi_write_back *wb,
+		  int i)
+{
+	size_t max = ISCSI_WB_MAX_EXTENT;
+
+	if (i + 1 < wb->ndirty
+	&&  iscsi_wb_end(wb->dirty[i]) == wb->dirty[i + 1]->lba
+	&&  iscsi_wb_bytes(wb, wb->dirty[i]) +
+	    iscsi_wb_bytes(wb, wb->dirty[i + 1]) <= max
+	&&  iscsi_wb_append(iscsi, wb, wb->dirty[i], wb->dirty[i + 1]) == 0) {
+		struct iscsi_wb_extent *next = wb->dirty[i + 1];
+
+		/* remove_at() takes off what append() added */
+		wb->dirty_bytes += iscsi_wb_bytes(wb, next);
+		iscsi_wb_free_extent(iscsi, iscsi_wb_remove_at(wb, i + 1));
+	}
+	if (i > 0
+	&&  iscsi_wb_end(wb->dirty[i - 1]) == wb->dirty[i]->lba
+	&&  iscsi_wb_bytes(wb, wb->dirty[i - 1]) +
+	    iscsi_wb_bytes(wb, wb->dirty[i]) <= max
+	&&  iscsi_wb_append(iscsi, wb, wb->dirty[i - 1], wb->dirty[i]) == 0) {
+		struct iscsi_wb_extent *ext = wb->dirty[i];
+
+		wb->dirty_bytes += iscsi_wb_bytes(wb, ext);
+		iscsi_wb_free_extent(iscsi, iscsi_wb_remove_at(wb, i));
+	}
+}
+
+/* Copy a write into the dirty extents */
+static int
+iscsi_wb_absorb(struct iscsi_context *iscsi, struct iscsi_write_back *wb,
+		struct iscsi_wb_write *w)
+{
+	size_t len = (size_t)w->num_blocks * wb->block_size;
+	struct iscsi_wb_extent *ext;
+
+	ext = iscsi_zmalloc(iscsi, sizeof(struct iscsi_wb_extent));
+	if (ext == NULL) {
+		goto err;
+	}
+	ext->data = iscsi_malloc(iscsi, len);
+	if (ext->data == NULL) {
+		iscsi_free(iscsi, ext);
+		goto err;
+	}
+	memcpy(ext->data, w->buf, len);
+	ext->lba        = w->lba;
+	ext->num_blocks = w->num_blocks;
+	ext->min_seq    = w->seq;
+	ext->dirtied    = time(NULL);
+
+	if (iscsi_wb_punch(iscsi, wb, w->lba, w->lba + w->num_blocks) != 0
+	||  iscsi_wb_insert_at(iscsi, wb, iscsi_wb_search(wb, w->lba),
+			       ext) != 0) {
+		iscsi_wb_free_extent(iscsi, ext);
+		goto err;
+	}
+	iscsi_wb_coalesce(iscsi, wb, iscsi_wb_search(wb, w->lba));
+
+	return 0;
+
+err:
+	iscsi_set_error(iscsi, "Out-of-memory: Failed to allocate dirty "
+			"extent.");
+	return -1;
+}
+
+/* Is any of [lba, end) still on its way to the target */
+static int
+iscsi_wb_in_flight(struct iscsi_write_back *wb, uint64_t lba, uint64_t end)
+{
+	struct iscsi_wb_extent *ext;
+
+	for (ext = wb->flushing; ext != NULL; ext = ext->next) {
+		if (!ext->done && ext->lba < end && lba < iscsi_wb_end(ext)) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/* Free the written extents once no read can still need them */
+static void
+iscsi_wb_retire(struct iscsi_context *iscsi, struct iscsi_write_back *wb)
+{
+	struct iscsi_wb_extent **p = &wb->flushing, *ext;
+
+	if (wb->reads > 0) {
+		return;
+	}
+	while ((ext = *p) != NULL) {
+		if (!ext->done) {
+			p = &ext->next;
+			continue;
+		}
+		*p = ext->next;
+		if (!ext->through) {
+			wb->flushing_bytes -= iscsi_wb_bytes(wb, ext);
+		}
+		iscsi_wb_free_extent(iscsi, ext);
+	}
+}
+
+static void iscsi_wb_release(struct iscsi_context *iscsi,
+			     struct iscsi_write_back *wb);
+static void iscsi_wb_admit(struct iscsi_context *iscsi,
+			   struct iscsi_write_back *wb);
+static void iscsi_wb_flush(struct iscsi_context *iscsi,
+			   struct iscsi_write_back *wb);
+static void iscsi_wb_check_barriers(struct iscsi_context *iscsi,
+				    struct iscsi_write_back *wb);
+
+static void
+iscsi_wb_write_cb(struct iscsi_context *iscsi, int status,
+		  void *command_data _U_, void *private_data)
+{
+	struct iscsi_wb_extent *ext = private_data;
+	struct iscsi_write_back *wb = ext->wb;
+
+	ext->done = 1;
+	wb->writes--;
+	if (status != SCSI_STATUS_GOOD) {
+		if (wb->error == SCSI_STATUS_GOOD) {
+			wb->error = status;
+		}
+	} else {
+		if (wb->sync_hi == wb->sync_lo || ext->lba < wb->sync_lo) {
+			wb->sync_lo = ext->lba;
+		}
+		if (iscsi_wb_end(ext) > wb->sync_hi) {
+			wb->sync_hi = iscsi_wb_end(ext);
+		}
+	}
+	if (ext->through) {
+		/* the caller may free the buffer as soon as this returns */
+		ext->data = NULL;
+		ext->cb(iscsi, status, NULL, ext->private_data);
+	}
+
+	if (wb->disabled) {
+		if (wb->writes == 0 && wb->reads == 0) {
+			iscsi_wb_release(iscsi, wb);
+		}
+		return;
+	}
+	iscsi_wb_retire(iscsi, wb);
+	if (status == SCSI_STATUS_CANCELLED) {
+		/* the context is going away or giving up on the session */
+		return;
+	}
+	iscsi_wb_admit(iscsi, wb);
+	iscsi_wb_flush(iscsi, wb);
+	iscsi_wb_check_barriers(iscsi, wb);
+}
+
+static int
+iscsi_wb_send(struct iscsi_context *iscsi, struct iscsi_write_back *wb,
+	      struct iscsi_wb_extent *ext)
+{
+	ext->wb = wb;
+	ISCSI_LIST_ADD_END(&wb->flushing, ext);
+	if (!ext->through) {
+		wb->flushing_bytes += iscsi_wb_bytes(wb, ext);
+	}
+	wb->writes++;
+	if (iscsi_write_blocks_direct(iscsi, wb->lun, ext->lba,
+				      ext->num_blocks, ext->data,
+				      iscsi_wb_write_cb, ext) != 0) {
+		wb->writes--;
+		ISCSI_LIST_REMOVE(&wb->flushing, ext);
+		if (!ext->through) {
+			wb->flushing_bytes -= iscsi_wb_bytes(wb, ext);
+		}
+		return -1;
+	}
+	return 0;
+}
+
+/* Write out the dirty extents that are due and not blocked behind an
+ * overlapping extent that is still in flight.
+ */
+static void
+iscsi_wb_flush(struct iscsi_context *iscsi, struct iscsi_write_back *wb)
+{
+	uint64_t barrier_seq = 0;
+	time_t old = 0;
+	int all, i = 0;
+
+	all = wb->dirty_bytes >= wb->flush_bytes || wb->waiting != NULL;
+	if (wb->barriers != NULL) {
+		struct iscsi_wb_barrier *b;
+
+		for (b = wb->barriers; b->next != NULL; b = b->next) {
+			;
+		}
+		barrier_seq = b->seq;
+	}
+	if (wb->max_age > 0) {
+		old = time(NULL) - wb->max_age;
+	}
+
+	while (i < wb->ndirty) {
+		struct iscsi_wb_extent *ext = wb->dirty[i];
+
+		if ((!all && ext->min_seq > barrier_seq
+		     && (wb->max_age == 0 || ext->dirtied > old))
+		||  iscsi_wb_in_flight(wb, ext->lba, iscsi_wb_end(ext))) {
+			i++;
+			continue;
+		}
+		iscsi_wb_remove_at(wb, i);
+		if (iscsi_wb_send(iscsi, wb, ext) != 0) {
+			ISCSI_LOG(iscsi, 1, "write-back of %u blocks at %llu "
+				  "failed: %s", ext->num_blocks,
+				  (unsigned long long)ext->lba,
+				  iscsi_get_error(iscsi));
+			if (wb->error == SCSI_STATUS_GOOD) {
+				wb->error = SCSI_STATUS_ERROR;
+			}
+			iscsi_wb_free_extent(iscsi, ext);
+		}
+	}
+}
+
+/* Let waiting writes in, in order, as long as there is room */
+static void
+iscsi_wb_admit(struct iscsi_context *iscsi, struct iscsi_write_back *wb)
+{
+	struct iscsi_wb_write *w;
+
+	if (wb->admitting) {
+		return;
+	}
+	wb->admitting = 1;
+
+	while ((w = wb->waiting) != NULL) {
+		size_t len = (size_t)w->num_blocks * wb->block_size;
+		int status = SCSI_STATUS_GOOD;
+
+		if (len > wb->max_bytes) {
+			struct iscsi_wb_extent *ext;
+
+			/* too big to ever fit, so it goes straight out once
+			 * the writes it overlaps are out of the way */
+			if (iscsi_wb_in_flight(wb, w->lba,
+					       w->lba + w->num_blocks)) {
+				break;
+			}
+			ext = iscsi_zmalloc(iscsi,
+					    sizeof(struct iscsi_wb_extent));
+			if (ext == NULL
+			||  iscsi_wb_punch(iscsi, wb, w->lba,
+					   w->lba + w->num_blocks) != 0) {
+				iscsi_free(iscsi, ext);
+				break;
+			}
+			ext->lba          = w->lba;
+			ext->num_blocks   = w->num_blocks;
+			ext->data         = w->buf;
+			ext->min_seq      = w->seq;
+			ext->through      = 1;
+			ext->cb           = w->cb;
+			ext->private_data = w->private_data;
+			ISCSI_LIST_REMOVE(&wb->waiting, w);
+			iscsi_free(iscsi, w);
+			if (iscsi_wb_send(iscsi, wb, ext) != 0) {
+				ext->cb(iscsi, SCSI_STATUS_ERROR, NULL,
+					ext->private_data);
+				iscsi_free(iscsi, ext);
+			}
+			continue;
+		}
+
+		if (wb->dirty_bytes + wb->flushing_bytes + len > wb->max_bytes) {
+			break;
+		}
+		ISCSI_LIST_REMOVE(&wb->waiting, w);
+		if (iscsi_wb_absorb(iscsi, wb, w) != 0) {
+			status = SCSI_STATUS_ERROR;
+		}
+		w->cb(iscsi, status, NULL, w->private_data);
+		iscsi_free(iscsi, w);
+	}
+
+	wb->admitting = 0;
+}
+
+/* Lowest sequence number that has not reached the target yet */
+static uint64_t
+iscsi_wb_min_seq(struct iscsi_write_back *wb)
+{
+	uint64_t min = wb->seq + 1;
+	struct iscsi_wb_extent *ext;
+	int i;
+
+	for (i = 0; i < wb->ndirty; i++) {
+		if (wb->dirty[i]->min_seq < min) {
+			min = wb->dirty[i]->min_seq;
+		}
+	}
+	for (ext = wb->flushing; ext != NULL; ext = ext->next) {
+		if (!ext->done && ext->min_seq < min) {
+			min = ext->min_seq;
+		}
+	}
+	if (wb->waiting != NULL && wb->waiting->seq < min) {
+		min = wb->waiting->seq;
+	}
+	return min;
+}
+
+static void
+iscsi_wb_barriers_done(struct iscsi_context *iscsi,
+		       struct iscsi_wb_barrier *b, int status)
+{
+	struct iscsi_wb_barrier *next;
+
+	for (; b != NULL; b = next) {
+		next = b->next;
+		b->cb(iscsi, status, NULL, b->private_data);
+		iscsi_free(iscsi, b);
+	}
+}
+
+static void
+iscsi_wb_sync_cb(struct iscsi_context *iscsi, int status,
+		 void *command_data, void *private_data)
+{
+	if (status != SCSI_STATUS_GOOD) {
+		iscsi_set_error(iscsi, "SYNCHRONIZE CACHE16 failed: %s",
+				iscsi_get_error(iscsi));
+	}
+	scsi_free_scsi_task(command_data);
+	iscsi_wb_barriers_done(iscsi, private_data, status);
+}
+
+/* Complete the barriers that every write before them has made it past */
+static void
+iscsi_wb_check_barriers(struct iscsi_context *iscsi,
+			struct iscsi_write_back *wb)
+{
+	struct iscsi_wb_barrier *done = NULL, **tail = &done;
+	uint64_t min, num_blocks;
+	int status;
+
+	if (wb->barriers == NULL) {
+		return;
+	}
+	min = iscsi_wb_min_seq(wb);
+	while (wb->barriers != NULL && wb->barriers->seq < min) {
+		*tail = wb->barriers;
+		wb->barriers = wb->barriers->next;
+		tail = &(*tail)->next;
+		*tail = NULL;
+	}
+	if (done == NULL) {
+		return;
+	}
+
+	status = wb->error;
+	wb->error = SCSI_STATUS_GOOD;
+	if (status != SCSI_STATUS_GOOD) {
+		iscsi_set_error(iscsi, "Write-back failed since the last "
+				"barrier");
+		iscsi_wb_barriers_done(iscsi, done, status);
+		return;
+	}
+	if (wb->sync_hi == wb->sync_lo) {
+		/* nothing has been written since the last one */
+		iscsi_wb_barriers_done(iscsi, done, SCSI_STATUS_GOOD);
+		return;
+	}
+
+	/* 0 blocks is all the way to the end of the LUN */
+	num_blocks = wb->sync_hi - wb->sync_lo;
+	if (num_blocks > 0xffffffff) {
+		num_blocks = 0;
+	}
+	if (iscsi_synchronizecache16_task(iscsi, wb->lun, wb->sync_lo,
+					  num_blocks, 0, 0, iscsi_wb_sync_cb,
+					  done) == NULL) {
+		iscsi_wb_barriers_done(iscsi, done, SCSI_STATUS_ERROR);
+		return;
+	}
+	wb->sync_lo = wb->sync_hi = 0;
+}
+
+int
+iscsi_write_back_write(struct iscsi_context *iscsi,
+		       struct iscsi_write_back *wb, uint64_t lba,
+		       uint32_t num_blocks, unsigned char *buf,
+		       iscsi_command_cb cb, void *private_data)
+{
+	struct iscsi_wb_write *w;
+	int was_waiting = wb->waiting != NULL;
+
+	if (cb == NULL) {
+		iscsi_set_error(iscsi, "Write-back needs a callback");
+		return -1;
+	}
+	if (num_blocks == 0) {
+		iscsi_set_error(iscsi, "Write-back of 0 blocks");
+		return -1;
+	}
+
+	w = iscsi_malloc(iscsi, sizeof(struct iscsi_wb_write));
+	if (w == NULL) {
+		iscsi_set_error(iscsi, "Out-of-memory: Failed to allocate "
+				"write-back write.");
+		return -1;
+	}
+	w->next         = NULL;
+	w->lba          = lba;
+	w->num_blocks   = num_blocks;
+	w->buf          = buf;
+	w->cb           = cb;
+	w->private_data = private_data;
+	w->seq          = ++wb->seq;
+	ISCSI_LIST_ADD_END(&wb->waiting, w);
+
+	/* Writes that are already waiting keep their place */
+	if (!was_waiting) {
+		iscsi_wb_admit(iscsi, wb);
+	}
+	iscsi_wb_flush(iscsi, wb);
+
+	return 0;
+}
+
+static void
+iscsi_wb_read_cb(struct iscsi_context *iscsi, int status,
+		 void *command_data _U_, void *private_data)
+{
+	struct iscsi_wb_read *rd = private_data;
+	struct iscsi_write_back *wb = rd->wb;
+	uint64_t end = rd->lba + rd->num_blocks;
+	uint32_t bs = wb->block_size;
+	struct iscsi_wb_extent *ext;
+	int i;
+
+	if (status == SCSI_STATUS_GOOD) {
+		/* oldest first, so the newest data wins */
+		for (ext = wb->flushing; ext != NULL; ext = ext->next) {
+			uint64_t from, to;
+
+			if (ext->data == NULL || ext->lba >= end
+			||  iscsi_wb_end(ext) <= rd->lba) {
+				continue;
+			}
+			from = ext->lba > rd->lba ? ext->lba : rd->lba;
+			to = iscsi_wb_end(ext) < end ? iscsi_wb_end(ext) : end;
+			memcpy(rd->buf + (from - rd->lba) * bs,
+			       ext->data + (from - ext->lba) * bs,
+			       (to - from) * bs);
+		}
+		for (i = iscsi_wb_search(wb, rd->lba);
+		     i < wb->ndirty && wb->dirty[i]->lba < end; i++) {
+			uint64_t from, to;
+
+			ext  = wb->dirty[i];
+			from = ext->lba > rd->lba ? ext->lba : rd->lba;
+			to = iscsi_wb_end(ext) < end ? iscsi_wb_end(ext) : end;
+			memcpy(rd->buf + (from - rd->lba) * bs,
+			       ext->data + (from - ext->lba) * bs,
+			       (to - from) * bs);
+		}
+	}
+
+	wb->reads--;
+	if (wb->disabled) {
+		rd->cb(iscsi, status, NULL, rd->private_data);
+		iscsi_free(iscsi, rd);
+		if (wb->writes == 0 && wb->reads == 0) {
+			iscsi_wb_release(iscsi, wb);
+		}
+		return;
+	}
+	iscsi_wb_retire(iscsi, wb);
+	/* retiring may have made room for waiting writes */
+	iscsi_wb_admit(iscsi, wb);
+
+	rd->cb(iscsi, status, NULL, rd->private_data);
+	iscsi_free(iscsi, rd);
+}
+
+int
+iscsi_write_back_read(struct iscsi_context *iscsi,
+		      struct iscsi_write_back *wb, uint64_t lba,
+		      uint32_t num_blocks, unsigned char *buf,
+		      iscsi_command_cb cb, void *private_data)
+{
+	struct iscsi_wb_read *rd;
+
+	if (cb == NULL) {
+		iscsi_set_error(iscsi, "Write-back read needs a callback");
+		return -1;
+	}
+
+	rd = iscsi_malloc(iscsi, sizeof(struct iscsi_wb_read));
+	if (rd == NULL) {
+		iscsi_set_error(iscsi, "Out-of-memory: Failed to allocate "
+				"write-back read.");
+		return -1;
+	}
+	rd->wb           = wb;
+	rd->lba          = lba;
+	rd->num_blocks   = num_blocks;
+	rd->buf          = buf;
+	rd->cb           = cb;
+	rd->private_data = private_data;
+
+	wb->reads++;
+	if (iscsi_read_blocks_clean(iscsi, wb->lun, lba, num_blocks, buf,
+				    iscsi_wb_read_cb, rd) != 0) {
+		wb->reads--;
+		iscsi_free(iscsi, rd);
+		return -1;
+	}
+	return 0;
+}
+
+/* Called from iscsi_service() to write out extents that got too old */
+void
+iscsi_write_back_scan(struct iscsi_context *iscsi)
+{
+	struct iscsi_write_back *wb;
+	time_t now = time(NULL);
+
+	for (wb = iscsi->write_backs; wb != NULL; wb = wb->next) {
+		if (wb->max_age == 0 || wb->ndirty == 0
+		||  now < wb->next_age_scan) {
+			continue;
+		}
+		wb->next_age_scan = now + 1;
+		iscsi_wb_flush(iscsi, wb);
+	}
+}
+
+int
+iscsi_enable_write_back(struct iscsi_context *iscsi, int lun,
+			size_t max_bytes, size_t flush_bytes, int max_age)
+{
+	struct iscsi_write_back *wb;
+
+	if (iscsi->limits.block_size == 0) {
+		iscsi_set_error(iscsi, "Block size is not known, call "
+				"iscsi_set_block_limits() first");
+		return -1;
+	}
+	if (max_bytes < iscsi->limits.block_size || flush_bytes == 0
+	||  flush_bytes > max_bytes || max_age < 0) {
+		iscsi_set_error(iscsi, "Invalid write-back limits");
+		return -1;
+	}
+	if (iscsi_get_write_back(iscsi, lun) != NULL) {
+		iscsi_set_error(iscsi, "LUN %d already has write-back", lun);
+		return -1;
+	}
+
+	wb = iscsi_zmalloc(iscsi, sizeof(struct iscsi_write_back));
+	if (wb == NULL) {
+		iscsi_set_error(iscsi, "Out-of-memory: Failed to allocate "
+				"write-back.");
+		return -1;
+	}
+	wb->lun         = lun;
+	wb->block_size  = iscsi->limits.block_size;
+	wb->max_bytes   = max_bytes;
+	wb->flush_bytes = flush_bytes;
+	wb->max_age     = max_age;
+
+	ISCSI_LIST_ADD(&iscsi->write_backs, wb);
+
+	return 0;
+}
+
+static void
+iscsi_wb_release(struct iscsi_context *iscsi, struct iscsi_write_back *wb)
+{
+	struct iscsi_wb_extent *ext;
+
+	while ((ext = wb->flushing) != NULL) {
+		wb->flushing = ext->next;
+		iscsi_wb_free_extent(iscsi, ext);
+	}
+	iscsi_free(iscsi, wb->dirty);
+	iscsi_free(iscsi, wb);
+}
+
+/* Drop everything that is not on the wire yet. The extents that are
+ * stay on the flushing list until their WRITEs complete.
+ */
+static void
+iscsi_wb_disable(struct iscsi_context *iscsi, struct iscsi_write_back *wb)
+{
+	struct iscsi_wb_write *w;
+	struct iscsi_wb_barrier *b;
+	int i;
+
+	ISCSI_LIST_REMOVE(&iscsi->write_backs, wb);
+	wb->disabled = 1;
+
+	for (i = 0; i < wb->ndirty; i++) {
+		iscsi_wb_free_extent(iscsi, wb->dirty[i]);
+	}
+	wb->ndirty      = 0;
+	wb->dirty_bytes = 0;
+
+	while ((w = wb->waiting) != NULL) {
+		wb->waiting = w->next;
+		w->cb(iscsi, SCSI_STATUS_CANCELLED, NULL, w->private_data);
+		iscsi_free(iscsi, w);
+	}
+	b = wb->barriers;
+	wb->barriers = NULL;
+	iscsi_wb_barriers_done(iscsi, b, SCSI_STATUS_CANCELLED);
+
+	if (wb->writes == 0 && wb->reads == 0) {
+		iscsi_wb_release(iscsi, wb);
+	}
+	/* otherwise the last WRITE or read to complete frees it */
+}
+
+int
+iscsi_disable_write_back(struct iscsi_context *iscsi, int lun)
+{
+	struct iscsi_write_back *wb = iscsi_get_write_back(iscsi, lun);
+
+	if (wb == NULL) {
+		return 0;
+	}
+	iscsi_wb_retire(iscsi, wb);
+	if (wb->ndirty != 0 || wb->flushing != NULL || wb->waiting != NULL
+	||  wb->barriers != NULL || wb->reads != 0) {
+		iscsi_set_error(iscsi, "Write-back for LUN %d is not idle, "
+				"wait for a barrier first", lun);
+		return -1;
+	}
+	iscsi_wb_disable(iscsi, wb);
+
+	return 0;
+}
+
+int
+iscsi_write_back_barrier_async(struct iscsi_context *iscsi, int lun,
+			       iscsi_command_cb cb, void *private_data)
+{
+	struct iscsi_write_back *wb = iscsi_get_write_back(iscsi, lun);
+	struct iscsi_wb_barrier *b;
+
+	if (wb == NULL) {
+		iscsi_set_error(iscsi, "LUN %d has no write-back", lun);
+		return -1;
+	}
+	if (cb == NULL) {
+		iscsi_set_error(iscsi, "Barrier needs a callback");
+		return -1;
+	}
+
+	b = iscsi_malloc(iscsi, sizeof(struct iscsi_wb_barrier));
+	if (b == NULL) {
+		iscsi_set_error(iscsi, "Out-of-memory: Failed to allocate "
+				"barrier.");
+		return -1;
+	}
+	b->next         = NULL;
+	b->seq          = wb->seq;
+	b->cb           = cb;
+	b->private_data = private_data;
+	ISCSI_LIST_ADD_END(&wb->barriers, b);
+
+	iscsi_wb_flush(iscsi, wb);
+	iscsi_wb_check_barriers(iscsi, wb);
+
+	return 0;
+}
+
+/* Only called from iscsi_destroy_context(), anything still dirty is lost */
+void
+iscsi_free_write_backs(struct iscsi_context *iscsi)
+{
+	while (iscsi->write_backs != NULL) {
+		iscsi_wb_disable(iscsi, iscsi->write_backs);
+	}
+}
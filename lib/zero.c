@@ -0,0 +1,379 @@
+/*
+   Copyright (C) 2026 by agent <agent@local>
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU Lesser General Public License as published by
+   the Free Software Foundation; either version 2.1 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public License
+   along with this program; if not, see <http://www.gnu.org/licenses/>.
+*/
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "iscsi.h"
+#include "iscsi-private.h"
+#include "scsi-lowlevel.h"
+#include "slist.h"
+
+/*
+ * Zero block detection.
+ *
+ * Looks through the data of iscsi_write_blocks_async() for runs of
+ * blocks that are all zero, and sends those as WRITE SAME16 of a single
+ * zero block instead, with UNMAP set if the LUN supports unmapping
+ * through WRITE SAME16. Only the rest goes out as normal writes.
+ *
+ * If the target rejects the WRITE SAME16 the run is written out as
+ * normal data, and no more WRITE SAMEs are tried on that LUN.
+ */
+
+/* blocks per WRITE SAME16 if the target has no limit */
+#define ISCSI_ZERO_DEFAULT_WS (1024 * 1024)
+
+struct iscsi_zero_detect {
+	struct iscsi_zero_detect *next;
+	int lun;
+	uint32_t block_size;
+	uint32_t min_blocks;
+	uint32_t max_ws;
+	int unmap;
+	int no_ws;
+
+	int in_flight;
+	int disabled;
+	struct iscsi_zero_detect_stats stats;
+};
+
+struct iscsi_zero_write {
+	iscsi_command_cb cb;
+	void *private_data;
+	int pending;
+	int status;
+};
+
+struct iscsi_zero_same {
+	struct iscsi_zero_detect *zd;
+	struct iscsi_zero_write *zw;
+	uint64_t lba;
+	uint32_t num_blocks;
+	unsigned char *buf;
+};
+
+/* OR a cache line worth of words together at a time, which compilers
+ * turn into vector code where they can */
+static int
+iscsi_zero_block(const unsigned char *p, uint32_t len)
+{
+	uint64_t w[8];
+	uint32_t i = 0;
+
+	for (; i + sizeof(w) <= len; i += sizeof(w)) {
+		memcpy(w, p + i, sizeof(w));
+		if ((w[0] | w[1] | w[2] | w[3] | w[4] | w[5] | w[6] | w[7])
+		    != 0) {
+			return 0;
+		}
+	}
+	for (; i < len; i++) {
+		if (p[i] != 0) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+/* Find the next run of at least min_blocks zero blocks from *start on */
+static int
+iscsi_zero_next_run(struct iscsi_zero_detect *zd, const unsigned char *buf,
+		    uint32_t num_blocks, uint32_t *start, uint32_t *end)
+{
+	uint32_t bs = zd->block_size, i = *start, first;
+
+	while (i < num_blocks) {
+		if (!iscsi_zero_block(buf + (size_t)i * bs, bs)) {
+			i++;
+			continue;
+		}
+		for (first = i++; i < num_blocks; i++) {
+			if (!iscsi_zero_block(buf + (size_t)i * bs, bs)) {
+				break;
+			}
+		}
+		if (i - first >= zd->min_blocks) {
+			*start = first;
+			*end   = i;
+			return 1;
+		}
+	}
+	return 0;
+}
+
+static void
+iscsi_zero_write_cb(struct iscsi_context *iscsi, int status,
+		    void *command_data _U_, void *private_data)
+{
+	struct iscsi_zero_write *zw = private_data;
+
+	if (status != SCSI_STATUS_GOOD && zw->status == SCSI_STATUS_GOOD) {
+		zw->status = status;
+	}
+	if (--zw->pending > 0) {
+		return;
+	}
+	zw->cb(iscsi, zw->status, NULL, zw->private_data);
+	iscsi_free(iscsi, zw);
+}
+
+static void
+iscsi_zero_same_cb(struct iscsi_context *iscsi, int status,
+		   void *command_data, void *private_data)
+{
+	struct iscsi_zero_same *ws = private_data;
+	struct iscsi_zero_detect *zd = ws->zd;
+	struct scsi_task *task = command_data;
+	int rejected;
+
+	rejected = status == SCSI_STATUS_CHECK_CONDITION
+		&& task->sense.key == SCSI_SENSE_ILLEGAL_REQUEST;
+	scsi_free_scsi_task(task);
+
+	if (rejected) {
+		/* write it the long way, and don't bother again */
+		zd->no_ws = 1;
+		if (iscsi_write_blocks_split(iscsi, zd->lun, ws->lba,
+					     ws->num_blocks, ws->buf,
+					     iscsi_zero_write_cb,
+					     ws->zw) == 0) {
+			status = SCSI_STATUS_GOOD;
+			ws->zw->pending++;
+		}
+	}
+	iscsi_zero_write_cb(iscsi, status, NULL, ws->zw);
+	iscsi_free(iscsi, ws);
+
+	if (--zd->in_flight == 0 && zd->disabled) {
+		iscsi_free(iscsi, zd);
+	}
+}
+
+static int
+iscsi_zero_same(struct iscsi_context *iscsi, struct iscsi_zero_detect *zd,
+		struct iscsi_zero_write *zw, uint64_t lba,
+		uint32_t num_blocks, unsigned char *buf)
+{
+	while (num_blocks > 0) {
+		uint32_t n = num_blocks < zd->max_ws ? num_blocks : zd->max_ws;
+		struct iscsi_zero_same *ws;
+
+		ws = iscsi_malloc(iscsi, sizeof(struct iscsi_zero_same));
+		if (ws == NULL) {
+			iscsi_set_error(iscsi, "Out-of-memory: Failed to "
+					"allocate WRITE SAME.");
+			return -1;
+		}
+		ws->zd         = zd;
+		ws->zw         = zw;
+		ws->lba        = lba;
+		ws->num_blocks = n;
+		ws->buf        = buf;
+
+		/* any of the zero blocks will do as the data */
+		if (iscsi_writesame16_task(iscsi, zd->lun, lba, buf,
+					   zd->block_size, n, 0, zd->unmap,
+					   0, 0, iscsi_zero_same_cb,
+					   ws) == NULL) {
+			iscsi_free(iscsi, ws);
+			return -1;
+		}
+		zd->in_flight++;
+		zw->pending++;
+		zd->stats.zero_blocks += n;
+		zd->stats.write_sames++;
+
+		lba        += n;
+		num_blocks -= n;
+		buf        += (size_t)n * zd->block_size;
+	}
+	return 0;
+}
+
+static int
+iscsi_zero_data(struct iscsi_context *iscsi, struct iscsi_zero_detect *zd,
+		struct iscsi_zero_write *zw, uint64_t lba,
+		uint32_t num_blocks, unsigned char *buf)
+{
+	if (iscsi_write_blocks_split(iscsi, zd->lun, lba, num_blocks, buf,
+				     iscsi_zero_write_cb, zw) != 0) {
+		return -1;
+	}
+	zw->pending++;
+	zd->stats.data_blocks += num_blocks;
+
+	return 0;
+}
+
+struct iscsi_zero_detect *
+iscsi_get_zero_detect(struct iscsi_context *iscsi, int lun)
+{
+	struct iscsi_zero_detect *zd;
+
+	for (zd = iscsi->zero_detects; zd != NULL; zd = zd->next) {
+		if (zd->lun == lun) {
+			return zd;
+		}
+	}
+	return NULL;
+}
+
+int
+iscsi_zero_detect_write(struct iscsi_context *iscsi,
+			struct iscsi_zero_detect *zd, uint64_t lba,
+			uint32_t num_blocks, unsigned char *buf,
+			iscsi_command_cb cb, void *private_data)
+{
+	struct iscsi_zero_write *zw;
+	uint32_t pos = 0, start = 0, end;
+
+	if (zd->no_ws || cb == NULL || iscsi->limits.block_size != zd->block_size
+	||  !iscsi_zero_next_run(zd, buf, num_blocks, &start, &end)) {
+		zd->stats.data_blocks += num_blocks;
+		return iscsi_write_blocks_split(iscsi, zd->lun, lba, num_blocks,
+						buf, cb, private_data);
+	}
+
+	zw = iscsi_zmalloc(iscsi, sizeof(struct iscsi_zero_write));
+	if (zw == NULL) {
+		iscsi_set_error(iscsi, "Out-of-memory: Failed to allocate "
+				"zero detect write.");
+		return -1;
+	}
+	zw->cb           = cb;
+	zw->private_data = private_data;
+	zw->status       = SCSI_STATUS_GOOD;
+	/* held until everything has been sent */
+	zw->pending      = 1;
+
+	do {
+		if (start > pos
+		&&  iscsi_zero_data(iscsi, zd, zw, lba + pos, start - pos,
+				    buf + (size_t)pos * zd->block_size) != 0) {
+			goto failed;
+		}
+		if (iscsi_zero_same(iscsi, zd, zw, lba + start, end - start,
+				    buf + (size_t)start * zd->block_size) != 0) {
+			goto failed;
+		}
+		pos = start = end;
+	} while (iscsi_zero_next_run(zd, buf, num_blocks, &start, &end));
+
+	if (pos < num_blocks
+	&&  iscsi_zero_data(iscsi, zd, zw, lba + pos, num_blocks - pos,
+			    buf + (size_t)pos * zd->block_size) != 0) {
+		goto failed;
+	}
+
+	iscsi_zero_write_cb(iscsi, SCSI_STATUS_GOOD, NULL, zw);
+	return 0;
+
+ failed:
+	if (zw->pending == 1) {
+		iscsi_free(iscsi, zw);
+		return -1;
+	}
+	/* the ones already sent will finish it off */
+	iscsi_zero_write_cb(iscsi, SCSI_STATUS_ERROR, NULL, zw);
+	return 0;
+}
+
+int
+iscsi_enable_zero_detect(struct iscsi_context *iscsi, int lun,
+			 uint32_t min_blocks)
+{
+	struct iscsi_zero_detect *zd;
+
+	if (iscsi->limits.block_size == 0) {
+		iscsi_set_error(iscsi, "Block size is not known, call "
+				"iscsi_set_block_limits() first");
+		return -1;
+	}
+	if (iscsi_get_zero_detect(iscsi, lun) != NULL) {
+		iscsi_set_error(iscsi, "LUN %d already has zero detection",
+				lun);
+		return -1;
+	}
+
+	zd = iscsi_zmalloc(iscsi, sizeof(struct iscsi_zero_detect));
+	if (zd == NULL) {
+		iscsi_set_error(iscsi, "Out-of-memory: Failed to allocate "
+				"zero detection.");
+		return -1;
+	}
+	zd->lun        = lun;
+	zd->block_size = iscsi->limits.block_size;
+	zd->min_blocks = min_blocks ? min_blocks : 1;
+	zd->unmap      = iscsi->limits.lbpws;
+	zd->max_ws     = ISCSI_ZERO_DEFAULT_WS;
+	if (iscsi->limits.max_ws_len != 0
+	&&  iscsi->limits.max_ws_len < zd->max_ws) {
+		zd->max_ws = iscsi->limits.max_ws_len;
+	}
+
+	ISCSI_LIST_ADD(&iscsi->zero_detects, zd);
+
+	return 0;
+}
+
+int
+iscsi_get_zero_detect_stats(struct iscsi_context *iscsi, int lun,
+			    struct iscsi_zero_detect_stats *stats)
+{
+	struct iscsi_zero_detect *zd = iscsi_get_zero_detect(iscsi, lun);
+
+	if (zd == NULL) {
+		iscsi_set_error(iscsi, "LUN %d has no zero detection", lun);
+		return -1;
+	}
+	*stats = zd->stats;
+
+	return 0;
+}
+
+static void
+iscsi_zero_disable(struct iscsi_context *iscsi, struct iscsi_zero_detect *zd)
+{
+	ISCSI_LIST_REMOVE(&iscsi->zero_detects, zd);
+	zd->disabled = 1;
+	if (zd->in_flight == 0) {
+		iscsi_free(iscsi, zd);
+	}
+	/* otherwise the last WRITE SAME to complete frees it */
+}
+
+void
+iscsi_disable_zero_detect(struct iscsi_context *iscsi, int lun)
+{
+	struct iscsi_zero_detect *zd = iscsi_get_zero_detect(iscsi, lun);
+
+	if (zd != NULL) {
+		iscsi_zero_disable(iscsi, zd);
+	}
+}
+
+void
+iscsi_free_zero_detects(struct iscsi_context *iscsi)
+{
+	while (iscsi->zero_detects != NULL) {
+		iscsi_zero_disable(iscsi, iscsi->zero_detects);
+	}
+}
@@ -0,0 +1,81 @@
+/* 
+   Copyright (C) 2026 by agent <agent@local>
+   
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+   
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+   
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, see <http://www.gnu.org/licenses/>.
+*/
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "iscsi.h"
+
+/*
+ * Known answers for the CRC16 T10-DIF guard, polynomial 0x8BB7, not
+ * reflected, initial value 0.
+ */
+static int
+check(const char *name, const unsigned char *buf, size_t len,
+      uint16_t expected)
+{
+	uint16_t crc;
+	size_t i;
+
+	crc = iscsi_crc16_t10dif(0, buf, len);
+	if (crc != expected) {
+		printf("%s: got 0x%04x, expected 0x%04x\n", name, crc, expected);
+		return -1;
+	}
+
+	/* feeding the buffer in pieces must give the same answer */
+	for (i = 1; i < len && i < 17; i++) {
+		crc = iscsi_crc16_t10dif(0, buf, i);
+		crc = iscsi_crc16_t10dif(crc, buf + i, len - i);
+		if (crc != expected) {
+			printf("%s split at %d: got 0x%04x, expected 0x%04x\n",
+			       name, (int)i, crc, expected);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+int main(int argc _U_, char *argv[] _U_)
+{
+	unsigned char buf[512];
+	int i, ret = 0;
+
+	ret |= check("check string", (const unsigned char *)"123456789", 9,
+		     0xd0db);
+
+	memset(buf, 0, sizeof(buf));
+	ret |= check("512 zero bytes", buf, sizeof(buf), 0x0000);
+
+	memset(buf, 0xff, sizeof(buf));
+	ret |= check("512 0xff bytes", buf, sizeof(buf), 0xe6a1);
+
+	for (i = 0; i < 512; i++) {
+		buf[i] = i & 0xff;
+	}
+	ret |= check("512 counting bytes", buf, sizeof(buf), 0x4f10);
+
+	if (ret) {
+		exit(10);
+	}
+	return 0;
+}
@@ -0,0 +1,289 @@
+/*
+   Copyright (C) 2026 by agent <agent@local>
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, see <http://www.gnu.org/licenses/>.
+*/
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#ifdef HAVE_POLL_H
+#include <poll.h>
+#endif
+
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <getopt.h>
+#include <time.h>
+#include "iscsi.h"
+#include "scsi-lowlevel.h"
+
+#ifndef discard_const
+#define discard_const(ptr) ((void *)((intptr_t)(ptr)))
+#endif
+
+const char *initiator = "iqn.2007-10.com.github:sahlberg:libiscsi:prog-reconnect-destroy";
+
+void write_cb(struct iscsi_context *iscsi _U_, int status _U_,
+	      void *command_data _U_, void *private_data _U_)
+{
+}
+
+void print_usage(void)
+{
+	fprintf(stderr, "Usage: prog_reconnect_destroy [-?|--help] [--usage] "
+		"[-i|--initiator-name=iqn-name]\n"
+		"\t\t<iscsi-portal-url>\n");
+	fprintf(stderr, "\n");
+	fprintf(stderr, "This command is used to test that a context can be "
+		"destroyed while it is reconnecting, with the completion "
+		"queue, read cache, write-back, provisioning map, discard "
+		"batching, zero detection, log ring and capture all "
+		"enabled.\n");
+}
+
+void print_help(void)
+{
+	fprintf(stderr, "Usage: prog_reconnect_destroy [OPTION...] <iscsi-url>\n");
+	fprintf(stderr, "  -i, --initiator-name=iqn-name     "
+		"Initiatorname to use\n");
+	fprintf(stderr, "\n");
+	fprintf(stderr, "Help options:\n");
+	fprintf(stderr, "  -?, --help                        "
+		"Show this help message\n");
+	fprintf(stderr, "      --usage                       "
+		"Display brief usage message\n");
+	fprintf(stderr, "\n");
+	fprintf(stderr, "iSCSI Portal URL format : %s\n",
+		ISCSI_PORTAL_URL_SYNTAX);
+	fprintf(stderr, "\n");
+	fprintf(stderr, "<host> is either of:\n");
+	fprintf(stderr, "  \"hostname\"       iscsi.example\n");
+	fprintf(stderr, "  \"ipv4-address\"   10.1.1.27\n");
+	fprintf(stderr, "  \"ipv6-address\"   [fce0::1]\n");
+}
+
+int main(int argc, char *argv[])
+{
+	struct iscsi_context *iscsi;
+	struct iscsi_url *iscsi_url = NULL;
+	const char *url = NULL;
+	int c, lun;
+	static int show_help = 0, show_usage = 0, debug = 0;
+	static unsigned char buf[64 * 1024];
+	char capture[] = "/tmp/prog_reconnect_destroy.XXXXXX";
+	struct scsi_readcapacity10 *rc10;
+	struct scsi_task *task;
+	uint32_t block_size;
+	struct pollfd pfd;
+	ssize_t count;
+	time_t end;
+	int fd;
+
+	static struct option long_options[] = {
+		{"help",           no_argument,          NULL,        'h'},
+		{"usage",          no_argument,          NULL,        'u'},
+		{"debug",          no_argument,          NULL,        'd'},
+		{"initiator-name", required_argument,    NULL,        'i'},
+		{0, 0, 0, 0}
+	};
+	int option_index;
+
+	while ((c = getopt_long(argc, argv, "h?uUdi:s", long_options,
+			&option_index)) != -1) {
+		switch (c) {
+		case 'h':
+		case '?':
+			show_help = 1;
+			break;
+		case 'u':
+			show_usage = 1;
+			break;
+		case 'd':
+			debug = 1;
+			break;
+		case 'i':
+			initiator = optarg;
+			break;
+		default:
+			fprintf(stderr, "Unrecognized option '%c'\n\n", c);
+			print_help();
+			exit(0);
+		}
+	}
+
+	if (show_help != 0) {
+		print_help();
+		exit(0);
+	}
+
+	if (show_usage != 0) {
+		print_usage();
+		exit(0);
+	}
+
+	if (optind != argc -1) {
+		print_usage();
+		exit(0);
+	}
+
+	if (argv[optind] != NULL) {
+		url = strdup(argv[optind]);
+	}
+	if (url == NULL) {
+		fprintf(stderr, "You must specify iscsi target portal.\n");
+		print_usage();
+		exit(10);
+	}
+
+	iscsi = iscsi_create_context(initiator);
+	if (iscsi == NULL) {
+		printf("Failed to create context\n");
+		exit(10);
+	}
+
+	if (debug > 0) {
+		iscsi_set_log_level(iscsi, debug);
+		iscsi_set_log_fn(iscsi, iscsi_log_to_stderr);
+	}
+
+	iscsi_url = iscsi_parse_full_url(iscsi, url);
+
+	if (url) {
+		free(discard_const(url));
+	}
+
+	if (iscsi_url == NULL) {
+		fprintf(stderr, "Failed to parse URL: %s\n",
+			iscsi_get_error(iscsi));
+		exit(10);
+	}
+
+	iscsi_set_session_type(iscsi, ISCSI_SESSION_NORMAL);
+
+	lun = iscsi_url->lun;
+	if (iscsi_full_connect_sync(iscsi, iscsi_url->portal, lun) != 0) {
+		fprintf(stderr, "iscsi_connect failed. %s\n",
+			iscsi_get_error(iscsi));
+		exit(10);
+	}
+	task = iscsi_readcapacity10_sync(iscsi, lun, 0, 0);
+	if (task == NULL || task->status != SCSI_STATUS_GOOD) {
+		fprintf(stderr, "failed to send readcapacity command\n");
+		exit(10);
+	}
+	rc10 = scsi_datain_unmarshall(task);
+	if (rc10 == NULL) {
+		fprintf(stderr, "failed to unmarshall readcapacity10 data\n");
+		exit(10);
+	}
+	block_size = rc10->block_size;
+	scsi_free_scsi_task(task);
+
+	if (iscsi_discover_block_limits_sync(iscsi, lun) != 0) {
+		fprintf(stderr, "Failed to discover block limits. %s\n",
+			iscsi_get_error(iscsi));
+		exit(10);
+	}
+
+	/* Everything the reconnecting context takes over from the old one */
+	if (iscsi_set_completion_queue(iscsi, 64) != 0
+	||  iscsi_enable_read_cache(iscsi, lun, 4096, 64) != 0
+	||  iscsi_enable_write_back(iscsi, lun, 1024 * 1024,
+				    sizeof(buf), 0) != 0
+	||  iscsi_enable_zero_detect(iscsi, lun, 8) != 0
+	||  iscsi_set_log_ring(iscsi, 64, 0) != 0) {
+		fprintf(stderr, "Failed to enable features. %s\n",
+			iscsi_get_error(iscsi));
+		exit(10);
+	}
+	/* these need a thin provisioned LUN, so go without if we can't */
+	if (iscsi_enable_lba_map(iscsi, lun) != 0) {
+		printf("No provisioning map: %s\n", iscsi_get_error(iscsi));
+	}
+	if (iscsi_enable_discard(iscsi, lun, 1024 * 1024, 0) != 0) {
+		printf("No discard batching: %s\n", iscsi_get_error(iscsi));
+	}
+
+	fd = mkstemp(capture);
+	if (fd == -1) {
+		fprintf(stderr, "Failed to create capture file\n");
+		exit(10);
+	}
+	close(fd);
+	if (iscsi_start_capture(iscsi, capture, 64) != 0) {
+		fprintf(stderr, "Failed to start capture. %s\n",
+			iscsi_get_error(iscsi));
+		unlink(capture);
+		exit(10);
+	}
+
+	/* Fill the write-back up to its flush threshold, so a WRITE of the
+	 * dirty data is queued and still in flight when the target drops
+	 * the connection. Not zeros, or zero detection turns it into a
+	 * WRITE SAME.
+	 */
+	memset(buf, 0xa5, sizeof(buf));
+	if (iscsi_write_blocks_async(iscsi, lun, 0, sizeof(buf) / block_size,
+				     buf, write_cb, NULL) != 0) {
+		fprintf(stderr, "iscsi_write_blocks_async failed : %s\n",
+			iscsi_get_error(iscsi));
+		unlink(capture);
+		exit(10);
+	}
+
+	printf("write garbage to the socket to trigger a server "
+	       "disconnect\n");
+	memset(buf, 0, 256);
+	count = write(iscsi_get_fd(iscsi), buf, 256);
+	if (count < 256) {
+		fprintf(stderr, "write failed.\n");
+		unlink(capture);
+		exit(10);
+	}
+
+	/* Once the target has dropped us, the context is reconnecting
+	 * and no longer logged in. Destroy it right there.
+	 */
+	end = time(NULL) + 10;
+	while (iscsi_is_logged_in(iscsi)) {
+		if (time(NULL) > end) {
+			fprintf(stderr, "Target never dropped the "
+				"connection\n");
+			unlink(capture);
+			exit(10);
+		}
+		pfd.fd = iscsi_get_fd(iscsi);
+		pfd.events = iscsi_which_events(iscsi);
+
+		if (poll(&pfd, 1, 1000) < 0) {
+			fprintf(stderr, "Poll failed");
+			unlink(capture);
+			exit(10);
+		}
+		iscsi_service(iscsi, pfd.revents);
+	}
+
+	printf("destroy the context while it is reconnecting\n");
+	iscsi_destroy_url(iscsi_url);
+	iscsi_destroy_context(iscsi);
+	unlink(capture);
+	return 0;
+}
@@ -0,0 +1,11 @@
+#!/bin/sh
+
+. ./functions.sh
+
+echo "CRC16 T10-DIF tests"
+
+echo -n "Test the protection information guard against known answers ... "
+./prog_crc16 > /dev/null || failure
+success
+
+exit 0
@@ -0,0 +1,17 @@
+#!/bin/sh
+
+. ./functions.sh
+
+echo "Reconnect and destroy test"
+
+start_target
+create_lun
+
+echo -n "Test destroying the context while it is reconnecting ... "
+./prog_reconnect_destroy -i ${IQNINITIATOR} iscsi://${TGTPORTAL}/${IQNTARGET}/1 > /dev/null || failure
+success
+
+shutdown_target
+delete_lun
+
+exit 0
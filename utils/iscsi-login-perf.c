@@ -0,0 +1,328 @@
+/*
+   Copyright (C) 2026 by agent <agent@local>
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, see <http://www.gnu.org/licenses/>.
+*/
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#ifdef HAVE_POLL_H
+#include <poll.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <getopt.h>
+#include <time.h>
+#include <sys/time.h>
+#include "iscsi.h"
+#include "scsi-lowlevel.h"
+
+/*
+ * Measure how many sessions per second we can bring up against a target.
+ * Each slot repeatedly creates a context, does a full connect (login and
+ * the post login TEST UNIT READY), logs out again and destroys the context.
+ */
+
+const char *initiator = "iqn.2007-10.com.github:sahlberg:libiscsi:iscsi-login-perf";
+
+enum slot_state {
+	SLOT_IDLE = 0,
+	SLOT_CONNECTING,
+	SLOT_LOGGING_OUT,
+	SLOT_DONE,
+	SLOT_FAILED
+};
+
+struct slot {
+	struct iscsi_context *iscsi;
+	enum slot_state state;
+	uint64_t start_us;
+};
+
+static const char *url;
+static enum iscsi_post_login_tur tur_mode = ISCSI_POST_LOGIN_TUR_WAIT;
+static uint64_t sessions, failures, logins, total_us, max_us;
+
+static uint64_t get_clock_us(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+static void logout_cb(struct iscsi_context *iscsi _U_, int status,
+		      void *command_data _U_, void *private_data)
+{
+	struct slot *slot = private_data;
+
+	slot->state = status ? SLOT_FAILED : SLOT_DONE;
+}
+
+static void connect_cb(struct iscsi_context *iscsi, int status,
+		       void *command_data _U_, void *private_data)
+{
+	struct slot *slot = private_data;
+	uint64_t us;
+
+	if (slot->state != SLOT_CONNECTING) {
+		return;
+	}
+	if (status != SCSI_STATUS_GOOD) {
+		fprintf(stderr, "Login failed: %s\n", iscsi_get_error(iscsi));
+		slot->state = SLOT_FAILED;
+		return;
+	}
+
+	us = get_clock_us() - slot->start_us;
+	logins++;
+	total_us += us;
+	if (us > max_us) {
+		max_us = us;
+	}
+
+	slot->state = SLOT_LOGGING_OUT;
+	if (iscsi_logout_async(iscsi, logout_cb, slot) != 0) {
+		slot->state = SLOT_FAILED;
+	}
+}
+
+static int start_slot(struct slot *slot)
+{
+	struct iscsi_url *iscsi_url;
+
+	slot->iscsi = iscsi_create_context(initiator);
+	if (slot->iscsi == NULL) {
+		fprintf(stderr, "Failed to create context\n");
+		return -1;
+	}
+
+	iscsi_url = iscsi_parse_full_url(slot->iscsi, url);
+	if (iscsi_url == NULL) {
+		fprintf(stderr, "Failed to parse URL: %s\n",
+			iscsi_get_error(slot->iscsi));
+		iscsi_destroy_context(slot->iscsi);
+		slot->iscsi = NULL;
+		return -1;
+	}
+
+	iscsi_set_session_type(slot->iscsi, ISCSI_SESSION_NORMAL);
+	iscsi_set_header_digest(slot->iscsi, ISCSI_HEADER_DIGEST_NONE_CRC32C);
+	iscsi_set_post_login_tur(slot->iscsi, tur_mode);
+
+	slot->state = SLOT_CONNECTING;
+	slot->start_us = get_clock_us();
+	if (iscsi_full_connect_async(slot->iscsi, iscsi_url->portal,
+				     iscsi_url->lun, connect_cb, slot) != 0) {
+		fprintf(stderr, "Failed to start connect: %s\n",
+			iscsi_get_error(slot->iscsi));
+		slot->state = SLOT_FAILED;
+	}
+	iscsi_destroy_url(iscsi_url);
+
+	return 0;
+}
+
+static void finish_slot(struct slot *slot)
+{
+	if (slot->state == SLOT_DONE) {
+		sessions++;
+	} else {
+		failures++;
+	}
+	iscsi_destroy_context(slot->iscsi);
+	slot->iscsi = NULL;
+	slot->state = SLOT_IDLE;
+}
+
+static void print_usage(void)
+{
+	fprintf(stderr, "Usage: iscsi-login-perf [-?] [-i <initiator-name>] "
+		"[-c <concurrency>] [-t <seconds>] [-T wait|pipeline|skip] "
+		"<iscsi-url>\n");
+}
+
+static void print_help(void)
+{
+	fprintf(stderr, "Usage: iscsi-login-perf [OPTION...] <iscsi-url>\n");
+	fprintf(stderr, "  -i, --initiator-name=iqn-name     Initiatorname to use\n");
+	fprintf(stderr, "  -c, --concurrency=<n>             Number of sessions to log in in parallel (default 1)\n");
+	fprintf(stderr, "  -t, --runtime=<seconds>           How long to run for (default 10)\n");
+	fprintf(stderr, "  -T, --tur=wait|pipeline|skip      What to do with the post login TEST UNIT READY\n");
+	fprintf(stderr, "\n");
+	fprintf(stderr, "Help options:\n");
+	fprintf(stderr, "  -?, --help                        Show this help message\n");
+	fprintf(stderr, "      --usage                       Display brief usage message\n");
+	fprintf(stderr, "\n");
+	fprintf(stderr, "iSCSI URL format : %s\n", ISCSI_URL_SYNTAX);
+	fprintf(stderr, "\n");
+	fprintf(stderr, "<host> is either of:\n");
+	fprintf(stderr, "  \"hostname\"       iscsi.example\n");
+	fprintf(stderr, "  \"ipv4-address\"   10.1.1.27\n");
+	fprintf(stderr, "  \"ipv6-address\"   [fce0::1]\n");
+}
+
+int main(int argc, char *argv[])
+{
+	struct slot *slots;
+	struct pollfd *pfd;
+	int concurrency = 1, runtime = 10;
+	int show_help = 0, show_usage = 0;
+	int c, i, err = 0;
+	uint64_t start_us, end_us, elapsed_us;
+
+	static struct option long_options[] = {
+		{"help",           no_argument,          NULL,        'h'},
+		{"usage",          no_argument,          NULL,        'u'},
+		{"initiator-name", required_argument,    NULL,        'i'},
+		{"concurrency",    required_argument,    NULL,        'c'},
+		{"runtime",        required_argument,    NULL,        't'},
+		{"tur",            required_argument,    NULL,        'T'},
+		{0, 0, 0, 0}
+	};
+	int option_index;
+
+	while ((c = getopt_long(argc, argv, "h?ui:c:t:T:", long_options,
+			&option_index)) != -1) {
+		switch (c) {
+		case 'h':
+		case '?':
+			show_help = 1;
+			break;
+		case 'u':
+			show_usage = 1;
+			break;
+		case 'i':
+			initiator = optarg;
+			break;
+		case 'c':
+			concurrency = atoi(optarg);
+			break;
+		case 't':
+			runtime = atoi(optarg);
+			break;
+		case 'T':
+			if (!strcmp(optarg, "wait")) {
+				tur_mode = ISCSI_POST_LOGIN_TUR_WAIT;
+			} else if (!strcmp(optarg, "pipeline")) {
+				tur_mode = ISCSI_POST_LOGIN_TUR_PIPELINE;
+			} else if (!strcmp(optarg, "skip")) {
+				tur_mode = ISCSI_POST_LOGIN_TUR_SKIP;
+			} else {
+				fprintf(stderr, "Unknown TUR mode '%s'\n", optarg);
+				print_usage();
+				exit(10);
+			}
+			break;
+		default:
+			fprintf(stderr, "Unrecognized option '%c'\n\n", c);
+			print_help();
+			exit(0);
+		}
+	}
+
+	if (show_help != 0) {
+		print_help();
+		exit(0);
+	}
+
+	if (show_usage != 0) {
+		print_usage();
+		exit(0);
+	}
+
+	if (optind != argc - 1 || concurrency < 1 || runtime < 1) {
+		print_usage();
+		exit(10);
+	}
+	url = argv[optind];
+
+	slots = calloc(concurrency, sizeof(struct slot));
+	pfd = calloc(concurrency, sizeof(struct pollfd));
+	if (slots == NULL || pfd == NULL) {
+		fprintf(stderr, "Out of Memory\n");
+		exit(10);
+	}
+
+	start_us = get_clock_us();
+	end_us = start_us + (uint64_t)runtime * 1000000;
+
+	for (;;) {
+		int active = 0;
+		uint64_t now = get_clock_us();
+
+		for (i = 0; i < concurrency; i++) {
+			if (slots[i].state == SLOT_DONE
+			||  slots[i].state == SLOT_FAILED) {
+				finish_slot(&slots[i]);
+			}
+			if (slots[i].state == SLOT_IDLE && now < end_us) {
+				if (start_slot(&slots[i]) != 0) {
+					err = 1;
+					goto finished;
+				}
+			}
+			if (slots[i].state == SLOT_IDLE) {
+				pfd[i].fd = -1;
+				pfd[i].events = 0;
+				continue;
+			}
+			active++;
+			pfd[i].fd = iscsi_get_fd(slots[i].iscsi);
+			pfd[i].events = iscsi_which_events(slots[i].iscsi);
+		}
+		if (active == 0) {
+			break;
+		}
+
+		if (poll(pfd, concurrency, 1000) < 0) {
+			continue;
+		}
+		for (i = 0; i < concurrency; i++) {
+			if (pfd[i].fd == -1 || pfd[i].revents == 0) {
+				continue;
+			}
+			if (iscsi_service(slots[i].iscsi, pfd[i].revents) < 0) {
+				fprintf(stderr, "iscsi_service failed with : %s\n",
+					iscsi_get_error(slots[i].iscsi));
+				slots[i].state = SLOT_FAILED;
+			}
+		}
+	}
+
+finished:
+	elapsed_us = get_clock_us() - start_us;
+	for (i = 0; i < concurrency; i++) {
+		if (slots[i].iscsi != NULL) {
+			iscsi_destroy_context(slots[i].iscsi);
+		}
+	}
+	free(slots);
+	free(pfd);
+
+	printf("sessions %" PRIu64 ", failures %" PRIu64 ", %.1f sessions/s\n",
+	       sessions, failures,
+	       sessions * 1000000.0 / (elapsed_us ? elapsed_us : 1));
+	if (logins) {
+		printf("login latency avg %" PRIu64 " us, max %" PRIu64 " us\n",
+		       total_us / logins, max_us);
+	}
+
+	return err || failures ? 1 : 0;
+}
@@ -37,8 +37,30 @@
 #define NOP_INTERVAL 5
 #define MAX_NOP_FAILURES 3
 
+/* latency histograms have 16 buckets for every power of two
+ * microseconds, which is good to about 6% */
+#define LAT_SUB_BITS 4
+#define LAT_BUCKETS (64 << LAT_SUB_BITS)
+
+/* where the time of a read went, from the task timestamps */
+enum {
+	LAT_QUEUED,	/* submitted until the command was on the wire */
+	LAT_TARGET,	/* command on the wire until the first data-in */
+	LAT_DATA_IN,	/* first data-in until the status */
+	LAT_TOTAL,	/* submitted until the status */
+	LAT_STAGES
+};
+
+const char *lat_stage_names[LAT_STAGES] = {
+	"queued", "target", "data-in", "total"
+};
+
+struct latency {
+	uint64_t count;
+	uint64_t buckets[LAT_BUCKETS];
+};
+
 const char *initiator = "iqn.2010-11.libiscsi:iscsi-perf";
-int proc_alarm = 0;
 int max_in_flight = 32;
 int blocks_per_io = 8;
 uint64_t runtime = 0;
@@ -69,6 +91,8 @@ struct client {
 	int busy_cnt;
 	int err_cnt;
 	int retry_cnt;
+
+	struct latency lat[LAT_STAGES];
 };
 
 uint64_t get_clock_ns(void) {
@@ -93,6 +117,96 @@ uint64_t get_clock_ns(void) {
 
 void fill_read_queue(struct client *client);
 
+int lat_bucket(uint64_t us)
+{
+	int shift = 0;
+
+	if (us < (1 << LAT_SUB_BITS)) {
+		return us;
+	}
+	while ((us >> shift) >= (2 << LAT_SUB_BITS)) {
+		shift++;
+	}
+	return ((shift + 1) << LAT_SUB_BITS) + (us >> shift)
+		- (1 << LAT_SUB_BITS);
+}
+
+uint64_t lat_bucket_us(int bucket)
+{
+	int shift;
+
+	if (bucket < (1 << LAT_SUB_BITS)) {
+		return bucket;
+	}
+	shift = (bucket >> LAT_SUB_BITS) - 1;
+	return (uint64_t)((bucket & ((1 << LAT_SUB_BITS) - 1))
+			  + (1 << LAT_SUB_BITS)) << shift;
+}
+
+void lat_add(struct latency *lat, uint64_t from, uint64_t to)
+{
+	if (from == 0 || to < from) {
+		return;
+	}
+	lat->count++;
+	lat->buckets[lat_bucket((to - from) / 1000)]++;
+}
+
+uint64_t lat_percentile(struct latency *lat, double p)
+{
+	uint64_t want = p * lat->count, seen = 0;
+	int i;
+
+	for (i = 0; i < LAT_BUCKETS; i++) {
+		seen += lat->buckets[i];
+		if (seen > want) {
+			return lat_bucket_us(i);
+		}
+	}
+	return lat_bucket_us(LAT_BUCKETS - 1);
+}
+
+void lat_task(struct client *client, struct scsi_task *task)
+{
+	struct scsi_task_times t;
+	uint64_t sent, first;
+
+	scsi_task_get_times(task, &t);
+	if (t.status == 0) {
+		return;
+	}
+	sent  = t.dataout_sent ? t.dataout_sent : t.header_sent;
+	first = t.first_response ? t.first_response : t.status;
+
+	lat_add(&client->lat[LAT_QUEUED], t.submitted, t.header_sent);
+	lat_add(&client->lat[LAT_TARGET], sent, first);
+	if (t.first_response) {
+		lat_add(&client->lat[LAT_DATA_IN], t.first_response, t.status);
+	}
+	lat_add(&client->lat[LAT_TOTAL], t.submitted, t.status);
+}
+
+void print_latency(struct client *client)
+{
+	int i;
+
+	if (!client->lat[LAT_TOTAL].count) {
+		return;
+	}
+	printf ("\n\nlatency (us)        p50       p90       p99     p99.9");
+	for (i = 0; i < LAT_STAGES; i++) {
+		struct latency *lat = &client->lat[i];
+
+		if (!lat->count) {
+			continue;
+		}
+		printf ("\n  %-10s %9" PRIu64 " %9" PRIu64 " %9" PRIu64 " %9" PRIu64,
+			lat_stage_names[i],
+			lat_percentile(lat, 0.5), lat_percentile(lat, 0.9),
+			lat_percentile(lat, 0.99), lat_percentile(lat, 0.999));
+	}
+}
+
 void progress(struct client *client) {
 	uint64_t now = get_clock_ns();
 	if (now - client->last_ns < 1000000000) return;
@@ -157,6 +271,7 @@ void cb(struct iscsi_context *iscsi _U_, int status, void *command_data, void *p
 	} else if (status == SCSI_STATUS_GOOD) {
 		client->retry_cnt = 0;
 		client->bytes += read16_cdb->transfer_length * client->blocksize;
+		lat_task(client, task);
 	} else {
 		fprintf(stderr, "Read16 failed with %s\n", iscsi_get_error(iscsi));
 		if (!client->ignore_errors) {
@@ -220,17 +335,8 @@ void usage(void) {
 	exit(1);
 }
 
-void sig_handler (int signum ) {
-	if (signum == SIGALRM) {
-		if (proc_alarm) {
-			fprintf(stderr, "\n\nABORT: Last alarm was not processed.\n");
-			exit(10);
-		}
-		proc_alarm = 1;
-		alarm(NOP_INTERVAL);
-	} else {
-		finished++;
-	}
+void sig_handler (int signum _U_) {
+	finished++;
 }
 
 int main(int argc, char *argv[])
@@ -380,40 +486,29 @@ int main(int argc, char *argv[])
 
 	sigaction(SIGINT, &sa, NULL);
 	sigaction(SIGTERM, &sa, NULL);
-	sigaction(SIGALRM, &sa, NULL);
 
 	printf("\n");
 
 	client.first_ns = client.last_ns = get_clock_ns();
 
 	iscsi_set_reconnect_max_retries(client.iscsi, client.max_reconnects);
+	iscsi_set_nop_keepalive(client.iscsi, NOP_INTERVAL, MAX_NOP_FAILURES);
 
 	fill_read_queue(&client);
 
-	alarm(NOP_INTERVAL);
-
 	while (client.in_flight && !client.err_cnt && finished < 2) {
 		pfd[0].fd = iscsi_get_fd(client.iscsi);
 		pfd[0].events = iscsi_which_events(client.iscsi);
 
-		if (proc_alarm) {
-			if (iscsi_get_nops_in_flight(client.iscsi) > MAX_NOP_FAILURES) {
-				iscsi_reconnect(client.iscsi);
-			} else {
-				iscsi_nop_out_async(client.iscsi, NULL, NULL, 0, NULL);
-			}
-			if (!iscsi_get_nops_in_flight(client.iscsi)) {
-				finished = 0;
-			}
-			proc_alarm = 0;
-		}
-
 		if (!pfd[0].events) {
 			sleep(1);
 			continue;
 		}
 
-		if (poll(&pfd[0], 1, -1) < 0) {
+		/* wake up at least once a second so that libiscsi can run
+		 * its keepalives and timeouts */
+		pfd[0].revents = 0;
+		if (poll(&pfd[0], 1, 1000) < 0) {
 			continue;
 		}
 		if (iscsi_service(client.iscsi, pfd[0].revents) < 0) {
@@ -421,10 +516,16 @@ int main(int argc, char *argv[])
 			break;
 		}
 	}
-	
-	alarm(0);
 
 	progress(&client);
+
+	struct iscsi_nop_rtt rtt;
+	iscsi_get_nop_rtt(client.iscsi, &rtt);
+	if (rtt.samples) {
+		printf ("\nNOP rtt min %u us, avg %u us, p99 %u us (%u samples)", rtt.min_us, rtt.avg_us, rtt.p99_us, rtt.samples);
+	}
+
+	print_latency(&client);
 	
 	if (!client.err_cnt && finished < 2) {
 		printf ("\n\nfinished.\n");